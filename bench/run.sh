@@ -0,0 +1,136 @@
+#!/bin/sh
+#
+# run.sh
+#
+# The benchmark suite behind `make bench`. Runs each benchmark against each
+# combination of backend and buffer size, and writes all the results as one
+# JSON document to $BENCH_OUTPUT, so runs can be compared across releases.
+#
+# The benchmarks are:
+#
+#   bulk      the command writes $BENCH_BYTES of zeros as fast as it can
+#   lines     the command writes $BENCH_LINES short lines, one write each
+#   latency   one byte at a time goes stdin -> PTY -> command -> PTY ->
+#             stdout and back to us, $BENCH_ROUNDS times
+#   startup   time from fork to the first byte of output, $BENCH_STARTS
+#             times
+#   startup-fork
+#             the same, but with terminator starting the command with fork
+#             rather than posix_spawn
+#   exec      time from fork to the command starting, leaving out the trip
+#             back through the PTY, $BENCH_STARTS times; this is where a
+#             static build (configure --enable-static-build) shows
+#
+# Given a capture made with terminator --record as $BENCH_CAPTURE, each
+# stage of the output path is also measured on it, with terminator-replay
+# playing it as fast as it will go:
+#
+#   replay, replay-filter, replay-framing, replay-jsonl, replay-snapshot
+#             the output as it is, with --strip-ansi and --normalize-crlf,
+#             in length-prefixed and jsonl frames, and through --snapshot
+#
+# Everything can be overridden from the environment, e.g.
+#
+#   make bench BENCH_BYTES=4G BENCH_BACKENDS="poll io_uring"
+
+set -e
+
+TERMINATOR=${TERMINATOR:-./terminator}
+BENCH=${BENCH:-bench/terminator-bench}
+REPLAY=${REPLAY:-./terminator-replay}
+BENCH_OUTPUT=${BENCH_OUTPUT:-bench-results.json}
+BENCH_VERSION=${BENCH_VERSION:-unknown}
+
+BENCH_BYTES=${BENCH_BYTES:-1G}
+BENCH_LINES=${BENCH_LINES:-1000000}
+BENCH_ROUNDS=${BENCH_ROUNDS:-10000}
+BENCH_STARTS=${BENCH_STARTS:-200}
+BENCH_CAPTURE=${BENCH_CAPTURE:-}
+
+# threads is the default one-thread-per-direction mode; the others are
+# --event-loop with the given --backend.
+BENCH_BACKENDS=${BENCH_BACKENDS:-"threads poll io_uring"}
+BENCH_BUFFER_SIZES=${BENCH_BUFFER_SIZES:-"64K 1M"}
+
+# The terminator options for a backend
+backend_options() {
+    case "$1" in
+        threads)
+            echo ""
+            ;;
+        *)
+            echo "--event-loop --backend=$1"
+            ;;
+    esac
+}
+
+# Run one benchmark and add its result to the output. The arguments are the
+# benchmark name, backend, buffer size, then the terminator-bench command
+# line.
+run() {
+    name=$1
+    backend=$2
+    size=$3
+    shift 3
+
+    echo "bench: $name, $backend, $size" >&2
+    result=$("$BENCH" "$@")
+
+    printf '%s\n    {"benchmark": "%s", "backend": "%s", "buffer_size": "%s", %s' \
+        "$separator" "$name" "$backend" "$size" "${result#\{}" >>"$BENCH_OUTPUT"
+    separator=,
+}
+
+printf '{\n  "version": "%s",\n  "host": "%s",\n  "date": "%s",\n  "results": [' \
+    "$BENCH_VERSION" "$(uname -srm)" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+    >"$BENCH_OUTPUT"
+separator=
+
+for backend in $BENCH_BACKENDS; do
+    options=$(backend_options "$backend")
+
+    # Backends that weren't built in, or that the kernel doesn't support,
+    # are skipped rather than failing the whole run.
+    if ! "$TERMINATOR" $options true </dev/null >/dev/null 2>&1; then
+        echo "bench: skipping $backend, which isn't available" >&2
+        continue
+    fi
+
+    for size in $BENCH_BUFFER_SIZES; do
+        t="$TERMINATOR $options --buffer-size=$size"
+
+        run bulk "$backend" "$size" throughput \
+            $t head -c "$BENCH_BYTES" /dev/zero
+        run lines "$backend" "$size" throughput \
+            $t seq "$BENCH_LINES"
+        run latency "$backend" "$size" latency "$BENCH_ROUNDS" \
+            $t dd bs=1 count="$BENCH_ROUNDS" status=none
+        run startup "$backend" "$size" startup "$BENCH_STARTS" \
+            $t echo x
+        run startup-fork "$backend" "$size" startup "$BENCH_STARTS" \
+            $t --spawn=fork echo x
+        run exec "$backend" "$size" exec "$BENCH_STARTS" \
+            $t "$BENCH" stamp
+    done
+done
+
+if [ -n "$BENCH_CAPTURE" ]; then
+    for size in $BENCH_BUFFER_SIZES; do
+        r="$REPLAY --fast --buffer-size=$size"
+
+        run replay replay "$size" throughput \
+            $r "$BENCH_CAPTURE"
+        run replay-filter replay "$size" throughput \
+            $r --strip-ansi --normalize-crlf "$BENCH_CAPTURE"
+        run replay-framing replay "$size" throughput \
+            $r --framing=length-prefixed "$BENCH_CAPTURE"
+        run replay-jsonl replay "$size" throughput \
+            $r --framing=jsonl "$BENCH_CAPTURE"
+        run replay-snapshot replay "$size" throughput \
+            $r --snapshot "$BENCH_CAPTURE"
+    done
+fi
+
+printf '\n  ]\n}\n' >>"$BENCH_OUTPUT"
+
+echo "bench: results are in $BENCH_OUTPUT" >&2
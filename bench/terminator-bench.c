@@ -0,0 +1,415 @@
+/* terminator-bench.c
+ *
+ * The measuring half of `make bench`. Each mode runs a command, usually
+ * terminator wrapping something, with pipes on its standard input and
+ * output, and prints what it measured as a single JSON object:
+ *
+ *   terminator-bench throughput command [arg...]
+ *       Read everything the command writes, and report how fast it came.
+ *
+ *   terminator-bench latency ROUNDS command [arg...]
+ *       Send the command one byte at a time, waiting for each to come back
+ *       before sending the next, and report the round trip times. The
+ *       command should echo its input and exit after ROUNDS bytes, as
+ *       `dd bs=1 count=ROUNDS status=none` does.
+ *
+ *   terminator-bench startup RUNS command [arg...]
+ *       Run the command RUNS times, and report the time from fork to the
+ *       first byte of output.
+ *
+ *   terminator-bench exec RUNS command [arg...]
+ *       Run the command RUNS times, and report the time from fork to the
+ *       start of whatever the command runs in turn, which should be
+ *       `terminator-bench stamp`. This leaves out the trip back through
+ *       the PTY that startup includes, so it follows how long terminator
+ *       itself takes to get going.
+ *
+ *   terminator-bench stamp
+ *       Print the monotonic time in nanoseconds, and nothing else.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "my_assert.h"
+#include "parse.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator-bench"
+
+/* How much to read at a time in throughput mode */
+#define BENCH_READ_SIZE (256 * 1024)
+
+/* The longest line stamp mode prints */
+#define BENCH_STAMP_SIZE 64
+
+/* The most rounds or runs allowed */
+#define BENCH_MAX_SAMPLES 10000000UL
+
+
+/* A running command and our ends of its pipes */
+struct bench_child {
+    pid_t pid;
+
+    /* Our end of its standard input, or -1 if it gets /dev/null */
+    int in_fd;
+
+    /* Our end of its standard output */
+    int out_fd;
+};
+
+/* Start ARGV with a pipe for standard output and, if WANT_INPUT is set, one
+ * for standard input too. */
+static void bench_spawn(struct bench_child *child, char **argv,
+                        int want_input);
+
+/* Close our ends of the pipes, wait for the command, and return its exit
+ * status, failing if it didn't exit cleanly. */
+static int bench_wait(struct bench_child *child);
+
+/* Read and throw away everything left on FD. Returns the number of bytes. */
+static uint64_t drain(int fd);
+
+/* The benchmarks themselves. Each returns the exit status. */
+static int run_throughput(char **argv);
+static int run_latency(unsigned long rounds, char **argv);
+static int run_startup(unsigned long runs, char **argv);
+static int run_exec(unsigned long runs, char **argv);
+
+/* Print the summary of N samples, in nanoseconds, as JSON fields. The
+ * samples are sorted in the process. */
+static void print_samples(uint64_t *samples, size_t n);
+
+/* Sort helper for qsort. */
+static int compare_u64(const void *a, const void *b);
+
+/* Print a usage message to FP. */
+static void print_usage(FILE *fp);
+
+/* The current monotonic time in nanoseconds. */
+static uint64_t now_ns(void);
+
+
+int main(int argc, char **argv) {
+    unsigned long count;
+
+    if (argc >= 3 && strcmp(argv[1], "throughput") == 0) {
+        return run_throughput(argv + 2);
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "latency") == 0) {
+        ASSERT_ZERO_WITH_MESSAGE(
+            parse_unsigned(argv[2], 1, BENCH_MAX_SAMPLES, &count),
+            "Invalid number of rounds"
+        );
+        return run_latency(count, argv + 3);
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "startup") == 0) {
+        ASSERT_ZERO_WITH_MESSAGE(
+            parse_unsigned(argv[2], 1, BENCH_MAX_SAMPLES, &count),
+            "Invalid number of runs"
+        );
+        return run_startup(count, argv + 3);
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "exec") == 0) {
+        ASSERT_ZERO_WITH_MESSAGE(
+            parse_unsigned(argv[2], 1, BENCH_MAX_SAMPLES, &count),
+            "Invalid number of runs"
+        );
+        return run_exec(count, argv + 3);
+    }
+
+    if (argc == 2 && strcmp(argv[1], "stamp") == 0) {
+        printf("%llu\n", (unsigned long long) now_ns());
+        return EXIT_SUCCESS;
+    }
+
+    print_usage(stderr);
+    return EXIT_FAILURE;
+}
+
+
+static void bench_spawn(struct bench_child *child, char **argv,
+                        int want_input) {
+    int in_pipe[2] = { -1, -1 };
+    int out_pipe[2];
+
+    if (want_input) {
+        ASSERT_ZERO(pipe2(in_pipe, O_CLOEXEC));
+    }
+
+    ASSERT_ZERO(pipe2(out_pipe, O_CLOEXEC));
+
+    ASSERT_NONNEG(child->pid = fork());
+
+    if (child->pid == 0) {
+        int in_fd = want_input ? in_pipe[0] : open("/dev/null", O_RDONLY);
+
+        ASSERT_NONNEG(in_fd);
+        ASSERT_NONNEG(dup2(in_fd, STDIN_FILENO));
+        ASSERT_NONNEG(dup2(out_pipe[1], STDOUT_FILENO));
+
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    if (want_input) {
+        ASSERT_ZERO(close(in_pipe[0]));
+    }
+
+    ASSERT_ZERO(close(out_pipe[1]));
+
+    child->in_fd = in_pipe[1];
+    child->out_fd = out_pipe[0];
+}
+
+
+static int bench_wait(struct bench_child *child) {
+    int status;
+
+    if (child->in_fd >= 0) {
+        ASSERT_ZERO(close(child->in_fd));
+        child->in_fd = -1;
+    }
+
+    drain(child->out_fd);
+    ASSERT_ZERO(close(child->out_fd));
+
+    ASSERT_NONNEG(waitpid(child->pid, &status, 0));
+    ASSERT_WITH_MESSAGE(WIFEXITED(status), "The command didn't exit cleanly");
+
+    return WEXITSTATUS(status);
+}
+
+
+static uint64_t drain(int fd) {
+    static char buffer[BENCH_READ_SIZE];
+
+    uint64_t total = 0;
+    ssize_t n;
+
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        ASSERT_NONNEG(n);
+        total += n;
+    }
+
+    return total;
+}
+
+
+static int run_throughput(char **argv) {
+    struct bench_child child;
+    uint64_t start, end, bytes;
+    double seconds;
+    int status;
+
+    start = now_ns();
+    bench_spawn(&child, argv, 0);
+    bytes = drain(child.out_fd);
+    end = now_ns();
+    status = bench_wait(&child);
+
+    seconds = (end - start) / 1e9;
+
+    printf("{\"bytes\": %llu, \"seconds\": %.6f, \"mib_per_second\": %.2f, "
+           "\"status\": %d}\n",
+           (unsigned long long) bytes, seconds,
+           seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0, status);
+
+    return EXIT_SUCCESS;
+}
+
+
+static int run_latency(unsigned long rounds, char **argv) {
+    struct bench_child child;
+    uint64_t *samples;
+    unsigned long i;
+    char c = 'x';
+
+    ASSERT_NONZERO(samples = malloc(rounds * sizeof(*samples)));
+
+    bench_spawn(&child, argv, 1);
+
+    for (i = 0; i < rounds; i++) {
+        uint64_t start = now_ns();
+        ssize_t n;
+
+        ASSERT_WITH_MESSAGE(write(child.in_fd, &c, 1) == 1,
+                            "Can't write to the command");
+
+        while ((n = read(child.out_fd, &c, 1)) < 0 && errno == EINTR) {
+            /* Try again. */
+        }
+
+        ASSERT_WITH_MESSAGE(n == 1, "The command stopped echoing");
+        samples[i] = now_ns() - start;
+    }
+
+    bench_wait(&child);
+
+    printf("{");
+    print_samples(samples, rounds);
+    printf("}\n");
+
+    free(samples);
+
+    return EXIT_SUCCESS;
+}
+
+
+static int run_startup(unsigned long runs, char **argv) {
+    struct bench_child child;
+    uint64_t *samples;
+    unsigned long i;
+
+    ASSERT_NONZERO(samples = malloc(runs * sizeof(*samples)));
+
+    for (i = 0; i < runs; i++) {
+        uint64_t start = now_ns();
+        char c;
+        ssize_t n;
+
+        bench_spawn(&child, argv, 0);
+
+        while ((n = read(child.out_fd, &c, 1)) < 0 && errno == EINTR) {
+            /* Try again. */
+        }
+
+        ASSERT_WITH_MESSAGE(n == 1, "The command wrote nothing");
+        samples[i] = now_ns() - start;
+
+        bench_wait(&child);
+    }
+
+    printf("{");
+    print_samples(samples, runs);
+    printf("}\n");
+
+    free(samples);
+
+    return EXIT_SUCCESS;
+}
+
+
+static int run_exec(unsigned long runs, char **argv) {
+    struct bench_child child;
+    uint64_t *samples;
+    unsigned long i;
+
+    ASSERT_NONZERO(samples = malloc(runs * sizeof(*samples)));
+
+    for (i = 0; i < runs; i++) {
+        uint64_t start = now_ns();
+        char line[BENCH_STAMP_SIZE];
+        size_t length = 0;
+        unsigned long long stamp;
+        char *end;
+        ssize_t n;
+
+        bench_spawn(&child, argv, 0);
+
+        /* The stamp comes through a PTY, so it may arrive in pieces and end
+         * in \r\n. */
+        while (length == 0 || line[length - 1] != '\n') {
+            ASSERT_WITH_MESSAGE(length < sizeof(line) - 1,
+                                "The stamp is too long");
+
+            n = read(child.out_fd, line + length, sizeof(line) - 1 - length);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            ASSERT_WITH_MESSAGE(n > 0, "The command wrote no stamp");
+            length += n;
+        }
+
+        line[length] = '\0';
+
+        errno = 0;
+        stamp = strtoull(line, &end, 10);
+        ASSERT_WITH_MESSAGE(errno == 0 && end != line && stamp >= start,
+                            "The command wrote a bad stamp");
+        samples[i] = stamp - start;
+
+        bench_wait(&child);
+    }
+
+    printf("{");
+    print_samples(samples, runs);
+    printf("}\n");
+
+    free(samples);
+
+    return EXIT_SUCCESS;
+}
+
+
+static void print_samples(uint64_t *samples, size_t n) {
+    uint64_t sum = 0;
+    size_t i;
+
+    qsort(samples, n, sizeof(*samples), &compare_u64);
+
+    for (i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+
+    printf("\"samples\": %zu, \"mean_ns\": %llu, \"min_ns\": %llu, "
+           "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+           "\"max_ns\": %llu",
+           n, (unsigned long long) (sum / n),
+           (unsigned long long) samples[0],
+           (unsigned long long) samples[n / 2],
+           (unsigned long long) samples[n * 9 / 10],
+           (unsigned long long) samples[n * 99 / 100],
+           (unsigned long long) samples[n - 1]);
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static void print_usage(FILE *fp) {
+    fprintf(fp,
+        "Usage: %s throughput command [arg...]\n"
+        "       %s latency ROUNDS command [arg...]\n"
+        "       %s startup RUNS command [arg...]\n"
+        "       %s exec RUNS command [arg...]\n"
+        "       %s stamp\n",
+        ASSERT_PROGRAM_NAME, ASSERT_PROGRAM_NAME, ASSERT_PROGRAM_NAME,
+        ASSERT_PROGRAM_NAME, ASSERT_PROGRAM_NAME
+    );
+}
+
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    ASSERT_ZERO(clock_gettime(CLOCK_MONOTONIC, &now));
+
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
@@ -0,0 +1,44 @@
+/* backpressure_policy.c
+ *
+ * What to do when the output buffer fills. See backpressure_policy.h for
+ * details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stddef.h>
+#include <string.h>
+
+#include "backpressure_policy.h"
+
+
+int backpressure_policy_parse(const char *arg,
+                              struct backpressure_policy *policy) {
+    static const char spill_prefix[] = "spill:";
+
+    struct backpressure_policy parsed;
+
+    parsed.dir = NULL;
+
+    if (strcmp(arg, "block") == 0) {
+        parsed.mode = BACKPRESSURE_BLOCK;
+    }
+    else if (strcmp(arg, "drop-oldest") == 0) {
+        parsed.mode = BACKPRESSURE_DROP_OLDEST;
+    }
+    else if (strcmp(arg, "drop-newest") == 0) {
+        parsed.mode = BACKPRESSURE_DROP_NEWEST;
+    }
+    else if (strncmp(arg, spill_prefix, sizeof(spill_prefix) - 1) == 0 &&
+             arg[sizeof(spill_prefix) - 1] != '\0') {
+        parsed.mode = BACKPRESSURE_SPILL;
+        parsed.dir = arg + sizeof(spill_prefix) - 1;
+    }
+    else {
+        return -1;
+    }
+
+    *policy = parsed;
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+/* backpressure_policy.h
+ *
+ * What to do when output arrives faster than it can be written and the buffer
+ * fills. By default we stop reading, which pushes back on the command through
+ * the PTY until it stalls too. For output where keeping up matters more than
+ * keeping everything, we can throw data away instead, and for output where
+ * keeping everything matters more than memory, we can let it overflow into a
+ * file on disk.
+ *
+ * Anything but blocking needs writes that come back rather than wait, so the
+ * output is switched to nonblocking for as long as the direction lasts.
+ */
+
+#ifndef BACKPRESSURE_POLICY_H_INCLUDED
+#define BACKPRESSURE_POLICY_H_INCLUDED
+
+enum backpressure_mode {
+    /* Stop reading until there is room again. This is the default. */
+    BACKPRESSURE_BLOCK,
+
+    /* Make room by throwing away the oldest data in the buffer. */
+    BACKPRESSURE_DROP_OLDEST,
+
+    /* Throw away whatever arrives while the buffer is full. */
+    BACKPRESSURE_DROP_NEWEST,
+
+    /* Carry on reading into a file in dir, and write it out in order once
+     * the buffer has drained. */
+    BACKPRESSURE_SPILL
+};
+
+struct backpressure_policy {
+    enum backpressure_mode mode;
+    const char *dir;
+};
+
+/* Parse a policy of the form block, drop-oldest, drop-newest or spill:<dir>.
+ * The directory is not copied, so ARG must outlive the policy. Returns 0 on
+ * success or -1 if the string isn't a valid policy. */
+int backpressure_policy_parse(const char *arg,
+                              struct backpressure_policy *policy);
+
+#endif /* BACKPRESSURE_POLICY_H_INCLUDED */
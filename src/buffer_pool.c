@@ -0,0 +1,192 @@
+/* buffer_pool.c
+ *
+ * A pool of fixed-size, page-aligned buffers. See buffer_pool.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "buffer_pool.h"
+#include "my_assert.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* How much to map at a time, unless a single buffer is bigger */
+#define BUFFER_POOL_CHUNK_SIZE (2 * 1024 * 1024)
+
+/* The huge page size we round mappings to. This is the usual size on x86-64
+ * and arm64; if the system's is bigger, MAP_HUGETLB fails and we fall back to
+ * asking for transparent huge pages. */
+#define BUFFER_POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+
+/* Round N up to a multiple of ALIGN. */
+static size_t round_up(size_t n, size_t align);
+
+/* Map a new chunk and put it at the front of the list. */
+static void add_chunk(struct buffer_pool *pool);
+
+
+void buffer_pool_init(struct buffer_pool *pool, size_t buffer_size,
+                      int huge_pages) {
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    ASSERT_WITH_MESSAGE(page_size > 0, "Can't tell the page size");
+
+    pool->slab_size = round_up(buffer_size, page_size);
+    pool->slabs_per_chunk = BUFFER_POOL_CHUNK_SIZE / pool->slab_size;
+
+    if (pool->slabs_per_chunk == 0) {
+        pool->slabs_per_chunk = 1;
+    }
+
+    pool->want_huge_pages = huge_pages;
+    pool->free_list = NULL;
+    pool->chunks = NULL;
+
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    pool->stats.slab_size = pool->slab_size;
+
+    ASSERT_ZERO(pthread_mutex_init(&pool->lock, NULL));
+}
+
+
+void buffer_pool_destroy(struct buffer_pool *pool) {
+    struct buffer_pool_chunk *chunk, *next;
+
+    ASSERT_WITH_MESSAGE(pool->stats.in_use == 0,
+                        "Buffer pool destroyed while still in use");
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Buffer pool of %zu byte slabs: high water %zu of %zu.\n",
+            pool->stats.slab_size, pool->stats.high_water,
+            pool->stats.capacity);
+#endif
+
+    for (chunk = pool->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        ASSERT_ZERO(munmap(chunk->memory, chunk->size));
+        free(chunk);
+    }
+
+    pool->chunks = NULL;
+    pool->free_list = NULL;
+
+    ASSERT_ZERO(pthread_mutex_destroy(&pool->lock));
+}
+
+
+void *buffer_pool_take(struct buffer_pool *pool) {
+    void *buffer;
+
+    ASSERT_ZERO(pthread_mutex_lock(&pool->lock));
+
+    /* Reuse the most recently returned buffer, since it's the most likely
+     * to still be in the cache. */
+    if (pool->free_list) {
+        buffer = pool->free_list;
+        pool->free_list = *(void **) buffer;
+    }
+    else {
+        if (!pool->chunks || pool->chunks->carved == pool->slabs_per_chunk) {
+            add_chunk(pool);
+        }
+
+        buffer = (char *) pool->chunks->memory +
+            pool->chunks->carved * pool->slab_size;
+        pool->chunks->carved++;
+    }
+
+    pool->stats.in_use++;
+
+    if (pool->stats.in_use > pool->stats.high_water) {
+        pool->stats.high_water = pool->stats.in_use;
+    }
+
+    ASSERT_ZERO(pthread_mutex_unlock(&pool->lock));
+
+    return buffer;
+}
+
+
+void buffer_pool_give(struct buffer_pool *pool, void *buffer) {
+    ASSERT_ZERO(pthread_mutex_lock(&pool->lock));
+
+    *(void **) buffer = pool->free_list;
+    pool->free_list = buffer;
+    pool->stats.in_use--;
+
+    ASSERT_ZERO(pthread_mutex_unlock(&pool->lock));
+}
+
+
+void buffer_pool_get_stats(struct buffer_pool *pool,
+                           struct buffer_pool_stats *stats) {
+    ASSERT_ZERO(pthread_mutex_lock(&pool->lock));
+    *stats = pool->stats;
+    ASSERT_ZERO(pthread_mutex_unlock(&pool->lock));
+}
+
+
+static size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+
+static void add_chunk(struct buffer_pool *pool) {
+    struct buffer_pool_chunk *chunk;
+    size_t size = pool->slabs_per_chunk * pool->slab_size;
+    void *memory = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    /* Explicit huge pages only work if the administrator has set some
+     * aside, so don't count on it. */
+    if (pool->want_huge_pages) {
+        size = round_up(size, BUFFER_POOL_HUGE_PAGE_SIZE);
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (memory != MAP_FAILED) {
+            pool->stats.huge_pages = 1;
+        }
+    }
+#endif
+
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ASSERT(memory != MAP_FAILED);
+
+#ifdef MADV_HUGEPAGE
+        /* Transparent huge pages are the next best thing. */
+        if (pool->want_huge_pages && madvise(memory, size, MADV_HUGEPAGE) == 0) {
+            pool->stats.huge_pages = 1;
+        }
+#endif
+    }
+
+    ASSERT_NONZERO(chunk = malloc(sizeof(*chunk)));
+    chunk->memory = memory;
+    chunk->size = size;
+    chunk->carved = 0;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+
+    pool->stats.capacity += pool->slabs_per_chunk;
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Mapped %zu bytes for %zu buffers of %zu bytes.\n", size,
+            pool->slabs_per_chunk, pool->slab_size);
+#endif
+}
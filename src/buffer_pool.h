@@ -0,0 +1,83 @@
+/* buffer_pool.h
+ *
+ * A pool of fixed-size, page-aligned buffers for the copy paths. Buffers are
+ * carved out of large mappings and recycled through a free list, so starting
+ * and finishing sessions doesn't churn the allocator, and recently used
+ * buffers, which are still warm in the cache, are handed out first.
+ *
+ * Memory is only touched when a buffer is first handed out, so on a NUMA
+ * system a pool used by a single thread ends up local to that thread's node
+ * without any explicit placement. Buffers may be returned from any thread.
+ */
+
+#ifndef BUFFER_POOL_H_INCLUDED
+#define BUFFER_POOL_H_INCLUDED
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* The usage figures for a pool */
+struct buffer_pool_stats {
+    /* The size of each buffer, rounded up to whole pages */
+    size_t slab_size;
+
+    /* The number of buffers handed out right now, and the most there have
+     * ever been at once */
+    size_t in_use;
+    size_t high_water;
+
+    /* The number of buffers the pool has memory for, used or not */
+    size_t capacity;
+
+    /* Nonzero if any of the memory is backed by huge pages */
+    int huge_pages;
+};
+
+/* One mapping that buffers are carved from */
+struct buffer_pool_chunk {
+    void *memory;
+    size_t size;
+
+    /* The number of buffers carved out so far. The rest hasn't been
+     * touched. */
+    size_t carved;
+
+    struct buffer_pool_chunk *next;
+};
+
+struct buffer_pool {
+    size_t slab_size;
+    size_t slabs_per_chunk;
+    int want_huge_pages;
+
+    pthread_mutex_t lock;
+
+    /* Returned buffers, linked through their first word */
+    void *free_list;
+
+    /* The newest chunk is first, and is the one being carved. */
+    struct buffer_pool_chunk *chunks;
+
+    struct buffer_pool_stats stats;
+};
+
+/* Set up a pool of buffers of at least BUFFER_SIZE bytes each. No memory is
+ * mapped until the first buffer is taken. With HUGE_PAGES set, try to back
+ * the buffers with huge pages. */
+void buffer_pool_init(struct buffer_pool *pool, size_t buffer_size,
+                      int huge_pages);
+
+/* Unmap all the pool's memory. Every buffer must have been returned. */
+void buffer_pool_destroy(struct buffer_pool *pool);
+
+/* Take a buffer, mapping more memory if the pool is empty. */
+void *buffer_pool_take(struct buffer_pool *pool);
+
+/* Give back a buffer from buffer_pool_take on the same pool. */
+void buffer_pool_give(struct buffer_pool *pool, void *buffer);
+
+/* Copy out the pool's current usage figures. */
+void buffer_pool_get_stats(struct buffer_pool *pool,
+                           struct buffer_pool_stats *stats);
+
+#endif /* BUFFER_POOL_H_INCLUDED */
@@ -0,0 +1,165 @@
+/* cgroup.c
+ *
+ * A cgroup v2 of the command's own. See cgroup.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "cgroup.h"
+#include "my_assert.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+
+/* The controllers whose interface files can be given as limits */
+static const char *const controllers[] = { "cpu", "io", "memory", "pids" };
+
+/* The controller FILE belongs to, or NULL if it isn't one we allow. */
+static const char *file_controller(const char *file);
+
+/* Write VALUE to the file NAME in the directory DIR. Returns 0 on success,
+ * or -1 with errno set. */
+static int write_file(const char *dir, const char *name, const char *value);
+
+
+void cgroup_config_init(struct cgroup_config *config) {
+    config->parent = NULL;
+    config->n_limits = 0;
+}
+
+
+int cgroup_limit_parse(char *arg, struct cgroup_config *config) {
+    char *equals = strchr(arg, '=');
+
+    if (!equals || equals == arg || strchr(arg, '/') ||
+            config->n_limits >= CGROUP_MAX_LIMITS) {
+        return -1;
+    }
+
+    *equals = '\0';
+
+    if (!file_controller(arg)) {
+        *equals = '=';
+        return -1;
+    }
+
+    config->limits[config->n_limits].file = arg;
+    config->limits[config->n_limits].value = equals + 1;
+    config->n_limits++;
+
+    return 0;
+}
+
+
+void cgroup_create(struct cgroup *cgroup, const struct cgroup_config *config) {
+    char *procs_path;
+    char enable[32];
+    size_t i;
+    int failed;
+
+    ASSERT(asprintf(&cgroup->path, "%s/terminator-%ld", config->parent,
+                    (long) getpid()) >= 0);
+
+    ASSERT_ZERO_WITH_MESSAGE(mkdir(cgroup->path, 0755),
+                             "Can't make a cgroup for the command");
+
+    for (i = 0; i < config->n_limits; i++) {
+        /* A controller may well be on already, or be left for whoever set
+         * up the parent to turn on; if it is missing, the limit itself
+         * fails below. */
+        snprintf(enable, sizeof(enable), "+%s",
+                 file_controller(config->limits[i].file));
+
+        if (write_file(config->parent, "cgroup.subtree_control",
+                       enable) < 0) {
+#ifdef ASSERT_DEBUG
+            fprintf(stderr, "Couldn't turn on %s in %s: %s.\n", enable + 1,
+                    config->parent, strerror(errno));
+#endif
+        }
+
+        failed = write_file(cgroup->path, config->limits[i].file,
+                            config->limits[i].value) < 0;
+
+        /* An empty cgroup is no use to anyone, so don't leave it behind. */
+        if (failed) {
+            ASSERT_ZERO(rmdir(cgroup->path));
+        }
+
+        ASSERT_WITH_MESSAGE(!failed, "Can't set a cgroup limit");
+    }
+
+    ASSERT(asprintf(&procs_path, "%s/cgroup.procs", cgroup->path) >= 0);
+    ASSERT_NONNEG(cgroup->procs_fd = open(procs_path,
+                                          O_WRONLY | O_CLOEXEC));
+    free(procs_path);
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Running the command in %s.\n", cgroup->path);
+#endif
+}
+
+
+void cgroup_destroy(struct cgroup *cgroup) {
+    ASSERT_ZERO(close(cgroup->procs_fd));
+    cgroup->procs_fd = -1;
+
+    /* Anything the command left running keeps the cgroup, and its limits,
+     * alive. */
+    if (rmdir(cgroup->path) < 0) {
+        ASSERT(errno == EBUSY);
+        fprintf(stderr, "%s: Leaving %s, which is still in use\n",
+                ASSERT_PROGRAM_NAME, cgroup->path);
+    }
+
+    free(cgroup->path);
+    cgroup->path = NULL;
+}
+
+
+static const char *file_controller(const char *file) {
+    size_t i, length;
+
+    for (i = 0; i < sizeof(controllers) / sizeof(*controllers); i++) {
+        length = strlen(controllers[i]);
+
+        if (strncmp(file, controllers[i], length) == 0 &&
+                file[length] == '.' && file[length + 1] != '\0') {
+            return controllers[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static int write_file(const char *dir, const char *name, const char *value) {
+    char *path;
+    ssize_t n;
+    int fd, saved_errno;
+
+    ASSERT(asprintf(&path, "%s/%s", dir, name) >= 0);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    free(path);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    n = write(fd, value, strlen(value));
+    saved_errno = errno;
+    ASSERT_ZERO(close(fd));
+    errno = saved_errno;
+
+    return n == (ssize_t) strlen(value) ? 0 : -1;
+}
@@ -0,0 +1,57 @@
+/* cgroup.h
+ *
+ * A cgroup v2 of the command's own, for --cgroup, so that its CPU, memory
+ * and I/O can be capped, and can't crowd out whatever else runs alongside
+ * it. The cgroup is made under one given on the command line, which has to
+ * be delegated to us, and the limits are written into it before the
+ * command starts; the child moves itself in between fork and exec, so
+ * nothing it runs escapes. The cgroup is removed once the command has been
+ * reaped, unless something it started is still in there.
+ */
+
+#ifndef CGROUP_H_INCLUDED
+#define CGROUP_H_INCLUDED
+
+#include <stddef.h>
+
+/* The most limits that can be given */
+#define CGROUP_MAX_LIMITS 16
+
+/* A value to write to one of the cgroup's interface files, such as
+ * memory.max */
+struct cgroup_limit {
+    const char *file;
+    const char *value;
+};
+
+struct cgroup_config {
+    /* The cgroup to make ours in, or NULL for none */
+    const char *parent;
+
+    struct cgroup_limit limits[CGROUP_MAX_LIMITS];
+    size_t n_limits;
+};
+
+struct cgroup {
+    /* The path of our cgroup, and its cgroup.procs file, open for the child
+     * to write itself into, or -1 */
+    char *path;
+    int procs_fd;
+};
+
+/* Set up a configuration with no cgroup. */
+void cgroup_config_init(struct cgroup_config *config);
+
+/* Add a limit of the form FILE=VALUE, where FILE is one of the cpu., io.,
+ * memory. or pids. interface files, to CONFIG. Returns 0 on success or -1 if
+ * the string isn't of that form, or there are too many limits already. */
+int cgroup_limit_parse(char *arg, struct cgroup_config *config);
+
+/* Make our cgroup under CONFIG's parent, turning on the controllers its
+ * limits need there, and set the limits. Failing to do so is fatal. */
+void cgroup_create(struct cgroup *cgroup, const struct cgroup_config *config);
+
+/* Remove our cgroup, once the command has been reaped. */
+void cgroup_destroy(struct cgroup *cgroup);
+
+#endif /* CGROUP_H_INCLUDED */
@@ -0,0 +1,177 @@
+/* child_watch.c
+ *
+ * Turn the exit of a child process into a readable file descriptor. See
+ * child_watch.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "child_watch.h"
+#include "my_assert.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+
+/* The self-pipe shared by every watch that falls back to SIGCHLD. */
+static int sigchld_pipe[2] = { -1, -1 };
+
+/* Write a byte to the self-pipe to wake up whoever is polling it. */
+static void sigchld_handler(int signo);
+
+/* Create the self-pipe and install the SIGCHLD handler, once. */
+static void sigchld_pipe_setup(void);
+
+/* Open a pidfd for the process, or return -1 if the system can't. */
+static int open_pidfd(pid_t pid);
+
+
+void child_watch_start(struct child_watch *watch, pid_t pid) {
+    watch->pid = pid;
+    watch->exited = 0;
+    watch->status = 0;
+    memset(&watch->usage, 0, sizeof(watch->usage));
+
+    if ((watch->fd = open_pidfd(pid)) >= 0) {
+        watch->is_pidfd = 1;
+    }
+    else {
+        char wake_char = 0;
+
+        sigchld_pipe_setup();
+
+        watch->fd = sigchld_pipe[0];
+        watch->is_pidfd = 0;
+
+        /* The child may have exited before the handler was installed, in
+         * which case no signal is coming. Wake the first poll so that we
+         * check at least once. */
+        if (write(sigchld_pipe[1], &wake_char, 1) < 0) {
+            ASSERT(errno == EAGAIN);
+        }
+    }
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Watching child %d using %s.\n", (int) pid,
+            watch->is_pidfd ? "a pidfd" : "a SIGCHLD self-pipe");
+#endif
+}
+
+
+int child_watch_check(struct child_watch *watch) {
+    pid_t result;
+
+    if (watch->exited) {
+        return 1;
+    }
+
+    if (!watch->is_pidfd) {
+        char drain[64];
+
+        while (read(watch->fd, drain, sizeof(drain)) > 0) {
+            /* Keep draining. */
+        }
+    }
+
+    ASSERT_NONNEG(result = wait4(watch->pid, &watch->status, WNOHANG,
+                                   &watch->usage));
+
+    if (result == watch->pid) {
+        watch->exited = 1;
+
+#ifdef ASSERT_DEBUG
+        fprintf(stderr, "Child exited.\n");
+#endif
+    }
+
+    return watch->exited;
+}
+
+
+void child_watch_finish(struct child_watch *watch) {
+    if (!watch->exited) {
+        ASSERT_NONNEG(wait4(watch->pid, &watch->status, 0, &watch->usage));
+        watch->exited = 1;
+    }
+
+    if (watch->is_pidfd) {
+        ASSERT_ZERO(close(watch->fd));
+    }
+
+    watch->fd = -1;
+}
+
+
+int child_watch_per_child(void) {
+    int fd = open_pidfd(getpid());
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    ASSERT_ZERO(close(fd));
+    return 1;
+}
+
+
+static void sigchld_handler(int signo) {
+    int saved_errno = errno;
+    char wake_char = 0;
+
+    /* If the pipe is full, a wakeup is already pending. */
+    if (write(sigchld_pipe[1], &wake_char, 1) < 0) {
+        /* Nothing else we can safely do here. */
+    }
+
+    errno = saved_errno;
+}
+
+
+static void sigchld_pipe_setup(void) {
+    struct sigaction action;
+
+    if (sigchld_pipe[0] >= 0) {
+        return;
+    }
+
+    ASSERT_ZERO(pipe(sigchld_pipe));
+
+    ASSERT_NONNEG(fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK));
+    ASSERT_NONNEG(fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK));
+    ASSERT_NONNEG(fcntl(sigchld_pipe[0], F_SETFD, FD_CLOEXEC));
+    ASSERT_NONNEG(fcntl(sigchld_pipe[1], F_SETFD, FD_CLOEXEC));
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &sigchld_handler;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    ASSERT_ZERO(sigemptyset(&action.sa_mask));
+    ASSERT_ZERO(sigaction(SIGCHLD, &action, NULL));
+}
+
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+
+    if (fd >= 0) {
+        ASSERT_NONNEG(fcntl(fd, F_SETFD, FD_CLOEXEC));
+    }
+
+    return fd;
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,49 @@
+/* child_watch.h
+ *
+ * Turn the exit of a child process into a file descriptor that becomes
+ * readable, so it can be waited for alongside other I/O. On Linux this is a
+ * pidfd; elsewhere a SIGCHLD handler writes to a self-pipe.
+ */
+
+#ifndef CHILD_WATCH_H_INCLUDED
+#define CHILD_WATCH_H_INCLUDED
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+struct child_watch {
+    pid_t pid;
+
+    /* The descriptor to poll for POLLIN. */
+    int fd;
+
+    /* Nonzero if fd is a pidfd, otherwise it is the read end of the
+     * self-pipe. */
+    int is_pidfd;
+
+    /* Set once the child has been reaped, along with its wait status. */
+    int exited;
+    int status;
+
+    /* What the child, and any children of its own it waited for, used, as
+     * reported when it was reaped. */
+    struct rusage usage;
+};
+
+/* Start watching the child with the given process ID. This must be called
+ * from the parent after fork. */
+void child_watch_start(struct child_watch *watch, pid_t pid);
+
+/* Called when the watch descriptor is readable. Reaps the child if it has
+ * exited, and returns nonzero if so. */
+int child_watch_check(struct child_watch *watch);
+
+/* Stop watching. If the child hasn't been reaped yet, block until it is. */
+void child_watch_finish(struct child_watch *watch);
+
+/* Nonzero if every watch gets a descriptor of its own, i.e. pidfds work.
+ * Otherwise all watches share the self-pipe, and only one thread at a time
+ * should be waiting on them. */
+int child_watch_per_child(void);
+
+#endif /* CHILD_WATCH_H_INCLUDED */
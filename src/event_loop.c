@@ -0,0 +1,157 @@
+/* event_loop.c
+ *
+ * A single-threaded alternative to running one thread per direction. See
+ * event_loop.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event_loop.h"
+#include "my_assert.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+
+/* The poll backend */
+static void poll_run(struct redirection_info *infos, size_t n_infos,
+                     struct child_watch *watch);
+
+
+int event_loop_backend_parse(const char *arg,
+                             enum event_loop_backend *backend) {
+    if (strcmp(arg, "auto") == 0) {
+        *backend = EVENT_LOOP_AUTO;
+    }
+    else if (strcmp(arg, "poll") == 0) {
+        *backend = EVENT_LOOP_POLL;
+    }
+    else if (strcmp(arg, "io_uring") == 0 || strcmp(arg, "io-uring") == 0) {
+        *backend = EVENT_LOOP_IO_URING;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+enum event_loop_backend event_loop_backend_resolve(
+    enum event_loop_backend backend
+) {
+#ifdef HAVE_IO_URING
+    if (backend == EVENT_LOOP_AUTO) {
+        backend = event_loop_uring_available() ?
+            EVENT_LOOP_IO_URING : EVENT_LOOP_POLL;
+    }
+    else if (backend == EVENT_LOOP_IO_URING) {
+        ASSERT_WITH_MESSAGE(event_loop_uring_available(),
+                            "io_uring is not supported by this kernel");
+    }
+#else
+    ASSERT_WITH_MESSAGE(backend != EVENT_LOOP_IO_URING,
+                        "Built without io_uring support");
+    backend = EVENT_LOOP_POLL;
+#endif
+
+    return backend;
+}
+
+
+void event_loop_run(struct redirection_info *infos, size_t n_infos,
+                    struct child_watch *watch,
+                    enum event_loop_backend backend) {
+#ifdef HAVE_IO_URING
+    if (backend == EVENT_LOOP_IO_URING) {
+        event_loop_uring_run(infos, n_infos, watch);
+        return;
+    }
+#endif
+
+    poll_run(infos, n_infos, watch);
+}
+
+
+static void poll_run(struct redirection_info *infos, size_t n_infos,
+                     struct child_watch *watch) {
+    /* Two entries per direction, plus one for the child watch */
+    struct pollfd *poll_fds;
+    size_t watch_index = 2 * n_infos;
+
+    ASSERT_NONZERO(poll_fds = calloc(watch_index + 1, sizeof(*poll_fds)));
+
+    for (;;) {
+        int any_active = 0;
+        int64_t timeout = -1;
+        size_t i;
+
+        for (i = 0; i < n_infos; i++) {
+            struct pollfd *in_pfd = &poll_fds[2 * i];
+            struct pollfd *out_pfd = &poll_fds[2 * i + 1];
+
+            if (redirection_active(&infos[i])) {
+                int64_t flush_timeout;
+
+                redirection_prepare(&infos[i]);
+                flush_timeout = redirection_timeout(&infos[i]);
+
+                any_active = 1;
+                redirection_poll_setup(&infos[i], &in_pfd->fd, &in_pfd->events,
+                                       &out_pfd->fd, &out_pfd->events);
+
+                if (flush_timeout >= 0 &&
+                        (timeout < 0 || flush_timeout < timeout)) {
+                    timeout = flush_timeout;
+                }
+            }
+            else {
+                in_pfd->fd = out_pfd->fd = -1;
+            }
+        }
+
+        poll_fds[watch_index].fd = watch->exited ? -1 : watch->fd;
+        poll_fds[watch_index].events = POLLIN;
+
+        if (!any_active) {
+            break;
+        }
+
+        if (redirection_poll(poll_fds, watch_index + 1, timeout) < 0) {
+            /* The SIGCHLD handler may interrupt us; that's what the
+             * self-pipe is for. */
+            ASSERT(errno == EINTR);
+            continue;
+        }
+
+        if (poll_fds[watch_index].revents) {
+            child_watch_check(watch);
+        }
+
+        for (i = 0; i < n_infos; i++) {
+            if (poll_fds[2 * i].fd < 0 && poll_fds[2 * i + 1].fd < 0) {
+                continue;
+            }
+
+            redirection_handle(&infos[i], poll_fds[2 * i].revents,
+                               poll_fds[2 * i + 1].revents);
+
+            if (infos[i].end_all && !redirection_active(&infos[i])) {
+#ifdef ASSERT_DEBUG
+                fprintf(stderr, "%d: And we are all done!\n", infos[i].id);
+#endif
+
+                redirection_end_all(infos, n_infos);
+            }
+        }
+    }
+
+    free(poll_fds);
+}
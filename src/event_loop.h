@@ -0,0 +1,54 @@
+/* event_loop.h
+ *
+ * A single-threaded alternative to running one thread per direction. One
+ * poll() multiplexes every direction along with the child's exit, and blocks
+ * without a timeout, so an idle wrapper costs nothing. The only timeouts are
+ * for output a flush policy is holding back.
+ */
+
+#ifndef EVENT_LOOP_H_INCLUDED
+#define EVENT_LOOP_H_INCLUDED
+
+#include <stddef.h>
+
+#include "child_watch.h"
+#include "redirect.h"
+
+/* The ways the event loop can wait for work */
+enum event_loop_backend {
+    /* io_uring if it was built in and the kernel supports it, otherwise
+     * poll */
+    EVENT_LOOP_AUTO,
+
+    EVENT_LOOP_POLL,
+
+    /* Keep reads and writes queued in the kernel with io_uring. Only the
+     * copy transport is supported. */
+    EVENT_LOOP_IO_URING
+};
+
+/* Parse a backend name: auto, poll or io_uring. Returns 0 on success or -1 if
+ * the name isn't recognized. */
+int event_loop_backend_parse(const char *arg, enum event_loop_backend *backend);
+
+/* Turn EVENT_LOOP_AUTO into whichever backend will actually be used. Exits
+ * with an error if io_uring was asked for but isn't available. */
+enum event_loop_backend event_loop_backend_resolve(
+    enum event_loop_backend backend
+);
+
+/* Copy data for all the given directions until they are finished, reaping
+ * the watched child if it exits along the way. When a direction with end_all
+ * set finishes, the others are stopped. BACKEND must already be resolved. */
+void event_loop_run(struct redirection_info *infos, size_t n_infos,
+                    struct child_watch *watch,
+                    enum event_loop_backend backend);
+
+#ifdef HAVE_IO_URING
+/* The io_uring backend, in event_loop_uring.c */
+int event_loop_uring_available(void);
+void event_loop_uring_run(struct redirection_info *infos, size_t n_infos,
+                          struct child_watch *watch);
+#endif
+
+#endif /* EVENT_LOOP_H_INCLUDED */
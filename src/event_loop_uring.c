@@ -0,0 +1,405 @@
+/* event_loop_uring.c
+ *
+ * The io_uring backend for the event loop. Rather than waiting for readiness
+ * and then making a system call per read and per write, each direction keeps
+ * a read and a write queued with the kernel at the same time, and a single
+ * io_uring_enter both submits new work and waits for finished work. The
+ * child's exit is also a queued operation: IORING_OP_WAITID where the kernel
+ * has it, or a poll on the child watch descriptor otherwise.
+ *
+ * The PTY master is non-blocking, so io_uring hands -EAGAIN straight back
+ * rather than waiting. When that happens, the direction queues a poll for
+ * readiness and only retries once it fires, rather than spinning.
+ *
+ * Output held back by a flush policy is woken for with IORING_OP_TIMEOUT,
+ * at most one per direction at a time.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/wait.h>
+
+#include "event_loop.h"
+#include "my_assert.h"
+#include "uring.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* Room for a read, a write, a flush timer and their cancellations per
+ * direction, plus the child */
+#define URING_ENTRIES 32
+
+/* What a completion is for, in the low bits of its user_data. The rest is the
+ * index of the direction. */
+#define URING_OP_READ     0
+#define URING_OP_WRITE    1
+#define URING_OP_CHILD    2
+#define URING_OP_CANCEL   3
+#define URING_OP_READABLE 4
+#define URING_OP_WRITABLE 5
+#define URING_OP_TIMER    6
+#define URING_OP_BITS     3
+
+#define URING_USER_DATA(INDEX, OP) (((uint64_t) (INDEX) << URING_OP_BITS) | (OP))
+
+
+/* The in-flight operations for one direction */
+struct uring_direction {
+    /* The operation queued on each side, or -1 if there is none. This is
+     * URING_OP_READABLE or URING_OP_WRITABLE while waiting for readiness
+     * after -EAGAIN. */
+    int read_op;
+    int write_op;
+    int read_cancelled;
+
+    /* Nonzero while a flush timer is queued */
+    int timer_pending;
+
+    /* The last attempt got -EAGAIN, so wait for readiness before the next */
+    int read_blocked;
+    int write_blocked;
+
+    /* Readiness has been seen since the last write. Under a backpressure
+     * policy other than blocking, every write waits for this, since the
+     * kernel would otherwise hold on to a write that can't go anywhere yet,
+     * and drop-oldest couldn't touch the data it was given. */
+    int write_ready;
+
+    /* The kernel reads these when the submission is consumed, so they have
+     * to stay put until then. */
+    struct iovec read_iov[2];
+    struct iovec write_iov[2];
+    struct __kernel_timespec timer;
+};
+
+/* Queue whatever reads and writes direction I is ready for. */
+static void queue_direction(struct uring *ring, struct redirection_info *info,
+                            struct uring_direction *direction, size_t i);
+
+/* Queue a poll of FD for EVENTS, reported with the given user_data. */
+static void queue_poll(struct uring *ring, int fd, short events,
+                       uint64_t user_data);
+
+/* Queue a cancellation of the operation with the given user_data. */
+static void queue_cancel(struct uring *ring, uint64_t user_data);
+
+/* Get a submission entry, which must be available given URING_ENTRIES. */
+static struct io_uring_sqe *get_sqe(struct uring *ring);
+
+
+int event_loop_uring_available(void) {
+    struct uring ring;
+    int available;
+
+    if (uring_init(&ring, 2) < 0) {
+        return 0;
+    }
+
+    available = uring_opcode_supported(&ring, IORING_OP_READV) &&
+        uring_opcode_supported(&ring, IORING_OP_WRITEV) &&
+        uring_opcode_supported(&ring, IORING_OP_POLL_ADD) &&
+        uring_opcode_supported(&ring, IORING_OP_ASYNC_CANCEL) &&
+        uring_opcode_supported(&ring, IORING_OP_TIMEOUT);
+
+    uring_destroy(&ring);
+
+    return available;
+}
+
+
+void event_loop_uring_run(struct redirection_info *infos, size_t n_infos,
+                          struct child_watch *watch) {
+    struct uring ring;
+    struct uring_direction *directions;
+
+    /* Where IORING_OP_WAITID reports the child's exit */
+    siginfo_t child_info;
+
+    int use_waitid;
+    int child_pending = 0;
+    int child_cancelled = 0;
+    int ended = 0;
+    size_t i;
+
+    ASSERT_ZERO_WITH_MESSAGE(uring_init(&ring, URING_ENTRIES),
+                             "Failed to set up io_uring");
+    ASSERT_NONZERO(directions = calloc(n_infos, sizeof(*directions)));
+
+    for (i = 0; i < n_infos; i++) {
+        directions[i].read_op = directions[i].write_op = -1;
+    }
+
+    /* WNOWAIT leaves the child to be reaped by child_watch_check, same as
+     * with the other ways of watching it. */
+    use_waitid = uring_opcode_supported(&ring, IORING_OP_WAITID);
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Using io_uring, watching the child with %s.\n",
+            use_waitid ? "IORING_OP_WAITID" : "IORING_OP_POLL_ADD");
+#endif
+
+    for (;;) {
+        struct io_uring_cqe *cqe;
+        int any_active = 0;
+        int any_pending = 0;
+        int any_ended = 0;
+        int result;
+
+        for (i = 0; i < n_infos; i++) {
+            queue_direction(&ring, &infos[i], &directions[i], i);
+
+            any_active |= redirection_active(&infos[i]);
+            any_pending |= directions[i].read_op >= 0 ||
+                directions[i].write_op >= 0;
+            any_ended |= infos[i].end_all && !redirection_active(&infos[i]);
+        }
+
+        /* Sending the EOF can finish a direction right there, with nothing
+         * to come back from the kernel about it, so the others have to be
+         * told now rather than after the next completion, which may never
+         * come. Queueing them again cancels their reads. */
+        if (any_ended && !ended) {
+#ifdef ASSERT_DEBUG
+            fprintf(stderr, "And we are all done!\n");
+#endif
+
+            redirection_end_all(infos, n_infos);
+            ended = 1;
+            continue;
+        }
+
+        if (!watch->exited && !child_pending && any_active) {
+            if (use_waitid) {
+                struct io_uring_sqe *sqe = get_sqe(&ring);
+
+                sqe->opcode = IORING_OP_WAITID;
+                sqe->fd = watch->pid;
+                sqe->len = P_PID;
+                sqe->file_index = WEXITED | WNOWAIT;
+                sqe->addr2 = (uintptr_t) &child_info;
+                sqe->user_data = URING_USER_DATA(0, URING_OP_CHILD);
+            }
+            else {
+                queue_poll(&ring, watch->fd, POLLIN,
+                           URING_USER_DATA(0, URING_OP_CHILD));
+            }
+
+            child_pending = 1;
+            child_cancelled = 0;
+        }
+
+        /* Once everything is done, the child watch is only holding us up. We
+         * still have to wait for it to be cancelled, since the kernel may
+         * write to child_info until then. */
+        if (!any_active && child_pending && !child_cancelled) {
+            queue_cancel(&ring, URING_USER_DATA(0, URING_OP_CHILD));
+            child_cancelled = 1;
+        }
+
+        if (!any_active && !any_pending && !child_pending) {
+            break;
+        }
+
+        result = uring_submit_and_wait(&ring, 1);
+
+        if (result < 0) {
+            /* The SIGCHLD handler may interrupt us if there's no pidfd. */
+            ASSERT_WITH_MESSAGE(result == -EINTR, "io_uring_enter failed");
+            continue;
+        }
+
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            size_t index = cqe->user_data >> URING_OP_BITS;
+            int op = cqe->user_data & ((1 << URING_OP_BITS) - 1);
+            int res = cqe->res;
+
+            uring_cqe_seen(&ring);
+
+            switch (op) {
+                case URING_OP_READ:
+                    directions[index].read_op = -1;
+                    directions[index].read_blocked = res == -EAGAIN;
+
+                    if (res != -ECANCELED) {
+                        redirection_input_done(&infos[index], res);
+                    }
+                    break;
+
+                case URING_OP_WRITE:
+                    directions[index].write_op = -1;
+                    directions[index].write_blocked = res == -EAGAIN;
+
+                    if (res != -ECANCELED) {
+                        redirection_output_done(&infos[index], res);
+                    }
+                    break;
+
+                case URING_OP_READABLE:
+                    /* A hangup shows up as EOF or EIO on the next read. */
+                    directions[index].read_op = -1;
+                    directions[index].read_blocked = 0;
+                    break;
+
+                case URING_OP_WRITABLE:
+                    directions[index].write_op = -1;
+                    directions[index].write_blocked = 0;
+                    directions[index].write_ready = 1;
+
+                    if (res > 0 && res & (POLLHUP | POLLERR)) {
+                        redirection_output_done(&infos[index], -EPIPE);
+                    }
+                    break;
+
+                case URING_OP_CHILD:
+                    child_pending = 0;
+
+                    if (res >= 0) {
+                        child_watch_check(watch);
+                    }
+                    break;
+
+                case URING_OP_TIMER:
+                    /* The data it was for is due now, and will be picked up
+                     * when the direction is queued again. */
+                    directions[index].timer_pending = 0;
+                    break;
+
+                case URING_OP_CANCEL:
+                    break;
+            }
+        }
+    }
+
+    free(directions);
+    uring_destroy(&ring);
+}
+
+
+static void queue_direction(struct uring *ring, struct redirection_info *info,
+                            struct uring_direction *direction, size_t i) {
+    redirection_prepare(info);
+
+    if (direction->read_op < 0 && redirection_wants_input(info)) {
+        if (direction->read_blocked) {
+            direction->read_op = URING_OP_READABLE;
+            queue_poll(ring, info->in_fd, POLLIN,
+                       URING_USER_DATA(i, URING_OP_READABLE));
+        }
+        else {
+            struct io_uring_sqe *sqe = get_sqe(ring);
+
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = info->in_fd;
+            sqe->addr = (uintptr_t) direction->read_iov;
+            sqe->len = redirection_input_iov(info, direction->read_iov);
+            sqe->off = (uint64_t) -1;
+            sqe->user_data = URING_USER_DATA(i, URING_OP_READ);
+
+            direction->read_op = URING_OP_READ;
+        }
+
+        direction->read_cancelled = 0;
+    }
+
+    /* A read may sit in the kernel indefinitely, e.g. waiting on a terminal,
+     * after the direction has been told to stop. */
+    if (direction->read_op >= 0 && !direction->read_cancelled &&
+            !info->keep_going) {
+        queue_cancel(ring, URING_USER_DATA(i, direction->read_op));
+        direction->read_cancelled = 1;
+    }
+
+    if (direction->write_op < 0) {
+        int must_wait = direction->write_blocked ||
+            (info->backpressure != BACKPRESSURE_BLOCK &&
+             !direction->write_ready);
+
+        if (info->sink && redirection_wants_output(info)) {
+            redirection_output_done(info, redirection_sink_write(info));
+        }
+        else if ((redirection_wants_output(info) && must_wait) ||
+                (redirection_wants_eof(info) && direction->write_blocked)) {
+            direction->write_op = URING_OP_WRITABLE;
+            queue_poll(ring, info->out_fd, POLLOUT,
+                       URING_USER_DATA(i, URING_OP_WRITABLE));
+        }
+        else if (redirection_wants_output(info)) {
+            struct io_uring_sqe *sqe = get_sqe(ring);
+
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = info->out_fd;
+            sqe->addr = (uintptr_t) direction->write_iov;
+            sqe->len = redirection_output_iov(info, direction->write_iov);
+            sqe->off = (uint64_t) -1;
+            sqe->user_data = URING_USER_DATA(i, URING_OP_WRITE);
+
+            direction->write_op = URING_OP_WRITE;
+            direction->write_ready = 0;
+        }
+        else if (redirection_wants_eof(info)) {
+            /* This happens once per direction, so there's no point queueing
+             * it, unless it has to wait for room. */
+            direction->write_blocked = redirection_send_eof(info) == -EAGAIN;
+        }
+        else if (!direction->timer_pending) {
+            /* A timer that fires early just means another look, so there's
+             * no need to cancel one that is already queued. */
+            int64_t timeout = redirection_timeout(info);
+
+            if (timeout >= 0) {
+                struct io_uring_sqe *sqe = get_sqe(ring);
+
+                direction->timer.tv_sec = timeout / 1000000000;
+                direction->timer.tv_nsec = timeout % 1000000000;
+
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uintptr_t) &direction->timer;
+                sqe->len = 1;
+                sqe->user_data = URING_USER_DATA(i, URING_OP_TIMER);
+
+                direction->timer_pending = 1;
+            }
+        }
+    }
+}
+
+
+static void queue_poll(struct uring *ring, int fd, short events,
+                       uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = events;
+    sqe->user_data = user_data;
+}
+
+
+static void queue_cancel(struct uring *ring, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = URING_USER_DATA(0, URING_OP_CANCEL);
+}
+
+
+static struct io_uring_sqe *get_sqe(struct uring *ring) {
+    struct io_uring_sqe *sqe;
+
+    ASSERT_NONZERO_WITH_MESSAGE(sqe = uring_get_sqe(ring),
+                                "io_uring submission queue is full");
+
+    return sqe;
+}
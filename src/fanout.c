@@ -0,0 +1,203 @@
+/* fanout.c
+ *
+ * A lock-free ring of chunks with one producer and any number of readers.
+ * See fanout.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fanout.h"
+#include "my_assert.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* Each chunk starts on this boundary, with a header of this size: the
+ * payload's length, the tag, the timestamp and the bytes dropped before
+ * it */
+#define FANOUT_ALIGN       8
+#define FANOUT_HEADER_SIZE 24
+
+
+/* The space a chunk with a payload of N bytes takes in the ring. */
+static size_t chunk_size(size_t n);
+
+/* Copy N bytes from BUFFER into the ring at POSITION, wrapping as needed. */
+static void ring_write(struct fanout *fanout, uint64_t position,
+                       const void *buffer, size_t n);
+
+/* Copy N bytes out of the ring at POSITION into BUFFER. */
+static void ring_read(const struct fanout *fanout, uint64_t position,
+                      void *buffer, size_t n);
+
+
+void fanout_init(struct fanout *fanout, size_t capacity) {
+    ASSERT(capacity >= FANOUT_CHUNK_OVERHEAD &&
+           (capacity & (capacity - 1)) == 0);
+
+    ASSERT_NONZERO(fanout->data = malloc(capacity));
+    fanout->capacity = capacity;
+    atomic_init(&fanout->head, 0);
+    fanout->n_readers = 0;
+    fanout->dropped = 0;
+}
+
+
+void fanout_destroy(struct fanout *fanout) {
+    free(fanout->data);
+    fanout->data = NULL;
+    fanout->n_readers = 0;
+}
+
+
+void fanout_add_reader(struct fanout *fanout, struct fanout_reader *reader) {
+    ASSERT(fanout->n_readers < FANOUT_MAX_READERS);
+
+    reader->fanout = fanout;
+    atomic_init(&reader->cursor,
+                atomic_load_explicit(&fanout->head, memory_order_relaxed));
+    fanout->readers[fanout->n_readers++] = reader;
+}
+
+
+int fanout_publish(struct fanout *fanout, unsigned tag, uint64_t timestamp,
+                   const struct iovec *iov, int iov_count, size_t n) {
+    uint64_t head = atomic_load_explicit(&fanout->head, memory_order_relaxed);
+    uint64_t header[FANOUT_HEADER_SIZE / sizeof(uint64_t)];
+    uint64_t position;
+    size_t size = chunk_size(n);
+    size_t done = 0;
+    int i;
+
+    /* The acquire in fanout_backlog pairs with each reader's release, so
+     * they have finished with the space before it is written over. */
+    if (size > fanout->capacity - fanout_backlog(fanout)) {
+        fanout->dropped += n;
+        return -1;
+    }
+
+    header[0] = (uint64_t) n << 32 | tag;
+    header[1] = timestamp;
+    header[2] = fanout->dropped;
+    ring_write(fanout, head, header, sizeof(header));
+
+    position = head + FANOUT_HEADER_SIZE;
+
+    for (i = 0; i < iov_count && done < n; i++) {
+        size_t length = iov[i].iov_len < n - done ? iov[i].iov_len : n - done;
+
+        ring_write(fanout, position + done, iov[i].iov_base, length);
+        done += length;
+    }
+
+    fanout->dropped = 0;
+
+    /* Only now can the readers see it, all of it. */
+    atomic_store_explicit(&fanout->head, head + size, memory_order_release);
+
+    return 0;
+}
+
+
+size_t fanout_backlog(const struct fanout *fanout) {
+    uint64_t head = atomic_load_explicit(&fanout->head, memory_order_relaxed);
+    uint64_t backlog = 0;
+    size_t i;
+
+    for (i = 0; i < fanout->n_readers; i++) {
+        uint64_t cursor = atomic_load_explicit(&fanout->readers[i]->cursor,
+                                               memory_order_acquire);
+
+        if (head - cursor > backlog) {
+            backlog = head - cursor;
+        }
+    }
+
+    return backlog;
+}
+
+
+int fanout_peek(struct fanout_reader *reader, struct fanout_chunk *chunk) {
+    const struct fanout *fanout = reader->fanout;
+    uint64_t cursor = atomic_load_explicit(&reader->cursor,
+                                           memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&fanout->head, memory_order_acquire);
+    uint64_t header[FANOUT_HEADER_SIZE / sizeof(uint64_t)];
+    size_t offset, first;
+
+    if (cursor == head) {
+        return 0;
+    }
+
+    ring_read(fanout, cursor, header, sizeof(header));
+
+    chunk->length = header[0] >> 32;
+    chunk->tag = header[0] & 0xffffffffU;
+    chunk->timestamp = header[1];
+    chunk->dropped = header[2];
+    chunk->next = cursor + chunk_size(chunk->length);
+
+    /* The payload is a slice of the ring, which may wrap around its end. */
+    offset = (cursor + FANOUT_HEADER_SIZE) & (fanout->capacity - 1);
+    first = fanout->capacity - offset;
+
+    chunk->iov[0].iov_base = fanout->data + offset;
+    chunk->iov_count = chunk->length > 0 ? 1 : 0;
+
+    if (chunk->length <= first) {
+        chunk->iov[0].iov_len = chunk->length;
+    }
+    else {
+        chunk->iov[0].iov_len = first;
+        chunk->iov[1].iov_base = fanout->data;
+        chunk->iov[1].iov_len = chunk->length - first;
+        chunk->iov_count = 2;
+    }
+
+    return 1;
+}
+
+
+void fanout_release(struct fanout_reader *reader,
+                    const struct fanout_chunk *chunk) {
+    atomic_store_explicit(&reader->cursor, chunk->next, memory_order_release);
+}
+
+
+static size_t chunk_size(size_t n) {
+    return (FANOUT_HEADER_SIZE + n + FANOUT_ALIGN - 1) & ~(FANOUT_ALIGN - 1);
+}
+
+
+static void ring_write(struct fanout *fanout, uint64_t position,
+                       const void *buffer, size_t n) {
+    size_t offset = position & (fanout->capacity - 1);
+    size_t first = fanout->capacity - offset;
+
+    if (n <= first) {
+        memcpy(fanout->data + offset, buffer, n);
+    }
+    else {
+        memcpy(fanout->data + offset, buffer, first);
+        memcpy(fanout->data, (const char *) buffer + first, n - first);
+    }
+}
+
+
+static void ring_read(const struct fanout *fanout, uint64_t position,
+                      void *buffer, size_t n) {
+    size_t offset = position & (fanout->capacity - 1);
+    size_t first = fanout->capacity - offset;
+
+    if (n <= first) {
+        memcpy(buffer, fanout->data + offset, n);
+    }
+    else {
+        memcpy(buffer, fanout->data + offset, first);
+        memcpy((char *) buffer + first, fanout->data, n - first);
+    }
+}
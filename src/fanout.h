@@ -0,0 +1,105 @@
+/* fanout.h
+ *
+ * A lock-free ring of chunks with one producer and any number of readers,
+ * for handing what a copy path reads to consumers on other threads, such as
+ * the recorder, without a lock or a wait on the copy path. Each chunk is
+ * copied in once, however many readers there are, and each reader takes it
+ * as a slice of the ring, in place, which stays put until that reader
+ * releases it. A chunk's space is only reused once every reader has released
+ * it, so the readers' positions act as its reference count.
+ *
+ * A slow reader never holds up the producer. A chunk that doesn't fit is
+ * dropped, for every reader, and the number of bytes dropped goes with the
+ * next chunk that does fit, so the readers can say what they missed.
+ */
+
+#ifndef FANOUT_H_INCLUDED
+#define FANOUT_H_INCLUDED
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+/* The most readers one ring can have */
+#define FANOUT_MAX_READERS 4
+
+/* The space each chunk takes beyond its payload, at most */
+#define FANOUT_CHUNK_OVERHEAD 32
+
+struct fanout_reader;
+
+struct fanout {
+    /* The ring, whose capacity is a power of two */
+    unsigned char *data;
+    size_t capacity;
+
+    /* How many bytes have been published since the start, which only the
+     * producer moves on */
+    atomic_ullong head;
+
+    /* The readers, all added before the first chunk is published */
+    struct fanout_reader *readers[FANOUT_MAX_READERS];
+    size_t n_readers;
+
+    /* Bytes dropped since the last chunk that fit. Only the producer
+     * touches this, so anyone else may only look once it is done. */
+    uint64_t dropped;
+};
+
+struct fanout_reader {
+    struct fanout *fanout;
+
+    /* How far this reader has released, which only it moves on */
+    atomic_ullong cursor;
+};
+
+/* A chunk as a reader sees it */
+struct fanout_chunk {
+    /* What the producer said the chunk was, and when */
+    unsigned tag;
+    uint64_t timestamp;
+
+    /* Bytes dropped just before this chunk */
+    uint64_t dropped;
+
+    /* The payload, in place in the ring */
+    size_t length;
+    struct iovec iov[2];
+    int iov_count;
+
+    /* Where the next chunk starts */
+    uint64_t next;
+};
+
+/* Allocate a ring of CAPACITY bytes, which must be a power of two. */
+void fanout_init(struct fanout *fanout, size_t capacity);
+
+/* Release the ring. The readers go with it. */
+void fanout_destroy(struct fanout *fanout);
+
+/* Add READER to the ring. This must happen before anything is published. */
+void fanout_add_reader(struct fanout *fanout, struct fanout_reader *reader);
+
+/* Publish N bytes, spread over IOV_COUNT iovecs, as one chunk. Only one
+ * thread may publish to a ring. Returns 0 on success, or -1 if the chunk
+ * didn't fit and was dropped. Never blocks. */
+int fanout_publish(struct fanout *fanout, unsigned tag, uint64_t timestamp,
+                   const struct iovec *iov, int iov_count, size_t n);
+
+/* The number of bytes the slowest reader has yet to release. Only the
+ * producer may call this. */
+size_t fanout_backlog(const struct fanout *fanout);
+
+/* Look at the reader's next chunk. Returns 1 and fills in CHUNK if there is
+ * one, or 0 if the reader has caught up. The chunk stays the same until it
+ * is released. */
+int fanout_peek(struct fanout_reader *reader, struct fanout_chunk *chunk);
+
+/* Release a chunk from fanout_peek, so that its space can be reused once
+ * every other reader has too. */
+void fanout_release(struct fanout_reader *reader,
+                    const struct fanout_chunk *chunk);
+
+#endif /* FANOUT_H_INCLUDED */
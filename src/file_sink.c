@@ -0,0 +1,269 @@
+/* file_sink.c
+ *
+ * Output written straight into a file through a memory mapping. See
+ * file_sink.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "file_sink.h"
+#include "my_assert.h"
+#include "parse.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+
+/* Allocate and map the window starting at OFFSET. Returns 0 or a negated
+ * errno value. */
+static int map_window(struct file_sink *sink, off_t offset);
+
+/* Unmap the window, and cut the file to the length of its output. Returns 0
+ * or a negated errno value. */
+static int finish_file(struct file_sink *sink);
+
+/* Finish the file, move it out of the way and start a new one. Returns 0 or
+ * a negated errno value. */
+static int rotate(struct file_sink *sink);
+
+/* Nonzero if the current file is due to be rotated before N more bytes go
+ * in, which is then cut down to what fits. */
+static int rotation_due(const struct file_sink *sink, size_t *n);
+
+/* The current monotonic time in nanoseconds. */
+static uint64_t now_ns(void);
+
+
+int file_sink_rotation_parse(const char *arg,
+                             struct file_sink_rotation *rotation) {
+    static const char size_prefix[] = "size:";
+    static const char interval_prefix[] = "interval:";
+
+    if (strncmp(arg, size_prefix, sizeof(size_prefix) - 1) == 0) {
+        return parse_size(arg + sizeof(size_prefix) - 1,
+                          FILE_SINK_MIN_ROTATE_SIZE, SIZE_MAX,
+                          &rotation->bytes);
+    }
+
+    if (strncmp(arg, interval_prefix, sizeof(interval_prefix) - 1) == 0) {
+        return parse_unsigned(arg + sizeof(interval_prefix) - 1, 1,
+                              FILE_SINK_MAX_INTERVAL_MS,
+                              &rotation->interval_ms);
+    }
+
+    return -1;
+}
+
+
+void file_sink_open(struct file_sink *sink, const char *path,
+                    const struct file_sink_rotation *rotation) {
+    sink->path = path;
+    sink->rotation = *rotation;
+    sink->window = NULL;
+    sink->window_offset = 0;
+    sink->window_used = 0;
+    sink->length = 0;
+    sink->opened_ns = now_ns();
+    sink->rotations = 0;
+
+    ASSERT_NONNEG_WITH_MESSAGE(
+        sink->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666),
+        "Can't open the output file"
+    );
+
+    ASSERT_ZERO_WITH_MESSAGE(map_window(sink, 0),
+                             "Can't make room in the output file");
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Writing output to %s on fd %d.\n", path, sink->fd);
+#endif
+}
+
+
+ssize_t file_sink_writev(struct file_sink *sink, const struct iovec *iov,
+                         int iov_count) {
+    size_t written = 0;
+    size_t offset, n;
+    int result;
+    int i;
+
+    for (i = 0; i < iov_count; i++) {
+        for (offset = 0; offset < iov[i].iov_len; offset += n) {
+            n = iov[i].iov_len - offset;
+
+            /* After a rotation, have another look at how much fits. */
+            if (rotation_due(sink, &n)) {
+                if ((result = rotate(sink)) < 0) {
+                    return written > 0 ? (ssize_t) written : result;
+                }
+
+                n = 0;
+                continue;
+            }
+
+            if (sink->window_used == FILE_SINK_WINDOW_SIZE &&
+                    (result = map_window(sink, sink->window_offset +
+                                         FILE_SINK_WINDOW_SIZE)) < 0) {
+                return written > 0 ? (ssize_t) written : result;
+            }
+
+            if (n > FILE_SINK_WINDOW_SIZE - sink->window_used) {
+                n = FILE_SINK_WINDOW_SIZE - sink->window_used;
+            }
+
+            memcpy(sink->window + sink->window_used,
+                   (const char *) iov[i].iov_base + offset, n);
+
+            sink->window_used += n;
+            sink->length += n;
+            written += n;
+        }
+    }
+
+    return written;
+}
+
+
+int file_sink_close(struct file_sink *sink) {
+    int result = finish_file(sink);
+
+    ASSERT_ZERO(close(sink->fd));
+    sink->fd = -1;
+
+    return result;
+}
+
+
+static int map_window(struct file_sink *sink, off_t offset) {
+    int result;
+
+    if (sink->window) {
+        ASSERT_ZERO(munmap(sink->window, FILE_SINK_WINDOW_SIZE));
+        sink->window = NULL;
+    }
+
+    /* The mapping can only touch what is in the file, and the blocks have
+     * to be there before we copy into them, or a full disk is a SIGBUS. */
+    if (ftruncate(sink->fd, offset + FILE_SINK_WINDOW_SIZE) < 0) {
+        return -errno;
+    }
+
+    result = posix_fallocate(sink->fd, offset, FILE_SINK_WINDOW_SIZE);
+
+    if (result != 0) {
+        return -result;
+    }
+
+    sink->window = mmap(NULL, FILE_SINK_WINDOW_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, sink->fd, offset);
+
+    if (sink->window == MAP_FAILED) {
+        sink->window = NULL;
+        return -errno;
+    }
+
+    sink->window_offset = offset;
+    sink->window_used = 0;
+
+    return 0;
+}
+
+
+static int finish_file(struct file_sink *sink) {
+    if (sink->window) {
+        ASSERT_ZERO(munmap(sink->window, FILE_SINK_WINDOW_SIZE));
+        sink->window = NULL;
+    }
+
+    if (ftruncate(sink->fd, sink->length) < 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+
+static int rotate(struct file_sink *sink) {
+    char *rotated_path;
+    int fd, result;
+
+    if ((result = finish_file(sink)) < 0) {
+        return result;
+    }
+
+    /* Nobody should see the old file under its new name until all of it is
+     * on disk. */
+    if (fdatasync(sink->fd) < 0) {
+        return -errno;
+    }
+
+    if (asprintf(&rotated_path, "%s.%lu", sink->path,
+                 sink->rotations + 1) < 0) {
+        return -ENOMEM;
+    }
+
+    result = rename(sink->path, rotated_path) < 0 ? -errno : 0;
+    free(rotated_path);
+
+    if (result < 0) {
+        return result;
+    }
+
+    sink->rotations++;
+
+    if ((fd = open(sink->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0666)) < 0) {
+        return -errno;
+    }
+
+    /* Keep the same descriptor, which others may be polling or syncing. */
+    ASSERT_NONNEG(dup3(fd, sink->fd, O_CLOEXEC));
+    ASSERT_ZERO(close(fd));
+
+    sink->length = 0;
+    sink->opened_ns = now_ns();
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Rotated %s for the %lu%s time.\n", sink->path,
+            sink->rotations, sink->rotations == 1 ? "st" : "th");
+#endif
+
+    return map_window(sink, 0);
+}
+
+
+static int rotation_due(const struct file_sink *sink, size_t *n) {
+    if (sink->rotation.bytes > 0) {
+        if (sink->length >= sink->rotation.bytes) {
+            return 1;
+        }
+
+        if (*n > sink->rotation.bytes - sink->length) {
+            *n = sink->rotation.bytes - sink->length;
+        }
+    }
+
+    /* An empty file can wait for something to go in it. */
+    return sink->rotation.interval_ms > 0 && sink->length > 0 &&
+        now_ns() - sink->opened_ns >=
+            (uint64_t) sink->rotation.interval_ms * 1000000;
+}
+
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    ASSERT_ZERO(clock_gettime(CLOCK_MONOTONIC, &now));
+
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
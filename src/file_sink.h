@@ -0,0 +1,83 @@
+/* file_sink.h
+ *
+ * Output written straight into a file through a memory mapping, for
+ * --output-file, rather than through write(). The file is mapped a window
+ * at a time, and each window's blocks are allocated before it is mapped, so
+ * that running out of disk shows up as an error from file_sink_writev
+ * rather than a SIGBUS part way through a copy. Until the file is finished,
+ * it is as long as the end of the current window, with zeros after the
+ * output.
+ *
+ * The file can be rotated once it reaches a size, or has been open for a
+ * time. A file that has been rotated is cut to the length of its output and
+ * synced before it is renamed from PATH to PATH.1, PATH.2 and so on, so a
+ * rotated file is always complete, even after a crash. The new PATH takes
+ * over the old one's file descriptor, so whatever polls or syncs it doesn't
+ * need to know.
+ */
+
+#ifndef FILE_SINK_H_INCLUDED
+#define FILE_SINK_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* How much of the file is mapped at a time */
+#define FILE_SINK_WINDOW_SIZE (4 * 1024 * 1024)
+
+/* The smallest file worth rotating at, and the longest interval between
+ * rotations, in milliseconds */
+#define FILE_SINK_MIN_ROTATE_SIZE  (4 * 1024)
+#define FILE_SINK_MAX_INTERVAL_MS  (7UL * 24 * 60 * 60 * 1000)
+
+/* When to start a new file. Either may be zero, for no limit. */
+struct file_sink_rotation {
+    size_t bytes;
+    unsigned long interval_ms;
+};
+
+struct file_sink {
+    const char *path;
+    int fd;
+    struct file_sink_rotation rotation;
+
+    /* The mapped window, where in the file it starts, and how much of it
+     * has been written */
+    char *window;
+    off_t window_offset;
+    size_t window_used;
+
+    /* The output in the current file, when it was opened, and how many
+     * files have been rotated out */
+    size_t length;
+    uint64_t opened_ns;
+    unsigned long rotations;
+};
+
+/* Parse a rotation of the form size:<n>, where <n> may have a K, M or G
+ * suffix, or interval:<ms>, into the matching field of *ROTATION, leaving
+ * the other alone, so that both can be given. Returns 0 on success or -1 if
+ * the string isn't valid. */
+int file_sink_rotation_parse(const char *arg,
+                             struct file_sink_rotation *rotation);
+
+/* Create or truncate the file at PATH, and map its first window. Failing to
+ * do so is fatal. */
+void file_sink_open(struct file_sink *sink, const char *path,
+                    const struct file_sink_rotation *rotation);
+
+/* Copy the data in the IOV_COUNT entries of IOV into the file, rotating it
+ * as it comes due. Returns the number of bytes written, or a negated errno
+ * value if none could be. */
+ssize_t file_sink_writev(struct file_sink *sink, const struct iovec *iov,
+                         int iov_count);
+
+/* Cut the file to the length of its output, and close it. Returns 0, or a
+ * negated errno value if that went wrong, in which case the file may still
+ * have zeros at the end. */
+int file_sink_close(struct file_sink *sink);
+
+#endif /* FILE_SINK_H_INCLUDED */
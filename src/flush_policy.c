@@ -0,0 +1,53 @@
+/* flush_policy.c
+ *
+ * When to pass buffered output on. See flush_policy.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <string.h>
+
+#include "flush_policy.h"
+#include "parse.h"
+
+
+int flush_policy_parse(const char *arg, struct flush_policy *policy) {
+    static const char bytes_prefix[] = "bytes:";
+    static const char latency_prefix[] = "latency:";
+
+    struct flush_policy parsed;
+
+    parsed.bytes = 0;
+    parsed.latency_us = FLUSH_DEFAULT_LATENCY_US;
+
+    if (strcmp(arg, "immediate") == 0) {
+        parsed.mode = FLUSH_IMMEDIATE;
+        parsed.latency_us = 0;
+    }
+    else if (strcmp(arg, "line") == 0) {
+        parsed.mode = FLUSH_LINE;
+    }
+    else if (strncmp(arg, bytes_prefix, sizeof(bytes_prefix) - 1) == 0) {
+        if (parse_size(arg + sizeof(bytes_prefix) - 1, 1, FLUSH_MAX_BYTES,
+                       &parsed.bytes)) {
+            return -1;
+        }
+
+        parsed.mode = FLUSH_BYTES;
+    }
+    else if (strncmp(arg, latency_prefix, sizeof(latency_prefix) - 1) == 0) {
+        if (parse_unsigned(arg + sizeof(latency_prefix) - 1, 1,
+                           FLUSH_MAX_LATENCY_US, &parsed.latency_us)) {
+            return -1;
+        }
+
+        parsed.mode = FLUSH_LATENCY;
+    }
+    else {
+        return -1;
+    }
+
+    *policy = parsed;
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+/* flush_policy.h
+ *
+ * When to pass buffered output on. Writing each read straight back out keeps
+ * latency down, but a command that prints a few bytes at a time then costs a
+ * write, and a wakeup downstream, for every few bytes. Holding the data back
+ * for a little while gathers it into fewer, larger writes.
+ *
+ * Whatever the policy, data is never held once the buffer is full, or once
+ * the direction is finishing, so holding it can't cause a stall.
+ */
+
+#ifndef FLUSH_POLICY_H_INCLUDED
+#define FLUSH_POLICY_H_INCLUDED
+
+#include <stddef.h>
+
+/* How long line and bytes hold data that is still waiting for a newline or
+ * enough company, by default */
+#define FLUSH_DEFAULT_LATENCY_US 10000
+
+/* The most anything can be held for, and the most worth waiting for, which
+ * is as big as a buffer can be */
+#define FLUSH_MAX_LATENCY_US (60UL * 1000 * 1000)
+#define FLUSH_MAX_BYTES      (1024 * 1024 * 1024)
+
+enum flush_mode {
+    /* Write whatever there is as soon as it arrives. This is the default. */
+    FLUSH_IMMEDIATE,
+
+    /* Write up to the end of the last complete line, holding on to a
+     * partial line until its newline arrives or it has waited latency_us. */
+    FLUSH_LINE,
+
+    /* Wait until there are at least bytes to write, or the oldest has waited
+     * latency_us. */
+    FLUSH_BYTES,
+
+    /* Let data wait up to latency_us for more to join it. */
+    FLUSH_LATENCY
+};
+
+struct flush_policy {
+    enum flush_mode mode;
+    size_t bytes;
+    unsigned long latency_us;
+};
+
+/* Parse a policy of the form immediate, line, bytes:<n> or latency:<us>,
+ * where <n> may have a K, M or G suffix. Returns 0 on success or -1 if the
+ * string isn't a valid policy. */
+int flush_policy_parse(const char *arg, struct flush_policy *policy);
+
+#endif /* FLUSH_POLICY_H_INCLUDED */
@@ -0,0 +1,184 @@
+/* framing.c
+ *
+ * Output wrapped in frames. See framing.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "framing.h"
+#include "my_assert.h"
+#include "record_format.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* The length of an exit frame's payload, as length-prefixed */
+#define FRAMING_EXIT_PAYLOAD_SIZE 8
+
+
+/* The names of the streams in jsonl, indexed by REDIRECTION_* */
+static const char *const stream_names[] = { "input", "output", "error" };
+
+static const char base64_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Put a length-prefixed header into OUT. */
+static void put_header(unsigned char *out, int type, int stream,
+                       size_t length, unsigned long long seq, uint64_t now);
+
+/* The name of STREAM in jsonl. */
+static const char *stream_name(int stream);
+
+
+int framing_parse(const char *arg, enum framing_mode *mode) {
+    if (strcmp(arg, "raw") == 0) {
+        *mode = FRAMING_RAW;
+    }
+    else if (strcmp(arg, "length-prefixed") == 0) {
+        *mode = FRAMING_LENGTH_PREFIXED;
+    }
+    else if (strcmp(arg, "jsonl") == 0) {
+        *mode = FRAMING_JSONL;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void framer_init(struct framer *framer, enum framing_mode mode) {
+    framer->mode = mode;
+    atomic_init(&framer->seq, 0);
+}
+
+
+size_t framer_payload_room(const struct framer *framer, size_t space) {
+    if (space <= FRAMING_MAX_OVERHEAD) {
+        return 0;
+    }
+
+    space -= FRAMING_MAX_OVERHEAD;
+
+    return framer->mode == FRAMING_JSONL ? space / 4 * 3 : space;
+}
+
+
+size_t framer_data_header(struct framer *framer, int stream, size_t n,
+                          uint64_t now, char *out) {
+    unsigned long long seq = atomic_fetch_add_explicit(&framer->seq, 1,
+                                                       memory_order_relaxed);
+
+    if (framer->mode == FRAMING_JSONL) {
+        return snprintf(out, FRAMING_MAX_OVERHEAD,
+                        "{\"type\":\"data\",\"seq\":%llu,\"time\":%llu,"
+                        "\"stream\":\"%s\",\"length\":%zu,\"data\":\"",
+                        seq, (unsigned long long) now, stream_name(stream), n);
+    }
+
+    put_header((unsigned char *) out, FRAMING_TYPE_DATA, stream, n, seq, now);
+
+    return FRAMING_HEADER_SIZE;
+}
+
+
+size_t framer_data_trailer(const struct framer *framer, char *out) {
+    if (framer->mode == FRAMING_JSONL) {
+        memcpy(out, "\"}\n", 3);
+        return 3;
+    }
+
+    return 0;
+}
+
+
+size_t framer_encoded_length(const struct framer *framer, size_t n) {
+    return framer->mode == FRAMING_JSONL ? (n + 2) / 3 * 4 : n;
+}
+
+
+size_t framer_encode(const struct framer *framer, const char *data,
+                     size_t n, char *out) {
+    const unsigned char *in = (const unsigned char *) data;
+    char *start = out;
+    uint32_t group;
+
+    if (framer->mode != FRAMING_JSONL) {
+        memcpy(out, data, n);
+        return n;
+    }
+
+    for (; n >= 3; in += 3, n -= 3) {
+        group = (uint32_t) in[0] << 16 | (uint32_t) in[1] << 8 | in[2];
+        *out++ = base64_digits[group >> 18];
+        *out++ = base64_digits[(group >> 12) & 0x3f];
+        *out++ = base64_digits[(group >> 6) & 0x3f];
+        *out++ = base64_digits[group & 0x3f];
+    }
+
+    if (n > 0) {
+        group = (uint32_t) in[0] << 16 | (n > 1 ? (uint32_t) in[1] << 8 : 0);
+        *out++ = base64_digits[group >> 18];
+        *out++ = base64_digits[(group >> 12) & 0x3f];
+        *out++ = n > 1 ? base64_digits[(group >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+
+    return out - start;
+}
+
+
+size_t framer_exit_frame(struct framer *framer, int stream, int status,
+                         int exit_code, char *out) {
+    unsigned long long seq;
+    struct timespec now;
+    uint64_t now_ns;
+
+    ASSERT_ZERO(clock_gettime(CLOCK_MONOTONIC, &now));
+    now_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+    seq = atomic_fetch_add_explicit(&framer->seq, 1, memory_order_relaxed);
+
+    if (framer->mode == FRAMING_JSONL) {
+        return snprintf(out, FRAMING_MAX_OVERHEAD,
+                        "{\"type\":\"exit\",\"seq\":%llu,\"time\":%llu,"
+                        "\"stream\":\"%s\",\"status\":%d,\"exit_code\":%d}\n",
+                        seq, (unsigned long long) now_ns, stream_name(stream),
+                        status, exit_code);
+    }
+
+    put_header((unsigned char *) out, FRAMING_TYPE_EXIT, stream,
+               FRAMING_EXIT_PAYLOAD_SIZE, seq, now_ns);
+    record_put_u32((unsigned char *) out + FRAMING_HEADER_SIZE,
+                   (uint32_t) status);
+    record_put_u32((unsigned char *) out + FRAMING_HEADER_SIZE + 4,
+                   (uint32_t) exit_code);
+
+    return FRAMING_HEADER_SIZE + FRAMING_EXIT_PAYLOAD_SIZE;
+}
+
+
+static void put_header(unsigned char *out, int type, int stream,
+                       size_t length, unsigned long long seq, uint64_t now) {
+    record_put_u32(out, FRAMING_MAGIC);
+    out[4] = type;
+    out[5] = stream;
+    record_put_u16(out + 6, 0);
+    record_put_u32(out + 8, length);
+    record_put_u32(out + 12, 0);
+    record_put_u64(out + 16, seq);
+    record_put_u64(out + 24, now);
+}
+
+
+static const char *stream_name(int stream) {
+    return stream >= 0 &&
+        (size_t) stream < sizeof(stream_names) / sizeof(*stream_names) ?
+        stream_names[stream] : "unknown";
+}
@@ -0,0 +1,108 @@
+/* framing.h
+ *
+ * Output wrapped in frames, for --framing, so that a program reading it can
+ * tell each chunk of the command's output from the next, and from the exit
+ * status that follows it, without a wrapper of its own. Each read becomes a
+ * frame carrying its length, the direction it came from, a monotonic
+ * timestamp and a sequence number shared by every direction, so frames
+ * from standard output and standard error can be put back in order.
+ *
+ * In length-prefixed frames, all integers are little-endian, as in
+ * record_format.h:
+ *
+ *   u32  FRAMING_MAGIC
+ *   u8   type, one of the FRAMING_TYPE_* values
+ *   u8   stream: REDIRECTION_OUTPUT or REDIRECTION_ERROR
+ *   u16  flags, currently zero
+ *   u32  length of the payload that follows
+ *   u32  zero
+ *   u64  sequence number, from zero
+ *   u64  CLOCK_MONOTONIC time in nanoseconds
+ *
+ * In jsonl, each frame is a line holding one JSON object, with the payload
+ * in base64, since the command's output needn't be UTF-8:
+ *
+ *   {"type":"data","seq":0,"time":123,"stream":"output","length":5,
+ *    "data":"aGVsbG8="}
+ *   {"type":"exit","seq":1,"time":456,"stream":"output","status":0,
+ *    "exit_code":0}
+ */
+
+#ifndef FRAMING_H_INCLUDED
+#define FRAMING_H_INCLUDED
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAMING_MAGIC       0x31524654 /* "TFR1" */
+#define FRAMING_HEADER_SIZE 32
+
+/* Data read from the command. The same values as RECORD_TYPE_DATA and
+ * RECORD_TYPE_EXIT. */
+#define FRAMING_TYPE_DATA 1
+
+/* The command exited. The payload is the i32 wait status, then the i32 exit
+ * code terminator exits with. This is always the last frame. */
+#define FRAMING_TYPE_EXIT 3
+
+/* The most a frame can add to its payload, besides the payload growing by
+ * a third in base64 */
+#define FRAMING_MAX_OVERHEAD 192
+
+enum framing_mode {
+    /* Pass the output on as it is. This is the default. */
+    FRAMING_RAW,
+
+    /* A binary header in front of each chunk */
+    FRAMING_LENGTH_PREFIXED,
+
+    /* A line of JSON for each chunk */
+    FRAMING_JSONL
+};
+
+/* What every framed direction shares */
+struct framer {
+    enum framing_mode mode;
+
+    /* The sequence number for the next frame */
+    atomic_ullong seq;
+};
+
+/* Parse raw, length-prefixed or jsonl. Returns 0 on success or -1 if the
+ * string isn't one of them. */
+int framing_parse(const char *arg, enum framing_mode *mode);
+
+/* Start numbering frames from zero. */
+void framer_init(struct framer *framer, enum framing_mode mode);
+
+/* The most payload whose frame fits in SPACE bytes, or zero if none does. */
+size_t framer_payload_room(const struct framer *framer, size_t space);
+
+/* Put the start of a data frame for N bytes from STREAM into OUT, which
+ * must have room for FRAMING_MAX_OVERHEAD bytes, and return its length. This
+ * takes the next sequence number. */
+size_t framer_data_header(struct framer *framer, int stream, size_t n,
+                          uint64_t now, char *out);
+
+/* Put the end of a data frame into OUT, which must have room for
+ * FRAMING_MAX_OVERHEAD bytes, and return its length. */
+size_t framer_data_trailer(const struct framer *framer, char *out);
+
+/* The most bytes framer_encode can produce from N bytes of payload. */
+size_t framer_encoded_length(const struct framer *framer, size_t n);
+
+/* Encode N bytes of payload into OUT, which must have room for
+ * framer_encoded_length(N) bytes, and return how many it took. Every piece
+ * of a frame's payload but the last must be a multiple of three bytes, so
+ * that base64 can carry on where it left off. */
+size_t framer_encode(const struct framer *framer, const char *data,
+                     size_t n, char *out);
+
+/* Put the exit frame, for wait status STATUS and terminator's EXIT_CODE,
+ * as STREAM, into OUT, which must have room for FRAMING_MAX_OVERHEAD
+ * bytes, and return its length. */
+size_t framer_exit_frame(struct framer *framer, int stream, int status,
+                         int exit_code, char *out);
+
+#endif /* FRAMING_H_INCLUDED */
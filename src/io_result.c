@@ -0,0 +1,111 @@
+/* io_result.c
+ *
+ * The system calls on the copy path, reporting failure rather than exiting.
+ * See io_result.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "io_result.h"
+
+
+enum io_failure io_classify(ssize_t result) {
+    switch (-result) {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+        case EINTR:
+            return IO_RETRY;
+
+        case EPIPE:
+        case ECONNRESET:
+            return IO_HANGUP;
+
+        default:
+            return IO_ERROR;
+    }
+}
+
+
+ssize_t io_readv(int fd, const struct iovec *iov, int iov_count) {
+    ssize_t n_read;
+
+    do {
+        n_read = readv(fd, iov, iov_count);
+    } while (n_read < 0 && errno == EINTR);
+
+    return n_read < 0 ? -errno : n_read;
+}
+
+
+ssize_t io_writev(int fd, const struct iovec *iov, int iov_count, int whole) {
+    struct iovec rest[IO_MAX_IOVECS];
+    size_t wanted = 0;
+    size_t total = 0;
+    int first = 0;
+    int i;
+
+    for (i = 0; i < iov_count && i < IO_MAX_IOVECS; i++) {
+        rest[i] = iov[i];
+        wanted += iov[i].iov_len;
+    }
+
+    iov_count = i;
+
+    for (;;) {
+        ssize_t n_written = writev(fd, rest + first, iov_count - first);
+
+        if (n_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return total > 0 ? (ssize_t) total : -errno;
+        }
+
+        total += n_written;
+
+        if (!whole || total == wanted || n_written == 0) {
+            return total;
+        }
+
+        /* Skip over what went, and go again with the rest. */
+        while ((size_t) n_written >= rest[first].iov_len) {
+            n_written -= rest[first].iov_len;
+            first++;
+        }
+
+        rest[first].iov_base = (char *) rest[first].iov_base + n_written;
+        rest[first].iov_len -= n_written;
+    }
+}
+
+
+#ifdef HAVE_SPLICE
+ssize_t io_splice(int in_fd, int out_fd, size_t length) {
+    ssize_t n_moved;
+
+    do {
+        n_moved = splice(in_fd, NULL, out_fd, NULL, length,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n_moved < 0 && errno == EINTR);
+
+    return n_moved < 0 ? -errno : n_moved;
+}
+#endif
+
+
+int io_fsync(int fd) {
+    int result;
+
+    do {
+        result = fsync(fd);
+    } while (result < 0 && errno == EINTR);
+
+    return result < 0 ? -errno : 0;
+}
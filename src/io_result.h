@@ -0,0 +1,60 @@
+/* io_result.h
+ *
+ * The system calls on the copy path, made so that they report failure rather
+ * than exiting the way the my_assert.h macros do. A read or write that fails
+ * there should only end the direction, or the server session, it belongs
+ * to, so my_assert.h is left for setup, where there's nothing better to do
+ * than give up.
+ *
+ * Results follow the same convention as io_uring and the redirection_*_done
+ * functions: a byte count on success, or a negated errno value. Interrupted
+ * calls are retried here, so callers never see -EINTR from them.
+ */
+
+#ifndef IO_RESULT_H_INCLUDED
+#define IO_RESULT_H_INCLUDED
+
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* The most iovecs io_writev takes */
+#define IO_MAX_IOVECS 2
+
+/* What a failed result means for whoever got it */
+enum io_failure {
+    /* Nothing is wrong: the descriptor isn't ready, so try again later. */
+    IO_RETRY,
+
+    /* The other end has gone away, which is how output normally ends. */
+    IO_HANGUP,
+
+    /* A real error, which ends the direction and is worth reporting. */
+    IO_ERROR
+};
+
+/* Sort a negative RESULT into one of the above. */
+enum io_failure io_classify(ssize_t result);
+
+/* readv() from FD. */
+ssize_t io_readv(int fd, const struct iovec *iov, int iov_count);
+
+/* writev() to FD, with at most IO_MAX_IOVECS iovecs. With WHOLE set, carry on
+ * after a short write for as long as FD takes more, so that a signal arriving
+ * mid-write doesn't cost a trip through poll. That is only worth it when FD
+ * is blocking; on a nonblocking one, a short write nearly always means the
+ * next would get -EAGAIN. If some of the data was written before an error,
+ * the count is returned, and the error is left for the next call. */
+ssize_t io_writev(int fd, const struct iovec *iov, int iov_count, int whole);
+
+#ifdef HAVE_SPLICE
+/* Move up to LENGTH bytes from IN_FD to OUT_FD with splice(), without
+ * blocking on the pipe. */
+ssize_t io_splice(int in_fd, int out_fd, size_t length);
+#endif
+
+/* fsync() FD, returning 0 or a negated errno value. */
+int io_fsync(int fd);
+
+#endif /* IO_RESULT_H_INCLUDED */
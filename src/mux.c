@@ -0,0 +1,914 @@
+/* mux.c
+ *
+ * Stream commands' I/O over one TCP connection. See mux.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "my_assert.h"
+#include "mux.h"
+#include "mux_format.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* The poll entries before the sessions': the wake pipe and the
+ * connection */
+#define MUX_POLL_WAKE 0
+#define MUX_POLL_SOCK 1
+#define MUX_POLL_SESSIONS 2
+
+/* Room for what the collector sends: one whole frame, and the start of the
+ * next */
+#define MUX_IN_CAPACITY (2 * (MUX_FRAME_HEADER_SIZE + MUX_MAX_PAYLOAD))
+
+/* Once we are done, how long to wait for the collector to close its side,
+ * in milliseconds. Closing with its last frames still unread would reset
+ * the connection, and could lose the end of what we sent. */
+#define MUX_LINGER_MS 1000
+
+/* The zstd compression level. The output is sent as it comes, so the
+ * fastest level is the one to use. */
+#define MUX_ZSTD_LEVEL 1
+
+
+/* Connect to ADDRESS, HOST:PORT, and return the socket. */
+static int connect_to(const char *address);
+
+/* Body of the connection thread. */
+static void *mux_thread_fn(void *arg);
+
+/* Adopt new sessions, and add the frames that are due to the batch: OPEN,
+ * CREDIT and EXIT. Sessions that are done are freed. Returns nonzero once
+ * the thread can finish. */
+static int queue_frames(struct mux *mux);
+
+/* Fill in the poll entries, and return how many there are. */
+static size_t poll_setup(struct mux *mux);
+
+/* Act on what poll said. */
+static void handle(struct mux *mux);
+
+/* Read a session's output into the batch. */
+static void read_output(struct mux *mux, struct mux_session *session);
+
+/* Write what is waiting of a session's input to its pipe. */
+static void write_input(struct mux_session *session);
+
+/* Read from the connection, and act on every whole frame. */
+static void receive(struct mux *mux);
+
+/* Act on one frame from the collector. Returns 0, or -1 if the collector
+ * broke the protocol. */
+static int handle_frame(struct mux *mux, int type, uint32_t id,
+                        const unsigned char *payload, uint32_t length);
+
+/* Add a frame to the batch. Returns 0, or -1 if there isn't room. */
+static int batch_frame(struct mux *mux, int type, uint32_t id,
+                       const void *payload, uint32_t length);
+
+/* Move the batch, compressed if asked, to the send buffer, if the send
+ * buffer is empty. */
+static void pack_batch(struct mux *mux);
+
+/* Send what we can of the send buffer without blocking. */
+static void send_out(struct mux *mux);
+
+/* Give up on the connection for the reason ERROR, a negated errno
+ * value. */
+static void lose(struct mux *mux, int error);
+
+/* Find the session numbered ID, or NULL if it is gone. */
+static struct mux_session *find_session(struct mux *mux, uint32_t id);
+
+/* Close our ends of a session's pipes, if they are still open. */
+static void session_close(struct mux_session *session);
+
+/* Interrupt the thread's poll. */
+static void mux_wake(struct mux *mux);
+
+
+void mux_start(struct mux *mux, const char *address, int codec) {
+    size_t packed_capacity = MUX_BATCH_SIZE;
+
+    mux->sock = connect_to(address);
+    mux->codec = codec;
+
+    mux->incoming = NULL;
+    mux->next_id = 1;
+    mux->lost = 0;
+    mux->error = 0;
+    mux->finishing = 0;
+
+    mux->sessions = NULL;
+    mux->n_sessions = 0;
+
+    ASSERT_NONZERO(mux->in = malloc(MUX_IN_CAPACITY));
+    mux->in_length = 0;
+
+    ASSERT_NONZERO(mux->batch = malloc(MUX_BATCH_SIZE));
+    mux->batch_length = 0;
+
+    /* Room for the worst case, where the codec makes things bigger. Such a
+     * batch is sent as it is instead, but the codec still needs the room
+     * to find that out. */
+    switch (codec) {
+#ifdef HAVE_ZSTD
+        case RECORD_CODEC_ZSTD:
+            packed_capacity = ZSTD_compressBound(MUX_BATCH_SIZE);
+            break;
+#endif
+
+#ifdef HAVE_LZ4
+        case RECORD_CODEC_LZ4:
+            packed_capacity = LZ4_compressBound(MUX_BATCH_SIZE);
+            break;
+#endif
+
+        default:
+            break;
+    }
+
+    mux->out_capacity = MUX_BATCH_HEADER_SIZE + packed_capacity;
+    ASSERT_NONZERO(mux->out = malloc(mux->out_capacity));
+
+    /* The hello is the first thing in the send buffer, so it goes out
+     * before any batch. */
+    memcpy(mux->out, MUX_HELLO_MAGIC, MUX_HELLO_MAGIC_SIZE);
+    record_put_u32(mux->out + 8, MUX_VERSION);
+    record_put_u32(mux->out + 12, MUX_WINDOW);
+    mux->out_length = MUX_HELLO_SIZE;
+    mux->out_offset = 0;
+
+    mux->poll_fds = NULL;
+    mux->poll_capacity = 0;
+
+    /* A collector that goes away mustn't take us with it, nor a direction
+     * writing to a pipe we have closed because of that. Writes report
+     * EPIPE instead. */
+    ASSERT(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
+
+    ASSERT_ZERO(pipe2(mux->wake_pipe, O_NONBLOCK | O_CLOEXEC));
+    ASSERT_ZERO(pthread_mutex_init(&mux->lock, NULL));
+    ASSERT_ZERO(pthread_create(&mux->thread, NULL, &mux_thread_fn, mux));
+}
+
+
+struct mux_session *mux_open(struct mux *mux, char *const *argv,
+                             int *out_fd, int *in_fd) {
+    struct mux_session *session;
+    int out_pipe[2], in_pipe[2];
+    char *const *p;
+    size_t length = 0;
+
+    ASSERT_NONZERO(session = calloc(1, sizeof(*session)));
+
+    /* The arguments go in whole, as many as fit in one frame. */
+    for (p = argv; *p && length + strlen(*p) + 1 <= MUX_MAX_PAYLOAD; p++) {
+        length += strlen(*p) + 1;
+    }
+
+    ASSERT_NONZERO(session->open_payload = malloc(length > 0 ? length : 1));
+    session->open_length = 0;
+
+    for (p = argv; session->open_length < length; p++) {
+        size_t n = strlen(*p) + 1;
+
+        memcpy(session->open_payload + session->open_length, *p, n);
+        session->open_length += n;
+    }
+
+    /* The output direction sets up its end as it needs. The input
+     * direction's end is nonblocking as well as ours, since the collector
+     * may never end the input, and io_uring can only cancel a read that is
+     * waiting for a nonblocking descriptor to become ready. */
+    ASSERT_ZERO(pipe2(out_pipe, O_CLOEXEC));
+    ASSERT_ZERO(pipe2(in_pipe, O_NONBLOCK | O_CLOEXEC));
+    ASSERT_NONNEG(fcntl(out_pipe[0], F_SETFL, O_NONBLOCK));
+
+    session->out_fd = out_pipe[0];
+    session->in_fd = in_pipe[1];
+    session->out_credit = MUX_WINDOW;
+    session->input.data = NULL;
+
+    ASSERT_ZERO(pthread_mutex_lock(&mux->lock));
+
+    if (mux->lost) {
+        ASSERT_ZERO(pthread_mutex_unlock(&mux->lock));
+
+        ASSERT_ZERO(close(out_pipe[0]));
+        ASSERT_ZERO(close(out_pipe[1]));
+        ASSERT_ZERO(close(in_pipe[0]));
+        ASSERT_ZERO(close(in_pipe[1]));
+        free(session->open_payload);
+        free(session);
+
+        return NULL;
+    }
+
+    session->id = mux->next_id++;
+    session->next = mux->incoming;
+    mux->incoming = session;
+
+    ASSERT_ZERO(pthread_mutex_unlock(&mux->lock));
+
+    mux_wake(mux);
+
+    *out_fd = out_pipe[1];
+    *in_fd = in_pipe[0];
+
+    return session;
+}
+
+
+void mux_exit(struct mux *mux, struct mux_session *session, int status) {
+    ASSERT_ZERO(pthread_mutex_lock(&mux->lock));
+    session->exited = 1;
+    session->status = status;
+    ASSERT_ZERO(pthread_mutex_unlock(&mux->lock));
+
+    mux_wake(mux);
+}
+
+
+int mux_finish(struct mux *mux) {
+    ASSERT_ZERO(pthread_mutex_lock(&mux->lock));
+    mux->finishing = 1;
+    ASSERT_ZERO(pthread_mutex_unlock(&mux->lock));
+
+    mux_wake(mux);
+    ASSERT_ZERO(pthread_join(mux->thread, NULL));
+
+    if (mux->sock >= 0) {
+        struct pollfd pfd;
+        char drain[4096];
+
+        /* Let the collector see we are done, and wait for it to agree,
+         * reading whatever it sent meanwhile. */
+        pfd.fd = mux->sock;
+        pfd.events = POLLIN;
+
+        if (shutdown(mux->sock, SHUT_WR) == 0) {
+            while (poll(&pfd, 1, MUX_LINGER_MS) > 0 &&
+                   recv(mux->sock, drain, sizeof(drain), 0) > 0) {
+                /* Keep draining. */
+            }
+        }
+
+        ASSERT_ZERO(close(mux->sock));
+        mux->sock = -1;
+    }
+
+    ASSERT_ZERO(close(mux->wake_pipe[0]));
+    ASSERT_ZERO(close(mux->wake_pipe[1]));
+    ASSERT_ZERO(pthread_mutex_destroy(&mux->lock));
+
+    free(mux->in);
+    free(mux->batch);
+    free(mux->out);
+    free(mux->poll_fds);
+
+    return mux->error;
+}
+
+
+static int connect_to(const char *address) {
+    struct addrinfo hints, *results, *result;
+    char *copy, *host, *port;
+    int sock = -1;
+    int one = 1;
+
+    ASSERT_NONZERO(host = copy = strdup(address));
+
+    /* The port comes after the last colon, so that an IPv6 address can
+     * have colons of its own, as long as it is in brackets. */
+    port = strrchr(host, ':');
+    ASSERT_WITH_MESSAGE(port && port != host && port[1] != '\0',
+                        "Invalid --connect address");
+    *port++ = '\0';
+
+    if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+        host[strlen(host) - 1] = '\0';
+        host++;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    ASSERT_ZERO_WITH_MESSAGE(getaddrinfo(host, port, &hints, &results),
+                             "Can't look up the --connect address");
+
+    for (result = results; result; result = result->ai_next) {
+        sock = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC,
+                      result->ai_protocol);
+
+        if (sock < 0) {
+            continue;
+        }
+
+        if (connect(sock, result->ai_addr, result->ai_addrlen) == 0) {
+            break;
+        }
+
+        ASSERT_ZERO(close(sock));
+        sock = -1;
+    }
+
+    freeaddrinfo(results);
+    free(copy);
+
+    ASSERT_NONNEG_WITH_MESSAGE(sock, "Can't connect to the --connect address");
+
+    /* We do our own batching, and a batch should go out as soon as it is
+     * made, not wait for the last one to be acknowledged. */
+    ASSERT_ZERO(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one,
+                           sizeof(one)));
+    ASSERT_NONNEG(fcntl(sock, F_SETFL, O_NONBLOCK));
+
+    return sock;
+}
+
+
+static void *mux_thread_fn(void *arg) {
+    struct mux *mux = arg;
+
+    while (!queue_frames(mux)) {
+        size_t n_poll_fds = poll_setup(mux);
+
+        if (poll(mux->poll_fds, n_poll_fds, -1) < 0) {
+            /* The SIGCHLD handler may interrupt us if there's no pidfd. */
+            ASSERT(errno == EINTR);
+            continue;
+        }
+
+        handle(mux);
+        pack_batch(mux);
+        send_out(mux);
+    }
+
+    return NULL;
+}
+
+
+static int queue_frames(struct mux *mux) {
+    struct mux_session **link;
+    struct mux_session *session;
+    int finishing;
+
+    /* The lock guards incoming and each session's exit, and nothing here
+     * waits on anything, so it is held throughout. */
+    ASSERT_ZERO(pthread_mutex_lock(&mux->lock));
+
+    while ((session = mux->incoming) != NULL) {
+        mux->incoming = session->next;
+        session->next = mux->sessions;
+        mux->sessions = session;
+        mux->n_sessions++;
+    }
+
+    for (link = &mux->sessions; (session = *link) != NULL; ) {
+        unsigned char status[4];
+
+        /* With the connection gone, all that is left is to wait for each
+         * command to exit, so the caller is done with the session. */
+        if (mux->lost) {
+            session_close(session);
+        }
+        else {
+            if (session->open_payload) {
+                if (batch_frame(mux, MUX_FRAME_OPEN, session->id,
+                                session->open_payload,
+                                session->open_length) < 0) {
+                    link = &session->next;
+                    continue;
+                }
+
+                free(session->open_payload);
+                session->open_payload = NULL;
+            }
+
+            /* Credit goes back in lumps, rather than a frame for every
+             * write, unless the collector has nothing left to send. */
+            if (session->input_owed > 0 &&
+                    (session->input_owed >= MUX_WINDOW / 4 ||
+                     session->input.length == 0)) {
+                record_put_u32(status, session->input_owed);
+
+                if (batch_frame(mux, MUX_FRAME_CREDIT, session->id, status,
+                                sizeof(status)) == 0) {
+                    session->input_owed = 0;
+                }
+            }
+
+            /* The exit goes after all of the output, which is in the batch
+             * once the pipe has ended. */
+            if (session->exited && session->out_fd < 0) {
+                record_put_u32(status, session->status);
+
+                if (batch_frame(mux, MUX_FRAME_EXIT, session->id, status,
+                                sizeof(status)) < 0) {
+                    link = &session->next;
+                    continue;
+                }
+            }
+        }
+
+        if (!session->exited || session->out_fd >= 0) {
+            link = &session->next;
+            continue;
+        }
+
+        session_close(session);
+        *link = session->next;
+        mux->n_sessions--;
+
+        if (session->input.data) {
+            ring_buffer_destroy(&session->input);
+        }
+
+        free(session->open_payload);
+        free(session);
+    }
+
+    /* Once finishing is set, nothing more can come in. */
+    finishing = mux->finishing && !mux->incoming;
+
+    ASSERT_ZERO(pthread_mutex_unlock(&mux->lock));
+
+    /* Anything just queued is sent before the next wait, or before we
+     * decide there's no need for one. */
+    pack_batch(mux);
+    send_out(mux);
+
+    return finishing && mux->n_sessions == 0 &&
+        (mux->lost || (mux->batch_length == 0 &&
+                       mux->out_offset == mux->out_length));
+}
+
+
+static size_t poll_setup(struct mux *mux) {
+    struct mux_session *session;
+    size_t n_poll_fds = MUX_POLL_SESSIONS + 2 * mux->n_sessions;
+    struct pollfd *pfd;
+
+    /* One output frame, however small, is worth reading for. */
+    int batch_room = mux->batch_length + MUX_FRAME_HEADER_SIZE <
+        MUX_BATCH_SIZE;
+
+    if (n_poll_fds > mux->poll_capacity) {
+        mux->poll_capacity = 2 * n_poll_fds;
+        ASSERT_NONZERO(mux->poll_fds =
+                       realloc(mux->poll_fds,
+                               mux->poll_capacity * sizeof(*mux->poll_fds)));
+    }
+
+    mux->poll_fds[MUX_POLL_WAKE].fd = mux->wake_pipe[0];
+    mux->poll_fds[MUX_POLL_WAKE].events = POLLIN;
+
+    /* Whatever arrives is acted on as soon as it is whole, so there is
+     * always room for more. */
+    mux->poll_fds[MUX_POLL_SOCK].fd = mux->sock;
+    mux->poll_fds[MUX_POLL_SOCK].events = POLLIN |
+        (mux->out_offset < mux->out_length ? POLLOUT : 0);
+
+    for (pfd = &mux->poll_fds[MUX_POLL_SESSIONS], session = mux->sessions;
+            session; session = session->next, pfd += 2) {
+        pfd[0].fd = batch_room && !session->open_payload &&
+            session->out_credit > 0 ? session->out_fd : -1;
+        pfd[0].events = POLLIN;
+
+        pfd[1].fd = session->input.data && session->input.length > 0 ?
+            session->in_fd : -1;
+        pfd[1].events = POLLOUT;
+    }
+
+    return n_poll_fds;
+}
+
+
+static void handle(struct mux *mux) {
+    struct mux_session *session;
+    struct pollfd *pfd;
+
+    if (mux->poll_fds[MUX_POLL_WAKE].revents) {
+        char drain[64];
+
+        while (read(mux->wake_pipe[0], drain, sizeof(drain)) > 0) {
+            /* Keep draining. */
+        }
+    }
+
+    if (mux->poll_fds[MUX_POLL_SOCK].revents & POLLOUT) {
+        send_out(mux);
+    }
+
+    /* Losing the connection closed the socket and every session's pipes,
+     * so none of the other revents are about anything that is still
+     * open. */
+    if (mux->lost) {
+        return;
+    }
+
+    for (pfd = &mux->poll_fds[MUX_POLL_SESSIONS], session = mux->sessions;
+            session; session = session->next, pfd += 2) {
+        if (pfd[0].revents) {
+            read_output(mux, session);
+        }
+
+        if (pfd[1].revents) {
+            write_input(session);
+        }
+    }
+
+    /* This comes last, since a lost connection closes the sessions'
+     * pipes. */
+    if (mux->poll_fds[MUX_POLL_SOCK].revents & ~POLLOUT) {
+        receive(mux);
+    }
+}
+
+
+static void read_output(struct mux *mux, struct mux_session *session) {
+    unsigned char *header = mux->batch + mux->batch_length;
+    size_t room;
+    ssize_t n;
+
+    /* Another session may have filled the batch since the poll. */
+    if (mux->batch_length + MUX_FRAME_HEADER_SIZE >= MUX_BATCH_SIZE) {
+        return;
+    }
+
+    room = MUX_BATCH_SIZE - mux->batch_length - MUX_FRAME_HEADER_SIZE;
+
+    if (room > session->out_credit) {
+        room = session->out_credit;
+    }
+
+    if (room > MUX_MAX_PAYLOAD) {
+        room = MUX_MAX_PAYLOAD;
+    }
+
+    while ((n = read(session->out_fd, header + MUX_FRAME_HEADER_SIZE,
+                     room)) < 0 && errno == EINTR) {
+        /* Try again. */
+    }
+
+    if (n < 0 && errno == EAGAIN) {
+        return;
+    }
+
+    /* An error can only mean the output is over, just as the end of the
+     * pipe does. */
+    if (n <= 0) {
+#ifdef ASSERT_DEBUG
+        fprintf(stderr, "Session %u: output done.\n", session->id);
+#endif
+        ASSERT_ZERO(close(session->out_fd));
+        session->out_fd = -1;
+        return;
+    }
+
+    header[0] = MUX_FRAME_OUTPUT;
+    header[1] = 0;
+    record_put_u16(header + 2, 0);
+    record_put_u32(header + 4, session->id);
+    record_put_u32(header + 8, n);
+
+    mux->batch_length += MUX_FRAME_HEADER_SIZE + n;
+    session->out_credit -= n;
+}
+
+
+static void write_input(struct mux_session *session) {
+    struct iovec iov[2];
+    int iov_count = ring_buffer_data_iov(&session->input, iov);
+    ssize_t n;
+
+    while ((n = writev(session->in_fd, iov, iov_count)) < 0 &&
+           errno == EINTR) {
+        /* Try again. */
+    }
+
+    if (n > 0) {
+        ring_buffer_consume(&session->input, n);
+        session->input_owed += n;
+    }
+    else if (n < 0 && errno != EAGAIN) {
+        /* The input direction has gone, so nothing more will be read;
+         * whatever else arrives for it is thrown away. */
+        ASSERT_ZERO(close(session->in_fd));
+        session->in_fd = -1;
+        ring_buffer_clear(&session->input);
+        return;
+    }
+
+    if (session->input.length == 0 && session->input_eof) {
+        ASSERT_ZERO(close(session->in_fd));
+        session->in_fd = -1;
+    }
+}
+
+
+static void receive(struct mux *mux) {
+    size_t offset = 0;
+    ssize_t n;
+
+    while ((n = recv(mux->sock, mux->in + mux->in_length,
+                     MUX_IN_CAPACITY - mux->in_length, 0)) < 0 &&
+           errno == EINTR) {
+        /* Try again. */
+    }
+
+    if (n < 0 && errno == EAGAIN) {
+        return;
+    }
+
+    if (n <= 0) {
+        lose(mux, n < 0 ? -errno : -EPIPE);
+        return;
+    }
+
+    mux->in_length += n;
+
+    while (mux->in_length - offset >= MUX_FRAME_HEADER_SIZE) {
+        const unsigned char *header = mux->in + offset;
+        uint32_t length = record_get_u32(header + 8);
+
+        if (length > MUX_MAX_PAYLOAD) {
+            lose(mux, -EPROTO);
+            return;
+        }
+
+        if (mux->in_length - offset < MUX_FRAME_HEADER_SIZE + length) {
+            break;
+        }
+
+        if (handle_frame(mux, header[0], record_get_u32(header + 4),
+                         header + MUX_FRAME_HEADER_SIZE, length) < 0) {
+            lose(mux, -EPROTO);
+            return;
+        }
+
+        offset += MUX_FRAME_HEADER_SIZE + length;
+    }
+
+    memmove(mux->in, mux->in + offset, mux->in_length - offset);
+    mux->in_length -= offset;
+}
+
+
+static int handle_frame(struct mux *mux, int type, uint32_t id,
+                        const unsigned char *payload, uint32_t length) {
+    struct mux_session *session = find_session(mux, id);
+    struct iovec iov[2];
+    int iov_count, i;
+
+    switch (type) {
+        case MUX_FRAME_INPUT:
+            if (!session || session->in_fd < 0 || session->input_eof) {
+                /* The command isn't reading any more. */
+                return 0;
+            }
+
+            if (!session->input.data) {
+                ring_buffer_init(&session->input, MUX_WINDOW, NULL);
+            }
+
+            /* What is in the pipe but not credited yet still counts
+             * against the window. */
+            if (session->input.length + session->input_owed + length >
+                    MUX_WINDOW) {
+                return -1;
+            }
+
+            iov_count = ring_buffer_space_iov(&session->input, iov);
+
+            for (i = 0; i < iov_count && length > 0; i++) {
+                size_t n = length < iov[i].iov_len ? length : iov[i].iov_len;
+
+                memcpy(iov[i].iov_base, payload, n);
+                ring_buffer_produce(&session->input, n);
+                payload += n;
+                length -= n;
+            }
+
+            return 0;
+
+        case MUX_FRAME_CREDIT:
+            if (length != 4) {
+                return -1;
+            }
+
+            if (session) {
+                session->out_credit += record_get_u32(payload);
+            }
+
+            return 0;
+
+        case MUX_FRAME_EOF:
+            if (session && !session->input_eof) {
+                session->input_eof = 1;
+
+                if (session->in_fd >= 0 &&
+                        (!session->input.data || session->input.length == 0)) {
+                    ASSERT_ZERO(close(session->in_fd));
+                    session->in_fd = -1;
+                }
+            }
+
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+
+static int batch_frame(struct mux *mux, int type, uint32_t id,
+                       const void *payload, uint32_t length) {
+    unsigned char *header = mux->batch + mux->batch_length;
+
+    if (mux->batch_length + MUX_FRAME_HEADER_SIZE + length > MUX_BATCH_SIZE) {
+        return -1;
+    }
+
+    header[0] = type;
+    header[1] = 0;
+    record_put_u16(header + 2, 0);
+    record_put_u32(header + 4, id);
+    record_put_u32(header + 8, length);
+    memcpy(header + MUX_FRAME_HEADER_SIZE, payload, length);
+
+    mux->batch_length += MUX_FRAME_HEADER_SIZE + length;
+
+    return 0;
+}
+
+
+static void pack_batch(struct mux *mux) {
+    unsigned char *header = mux->out;
+    unsigned char *packed = mux->out + MUX_BATCH_HEADER_SIZE;
+    size_t stored_length = mux->batch_length;
+    int codec = RECORD_CODEC_NONE;
+
+    if (mux->batch_length == 0 || mux->out_offset < mux->out_length ||
+            mux->lost) {
+        return;
+    }
+
+    /* A batch the codec can't shrink is sent as it is. */
+#ifdef HAVE_ZSTD
+    if (mux->codec == RECORD_CODEC_ZSTD) {
+        size_t n = ZSTD_compress(packed,
+                                 mux->out_capacity - MUX_BATCH_HEADER_SIZE,
+                                 mux->batch, mux->batch_length,
+                                 MUX_ZSTD_LEVEL);
+
+        if (!ZSTD_isError(n) && n < stored_length) {
+            stored_length = n;
+            codec = RECORD_CODEC_ZSTD;
+        }
+    }
+#endif
+
+#ifdef HAVE_LZ4
+    if (mux->codec == RECORD_CODEC_LZ4) {
+        int n = LZ4_compress_default((const char *) mux->batch,
+                                     (char *) packed, mux->batch_length,
+                                     mux->out_capacity -
+                                         MUX_BATCH_HEADER_SIZE);
+
+        if (n > 0 && (size_t) n < stored_length) {
+            stored_length = n;
+            codec = RECORD_CODEC_LZ4;
+        }
+    }
+#endif
+
+    if (codec == RECORD_CODEC_NONE) {
+        memcpy(packed, mux->batch, mux->batch_length);
+    }
+
+    record_put_u32(header, MUX_BATCH_MAGIC);
+    record_put_u32(header + 4, codec);
+    record_put_u32(header + 8, mux->batch_length);
+    record_put_u32(header + 12, stored_length);
+
+    mux->out_offset = 0;
+    mux->out_length = MUX_BATCH_HEADER_SIZE + stored_length;
+    mux->batch_length = 0;
+}
+
+
+static void send_out(struct mux *mux) {
+    while (mux->out_offset < mux->out_length && !mux->lost) {
+        ssize_t n = send(mux->sock, mux->out + mux->out_offset,
+                         mux->out_length - mux->out_offset, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno != EAGAIN) {
+                lose(mux, -errno);
+            }
+
+            return;
+        }
+
+        mux->out_offset += n;
+    }
+
+    if (mux->out_offset == mux->out_length) {
+        mux->out_offset = mux->out_length = 0;
+    }
+}
+
+
+static void lose(struct mux *mux, int error) {
+    struct mux_session *session;
+
+    /* Only the first reason counts. */
+    if (mux->sock < 0) {
+        return;
+    }
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Lost the connection: %s.\n", strerror(-error));
+#endif
+
+    ASSERT_ZERO(pthread_mutex_lock(&mux->lock));
+    mux->lost = 1;
+    mux->error = error;
+    ASSERT_ZERO(pthread_mutex_unlock(&mux->lock));
+
+    for (session = mux->sessions; session; session = session->next) {
+        session_close(session);
+    }
+
+    ASSERT_ZERO(close(mux->sock));
+    mux->sock = -1;
+
+    mux->batch_length = 0;
+    mux->out_offset = mux->out_length = 0;
+}
+
+
+static struct mux_session *find_session(struct mux *mux, uint32_t id) {
+    struct mux_session *session;
+
+    for (session = mux->sessions; session; session = session->next) {
+        if (session->id == id) {
+            return session;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void session_close(struct mux_session *session) {
+    if (session->out_fd >= 0) {
+        ASSERT_ZERO(close(session->out_fd));
+        session->out_fd = -1;
+    }
+
+    if (session->in_fd >= 0) {
+        ASSERT_ZERO(close(session->in_fd));
+        session->in_fd = -1;
+    }
+}
+
+
+static void mux_wake(struct mux *mux) {
+    char wake_char = 0;
+
+    /* If the pipe is full, a wakeup is already pending. */
+    if (write(mux->wake_pipe[1], &wake_char, 1) < 0) {
+        ASSERT(errno == EAGAIN);
+    }
+}
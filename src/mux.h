@@ -0,0 +1,146 @@
+/* mux.h
+ *
+ * Stream commands' I/O over one TCP connection, for --connect. Each command
+ * is a session on the connection. The output direction writes to a pipe
+ * rather than our standard output, and the mux sends what comes out of the
+ * pipe to the other end in batches, compressed if asked; what the other end
+ * sends for the command's input goes into a pipe that the input direction
+ * reads from. So the PTY side is copied as usual, with all its settings, and
+ * only the pipes are the mux's business. A server puts all its sessions on
+ * the same connection.
+ *
+ * Both directions of every session are flow controlled by credit, so
+ * neither end ever sends a session more than the other has room for: a
+ * session whose output isn't being taken stops being read, which holds up
+ * the command writing it, and no one else. See mux_format.h for what goes
+ * over the wire.
+ *
+ * A thread of its own runs the connection. If the connection is lost, every
+ * session's pipes are closed, which their directions see as their output
+ * hanging up and their input ending.
+ */
+
+#ifndef MUX_H_INCLUDED
+#define MUX_H_INCLUDED
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <poll.h>
+
+#include "ring_buffer.h"
+
+/* The credit each end starts with for each direction of each session */
+#define MUX_WINDOW (256 * 1024)
+
+/* The most frames to put in one batch, by their length before
+ * compression */
+#define MUX_BATCH_SIZE (256 * 1024)
+
+/* One command on the connection. Only the mux thread touches a session,
+ * apart from the fields marked as guarded by the mux's lock. */
+struct mux_session {
+    uint32_t id;
+
+    /* Our ends of the pipes: the read end of the output, and the write end
+     * of the input, or -1 once closed */
+    int out_fd;
+    int in_fd;
+
+    /* The OPEN frame's payload, until it has been sent */
+    char *open_payload;
+    size_t open_length;
+
+    /* How much more output the collector has room for */
+    uint64_t out_credit;
+
+    /* Input that has arrived but isn't in the pipe yet, allocated with the
+     * first of it, and how much has gone into the pipe without the
+     * collector being given credit for it yet */
+    struct ring_buffer input;
+    size_t input_owed;
+
+    /* Set once the collector has said the input is over */
+    int input_eof;
+
+    /* Guarded by the lock: set, with the wait status, once the command has
+     * exited */
+    int exited;
+    int status;
+
+    struct mux_session *next;
+};
+
+struct mux {
+    int sock;
+
+    /* One of the RECORD_CODEC_* values from record_format.h */
+    int codec;
+
+    pthread_t thread;
+
+    /* Writing a byte here interrupts the thread's poll. */
+    int wake_pipe[2];
+
+    /* Guards the fields below it, up to the thread's own state */
+    pthread_mutex_t lock;
+
+    /* New sessions, which the thread adopts on its next turn */
+    struct mux_session *incoming;
+    uint32_t next_id;
+
+    /* Set once the connection is lost, with the negated errno value saying
+     * why, which is -EPIPE if the collector hung up */
+    int lost;
+    int error;
+
+    /* Set once no more sessions are coming, so the thread can finish once
+     * the ones it has are done */
+    int finishing;
+
+    /* The thread's own state. The sessions it has adopted: */
+    struct mux_session *sessions;
+    size_t n_sessions;
+
+    /* What has arrived from the collector, up to one frame and a bit */
+    unsigned char *in;
+    size_t in_length;
+
+    /* The batch being filled, and the packed batches waiting to be sent,
+     * from out_offset */
+    unsigned char *batch;
+    size_t batch_length;
+    unsigned char *out;
+    size_t out_length;
+    size_t out_offset;
+    size_t out_capacity;
+
+    struct pollfd *poll_fds;
+    size_t poll_capacity;
+};
+
+/* Connect to ADDRESS, HOST:PORT with the host in brackets if it is an IPv6
+ * address, say hello, and start the thread. Batches are compressed with
+ * CODEC. */
+void mux_start(struct mux *mux, const char *address, int codec);
+
+/* Start a session for the command in ARGV, terminated by NULL. The
+ * command's output should be written to *OUT_FD, and its input read from
+ * *IN_FD; both are the caller's to close once the command's I/O is done.
+ * Returns the session, or NULL if the connection has been lost. Any thread
+ * may call this. */
+struct mux_session *mux_open(struct mux *mux, char *const *argv,
+                             int *out_fd, int *in_fd);
+
+/* Report that a session's command exited with STATUS. This is the last the
+ * caller may do with the session, and should only come once its output is
+ * done and *OUT_FD closed. Any thread may call this. */
+void mux_exit(struct mux *mux, struct mux_session *session, int status);
+
+/* Wait for every session to be done and for everything to be sent, then
+ * close the connection. Returns 0, or the negated errno value, or -EPIPE if
+ * the collector hung up, if the connection was lost on the way. */
+int mux_finish(struct mux *mux);
+
+#endif /* MUX_H_INCLUDED */
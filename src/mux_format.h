@@ -0,0 +1,78 @@
+/* mux_format.h
+ *
+ * What goes over a --connect connection. All integers are little-endian,
+ * packed with the helpers from record_format.h. We open the connection and
+ * start with a hello, then send batches of frames; the other end, the
+ * collector, sends frames on their own, with no batches around them:
+ *
+ *   us         hello, batch, batch, ...
+ *   collector  frame, frame, ...
+ *
+ * Every command is a session, numbered by us from 1 and never reused while
+ * the connection lasts, and every frame but the hello belongs to one.
+ *
+ * Both directions of a session are flow controlled by credit. Each end
+ * starts with the window from the hello for every session, in bytes, and
+ * may send that much OUTPUT or INPUT for the session before the other end
+ * sends CREDIT frames for more. Credit counts payload bytes as they are
+ * before compression.
+ */
+
+#ifndef MUX_FORMAT_H_INCLUDED
+#define MUX_FORMAT_H_INCLUDED
+
+#include "record_format.h"
+
+/* The hello:
+ *   8 bytes  MUX_HELLO_MAGIC
+ *   u32      MUX_VERSION
+ *   u32      the window each end starts with for each session */
+#define MUX_HELLO_MAGIC      "TERMMUX\0"
+#define MUX_HELLO_MAGIC_SIZE 8
+#define MUX_VERSION          1
+#define MUX_HELLO_SIZE       16
+
+/* A batch header, followed by the stored payload, which is a run of frames,
+ * compressed as a whole if the batch says so:
+ *   u32  MUX_BATCH_MAGIC
+ *   u32  codec, one of the RECORD_CODEC_* values
+ *   u32  length of the frames once decompressed
+ *   u32  length of the payload as stored */
+#define MUX_BATCH_MAGIC       0x31424d54 /* "TMB1" */
+#define MUX_BATCH_HEADER_SIZE 16
+
+/* A frame header, followed by LENGTH bytes of payload:
+ *   u8   type, one of the MUX_FRAME_* values
+ *   u8   flags, currently zero
+ *   u16  reserved, currently zero
+ *   u32  session
+ *   u32  length of the payload */
+#define MUX_FRAME_HEADER_SIZE 12
+
+/* The longest frame payload either end may send */
+#define MUX_MAX_PAYLOAD (64 * 1024)
+
+/* From us: a new session. The payload is the command's arguments, each
+ * ending in a NUL, as many as fit. */
+#define MUX_FRAME_OPEN   1
+
+/* From us: what the command wrote. */
+#define MUX_FRAME_OUTPUT 2
+
+/* From us: the command exited, after all of its output. The payload is the
+ * i32 wait status, and this is the last frame of the session. */
+#define MUX_FRAME_EXIT   3
+
+/* From the collector: input for the command. */
+#define MUX_FRAME_INPUT  4
+
+/* From either end: the u32 number of bytes more the sender has room for,
+ * of OUTPUT if it comes from the collector, or of INPUT if it comes from
+ * us. */
+#define MUX_FRAME_CREDIT 5
+
+/* From the collector: there will be no more input, so the command's input
+ * ends once what was sent before is written. */
+#define MUX_FRAME_EOF    6
+
+#endif /* MUX_FORMAT_H_INCLUDED */
@@ -0,0 +1,71 @@
+/* parse.c
+ *
+ * Helpers for parsing numeric command line arguments. See parse.h for
+ * details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "parse.h"
+
+
+int parse_unsigned(const char *arg, unsigned long min, unsigned long max,
+                   unsigned long *value) {
+    char *end;
+    unsigned long result;
+
+    /* strtoul happily accepts a leading minus sign. */
+    if (*arg < '0' || *arg > '9') {
+        return -1;
+    }
+
+    errno = 0;
+    result = strtoul(arg, &end, 10);
+
+    if (errno || *end != '\0' || result < min || result > max) {
+        return -1;
+    }
+
+    *value = result;
+    return 0;
+}
+
+
+int parse_size(const char *arg, size_t min, size_t max, size_t *size) {
+    char *end;
+    unsigned long long result;
+    unsigned shift = 0;
+
+    if (*arg < '0' || *arg > '9') {
+        return -1;
+    }
+
+    errno = 0;
+    result = strtoull(arg, &end, 10);
+
+    if (errno) {
+        return -1;
+    }
+
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+    }
+
+    if (*end != '\0' || result > (~0ULL >> shift)) {
+        return -1;
+    }
+
+    result <<= shift;
+
+    if (result < min || result > max) {
+        return -1;
+    }
+
+    *size = result;
+    return 0;
+}
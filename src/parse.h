@@ -0,0 +1,20 @@
+/* parse.h
+ *
+ * Helpers for parsing numeric command line arguments. Each returns 0 on
+ * success, or -1 if the string isn't valid, leaving the result untouched.
+ */
+
+#ifndef PARSE_H_INCLUDED
+#define PARSE_H_INCLUDED
+
+#include <stddef.h>
+
+/* Parse a decimal number between MIN and MAX inclusive. */
+int parse_unsigned(const char *arg, unsigned long min, unsigned long max,
+                   unsigned long *value);
+
+/* Parse a size in bytes between MIN and MAX inclusive. The number may be
+ * followed by a K, M or G suffix, for KiB, MiB or GiB. */
+int parse_size(const char *arg, size_t min, size_t max, size_t *size);
+
+#endif /* PARSE_H_INCLUDED */
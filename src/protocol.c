@@ -0,0 +1,259 @@
+/* protocol.c
+ *
+ * The messages exchanged with a terminator server. See protocol.h for
+ * details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "my_assert.h"
+#include "protocol.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* The descriptors we receive mustn't leak into commands forked by another
+ * thread before we get to mark them close-on-exec. */
+#ifdef MSG_CMSG_CLOEXEC
+#define PROTOCOL_RECV_FLAGS MSG_CMSG_CLOEXEC
+#else
+#define PROTOCOL_RECV_FLAGS 0
+#endif
+
+/* How much to read at a time */
+#define PROTOCOL_CHUNK_SIZE 4096
+
+/* Room for more descriptors than a message may carry, so that extras can be
+ * closed rather than silently leaked by a truncated control message */
+#define PROTOCOL_CONTROL_FDS (4 * PROTOCOL_MAX_FDS)
+
+
+/* Make sure there is room for N more bytes. */
+static void reserve(struct protocol_message *message, size_t n);
+
+
+void protocol_message_init(struct protocol_message *message) {
+    message->data = NULL;
+    message->length = 0;
+    message->capacity = 0;
+}
+
+
+void protocol_message_destroy(struct protocol_message *message) {
+    free(message->data);
+    protocol_message_init(message);
+}
+
+
+void protocol_put(struct protocol_message *message, const char *key,
+                  const char *value) {
+    size_t key_length = strlen(key);
+    size_t value_length = strlen(value);
+
+    reserve(message, key_length + value_length + 2);
+
+    memcpy(message->data + message->length, key, key_length);
+    message->length += key_length;
+    message->data[message->length++] = '=';
+    memcpy(message->data + message->length, value, value_length + 1);
+    message->length += value_length + 1;
+}
+
+
+void protocol_finish(struct protocol_message *message) {
+    reserve(message, 1);
+    message->data[message->length++] = '\0';
+}
+
+
+int protocol_complete(const struct protocol_message *message) {
+    size_t offset = 0;
+
+    while (offset < message->length) {
+        const char *record = message->data + offset;
+        const char *end = memchr(record, '\0', message->length - offset);
+
+        if (!end) {
+            return 0;
+        }
+
+        if (end == record) {
+            return 1;
+        }
+
+        offset += end - record + 1;
+    }
+
+    return 0;
+}
+
+
+const char *protocol_next(const struct protocol_message *message,
+                          size_t *offset) {
+    const char *record;
+
+    if (*offset >= message->length) {
+        return NULL;
+    }
+
+    record = message->data + *offset;
+
+    if (*record == '\0') {
+        return NULL;
+    }
+
+    *offset += strlen(record) + 1;
+
+    return record;
+}
+
+
+const char *protocol_value(const char *record, const char *key) {
+    size_t key_length = strlen(key);
+
+    if (strncmp(record, key, key_length) == 0 && record[key_length] == '=') {
+        return record + key_length + 1;
+    }
+
+    return NULL;
+}
+
+
+int protocol_send(int sock, const struct protocol_message *message,
+                  const int *fds, size_t n_fds) {
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * PROTOCOL_MAX_FDS)];
+    } control;
+
+    struct msghdr msg;
+    struct iovec iov;
+    size_t sent = 0;
+
+    ASSERT_WITH_MESSAGE(n_fds <= PROTOCOL_MAX_FDS, "Too many descriptors");
+
+    while (sent < message->length) {
+        ssize_t n;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = message->data + sent;
+        iov.iov_len = message->length - sent;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        /* The descriptors ride along with the first byte. */
+        if (sent == 0 && n_fds > 0) {
+            struct cmsghdr *cmsg;
+
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+        }
+
+        n = sendmsg(sock, &msg, 0);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        sent += n;
+    }
+
+    return 0;
+}
+
+
+ssize_t protocol_receive(int sock, struct protocol_message *message,
+                         int fds[PROTOCOL_MAX_FDS], size_t *n_fds) {
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * PROTOCOL_CONTROL_FDS)];
+    } control;
+
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t n;
+
+    if (message->length >= PROTOCOL_MAX_MESSAGE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    reserve(message, PROTOCOL_CHUNK_SIZE);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = message->data + message->length;
+    iov.iov_len = PROTOCOL_CHUNK_SIZE;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    if ((n = recvmsg(sock, &msg, PROTOCOL_RECV_FLAGS)) < 0) {
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        size_t count, i;
+        int fd;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (i = 0; i < count; i++) {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+            if (*n_fds < PROTOCOL_MAX_FDS) {
+                ASSERT_NONNEG(fcntl(fd, F_SETFD, FD_CLOEXEC));
+                fds[(*n_fds)++] = fd;
+            }
+            else {
+                ASSERT_ZERO(close(fd));
+            }
+        }
+    }
+
+    message->length += n;
+
+    return n;
+}
+
+
+static void reserve(struct protocol_message *message, size_t n) {
+    size_t capacity = message->capacity ? message->capacity : 256;
+
+    if (message->length + n <= message->capacity) {
+        return;
+    }
+
+    while (capacity < message->length + n) {
+        capacity *= 2;
+    }
+
+    ASSERT_NONZERO(message->data = realloc(message->data, capacity));
+    message->capacity = capacity;
+}
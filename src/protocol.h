@@ -0,0 +1,72 @@
+/* protocol.h
+ *
+ * The messages exchanged with a terminator server over its Unix socket. A
+ * message is a series of NUL-terminated key=value records, ended by an empty
+ * record. File descriptors travel alongside as SCM_RIGHTS ancillary data.
+ *
+ * A spawn request has one "arg" record per argument, any number of "env"
+ * records, and at most one "cwd" record, and carries the descriptor to write
+ * the command's output to, optionally followed by one to read its input from.
+ * If there are no "env" records, the command gets the server's environment.
+ *
+ * The reply is sent once the command has exited and all its output has been
+ * written. It is either a "status" record with the decimal wait status, or an
+ * "error" record with a description of why the command couldn't be run.
+ */
+
+#ifndef PROTOCOL_H_INCLUDED
+#define PROTOCOL_H_INCLUDED
+
+#include <stddef.h>
+
+#include <sys/types.h>
+
+/* The most descriptors a message can carry */
+#define PROTOCOL_MAX_FDS 2
+
+/* The longest message a server will accept */
+#define PROTOCOL_MAX_MESSAGE (1024 * 1024)
+
+struct protocol_message {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+/* Set up an empty message. */
+void protocol_message_init(struct protocol_message *message);
+
+/* Release the memory held by a message. */
+void protocol_message_destroy(struct protocol_message *message);
+
+/* Append a key=value record. */
+void protocol_put(struct protocol_message *message, const char *key,
+                  const char *value);
+
+/* Append the empty record that ends a message. */
+void protocol_finish(struct protocol_message *message);
+
+/* Nonzero if the message holds its closing empty record. */
+int protocol_complete(const struct protocol_message *message);
+
+/* Step through the records of a complete message. *OFFSET starts at 0.
+ * Returns the next record, or NULL at the end of the message. */
+const char *protocol_next(const struct protocol_message *message,
+                          size_t *offset);
+
+/* If RECORD has the given key, return its value, and otherwise NULL. */
+const char *protocol_value(const char *record, const char *key);
+
+/* Send a whole message, with the given descriptors attached. Returns 0 on
+ * success or -1 with errno set. */
+int protocol_send(int sock, const struct protocol_message *message,
+                  const int *fds, size_t n_fds);
+
+/* Receive whatever is available of a message, appending it to MESSAGE. Any
+ * descriptors that arrive are stored in FDS, counted by *N_FDS, and made
+ * close-on-exec; any beyond PROTOCOL_MAX_FDS are closed. Returns the number
+ * of bytes received, 0 at end of file, or -1 with errno set. */
+ssize_t protocol_receive(int sock, struct protocol_message *message,
+                         int fds[PROTOCOL_MAX_FDS], size_t *n_fds);
+
+#endif /* PROTOCOL_H_INCLUDED */
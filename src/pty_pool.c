@@ -0,0 +1,131 @@
+/* pty_pool.c
+ *
+ * PTYs opened and set up ahead of time. See pty_pool.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "my_assert.h"
+#include "pty_pool.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+
+/* Body of the refill thread. */
+static void *refill_thread_fn(void *arg);
+
+/* Sleep for NS nanoseconds, however many signals arrive meanwhile. */
+static void sleep_ns(unsigned long long ns);
+
+
+void pty_pool_config_init(struct pty_pool_config *config) {
+    config->size = 0;
+    config->rate = PTY_POOL_DEFAULT_RATE;
+    config->stubs = 0;
+}
+
+
+void pty_pool_start(struct pty_pool *pool,
+                    const struct pty_pool_config *config) {
+    pool->config = *config;
+
+    ASSERT_NONZERO(pool->slots = calloc(config->size, sizeof(*pool->slots)));
+    pool->length = 0;
+
+    pool->hits = pool->misses = pool->opened = 0;
+
+    ASSERT_ZERO(pthread_mutex_init(&pool->lock, NULL));
+    ASSERT_ZERO(pthread_cond_init(&pool->cond, NULL));
+
+    ASSERT_ZERO(pthread_create(&pool->thread, NULL, &refill_thread_fn, pool));
+}
+
+
+int pty_pool_take(struct pty_pool *pool, struct spawn_slot *slot) {
+    int result = -1;
+
+    ASSERT_ZERO(pthread_mutex_lock(&pool->lock));
+
+    if (pool->length > 0) {
+        *slot = pool->slots[--pool->length];
+        pool->hits++;
+        result = 0;
+
+        ASSERT_ZERO(pthread_cond_signal(&pool->cond));
+    }
+    else {
+        pool->misses++;
+    }
+
+    ASSERT_ZERO(pthread_mutex_unlock(&pool->lock));
+
+    return result;
+}
+
+
+void pty_pool_get_stats(struct pty_pool *pool, struct pty_pool_stats *stats) {
+    ASSERT_ZERO(pthread_mutex_lock(&pool->lock));
+
+    stats->size = pool->config.size;
+    stats->available = pool->length;
+    stats->stubs = pool->config.stubs;
+    stats->hits = pool->hits;
+    stats->misses = pool->misses;
+    stats->opened = pool->opened;
+
+    ASSERT_ZERO(pthread_mutex_unlock(&pool->lock));
+}
+
+
+static void *refill_thread_fn(void *arg) {
+    struct pty_pool *pool = arg;
+    struct spawn_slot slot;
+
+    for (;;) {
+        ASSERT_ZERO(pthread_mutex_lock(&pool->lock));
+
+        while (pool->length >= pool->config.size) {
+            ASSERT_ZERO(pthread_cond_wait(&pool->cond, &pool->lock));
+        }
+
+        ASSERT_ZERO(pthread_mutex_unlock(&pool->lock));
+
+        /* Opening the PTY, and starting its stub, is the slow part, so it
+         * happens without holding up takers. */
+        spawn_slot_open(&slot, pool->config.stubs);
+
+        ASSERT_ZERO(pthread_mutex_lock(&pool->lock));
+        pool->slots[pool->length++] = slot;
+        pool->opened++;
+        ASSERT_ZERO(pthread_mutex_unlock(&pool->lock));
+
+#ifdef ASSERT_DEBUG
+        fprintf(stderr, "PTY pool: opened %s%s.\n", slot.slave_path,
+                slot.stub_pid > 0 ? ", with a stub" : "");
+#endif
+
+        if (pool->config.rate > 0) {
+            sleep_ns(1000000000ULL / pool->config.rate);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void sleep_ns(unsigned long long ns) {
+    struct timespec remaining;
+
+    remaining.tv_sec = ns / 1000000000ULL;
+    remaining.tv_nsec = ns % 1000000000ULL;
+
+    while (nanosleep(&remaining, &remaining) < 0) {
+        ASSERT(errno == EINTR);
+    }
+}
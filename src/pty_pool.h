@@ -0,0 +1,85 @@
+/* pty_pool.h
+ *
+ * PTYs opened and set up ahead of time, for the server's --pty-pool, so a
+ * spawn request can skip straight to starting the command. A thread keeps
+ * the pool topped up, at no more than a given number of PTYs a second so
+ * that a burst of requests doesn't become a burst of refills competing with
+ * them, and each PTY can come with a stub process already waiting on it (see
+ * spawn.h). The pool lives as long as the server does.
+ */
+
+#ifndef PTY_POOL_H_INCLUDED
+#define PTY_POOL_H_INCLUDED
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "spawn.h"
+
+/* The largest pool, and the fastest refill rate, in PTYs a second */
+#define PTY_POOL_MAX_SIZE 4096
+#define PTY_POOL_MAX_RATE 1000000
+
+/* The refill rate unless told otherwise */
+#define PTY_POOL_DEFAULT_RATE 100
+
+struct pty_pool_config {
+    /* How many PTYs to keep ready, or zero for no pool */
+    size_t size;
+
+    /* The most PTYs to open a second, or zero for no limit */
+    unsigned long rate;
+
+    /* Nonzero to start a stub on every PTY */
+    int stubs;
+};
+
+/* A snapshot of a pool's figures, for --stats */
+struct pty_pool_stats {
+    size_t size;
+    size_t available;
+    int stubs;
+
+    /* Requests that found a PTY waiting, and those that had to open their
+     * own */
+    unsigned long long hits;
+    unsigned long long misses;
+
+    /* PTYs the pool has opened */
+    unsigned long long opened;
+};
+
+struct pty_pool {
+    struct pty_pool_config config;
+
+    /* The PTYs ready to go, used from the top, and how many there are */
+    struct spawn_slot *slots;
+    size_t length;
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long opened;
+
+    /* Protects everything above, and wakes the refill thread when a PTY is
+     * taken */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    pthread_t thread;
+};
+
+/* Set up a configuration with no pool. */
+void pty_pool_config_init(struct pty_pool_config *config);
+
+/* Start filling a pool as CONFIG says. */
+void pty_pool_start(struct pty_pool *pool,
+                    const struct pty_pool_config *config);
+
+/* Take a PTY from the pool into SLOT. Returns 0 on success, or -1 if the pool
+ * is empty. Either way, it is counted. */
+int pty_pool_take(struct pty_pool *pool, struct spawn_slot *slot);
+
+/* Get a consistent snapshot of the pool's figures. */
+void pty_pool_get_stats(struct pty_pool *pool, struct pty_pool_stats *stats);
+
+#endif /* PTY_POOL_H_INCLUDED */
@@ -0,0 +1,66 @@
+/* read_pace.c
+ *
+ * How much to ask for on each read. See read_pace.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include "read_pace.h"
+
+/* The shortest gap between reads we believe, in nanoseconds, so that two
+ * reads in quick succession don't make the rate look unbounded */
+#define READ_PACE_MIN_GAP_NS 1000
+
+/* Each read moves the average 1/2^READ_PACE_WEIGHT_BITS of the way towards
+ * its own rate. */
+#define READ_PACE_WEIGHT_BITS 2
+
+
+void read_pace_init(struct read_pace *pace, size_t max_size) {
+    pace->max_size = max_size;
+    pace->size = max_size < READ_PACE_MIN_SIZE ? max_size : READ_PACE_MIN_SIZE;
+    pace->rate = 0;
+    pace->last_ns = 0;
+}
+
+
+void read_pace_update(struct read_pace *pace, size_t asked, size_t got,
+                      uint64_t now) {
+    uint64_t gap, rate;
+
+    if (got == 0) {
+        return;
+    }
+
+    if (pace->last_ns > 0) {
+        gap = now - pace->last_ns;
+
+        if (gap < READ_PACE_MIN_GAP_NS) {
+            gap = READ_PACE_MIN_GAP_NS;
+        }
+
+        rate = (uint64_t) got * 1000000000 / gap;
+
+        if (rate >= pace->rate) {
+            pace->rate += (rate - pace->rate) >> READ_PACE_WEIGHT_BITS;
+        }
+        else {
+            pace->rate -= (pace->rate - rate) >> READ_PACE_WEIGHT_BITS;
+        }
+    }
+
+    pace->last_ns = now;
+
+    /* A read that took everything it was offered probably left more
+     * behind, and one that took a fraction of it was plenty big enough.
+     * When it was the buffer that was short of space, a bigger read
+     * wouldn't have helped. */
+    if (got >= asked && asked >= pace->size && pace->size < pace->max_size) {
+        pace->size = pace->size * 2 < pace->max_size ?
+            pace->size * 2 : pace->max_size;
+    }
+    else if (got < pace->size / 4 && pace->size > READ_PACE_MIN_SIZE) {
+        pace->size = pace->size / 2 > READ_PACE_MIN_SIZE ?
+            pace->size / 2 : READ_PACE_MIN_SIZE;
+    }
+}
@@ -0,0 +1,61 @@
+/* read_pace.h
+ *
+ * How much to ask for on each read, and whether to go straight back for
+ * more. Interactive traffic arrives a few bytes at a time, and small reads
+ * keep the work done per read, filtering it or feeding a screen, small too.
+ * Sustained output fills whatever it is offered, so reads grow to the whole
+ * buffer, and once the input is coming in quickly enough we keep reading a
+ * nonblocking fd until it runs dry, rather than waiting for readiness
+ * between every read.
+ *
+ * The rate is a moving average of the bytes a second seen by each read, so
+ * a pause soon brings it back down.
+ */
+
+#ifndef READ_PACE_H_INCLUDED
+#define READ_PACE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The smallest read we ask for */
+#define READ_PACE_MIN_SIZE (4 * 1024)
+
+/* The rate, in bytes a second, above which input counts as sustained */
+#define READ_PACE_BULK_RATE (8 * 1024 * 1024)
+
+/* The most reads in a row before going back to wait, so that the other
+ * directions still get a look in */
+#define READ_PACE_MAX_BURST 16
+
+struct read_pace {
+    /* The size of the next read, and the most it can grow to */
+    size_t size;
+    size_t max_size;
+
+    /* The estimated rate, in bytes a second, and when the last read
+     * finished, or zero if there hasn't been one */
+    uint64_t rate;
+    uint64_t last_ns;
+};
+
+/* Start with small reads, growing to at most MAX_SIZE. */
+void read_pace_init(struct read_pace *pace, size_t max_size);
+
+/* Account for a read that asked for ASKED bytes and got GOT at time NOW, in
+ * monotonic nanoseconds. */
+void read_pace_update(struct read_pace *pace, size_t asked, size_t got,
+                      uint64_t now);
+
+/* The most to ask for on the next read. */
+static inline size_t read_pace_size(const struct read_pace *pace) {
+    return pace->size;
+}
+
+/* Nonzero if input is sustained, so that it's worth reading again straight
+ * away. */
+static inline int read_pace_bulk(const struct read_pace *pace) {
+    return pace->rate >= READ_PACE_BULK_RATE;
+}
+
+#endif /* READ_PACE_H_INCLUDED */
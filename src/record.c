@@ -0,0 +1,810 @@
+/* record.c
+ *
+ * Capture the traffic through the PTY to a file. See record.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "my_assert.h"
+#include "record.h"
+#include "record_format.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* The most a block can hold: it is written out as soon as it reaches
+ * RECORDER_BLOCK_SIZE, so only the last record, and the gaps that go with
+ * it, can take it beyond that. */
+#define RECORDER_BLOCK_CAPACITY \
+    (RECORDER_BLOCK_SIZE + RECORD_HEADER_SIZE + RECORDER_MAX_PAYLOAD + \
+     RECORDER_STREAMS * (RECORD_HEADER_SIZE + 8))
+
+/* The zstd compression level. Low levels are plenty fast enough to keep up
+ * with a terminal and still squeeze its output well. */
+#define RECORDER_ZSTD_LEVEL 3
+
+
+/* Body of the writer thread. */
+static void *writer_thread_fn(void *arg);
+
+/* Wait until the writer is woken, or RECORDER_FLUSH_MS have passed. Returns
+ * nonzero if the time ran out. */
+static int wait_for_wake(struct recorder *recorder);
+
+/* Wake the writer, unless a wakeup is already on its way. */
+static void wake_writer(struct recorder *recorder);
+
+/* The current time in nanoseconds on CLOCK, made relative to BASE. */
+static uint64_t clock_ns(clockid_t clock, uint64_t base);
+
+/* Describe the N bytes starting SKIP bytes into the iovecs as up to two
+ * iovecs in OUT. Returns the number filled in. */
+static int iov_slice(const struct iovec *iov, int iov_count, size_t skip,
+                     size_t n, struct iovec out[2]);
+
+/* Queue a control record header. The control queue must have room for
+ * it. */
+static void put_header(struct recorder *recorder, int type, int stream,
+                       size_t length, uint64_t timestamp);
+
+/* Queue a control record with its payload, waiting for the writer to make
+ * room if the queue is full. */
+static void put_control(struct recorder *recorder, int type,
+                        const unsigned char *payload, size_t length);
+
+/* Copy N bytes into the control queue, starting SKIP bytes into the
+ * iovecs. The queue must have room for them. */
+static void queue_put(struct recorder *recorder, const struct iovec *iov,
+                      int iov_count, size_t skip, size_t n);
+
+/* Copy N bytes out of the front of the control queue, leaving them
+ * there. */
+static void queue_peek(const struct recorder *recorder, unsigned char *buffer,
+                       size_t n);
+
+/* Add a record to the block, with its timestamp held to the last one. */
+static void block_append(struct recorder *recorder, int type, int stream,
+                         const struct iovec *iov, int iov_count,
+                         size_t length, uint64_t timestamp);
+
+/* Add a gap record for N bytes lost from STREAM to the block. */
+static void block_gap(struct recorder *recorder, int stream, uint64_t n,
+                      uint64_t timestamp);
+
+/* Move records from the streams and the control queue into the block, oldest
+ * first, until it is big enough to write out or there are no more. Returns
+ * nonzero if it is big enough. */
+static int take_records(struct recorder *recorder);
+
+/* Move the control record at the front of the queue into the block. The
+ * lock must be held. */
+static void take_control(struct recorder *recorder);
+
+/* Compress and write out the block, if there's anything in it. */
+static void flush_block(struct recorder *recorder);
+
+/* Write out the index and the trailer. */
+static void write_index(struct recorder *recorder);
+
+/* Write all of the iovecs to FD, however many tries it takes. The iovecs are
+ * used up in the process. */
+static void write_all(int fd, struct iovec *iov, int iov_count);
+
+
+int recorder_codec_parse(const char *arg, int *codec) {
+    if (strcmp(arg, "none") == 0) {
+        *codec = RECORD_CODEC_NONE;
+    }
+#ifdef HAVE_ZSTD
+    else if (strcmp(arg, "zstd") == 0) {
+        *codec = RECORD_CODEC_ZSTD;
+    }
+#endif
+#ifdef HAVE_LZ4
+    else if (strcmp(arg, "lz4") == 0) {
+        *codec = RECORD_CODEC_LZ4;
+    }
+#endif
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void recorder_start(struct recorder *recorder, const char *path, int codec) {
+    unsigned char header[RECORD_FILE_HEADER_SIZE];
+    struct iovec iov;
+    int stream;
+
+    ASSERT_NONNEG_WITH_MESSAGE(
+        recorder->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                            0666),
+        "Can't create the record file"
+    );
+
+    recorder->codec = codec;
+    recorder->start_ns = clock_ns(CLOCK_MONOTONIC, 0);
+    atomic_init(&recorder->stopping, 0);
+    atomic_init(&recorder->wake_pending, 0);
+
+    for (stream = 0; stream < RECORDER_STREAMS; stream++) {
+        fanout_init(&recorder->streams[stream], RECORDER_QUEUE_SIZE);
+        fanout_add_reader(&recorder->streams[stream],
+                          &recorder->readers[stream]);
+    }
+
+    ring_buffer_init(&recorder->control, RECORDER_CONTROL_SIZE, NULL);
+
+    ASSERT_NONZERO(recorder->block = malloc(RECORDER_BLOCK_CAPACITY));
+    recorder->block_length = 0;
+    recorder->block_first_ts = recorder->block_last_ts = 0;
+    recorder->last_ts = 0;
+
+    /* Room for the worst case, where the codec makes things bigger. Such a
+     * block is stored as it is instead, but the codec still needs the room
+     * to find that out. */
+    switch (codec) {
+#ifdef HAVE_ZSTD
+        case RECORD_CODEC_ZSTD:
+            recorder->packed_capacity =
+                ZSTD_compressBound(RECORDER_BLOCK_CAPACITY);
+            break;
+#endif
+
+#ifdef HAVE_LZ4
+        case RECORD_CODEC_LZ4:
+            recorder->packed_capacity =
+                LZ4_compressBound(RECORDER_BLOCK_CAPACITY);
+            break;
+#endif
+
+        default:
+            recorder->packed_capacity = 0;
+            break;
+    }
+
+    recorder->packed = NULL;
+
+    if (recorder->packed_capacity > 0) {
+        ASSERT_NONZERO(recorder->packed = malloc(recorder->packed_capacity));
+    }
+
+    recorder->offset = RECORD_FILE_HEADER_SIZE;
+    recorder->index = NULL;
+    recorder->index_length = 0;
+    recorder->index_capacity = 0;
+
+    memcpy(header, RECORD_FILE_MAGIC, RECORD_FILE_MAGIC_SIZE);
+    record_put_u32(header + 8, RECORD_FILE_VERSION);
+    record_put_u32(header + 12, 0);
+    record_put_u64(header + 16, clock_ns(CLOCK_REALTIME, 0));
+
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    write_all(recorder->fd, &iov, 1);
+
+    ASSERT_ZERO(sem_init(&recorder->wake, 0, 0));
+    ASSERT_ZERO(pthread_mutex_init(&recorder->lock, NULL));
+    ASSERT_ZERO(pthread_cond_init(&recorder->cond, NULL));
+    ASSERT_ZERO(pthread_create(&recorder->thread, NULL, &writer_thread_fn,
+                               recorder));
+}
+
+
+void recorder_data(struct recorder *recorder, int stream,
+                   const struct iovec *iov, int iov_count, size_t n) {
+    struct fanout *ring = &recorder->streams[stream];
+    uint64_t timestamp = clock_ns(CLOCK_MONOTONIC, recorder->start_ns);
+    struct iovec piece[2];
+    size_t offset = 0;
+    int dropped = 0;
+
+    while (offset < n) {
+        size_t length = n - offset;
+        int piece_count;
+
+        if (length > RECORDER_MAX_PAYLOAD) {
+            length = RECORDER_MAX_PAYLOAD;
+        }
+
+        piece_count = iov_slice(iov, iov_count, offset, length, piece);
+
+        if (fanout_publish(ring, RECORD_TYPE_DATA, timestamp, piece,
+                           piece_count, length) < 0) {
+            dropped = 1;
+        }
+
+        offset += length;
+    }
+
+    /* Wake the writer once there's a block's worth, or if it's falling
+     * behind. */
+    if (dropped || fanout_backlog(ring) >= RECORDER_BLOCK_SIZE) {
+        wake_writer(recorder);
+    }
+}
+
+
+void recorder_winsize(struct recorder *recorder, const struct winsize *size) {
+    unsigned char payload[8];
+
+    record_put_u16(payload, size->ws_row);
+    record_put_u16(payload + 2, size->ws_col);
+    record_put_u16(payload + 4, size->ws_xpixel);
+    record_put_u16(payload + 6, size->ws_ypixel);
+
+    put_control(recorder, RECORD_TYPE_WINSIZE, payload, sizeof(payload));
+}
+
+
+void recorder_exit(struct recorder *recorder, int status) {
+    unsigned char payload[4];
+
+    record_put_u32(payload, (uint32_t) status);
+
+    put_control(recorder, RECORD_TYPE_EXIT, payload, sizeof(payload));
+}
+
+
+void recorder_finish(struct recorder *recorder) {
+    int stream;
+
+    /* Everything recorded before this is seen by the writer once it sees
+     * this. */
+    atomic_store_explicit(&recorder->stopping, 1, memory_order_release);
+    ASSERT_ZERO(sem_post(&recorder->wake));
+
+    ASSERT_ZERO(pthread_join(recorder->thread, NULL));
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Recorded %zu blocks, %llu bytes.\n",
+            recorder->index_length,
+            (unsigned long long) recorder->offset);
+#endif
+
+    ASSERT_ZERO(close(recorder->fd));
+
+    ASSERT_ZERO(pthread_cond_destroy(&recorder->cond));
+    ASSERT_ZERO(pthread_mutex_destroy(&recorder->lock));
+    ASSERT_ZERO(sem_destroy(&recorder->wake));
+
+    for (stream = 0; stream < RECORDER_STREAMS; stream++) {
+        fanout_destroy(&recorder->streams[stream]);
+    }
+
+    ring_buffer_destroy(&recorder->control);
+    free(recorder->block);
+    free(recorder->packed);
+    free(recorder->index);
+}
+
+
+static void *writer_thread_fn(void *arg) {
+    struct recorder *recorder = arg;
+    int timed_out = 0;
+    int stopping, full, stream;
+
+    for (;;) {
+        stopping = atomic_load_explicit(&recorder->stopping,
+                                        memory_order_acquire);
+
+        /* Anything published from here on may need another wakeup. */
+        atomic_store_explicit(&recorder->wake_pending, 0,
+                              memory_order_release);
+
+        full = take_records(recorder);
+
+        if (full || timed_out || stopping) {
+            flush_block(recorder);
+        }
+
+        /* There may well be more where a full block came from. */
+        if (full) {
+            timed_out = 0;
+            continue;
+        }
+
+        if (stopping) {
+            break;
+        }
+
+        timed_out = wait_for_wake(recorder);
+    }
+
+    /* Nothing is recorded any more, so what was dropped at the very end is
+     * safe to look at, and has no later chunk to report it. */
+    for (stream = 0; stream < RECORDER_STREAMS; stream++) {
+        if (recorder->streams[stream].dropped > 0) {
+            block_gap(recorder, stream, recorder->streams[stream].dropped,
+                      clock_ns(CLOCK_MONOTONIC, recorder->start_ns));
+        }
+    }
+
+    flush_block(recorder);
+    write_index(recorder);
+
+    return NULL;
+}
+
+
+static int wait_for_wake(struct recorder *recorder) {
+    struct timespec deadline;
+
+    ASSERT_ZERO(clock_gettime(CLOCK_REALTIME, &deadline));
+    deadline.tv_sec += RECORDER_FLUSH_MS / 1000;
+    deadline.tv_nsec += (long) (RECORDER_FLUSH_MS % 1000) * 1000000L;
+
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (sem_timedwait(&recorder->wake, &deadline) < 0) {
+        if (errno == ETIMEDOUT) {
+            return 1;
+        }
+
+        ASSERT_WITH_MESSAGE(errno == EINTR,
+                            "Failed to wait for the record queue");
+    }
+
+    return 0;
+}
+
+
+static void wake_writer(struct recorder *recorder) {
+    if (!atomic_exchange_explicit(&recorder->wake_pending, 1,
+                                  memory_order_acq_rel)) {
+        ASSERT_ZERO(sem_post(&recorder->wake));
+    }
+}
+
+
+static uint64_t clock_ns(clockid_t clock, uint64_t base) {
+    struct timespec now;
+
+    ASSERT_ZERO(clock_gettime(clock, &now));
+
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec - base;
+}
+
+
+static int iov_slice(const struct iovec *iov, int iov_count, size_t skip,
+                     size_t n, struct iovec out[2]) {
+    int i = 0, out_count = 0;
+
+    while (i < iov_count && skip >= iov[i].iov_len) {
+        skip -= iov[i].iov_len;
+        i++;
+    }
+
+    while (n > 0) {
+        size_t length;
+
+        ASSERT_WITH_MESSAGE(i < iov_count && out_count < 2,
+                            "Record slice overrun");
+
+        length = iov[i].iov_len - skip;
+
+        if (length > n) {
+            length = n;
+        }
+
+        out[out_count].iov_base = (char *) iov[i].iov_base + skip;
+        out[out_count].iov_len = length;
+        out_count++;
+
+        n -= length;
+        skip = 0;
+        i++;
+    }
+
+    return out_count;
+}
+
+
+static void put_header(struct recorder *recorder, int type, int stream,
+                       size_t length, uint64_t timestamp) {
+    unsigned char header[RECORD_HEADER_SIZE];
+    struct iovec iov;
+
+    header[0] = type;
+    header[1] = stream;
+    record_put_u16(header + 2, 0);
+    record_put_u32(header + 4, length);
+    record_put_u64(header + 8, timestamp);
+
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    queue_put(recorder, &iov, 1, 0, sizeof(header));
+}
+
+
+static void put_control(struct recorder *recorder, int type,
+                        const unsigned char *payload, size_t length) {
+    struct iovec iov;
+
+    ASSERT_ZERO(pthread_mutex_lock(&recorder->lock));
+
+    /* The writer broadcasts whenever it makes room. */
+    while (ring_buffer_space(&recorder->control) <
+               RECORD_HEADER_SIZE + length) {
+        wake_writer(recorder);
+        ASSERT_ZERO(pthread_cond_wait(&recorder->cond, &recorder->lock));
+    }
+
+    put_header(recorder, type, 0, length,
+               clock_ns(CLOCK_MONOTONIC, recorder->start_ns));
+
+    iov.iov_base = (void *) payload;
+    iov.iov_len = length;
+    queue_put(recorder, &iov, 1, 0, length);
+
+    ASSERT_ZERO(pthread_mutex_unlock(&recorder->lock));
+}
+
+
+static void queue_put(struct recorder *recorder, const struct iovec *iov,
+                      int iov_count, size_t skip, size_t n) {
+    struct iovec space[2];
+    int space_count = ring_buffer_space_iov(&recorder->control, space);
+    int i = 0, j = 0;
+    size_t in_offset = skip, out_offset = 0, done = 0;
+
+    /* Find where to start in the source. */
+    while (i < iov_count && in_offset >= iov[i].iov_len) {
+        in_offset -= iov[i].iov_len;
+        i++;
+    }
+
+    while (done < n) {
+        size_t length = n - done;
+
+        ASSERT_WITH_MESSAGE(i < iov_count && j < space_count,
+                            "Record queue overrun");
+
+        if (length > iov[i].iov_len - in_offset) {
+            length = iov[i].iov_len - in_offset;
+        }
+
+        if (length > space[j].iov_len - out_offset) {
+            length = space[j].iov_len - out_offset;
+        }
+
+        memcpy((char *) space[j].iov_base + out_offset,
+               (const char *) iov[i].iov_base + in_offset, length);
+
+        done += length;
+        in_offset += length;
+        out_offset += length;
+
+        if (in_offset == iov[i].iov_len) {
+            i++;
+            in_offset = 0;
+        }
+
+        if (out_offset == space[j].iov_len) {
+            j++;
+            out_offset = 0;
+        }
+    }
+
+    ring_buffer_produce(&recorder->control, n);
+}
+
+
+static void queue_peek(const struct recorder *recorder, unsigned char *buffer,
+                       size_t n) {
+    struct iovec data[2];
+    int data_count = ring_buffer_data_iov(&recorder->control, data);
+    size_t first;
+
+    ASSERT_WITH_MESSAGE(data_count > 0 && n <= recorder->control.length,
+                        "Record queue underrun");
+
+    first = n < data[0].iov_len ? n : data[0].iov_len;
+    memcpy(buffer, data[0].iov_base, first);
+
+    if (first < n) {
+        memcpy(buffer + first, data[1].iov_base, n - first);
+    }
+}
+
+
+static void block_append(struct recorder *recorder, int type, int stream,
+                         const struct iovec *iov, int iov_count,
+                         size_t length, uint64_t timestamp) {
+    unsigned char *record = recorder->block + recorder->block_length;
+    size_t offset = RECORD_HEADER_SIZE;
+    int i;
+
+    if (timestamp < recorder->last_ts) {
+        timestamp = recorder->last_ts;
+    }
+
+    record[0] = type;
+    record[1] = stream;
+    record_put_u16(record + 2, 0);
+    record_put_u32(record + 4, length);
+    record_put_u64(record + 8, timestamp);
+
+    for (i = 0; i < iov_count; i++) {
+        memcpy(record + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+
+    if (recorder->block_length == 0) {
+        recorder->block_first_ts = timestamp;
+    }
+
+    recorder->block_last_ts = recorder->last_ts = timestamp;
+    recorder->block_length += RECORD_HEADER_SIZE + length;
+}
+
+
+static void block_gap(struct recorder *recorder, int stream, uint64_t n,
+                      uint64_t timestamp) {
+    unsigned char payload[8];
+    struct iovec iov;
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "%d: Recorder dropped %llu bytes.\n", stream,
+            (unsigned long long) n);
+#endif
+
+    record_put_u64(payload, n);
+
+    iov.iov_base = payload;
+    iov.iov_len = sizeof(payload);
+    block_append(recorder, RECORD_TYPE_GAP, stream, &iov, 1, sizeof(payload),
+                 timestamp);
+}
+
+
+static int take_records(struct recorder *recorder) {
+    struct fanout_chunk chunks[RECORDER_STREAMS];
+    int have[RECORDER_STREAMS];
+    unsigned char header[RECORD_HEADER_SIZE];
+    uint64_t control_ts = 0;
+    int have_control;
+    int stream, next;
+
+    for (stream = 0; stream < RECORDER_STREAMS; stream++) {
+        have[stream] = fanout_peek(&recorder->readers[stream],
+                                   &chunks[stream]);
+    }
+
+    ASSERT_ZERO(pthread_mutex_lock(&recorder->lock));
+    have_control = recorder->control.length > 0;
+
+    while (recorder->block_length < RECORDER_BLOCK_SIZE) {
+        if (have_control) {
+            queue_peek(recorder, header, RECORD_HEADER_SIZE);
+            control_ts = record_get_u64(header + 8);
+        }
+
+        /* Whichever is oldest goes next, the control record on a tie. */
+        next = -1;
+
+        for (stream = 0; stream < RECORDER_STREAMS; stream++) {
+            if (have[stream] && (next < 0 ||
+                    chunks[stream].timestamp < chunks[next].timestamp)) {
+                next = stream;
+            }
+        }
+
+        if (have_control && (next < 0 ||
+                control_ts <= chunks[next].timestamp)) {
+            take_control(recorder);
+            have_control = recorder->control.length > 0;
+            continue;
+        }
+
+        if (next < 0) {
+            break;
+        }
+
+        if (chunks[next].dropped > 0) {
+            block_gap(recorder, next, chunks[next].dropped,
+                      chunks[next].timestamp);
+        }
+
+        block_append(recorder, chunks[next].tag, next, chunks[next].iov,
+                     chunks[next].iov_count, chunks[next].length,
+                     chunks[next].timestamp);
+
+        fanout_release(&recorder->readers[next], &chunks[next]);
+        have[next] = fanout_peek(&recorder->readers[next], &chunks[next]);
+    }
+
+    ASSERT_ZERO(pthread_mutex_unlock(&recorder->lock));
+
+    return recorder->block_length >= RECORDER_BLOCK_SIZE;
+}
+
+
+static void take_control(struct recorder *recorder) {
+    unsigned char *record = recorder->block + recorder->block_length;
+    size_t length;
+    uint64_t timestamp;
+
+    /* Records go into the queue whole, so a header means its payload is
+     * there too. */
+    queue_peek(recorder, record, RECORD_HEADER_SIZE);
+    length = RECORD_HEADER_SIZE + record_get_u32(record + 4);
+    timestamp = record_get_u64(record + 8);
+
+    queue_peek(recorder, record, length);
+    ring_buffer_consume(&recorder->control, length);
+
+    if (timestamp < recorder->last_ts) {
+        timestamp = recorder->last_ts;
+        record_put_u64(record + 8, timestamp);
+    }
+
+    if (recorder->block_length == 0) {
+        recorder->block_first_ts = timestamp;
+    }
+
+    recorder->block_last_ts = recorder->last_ts = timestamp;
+    recorder->block_length += length;
+
+    /* Anyone waiting in put_control can try again. */
+    ASSERT_ZERO(pthread_cond_broadcast(&recorder->cond));
+}
+
+
+static void flush_block(struct recorder *recorder) {
+    unsigned char header[RECORD_BLOCK_HEADER_SIZE];
+    struct iovec iov[2];
+    unsigned char *stored = recorder->block;
+    size_t stored_length = recorder->block_length;
+    int codec = RECORD_CODEC_NONE;
+
+    if (recorder->block_length == 0) {
+        return;
+    }
+
+    /* A block the codec can't shrink is stored as it is, so reading it back
+     * is never slower than it needs to be. */
+#ifdef HAVE_ZSTD
+    if (recorder->codec == RECORD_CODEC_ZSTD) {
+        size_t n = ZSTD_compress(recorder->packed, recorder->packed_capacity,
+                                 recorder->block, recorder->block_length,
+                                 RECORDER_ZSTD_LEVEL);
+
+        if (!ZSTD_isError(n) && n < stored_length) {
+            stored = recorder->packed;
+            stored_length = n;
+            codec = RECORD_CODEC_ZSTD;
+        }
+    }
+#endif
+
+#ifdef HAVE_LZ4
+    if (recorder->codec == RECORD_CODEC_LZ4) {
+        int n = LZ4_compress_default((const char *) recorder->block,
+                                     (char *) recorder->packed,
+                                     recorder->block_length,
+                                     recorder->packed_capacity);
+
+        if (n > 0 && (size_t) n < stored_length) {
+            stored = recorder->packed;
+            stored_length = n;
+            codec = RECORD_CODEC_LZ4;
+        }
+    }
+#endif
+
+    record_put_u32(header, RECORD_BLOCK_MAGIC);
+    record_put_u32(header + 4, codec);
+    record_put_u32(header + 8, recorder->block_length);
+    record_put_u32(header + 12, stored_length);
+    record_put_u64(header + 16, recorder->block_first_ts);
+    record_put_u64(header + 24, recorder->block_last_ts);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = stored;
+    iov[1].iov_len = stored_length;
+    write_all(recorder->fd, iov, 2);
+
+    if (recorder->index_length == recorder->index_capacity) {
+        recorder->index_capacity = recorder->index_capacity ?
+            2 * recorder->index_capacity : 64;
+        ASSERT_NONZERO(recorder->index = realloc(
+            recorder->index,
+            recorder->index_capacity * sizeof(*recorder->index)
+        ));
+    }
+
+    recorder->index[recorder->index_length].offset = recorder->offset;
+    recorder->index[recorder->index_length].first_ts =
+        recorder->block_first_ts;
+    recorder->index_length++;
+
+    recorder->offset += sizeof(header) + stored_length;
+    recorder->block_length = 0;
+}
+
+
+static void write_index(struct recorder *recorder) {
+    unsigned char header[8];
+    unsigned char trailer[RECORD_TRAILER_SIZE];
+    unsigned char *entries;
+    size_t entries_length = recorder->index_length * RECORD_INDEX_ENTRY_SIZE;
+    struct iovec iov[3];
+    size_t i;
+
+    ASSERT_NONZERO(entries = malloc(entries_length ? entries_length : 1));
+
+    for (i = 0; i < recorder->index_length; i++) {
+        unsigned char *entry = entries + i * RECORD_INDEX_ENTRY_SIZE;
+
+        record_put_u64(entry, recorder->index[i].offset);
+        record_put_u64(entry + 8, recorder->index[i].first_ts);
+    }
+
+    record_put_u32(header, RECORD_INDEX_MAGIC);
+    record_put_u32(header + 4, recorder->index_length);
+
+    record_put_u64(trailer, recorder->offset);
+    record_put_u32(trailer + 8, recorder->index_length);
+    record_put_u32(trailer + 12, RECORD_TRAILER_MAGIC);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = entries;
+    iov[1].iov_len = entries_length;
+    iov[2].iov_base = trailer;
+    iov[2].iov_len = sizeof(trailer);
+    write_all(recorder->fd, iov, 3);
+
+    recorder->offset += sizeof(header) + entries_length + sizeof(trailer);
+
+    free(entries);
+}
+
+
+static void write_all(int fd, struct iovec *iov, int iov_count) {
+    while (iov_count > 0) {
+        ssize_t n = writev(fd, iov, iov_count);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        ASSERT_NONNEG_WITH_MESSAGE(n, "Can't write the record file");
+
+        while (iov_count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+
+        if (iov_count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
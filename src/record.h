@@ -0,0 +1,127 @@
+/* record.h
+ *
+ * Capture everything that passes through the PTY to a file, along with when
+ * it happened, for --record. The copy paths hand the recorder each chunk they
+ * read, which goes into a lock-free ring for its stream (see fanout.h); a
+ * writer thread of its own merges the streams in time order, packs them into
+ * blocks, compresses them if asked, and writes them out. The copy paths
+ * never take a lock or wait for the disk: if a ring fills up, data is
+ * dropped from the capture, not from the passthrough, and a gap record marks
+ * how much is missing. See record_format.h for the layout of the file.
+ */
+
+#ifndef RECORD_H_INCLUDED
+#define RECORD_H_INCLUDED
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "fanout.h"
+#include "ring_buffer.h"
+
+/* How much of each stream may be queued for the writer before data is
+ * dropped, which must be a power of two, and how much room there is for
+ * the few records that aren't data */
+#define RECORDER_QUEUE_SIZE   (8 * 1024 * 1024)
+#define RECORDER_CONTROL_SIZE (4 * 1024)
+
+/* The size at which a block is written out. A block that is still smaller
+ * than this is written anyway once it is RECORDER_FLUSH_MS old. */
+#define RECORDER_BLOCK_SIZE (64 * 1024)
+#define RECORDER_FLUSH_MS   1000
+
+/* Longer reads are split across several records, so that a single record
+ * never has to be split across blocks. */
+#define RECORDER_MAX_PAYLOAD (16 * 1024)
+
+/* The number of streams, one per direction of traffic */
+#define RECORDER_STREAMS 3
+
+/* One entry in the index at the end of the file */
+struct recorder_index_entry {
+    uint64_t offset;
+    uint64_t first_ts;
+};
+
+struct recorder {
+    int fd;
+
+    /* One of the RECORD_CODEC_* values from record_format.h */
+    int codec;
+
+    /* The monotonic time at the start, which timestamps count from */
+    uint64_t start_ns;
+
+    /* The data read for each stream, on its way from the copy path that
+     * read it to the writer thread, which is each ring's only reader */
+    struct fanout streams[RECORDER_STREAMS];
+    struct fanout_reader readers[RECORDER_STREAMS];
+
+    /* Wakes the writer early, when a block's worth is waiting or data is
+     * being dropped. wake_pending is set from the post until the writer
+     * wakes, so the copy paths post at most once a wakeup. */
+    sem_t wake;
+    atomic_int wake_pending;
+    atomic_int stopping;
+    pthread_t thread;
+
+    /* Serialized records other than data, such as the window size, which
+     * may come from any thread and mustn't be lost, guarded by the lock.
+     * The writer signals the condition whenever it makes room. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ring_buffer control;
+
+    /* The writer's state. The block being filled, and the buffer it is
+     * compressed into: */
+    unsigned char *block;
+    size_t block_length;
+    uint64_t block_first_ts;
+    uint64_t block_last_ts;
+    unsigned char *packed;
+    size_t packed_capacity;
+
+    /* The latest timestamp written. The streams are merged as they are
+     * published, so a record that turns up late is held to this, to keep
+     * the file in time order. */
+    uint64_t last_ts;
+
+    /* Where the next block goes in the file, and the index so far */
+    uint64_t offset;
+    struct recorder_index_entry *index;
+    size_t index_length;
+    size_t index_capacity;
+};
+
+/* Parse a compression method: none, zstd or lz4. Returns 0 on success or -1
+ * if the name is unknown or support for it wasn't built in. */
+int recorder_codec_parse(const char *arg, int *codec);
+
+/* Create the file at PATH, write its header, and start the writer thread.
+ * Blocks are compressed with CODEC. */
+void recorder_start(struct recorder *recorder, const char *path, int codec);
+
+/* Record N bytes read for STREAM, REDIRECTION_INPUT, REDIRECTION_OUTPUT or
+ * REDIRECTION_ERROR, spread over IOV_COUNT iovecs. Only one thread may
+ * record for each stream. This never takes a lock or blocks on the
+ * writer. */
+void recorder_data(struct recorder *recorder, int stream,
+                   const struct iovec *iov, int iov_count, size_t n);
+
+/* Record the terminal size. */
+void recorder_winsize(struct recorder *recorder, const struct winsize *size);
+
+/* Record the command's wait status. */
+void recorder_exit(struct recorder *recorder, int status);
+
+/* Write out everything still queued, then the index, and close the file.
+ * Nothing may be recorded from here on. */
+void recorder_finish(struct recorder *recorder);
+
+#endif /* RECORD_H_INCLUDED */
@@ -0,0 +1,109 @@
+/* record_format.h
+ *
+ * The layout of the capture files written by --record. All integers are
+ * little-endian. A file is laid out as:
+ *
+ *   file header   RECORD_FILE_HEADER_SIZE bytes
+ *   block...      each a block header followed by its payload
+ *   index         RECORD_INDEX_MAGIC, a count, then one entry per block
+ *   trailer       RECORD_TRAILER_SIZE bytes, pointing back at the index
+ *
+ * The payload of a block is a run of records, compressed as a whole if the
+ * block says so. Blocks can be read in order from the start of the file, so
+ * a capture cut short before the index was written is still readable; the
+ * index lets a reader seek to a point in time without decompressing
+ * everything before it.
+ */
+
+#ifndef RECORD_FORMAT_H_INCLUDED
+#define RECORD_FORMAT_H_INCLUDED
+
+#include <stdint.h>
+
+/* The file header:
+ *   8 bytes  RECORD_FILE_MAGIC
+ *   u32      RECORD_FILE_VERSION
+ *   u32      flags, currently zero
+ *   u64      wall clock time of the start of the capture, in nanoseconds
+ *            since the epoch. Record timestamps count from here. */
+#define RECORD_FILE_MAGIC       "TERMREC\0"
+#define RECORD_FILE_MAGIC_SIZE  8
+#define RECORD_FILE_VERSION     1
+#define RECORD_FILE_HEADER_SIZE 24
+
+/* A block header:
+ *   u32  RECORD_BLOCK_MAGIC
+ *   u32  codec, one of the RECORD_CODEC_* values
+ *   u32  length of the records once decompressed
+ *   u32  length of the payload as stored
+ *   u64  timestamp of the first record
+ *   u64  timestamp of the last record */
+#define RECORD_BLOCK_MAGIC       0x31425254 /* "TRB1" */
+#define RECORD_BLOCK_HEADER_SIZE 32
+
+#define RECORD_CODEC_NONE 0
+#define RECORD_CODEC_ZSTD 1
+#define RECORD_CODEC_LZ4  2
+
+/* A record header, followed by LENGTH bytes of payload:
+ *   u8   type, one of the RECORD_TYPE_* values
+ *   u8   stream, the direction of DATA: REDIRECTION_INPUT,
+ *        REDIRECTION_OUTPUT or REDIRECTION_ERROR
+ *   u16  flags, currently zero
+ *   u32  length of the payload
+ *   u64  monotonic nanoseconds since the start of the capture */
+#define RECORD_HEADER_SIZE 16
+
+/* Bytes that passed through the PTY */
+#define RECORD_TYPE_DATA    1
+
+/* The terminal size. The payload is u16 rows, u16 columns, u16 width and
+ * u16 height in pixels, as in struct winsize. */
+#define RECORD_TYPE_WINSIZE 2
+
+/* The command exited. The payload is the i32 wait status. */
+#define RECORD_TYPE_EXIT    3
+
+/* The recorder fell behind and dropped data to avoid slowing the copy down.
+ * The payload is the u64 number of bytes lost from the stream. */
+#define RECORD_TYPE_GAP     4
+
+/* The index: u32 RECORD_INDEX_MAGIC and u32 count, then per block a u64
+ * file offset of its header and the u64 timestamp of its first record */
+#define RECORD_INDEX_MAGIC      0x58495254 /* "TRIX" */
+#define RECORD_INDEX_ENTRY_SIZE 16
+
+/* The trailer, the last bytes of the file: u64 file offset of the index,
+ * u32 count of index entries, u32 RECORD_TRAILER_MAGIC */
+#define RECORD_TRAILER_MAGIC 0x444e4554 /* "TEND" */
+#define RECORD_TRAILER_SIZE  16
+
+/* Pack and unpack little-endian integers. */
+static inline void record_put_u16(unsigned char *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void record_put_u32(unsigned char *p, uint32_t v) {
+    record_put_u16(p, v);
+    record_put_u16(p + 2, v >> 16);
+}
+
+static inline void record_put_u64(unsigned char *p, uint64_t v) {
+    record_put_u32(p, v);
+    record_put_u32(p + 4, v >> 32);
+}
+
+static inline uint16_t record_get_u16(const unsigned char *p) {
+    return p[0] | (uint16_t) p[1] << 8;
+}
+
+static inline uint32_t record_get_u32(const unsigned char *p) {
+    return record_get_u16(p) | (uint32_t) record_get_u16(p + 2) << 16;
+}
+
+static inline uint64_t record_get_u64(const unsigned char *p) {
+    return record_get_u32(p) | (uint64_t) record_get_u32(p + 4) << 32;
+}
+
+#endif /* RECORD_FORMAT_H_INCLUDED */
@@ -0,0 +1,314 @@
+/* record_reader.c
+ *
+ * Read back a --record capture. See record_reader.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "my_assert.h"
+#include "record_format.h"
+#include "record_reader.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator-replay"
+
+
+/* Find the index from the trailer, if the capture has a whole one. */
+static void find_index(struct record_reader *reader);
+
+/* Move on to the next block. Returns nonzero if there was one, or zero at
+ * the end of the blocks, having set damaged if they didn't end cleanly. */
+static int next_block(struct record_reader *reader);
+
+/* Decompress the LENGTH bytes at STORED, with CODEC, into the reader's own
+ * buffer, where they should come to RAW_LENGTH. Returns nonzero if they
+ * did. */
+static int unpack(struct record_reader *reader, int codec,
+                  const unsigned char *stored, size_t length,
+                  size_t raw_length);
+
+
+void record_reader_open(struct record_reader *reader, const char *path) {
+    struct stat st;
+    void *map;
+
+    ASSERT_NONNEG_WITH_MESSAGE(reader->fd = open(path, O_RDONLY | O_CLOEXEC),
+                               "Can't open the capture");
+    ASSERT_ZERO(fstat(reader->fd, &st));
+
+    ASSERT_WITH_MESSAGE(S_ISREG(st.st_mode) &&
+                        st.st_size >= RECORD_FILE_HEADER_SIZE,
+                        "Not a --record capture");
+
+    ASSERT((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd,
+                       0)) != MAP_FAILED);
+
+    reader->map = map;
+    reader->size = st.st_size;
+
+    ASSERT_WITH_MESSAGE(memcmp(reader->map, RECORD_FILE_MAGIC,
+                               RECORD_FILE_MAGIC_SIZE) == 0,
+                        "Not a --record capture");
+    ASSERT_WITH_MESSAGE(record_get_u32(reader->map + 8) ==
+                            RECORD_FILE_VERSION,
+                        "The capture is from an unknown version of "
+                        "terminator");
+
+    reader->start_time_ns = record_get_u64(reader->map + 16);
+
+    /* Blocks are read in order from the start, so they go a page at a time
+     * well ahead of the copy. */
+    madvise(map, reader->size, MADV_SEQUENTIAL);
+
+    find_index(reader);
+
+    reader->unpacked = NULL;
+    reader->unpacked_capacity = 0;
+    record_reader_rewind(reader);
+}
+
+
+int record_reader_seek(struct record_reader *reader, uint64_t timestamp) {
+    size_t low = 0;
+    size_t high;
+    uint64_t offset;
+
+    if (!reader->index || reader->index_length == 0) {
+        return -1;
+    }
+
+    /* Find the last block whose first record is no later than TIMESTAMP,
+     * or the first block if they are all later. */
+    high = reader->index_length;
+
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+
+        if (record_get_u64(reader->index + middle * RECORD_INDEX_ENTRY_SIZE +
+                           8) <= timestamp) {
+            low = middle;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    offset = record_get_u64(reader->index + low * RECORD_INDEX_ENTRY_SIZE);
+
+    if (offset < RECORD_FILE_HEADER_SIZE || offset > reader->blocks_end) {
+        return -1;
+    }
+
+    reader->offset = offset;
+    reader->block = NULL;
+    reader->block_length = reader->block_offset = 0;
+    reader->damaged = 0;
+
+    return 0;
+}
+
+
+void record_reader_rewind(struct record_reader *reader) {
+    reader->offset = RECORD_FILE_HEADER_SIZE;
+    reader->block = NULL;
+    reader->block_length = reader->block_offset = 0;
+    reader->damaged = 0;
+}
+
+
+int record_reader_next(struct record_reader *reader,
+                       struct record_entry *entry) {
+    const unsigned char *header;
+    size_t length;
+
+    while (reader->block_offset == reader->block_length) {
+        if (!next_block(reader)) {
+            return 0;
+        }
+    }
+
+    /* A record that runs past the end of its block means the block is
+     * bad, so nothing after it can be trusted either. */
+    if (reader->block_length - reader->block_offset < RECORD_HEADER_SIZE) {
+        reader->damaged = 1;
+        reader->block_offset = reader->block_length = 0;
+        reader->offset = reader->blocks_end;
+        return 0;
+    }
+
+    header = reader->block + reader->block_offset;
+    length = record_get_u32(header + 4);
+
+    if (length > reader->block_length - reader->block_offset -
+            RECORD_HEADER_SIZE) {
+        reader->damaged = 1;
+        reader->block_offset = reader->block_length = 0;
+        reader->offset = reader->blocks_end;
+        return 0;
+    }
+
+    entry->type = header[0];
+    entry->stream = header[1];
+    entry->timestamp = record_get_u64(header + 8);
+    entry->payload = header + RECORD_HEADER_SIZE;
+    entry->length = length;
+
+    reader->block_offset += RECORD_HEADER_SIZE + length;
+
+    return 1;
+}
+
+
+void record_reader_close(struct record_reader *reader) {
+    ASSERT_ZERO(munmap((void *) reader->map, reader->size));
+    ASSERT_ZERO(close(reader->fd));
+    free(reader->unpacked);
+}
+
+
+static void find_index(struct record_reader *reader) {
+    const unsigned char *trailer;
+    uint64_t index_offset;
+    uint64_t count;
+
+    reader->blocks_end = reader->size;
+    reader->index = NULL;
+    reader->index_length = 0;
+
+    if (reader->size < RECORD_FILE_HEADER_SIZE + 8 + RECORD_TRAILER_SIZE) {
+        return;
+    }
+
+    trailer = reader->map + reader->size - RECORD_TRAILER_SIZE;
+    index_offset = record_get_u64(trailer);
+    count = record_get_u32(trailer + 8);
+
+    /* The index has to fill the space between the blocks and the trailer
+     * exactly, or the trailer is just the end of a cut short block that
+     * happens to look like one. */
+    if (record_get_u32(trailer + 12) != RECORD_TRAILER_MAGIC ||
+            index_offset < RECORD_FILE_HEADER_SIZE ||
+            index_offset > reader->size - RECORD_TRAILER_SIZE - 8 ||
+            reader->size - RECORD_TRAILER_SIZE - 8 - index_offset !=
+                count * RECORD_INDEX_ENTRY_SIZE ||
+            record_get_u32(reader->map + index_offset) !=
+                RECORD_INDEX_MAGIC ||
+            record_get_u32(reader->map + index_offset + 4) != count) {
+        return;
+    }
+
+    reader->blocks_end = index_offset;
+    reader->index = reader->map + index_offset + 8;
+    reader->index_length = count;
+}
+
+
+static int next_block(struct record_reader *reader) {
+    const unsigned char *header = reader->map + reader->offset;
+    const unsigned char *stored;
+    int codec;
+    size_t raw_length;
+    size_t stored_length;
+
+    if (reader->offset == reader->blocks_end) {
+        return 0;
+    }
+
+    if (reader->blocks_end - reader->offset < RECORD_BLOCK_HEADER_SIZE ||
+            record_get_u32(header) != RECORD_BLOCK_MAGIC) {
+        reader->damaged = 1;
+        return 0;
+    }
+
+    codec = record_get_u32(header + 4);
+    raw_length = record_get_u32(header + 8);
+    stored_length = record_get_u32(header + 12);
+    stored = header + RECORD_BLOCK_HEADER_SIZE;
+
+    if (stored_length > reader->blocks_end - reader->offset -
+            RECORD_BLOCK_HEADER_SIZE) {
+        reader->damaged = 1;
+        return 0;
+    }
+
+    if (codec == RECORD_CODEC_NONE) {
+        if (raw_length != stored_length) {
+            reader->damaged = 1;
+            return 0;
+        }
+
+        reader->block = stored;
+    }
+    else if (unpack(reader, codec, stored, stored_length, raw_length)) {
+        reader->block = reader->unpacked;
+    }
+    else {
+        reader->damaged = 1;
+        return 0;
+    }
+
+    reader->block_length = raw_length;
+    reader->block_offset = 0;
+    reader->offset += RECORD_BLOCK_HEADER_SIZE + stored_length;
+
+    return 1;
+}
+
+
+static int unpack(struct record_reader *reader, int codec,
+                  const unsigned char *stored, size_t length,
+                  size_t raw_length) {
+    if (raw_length > reader->unpacked_capacity) {
+        free(reader->unpacked);
+        ASSERT_NONZERO(reader->unpacked = malloc(raw_length));
+        reader->unpacked_capacity = raw_length;
+    }
+
+#ifdef HAVE_ZSTD
+    if (codec == RECORD_CODEC_ZSTD) {
+        size_t n = ZSTD_decompress(reader->unpacked, raw_length, stored,
+                                   length);
+
+        return !ZSTD_isError(n) && n == raw_length;
+    }
+#endif
+
+#ifdef HAVE_LZ4
+    if (codec == RECORD_CODEC_LZ4) {
+        int n = LZ4_decompress_safe((const char *) stored,
+                                    (char *) reader->unpacked, length,
+                                    raw_length);
+
+        return n >= 0 && (size_t) n == raw_length;
+    }
+#endif
+
+    /* A codec we don't know is as good as damage, unless it is one we
+     * would know if it had been built in. */
+    ASSERT_WITH_MESSAGE(codec != RECORD_CODEC_ZSTD &&
+                        codec != RECORD_CODEC_LZ4,
+                        "The capture is compressed with a codec that isn't "
+                        "built in");
+
+    (void) stored;
+    (void) length;
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/* record_reader.h
+ *
+ * Read back the capture files written by --record, for terminator-replay.
+ * The file is mapped whole, and its blocks are walked in order, each
+ * decompressed into a buffer of the reader's own if it was stored
+ * compressed, so a record's payload can be used where it lies until the
+ * next block is reached.
+ *
+ * A capture cut short, by a crash or while it is still being written, has
+ * no index, and may end part way through a block. Reading stops at the last
+ * whole block, and the reader notes that the capture was damaged, rather
+ * than failing; the index is only needed to seek.
+ */
+
+#ifndef RECORD_READER_H_INCLUDED
+#define RECORD_READER_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* One record, as found in its block */
+struct record_entry {
+    /* One of the RECORD_TYPE_* values, and for data, the stream it was
+     * read from */
+    int type;
+    int stream;
+
+    /* Monotonic nanoseconds since the start of the capture */
+    uint64_t timestamp;
+
+    /* The payload, which stays valid until the next block is read */
+    const unsigned char *payload;
+    size_t length;
+};
+
+struct record_reader {
+    int fd;
+
+    /* The whole file */
+    const unsigned char *map;
+    size_t size;
+
+    /* The wall clock time of the start of the capture, in nanoseconds since
+     * the epoch */
+    uint64_t start_time_ns;
+
+    /* Where the blocks end, which is at the index if there is one, and the
+     * index entries, or NULL if there is no index */
+    size_t blocks_end;
+    const unsigned char *index;
+    size_t index_length;
+
+    /* Where the next block header is */
+    size_t offset;
+
+    /* The records of the current block, and where the next one starts.
+     * A compressed block is decompressed into unpacked. */
+    const unsigned char *block;
+    size_t block_length;
+    size_t block_offset;
+    unsigned char *unpacked;
+    size_t unpacked_capacity;
+
+    /* Set once reading has stopped at something that isn't a whole block
+     * or record */
+    int damaged;
+};
+
+/* Open and map the capture at PATH, and check its header. Failing to do so
+ * is fatal. */
+void record_reader_open(struct record_reader *reader, const char *path);
+
+/* Carry on from the last block that starts at or before TIMESTAMP, so that
+ * at most a block of records before it is left to skip. Returns 0, or -1 if
+ * the capture has no usable index, in which case the reader is left where
+ * it was. */
+int record_reader_seek(struct record_reader *reader, uint64_t timestamp);
+
+/* Go back to the first record. */
+void record_reader_rewind(struct record_reader *reader);
+
+/* Fill in *ENTRY with the next record. Returns 1 if there was one, or 0 at
+ * the end of the capture, or where it stops being readable. */
+int record_reader_next(struct record_reader *reader,
+                       struct record_entry *entry);
+
+/* Unmap and close the capture. */
+void record_reader_close(struct record_reader *reader);
+
+#endif /* RECORD_READER_H_INCLUDED */
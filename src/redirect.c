@@ -0,0 +1,1503 @@
+/* redirect.c
+ *
+ * The copy state for one direction of traffic through the PTY. See redirect.h
+ * for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* In some environments, we'll be dealing with the STREAMS extension. If it's
+ * available, include it. */
+#if defined(_XOPEN_STREAMS) && _XOPEN_STREAMS != -1
+#include <stropts.h>
+#endif
+
+#include "io_result.h"
+#include "my_assert.h"
+#include "redirect.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* How much of a frame's payload to encode at a time: a multiple of three,
+ * for base64, and how much room that takes, which is also enough for the
+ * frame's header and trailer */
+#define REDIRECTION_FRAME_PIECE      3072
+#define REDIRECTION_FRAME_PIECE_SIZE 4096
+
+
+/* Try to set up the map transport. Returns nonzero on success. */
+static int map_setup(struct redirection_info *info);
+
+/* Try to set up the splice transport. Returns nonzero on success. */
+static int splice_setup(struct redirection_info *info, size_t buffer_size);
+
+/* Give up on splice after the kernel refused it, moving anything already in
+ * the pipe into a ring buffer. */
+static void splice_fall_back(struct redirection_info *info);
+
+/* Nonzero if the splice pipe has no room for another splice into it. */
+static int splice_pipe_full(const struct redirection_info *info);
+
+/* The number of bytes waiting to be written out. */
+static size_t buffered_length(const struct redirection_info *info);
+
+/* The number of bytes that can still be read in. */
+static size_t buffered_space(const struct redirection_info *info);
+
+/* Nonzero if the next read would go into the buffer itself, rather than to
+ * scratch to be dropped or to the spill file. */
+static int read_fits_buffer(const struct redirection_info *info);
+
+/* Describe where the last read from redirection_input_iov went, as up to two
+ * iovecs. */
+static int read_region(const struct redirection_info *info,
+                       struct iovec iov[2]);
+
+/* Make room in the buffer for N bytes read into scratch, as the backpressure
+ * policy says, and move in as many of them as there is room for. Returns how
+ * many that is. */
+static size_t backpressure_drop(struct redirection_info *info, size_t n);
+
+/* Remember the first error that ended the direction, and which FD it was
+ * on. */
+static void note_error(struct redirection_info *info, int fd, int error);
+
+/* Give up on out_fd, throwing away whatever was still to be written. */
+static void output_gone(struct redirection_info *info);
+
+/* Count N bytes thrown away, which were counted as read first if WAS_READ is
+ * set. */
+static void note_dropped(struct redirection_info *info, size_t n,
+                         int was_read);
+
+/* Nonzero if everything buffered should be written now, whatever the flush
+ * policy would otherwise wait for. */
+static int flush_overdue(const struct redirection_info *info, uint64_t now);
+
+/* Note where the last newline is in N bytes just read into IOV, ahead of
+ * them being added to the buffer. */
+static void find_line_end(struct redirection_info *info,
+                          const struct iovec *iov, int iov_count, size_t n);
+
+/* The current monotonic time in nanoseconds. */
+static uint64_t now_ns(void);
+
+/* Write the rows of the screen that changed, or with FINAL set, finish off
+ * the last snapshot, as far as there is room in the buffer. */
+static void snapshot_render(struct redirection_info *info, uint64_t now,
+                            int final);
+
+/* Apply a size from redirection_resize to the screen, if there is one. */
+static void screen_sync_size(struct redirection_info *info);
+
+/* Nonzero if the buffer has room for a rendered row and its prefix. */
+static int snapshot_fits(const struct redirection_info *info);
+
+/* Add N bytes to the buffer, which must have room for them, as if they had
+ * just been read. */
+static void buffer_put(struct redirection_info *info, const char *data,
+                       size_t n);
+
+/* Put N bytes just read into the scratch buffer into the buffer as a
+ * frame. */
+static void frame_put(struct redirection_info *info, size_t n);
+
+/* Read as much as will fit from in_fd, without any bookkeeping. Returns the
+ * number of bytes read, or a negated errno value. */
+static ssize_t fill_buffer(struct redirection_info *info);
+
+/* Write as much as possible to out_fd, without any bookkeeping. Returns the
+ * number of bytes written, or a negated errno value. */
+static ssize_t drain_buffer(struct redirection_info *info);
+
+#if !defined(_XOPEN_STREAMS) || _XOPEN_STREAMS == -1
+static int isastream(int fd);
+#endif
+
+
+void redirection_init(struct redirection_info *info, int id, int in_fd,
+                      int out_fd, int send_eot, int end_all,
+                      const struct redirection_config *config) {
+    int in_flags, out_flags;
+    int zero_copy;
+
+    info->id = id;
+    info->in_fd = in_fd;
+    info->out_fd = out_fd;
+    info->send_eot = send_eot;
+    info->end_all = end_all;
+    info->wait_eof = 0;
+    info->recorder = config->recorder;
+    info->stats = config->stats;
+    info->flush = config->flush;
+    text_filter_init(&info->filter, config->filter);
+
+    info->screen = NULL;
+    info->snapshot_row = NULL;
+    info->snapshot_interval_ms = config->snapshot_interval_ms;
+    info->snapshot_start_ns = info->snapshot_last_ns = 0;
+    info->snapshot_final_row = 0;
+    info->snapshot_done = 0;
+    atomic_init(&info->snapshot_resize, 0);
+
+    if (config->snapshot) {
+        ASSERT_NONZERO(info->screen = malloc(sizeof(*info->screen)));
+        screen_init(info->screen, config->snapshot_rows,
+                    config->snapshot_cols);
+        ASSERT_NONZERO(info->snapshot_row =
+                       malloc(SCREEN_ROW_BYTES(info->screen->cols)));
+        info->snapshot_start_ns = info->snapshot_last_ns = now_ns();
+    }
+    info->hold_since_ns = 0;
+    info->line_end = 0;
+
+    info->keep_going = 1;
+    info->found_eof = 0;
+    info->out_hangup = 0;
+
+    info->buffer.data = NULL;
+    info->splice_pipe[0] = info->splice_pipe[1] = -1;
+    info->splice_capacity = 0;
+    info->splice_length = 0;
+    info->splice_full = 0;
+
+    info->backpressure = config->backpressure.mode;
+    info->scratch = NULL;
+    info->scratch_size = 0;
+    info->spill.fd = -1;
+    info->spill.data = NULL;
+    info->spill.capacity = info->spill.head = info->spill.tail = 0;
+    info->read_target = REDIRECTION_READ_BUFFER;
+    info->write_in_flight = 0;
+    info->write_from_spill = 0;
+    info->out_nonblock = 0;
+    info->dropped = 0;
+    info->error = 0;
+    info->error_fd = -1;
+    info->framer = config->framer;
+    info->sink = config->sink;
+
+    zero_copy = config->zero_copy && !config->recorder &&
+        config->flush.mode != FLUSH_LINE && !config->filter &&
+        !config->snapshot && !config->framer && !config->sink &&
+        config->backpressure.mode == BACKPRESSURE_BLOCK;
+
+    if (zero_copy && map_setup(info)) {
+        info->transport = REDIRECTION_MAP;
+    }
+    else if (zero_copy && splice_setup(info, config->buffer_size)) {
+        info->transport = REDIRECTION_SPLICE;
+    }
+    else {
+        info->transport = REDIRECTION_COPY;
+        ring_buffer_init(&info->buffer, config->buffer_size, config->pool);
+    }
+
+    switch (info->backpressure) {
+        case BACKPRESSURE_BLOCK:
+            break;
+
+        case BACKPRESSURE_DROP_OLDEST:
+        case BACKPRESSURE_DROP_NEWEST:
+            /* No bigger than the buffer, so that dropping the oldest data
+             * can always make room for a whole read. */
+            info->scratch_size =
+                info->buffer.capacity < REDIRECTION_DEFAULT_BUFFER_SIZE ?
+                info->buffer.capacity : REDIRECTION_DEFAULT_BUFFER_SIZE;
+            ASSERT_NONZERO(info->scratch = malloc(info->scratch_size));
+            break;
+
+        case BACKPRESSURE_SPILL:
+            spill_open(&info->spill, config->backpressure.dir);
+            break;
+    }
+
+    /* Framed data is read to one side, and then framed into the buffer. */
+    if (info->framer) {
+        info->scratch_size =
+            info->buffer.capacity < REDIRECTION_DEFAULT_BUFFER_SIZE ?
+            info->buffer.capacity : REDIRECTION_DEFAULT_BUFFER_SIZE;
+        ASSERT_NONZERO(info->scratch = malloc(info->scratch_size));
+    }
+
+    ASSERT_NONNEG(out_flags = fcntl(out_fd, F_GETFL));
+
+    /* A write that waited for a stalled reader would stall our own reads
+     * with it, and the policy would never get a say. */
+    if (info->backpressure != BACKPRESSURE_BLOCK &&
+            !(out_flags & O_NONBLOCK)) {
+        ASSERT_NONNEG(fcntl(out_fd, F_SETFL, out_flags | O_NONBLOCK));
+        info->out_nonblock = 1;
+        out_flags |= O_NONBLOCK;
+    }
+
+    info->out_blocking = !(out_flags & O_NONBLOCK);
+    info->out_tty = isatty(info->out_fd);
+
+    ASSERT_NONNEG(in_flags = fcntl(in_fd, F_GETFL));
+    info->in_nonblocking = (in_flags & O_NONBLOCK) != 0;
+    info->read_asked = 0;
+    read_pace_init(&info->pace, info->transport == REDIRECTION_SPLICE ?
+                   info->splice_capacity : info->buffer.capacity);
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "%d: Using the %s transport from fd %d to fd %d.\n",
+            info->id, info->transport == REDIRECTION_SPLICE ? "splice" :
+            info->transport == REDIRECTION_MAP ? "map" : "copy",
+            info->in_fd, info->out_fd);
+#endif
+
+    /* The whole file counts as one read, made as we start. */
+    if (info->transport == REDIRECTION_MAP && info->stats) {
+        stats_add(&info->stats->reads, 1);
+        stats_read(info->stats, info->buffer.length);
+    }
+
+    syncer_start(&info->syncer, out_fd, &config->sync);
+}
+
+
+void redirection_config_init(struct redirection_config *config) {
+    config->buffer_size = REDIRECTION_DEFAULT_BUFFER_SIZE;
+    config->sync.mode = SYNC_NEVER;
+    config->sync.interval_ms = 0;
+    config->flush.mode = FLUSH_IMMEDIATE;
+    config->flush.bytes = 0;
+    config->flush.latency_us = 0;
+    config->backpressure.mode = BACKPRESSURE_BLOCK;
+    config->backpressure.dir = NULL;
+    config->filter = 0;
+    config->snapshot = 0;
+    config->snapshot_interval_ms = 0;
+    config->snapshot_rows = 0;
+    config->snapshot_cols = 0;
+    config->zero_copy = 0;
+    config->pool = NULL;
+    config->recorder = NULL;
+    config->framer = NULL;
+    config->sink = NULL;
+    config->stats = NULL;
+}
+
+
+void redirection_destroy(struct redirection_info *info) {
+    syncer_finish(&info->syncer);
+
+    if (info->transport == REDIRECTION_MAP) {
+        ASSERT_ZERO(munmap(info->buffer.data, info->buffer.capacity));
+        info->buffer.data = NULL;
+    }
+    else if (info->buffer.data) {
+        ring_buffer_destroy(&info->buffer);
+    }
+
+    if (info->screen) {
+        screen_destroy(info->screen);
+        free(info->screen);
+        free(info->snapshot_row);
+        info->screen = NULL;
+        info->snapshot_row = NULL;
+    }
+
+    if (info->splice_pipe[0] >= 0) {
+        ASSERT_ZERO(close(info->splice_pipe[0]));
+        ASSERT_ZERO(close(info->splice_pipe[1]));
+        info->splice_pipe[0] = info->splice_pipe[1] = -1;
+    }
+
+    free(info->scratch);
+    info->scratch = NULL;
+
+    if (info->spill.fd >= 0) {
+        spill_close(&info->spill);
+    }
+
+    /* The file description may be shared with whoever started us, so it
+     * goes back the way we found it. */
+    if (info->out_nonblock) {
+        int out_flags;
+
+        ASSERT_NONNEG(out_flags = fcntl(info->out_fd, F_GETFL));
+        ASSERT_NONNEG(fcntl(info->out_fd, F_SETFL, out_flags & ~O_NONBLOCK));
+        info->out_nonblock = 0;
+    }
+}
+
+
+void redirection_poll_setup(const struct redirection_info *info,
+                            int *in_fd, short *in_events,
+                            int *out_fd, short *out_events) {
+    /* Read whenever there is room in the buffer. If we can't take any input,
+     * leave the input side out of the poll entirely, so that a hangup doesn't
+     * keep waking us up before we're ready to deal with it. */
+    if (redirection_wants_input(info)) {
+        *in_fd = info->in_fd;
+        *in_events = POLLIN;
+    }
+    else {
+        *in_fd = -1;
+        *in_events = 0;
+    }
+
+    /* Always watch the output side for a hangup, but only ask to write when
+     * there is something to say. */
+    if (info->out_hangup) {
+        *out_fd = -1;
+        *out_events = 0;
+    }
+    else {
+        *out_fd = info->out_fd;
+        *out_events = (redirection_wants_output(info) ||
+                       redirection_wants_eof(info)) ? POLLOUT : 0;
+    }
+}
+
+
+void redirection_handle(struct redirection_info *info, short in_revents,
+                        short out_revents) {
+    ssize_t result;
+    int reads = 0;
+
+    if (info->stats && (in_revents || out_revents)) {
+        stats_add(&info->stats->wakeups, 1);
+    }
+
+    if (in_revents & (POLLHUP | POLLERR) && !(in_revents & POLLIN)) {
+#ifdef ASSERT_DEBUG
+        fprintf(stderr, "%d: Hangup on fd %d.\n", info->id, info->in_fd);
+#endif
+        info->found_eof = 1;
+    }
+
+    if (out_revents & (POLLHUP | POLLERR)) {
+        redirection_output_done(info, -EPIPE);
+    }
+
+    /* While the input is sustained, keep reading until it runs dry, or the
+     * buffer is full, rather than waiting to be told there is more. A read
+     * that the backpressure policy would drop or spill ends the burst, so
+     * the writer gets its turn first. */
+    if (in_revents & POLLIN && redirection_wants_input(info)) {
+        do {
+            result = fill_buffer(info);
+            redirection_input_done(info, result);
+
+            if (++reads > 1 && info->stats) {
+                stats_add(&info->stats->burst_reads, 1);
+            }
+        } while (result > 0 && reads < READ_PACE_MAX_BURST &&
+                 info->in_nonblocking && read_pace_bulk(&info->pace) &&
+                 redirection_wants_input(info) && read_fits_buffer(info));
+    }
+
+    if (out_revents & POLLOUT) {
+        if (redirection_wants_output(info)) {
+            redirection_output_done(info, drain_buffer(info));
+        }
+        else if (redirection_wants_eof(info)) {
+            redirection_send_eof(info);
+        }
+    }
+}
+
+
+void redirection_prepare(struct redirection_info *info) {
+    uint64_t now;
+
+    if (!info->screen || info->snapshot_done || info->out_hangup) {
+        return;
+    }
+
+    /* Once the final snapshot is under way, the size stays put. */
+    if (info->found_eof || !info->keep_going) {
+        snapshot_render(info, now_ns(), 1);
+        return;
+    }
+
+    screen_sync_size(info);
+
+    if (info->snapshot_interval_ms == 0 || !screen_any_dirty(info->screen)) {
+        return;
+    }
+
+    now = now_ns();
+
+    if (now - info->snapshot_last_ns >=
+            info->snapshot_interval_ms * 1000000ULL) {
+        snapshot_render(info, now, 0);
+    }
+}
+
+
+void redirection_resize(struct redirection_info *info, unsigned rows,
+                        unsigned cols) {
+    if (!info->screen || rows == 0 || cols == 0) {
+        return;
+    }
+
+    atomic_store_explicit(&info->snapshot_resize,
+                          (rows & 0xffff) << 16 | (cols & 0xffff),
+                          memory_order_relaxed);
+}
+
+
+int64_t redirection_timeout(const struct redirection_info *info) {
+    int64_t timeout = -1;
+    uint64_t now = 0;
+
+    if (info->out_hangup) {
+        return -1;
+    }
+
+    if (info->flush.mode != FLUSH_IMMEDIATE && buffered_length(info) > 0 &&
+            !redirection_wants_output(info)) {
+        uint64_t deadline =
+            info->hold_since_ns + info->flush.latency_us * 1000ULL;
+
+        now = now_ns();
+        timeout = deadline > now ? (int64_t) (deadline - now) : 0;
+    }
+
+    /* If there's no room for the snapshot, the write that makes room will
+     * wake us up anyway. */
+    if (info->screen && !info->snapshot_done && snapshot_fits(info)) {
+        if (info->found_eof) {
+            timeout = 0;
+        }
+        else if (info->snapshot_interval_ms > 0 &&
+                 screen_any_dirty(info->screen)) {
+            uint64_t deadline = info->snapshot_last_ns +
+                info->snapshot_interval_ms * 1000000ULL;
+            int64_t snapshot_timeout;
+
+            if (now == 0) {
+                now = now_ns();
+            }
+
+            snapshot_timeout =
+                deadline > now ? (int64_t) (deadline - now) : 0;
+
+            if (timeout < 0 || snapshot_timeout < timeout) {
+                timeout = snapshot_timeout;
+            }
+        }
+    }
+
+    return timeout;
+}
+
+
+int redirection_poll(struct pollfd *fds, nfds_t n_fds, int64_t timeout_ns) {
+#ifdef HAVE_PPOLL
+    struct timespec timeout;
+
+    if (timeout_ns < 0) {
+        return ppoll(fds, n_fds, NULL, NULL);
+    }
+
+    timeout.tv_sec = timeout_ns / 1000000000;
+    timeout.tv_nsec = timeout_ns % 1000000000;
+
+    return ppoll(fds, n_fds, &timeout, NULL);
+#else
+    /* Round up, so we never wake up just before the data is due and then
+     * have to go straight back to sleep. */
+    return poll(fds, n_fds,
+                timeout_ns < 0 ? -1 : (int) ((timeout_ns + 999999) / 1000000));
+#endif
+}
+
+
+int redirection_active(const struct redirection_info *info) {
+    return info->keep_going || buffered_length(info) > 0 ||
+        (info->screen && !info->snapshot_done && !info->out_hangup);
+}
+
+
+void redirection_stop(struct redirection_info *info) {
+    info->keep_going = 0;
+}
+
+
+void redirection_end_all(struct redirection_info *infos, size_t n_infos) {
+    size_t i;
+
+    for (i = 0; i < n_infos; i++) {
+        if (!infos[i].wait_eof) {
+            redirection_stop(&infos[i]);
+        }
+    }
+}
+
+
+int redirection_wants_input(const struct redirection_info *info) {
+    if (!info->keep_going || info->found_eof) {
+        return 0;
+    }
+
+    switch (info->backpressure) {
+        case BACKPRESSURE_DROP_OLDEST:
+        case BACKPRESSURE_DROP_NEWEST:
+            return 1;
+
+        case BACKPRESSURE_SPILL:
+            /* Once data is in the spill file, everything after it has to
+             * go there too, or it would be written out first. */
+            if (spill_length(&info->spill) > 0 || buffered_space(info) == 0) {
+                return spill_room(&info->spill) > 0;
+            }
+            break;
+
+        case BACKPRESSURE_BLOCK:
+            break;
+    }
+
+    if (info->framer) {
+        return framer_payload_room(info->framer, buffered_space(info)) > 0;
+    }
+
+    return buffered_space(info) > 0;
+}
+
+
+int redirection_wants_output(const struct redirection_info *info) {
+    size_t length = buffered_length(info);
+
+    if (info->out_hangup || length == 0) {
+        return 0;
+    }
+
+    switch (info->flush.mode) {
+        case FLUSH_IMMEDIATE:
+            return 1;
+
+        case FLUSH_LINE:
+            if (info->line_end > 0) {
+                return 1;
+            }
+            break;
+
+        case FLUSH_BYTES:
+            if (length >= info->flush.bytes) {
+                return 1;
+            }
+            break;
+
+        case FLUSH_LATENCY:
+            break;
+    }
+
+    return flush_overdue(info, now_ns());
+}
+
+
+int redirection_wants_eof(const struct redirection_info *info) {
+    return !info->out_hangup && info->keep_going && info->found_eof &&
+        buffered_length(info) == 0 &&
+        (!info->screen || info->snapshot_done);
+}
+
+
+int redirection_input_iov(struct redirection_info *info, struct iovec iov[2]) {
+    size_t room;
+    int iov_count;
+
+    if (info->backpressure == BACKPRESSURE_SPILL &&
+            (spill_length(&info->spill) > 0 || buffered_space(info) == 0)) {
+        iov[0].iov_base = spill_reserve(&info->spill, &room);
+        iov[0].iov_len = room;
+        info->read_target = REDIRECTION_READ_SPILL;
+        info->read_asked = iov[0].iov_len;
+        return 1;
+    }
+
+    if (info->scratch && buffered_space(info) == 0) {
+        iov[0].iov_base = info->scratch;
+        iov[0].iov_len = info->scratch_size;
+        info->read_target = REDIRECTION_READ_SCRATCH;
+        info->read_asked = iov[0].iov_len;
+        return 1;
+    }
+
+    /* Leave room for the frame around what is read. */
+    if (info->framer) {
+        room = framer_payload_room(info->framer, buffered_space(info));
+
+        if (room > info->scratch_size) {
+            room = info->scratch_size;
+        }
+
+        if (room > read_pace_size(&info->pace)) {
+            room = read_pace_size(&info->pace);
+        }
+
+        iov[0].iov_base = info->scratch;
+        iov[0].iov_len = room;
+        info->read_target = REDIRECTION_READ_FRAME;
+        info->read_asked = room;
+        return 1;
+    }
+
+    info->read_target = REDIRECTION_READ_BUFFER;
+    iov_count = ring_buffer_space_iov(&info->buffer, iov);
+
+    room = read_pace_size(&info->pace);
+
+    if (iov[0].iov_len >= room) {
+        iov[0].iov_len = room;
+        iov_count = 1;
+    }
+    else if (iov_count > 1 && iov[0].iov_len + iov[1].iov_len > room) {
+        iov[1].iov_len = room - iov[0].iov_len;
+    }
+
+    info->read_asked = iov[0].iov_len + (iov_count > 1 ? iov[1].iov_len : 0);
+    return iov_count;
+}
+
+
+int redirection_output_iov(struct redirection_info *info,
+                           struct iovec iov[2]) {
+    int iov_count;
+
+    info->write_in_flight = 1;
+
+    /* The buffer's data is older than anything in the spill file, so the
+     * spill file waits for the buffer to empty. */
+    info->write_from_spill =
+        info->buffer.length == 0 && spill_length(&info->spill) > 0;
+
+    if (info->write_from_spill) {
+        iov[0].iov_base = (char *) spill_data(&info->spill);
+        iov[0].iov_len = spill_length(&info->spill);
+        return 1;
+    }
+
+    iov_count = ring_buffer_data_iov(&info->buffer, iov);
+
+    /* Leave a partial line for later, unless it has waited long enough. */
+    if (info->flush.mode == FLUSH_LINE && info->line_end > 0 &&
+            info->line_end < info->buffer.length &&
+            !flush_overdue(info, now_ns())) {
+        if (info->line_end <= iov[0].iov_len) {
+            iov[0].iov_len = info->line_end;
+            iov_count = 1;
+        }
+        else {
+            iov[1].iov_len = info->line_end - iov[0].iov_len;
+        }
+    }
+
+    return iov_count;
+}
+
+
+void redirection_input_done(struct redirection_info *info, ssize_t result) {
+    /* How much of what was read goes on to be written */
+    size_t kept;
+
+    /* Once the output is gone, nobody wants what we read. */
+    if (info->out_hangup) {
+        return;
+    }
+
+    /* Once the slave side has been closed, Linux reports EIO on the master
+     * rather than a plain end of file. */
+    if (result == -EIO) {
+        result = 0;
+    }
+
+    if (info->stats) {
+        stats_add(&info->stats->reads, 1);
+    }
+
+    if (result == -EINVAL && info->transport == REDIRECTION_SPLICE) {
+        /* The input doesn't support splicing after all, so carry on the
+         * old-fashioned way. */
+        splice_fall_back(info);
+        return;
+    }
+
+    if (result == -EAGAIN || result == -EINTR) {
+        /* The data poll promised wasn't there after all, or a splice
+         * couldn't fit a whole page into the pipe, or io_uring was
+         * interrupted. Just try again. */
+        if (info->stats) {
+            stats_add(&info->stats->would_block, 1);
+        }
+
+        /* If it was the pipe, there is no use trying again until some of
+         * it has been written out, or we would spin waiting on an input
+         * that has been ready all along. */
+        if (info->transport == REDIRECTION_SPLICE && result == -EAGAIN &&
+                splice_pipe_full(info)) {
+            info->splice_full = 1;
+        }
+
+#ifdef ASSERT_DEBUG
+        fprintf(stderr, "%d: Read on fd %d would block.\n", info->id,
+                info->in_fd);
+#endif
+        return;
+    }
+
+    /* Anything else ends the input, as if it were the end of file, but
+     * whatever was read before still goes out. */
+    if (result < 0) {
+        note_error(info, info->in_fd, -result);
+        info->found_eof = 1;
+        return;
+    }
+
+    read_pace_update(&info->pace, info->read_asked, result, now_ns());
+
+    kept = result;
+
+    if (info->transport == REDIRECTION_COPY && result > 0) {
+        /* The data went into the free space, which starts where it did
+         * before the read, or wherever the backpressure policy sent it. */
+        struct iovec iov[2];
+        int iov_count = read_region(info, iov);
+
+        /* The recording gets everything, escapes and all. */
+        if (info->recorder) {
+            recorder_data(info->recorder, info->id, iov, iov_count, result);
+        }
+
+        if (info->filter.flags) {
+            kept = text_filter_apply(&info->filter, iov, iov_count, result);
+        }
+
+        /* With a screen, the data only goes to the screen, and what gets
+         * written comes from snapshots of it. */
+        if (info->screen) {
+            /* The command redraws for its new size after it hears of it,
+             * which is after the size is set, so this catches the change
+             * in time. */
+            screen_sync_size(info);
+
+            screen_feed(info->screen, iov[0].iov_base,
+                        kept < iov[0].iov_len ? kept : iov[0].iov_len);
+
+            if (kept > iov[0].iov_len) {
+                screen_feed(info->screen, iov[1].iov_base,
+                            kept - iov[0].iov_len);
+            }
+
+            kept = 0;
+        }
+
+        if (info->read_target == REDIRECTION_READ_FRAME && kept > 0) {
+            frame_put(info, kept);
+            kept = 0;
+        }
+
+        /* The buffer was full when the read started, so it goes in now, if
+         * at all, as far as the policy can make room. */
+        if (info->read_target == REDIRECTION_READ_SCRATCH && kept > 0) {
+            kept = backpressure_drop(info, kept);
+            iov_count = ring_buffer_space_iov(&info->buffer, iov);
+        }
+
+        /* Nothing in the spill file is held back, so there is no need to
+         * look for its lines. */
+        if (info->flush.mode == FLUSH_LINE &&
+                info->read_target != REDIRECTION_READ_SPILL) {
+            find_line_end(info, iov, iov_count, kept);
+        }
+    }
+
+    if (info->stats && kept > 0) {
+        stats_read(info->stats, kept);
+    }
+
+    /* The flush latency counts from when the oldest data arrived. */
+    if (info->flush.mode != FLUSH_IMMEDIATE && kept > 0 &&
+            buffered_length(info) == 0) {
+        info->hold_since_ns = now_ns();
+    }
+
+    if (info->transport == REDIRECTION_SPLICE) {
+        info->splice_length += kept;
+    }
+    else if (info->read_target == REDIRECTION_READ_SPILL) {
+        spill_produce(&info->spill, kept);
+
+        if (info->stats) {
+            stats_add(&info->stats->bytes_spilled, kept);
+        }
+    }
+    else {
+        ring_buffer_produce(&info->buffer, kept);
+    }
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "%d: Read %zd bytes on fd %d.\n", info->id, result,
+            info->in_fd);
+#endif
+
+    if (result == 0) {
+        info->found_eof = 1;
+    }
+}
+
+
+void redirection_output_done(struct redirection_info *info, ssize_t result) {
+    info->write_in_flight = 0;
+
+    /* After a hangup the buffer has been thrown away, so a write that was
+     * still in flight has nothing left to account for. */
+    if (info->out_hangup) {
+        return;
+    }
+
+    if (info->stats) {
+        stats_add(&info->stats->writes, 1);
+    }
+
+    if (result == -EINVAL && info->transport == REDIRECTION_SPLICE) {
+        splice_fall_back(info);
+        return;
+    }
+
+    if (result < 0 && io_classify(result) == IO_RETRY) {
+        if (info->stats) {
+            stats_add(&info->stats->would_block, 1);
+        }
+
+#ifdef ASSERT_DEBUG
+        fprintf(stderr, "%d: Write on fd %d would block.\n", info->id,
+                info->out_fd);
+#endif
+
+        /* Once we have been stopped, the command is gone, and a full PTY
+         * will never be read again, although it still polls as writable. */
+        if (!info->keep_going && info->out_tty) {
+            output_gone(info);
+        }
+        return;
+    }
+
+    /* A hangup is how output normally goes away, and on a terminal it can
+     * look like EIO. Anything else is worth a mention, but it too only ends
+     * this direction. */
+    if (result < 0) {
+        if (io_classify(result) == IO_ERROR &&
+                !(result == -EIO && info->out_tty)) {
+            note_error(info, info->out_fd, -result);
+        }
+
+        output_gone(info);
+        return;
+    }
+
+    if (info->stats) {
+        /* With FLUSH_LINE, the lines may have been all we offered. */
+        stats_wrote(info->stats, result,
+                    info->flush.mode == FLUSH_LINE &&
+                        (size_t) result == info->line_end ?
+                        (size_t) result : buffered_length(info));
+    }
+
+    if (info->transport == REDIRECTION_SPLICE) {
+        info->splice_length -= result;
+
+        if (result > 0) {
+            info->splice_full = 0;
+        }
+    }
+    else if (info->write_from_spill) {
+        spill_consume(&info->spill, result);
+    }
+    else {
+        ring_buffer_consume(&info->buffer, result);
+    }
+
+    if (info->flush.mode == FLUSH_LINE) {
+        /* Having written the complete lines, what is left is a partial line
+         * that only just started waiting on its own. */
+        if ((size_t) result == info->line_end && info->buffer.length > 0) {
+            info->hold_since_ns = now_ns();
+        }
+
+        info->line_end = info->line_end > (size_t) result ?
+            info->line_end - result : 0;
+    }
+
+    syncer_wrote(&info->syncer);
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "%d: Wrote %zd bytes on fd %d. ",
+        info->id, result, info->out_fd
+    );
+    fprintf(stderr, "%zu bytes remain in buffer.\n",
+        buffered_length(info)
+    );
+#endif
+}
+
+
+ssize_t redirection_sink_write(struct redirection_info *info) {
+    struct iovec iov[2];
+    int iov_count = redirection_output_iov(info, iov);
+
+    return file_sink_writev(info->sink, iov, iov_count);
+}
+
+
+int redirection_send_eof(struct redirection_info *info) {
+    char eot_char = 0x04;
+    struct iovec iov;
+    ssize_t result;
+
+    iov.iov_base = &eot_char;
+    iov.iov_len = 0;
+
+    if (info->send_eot && (isastream(info->out_fd) || isatty(info->out_fd))) {
+        iov.iov_len = 1;
+    }
+
+    result = io_writev(info->out_fd, &iov, 1, 0);
+
+    /* A PTY whose input queue is full can't take even the EOT. */
+    if (result == -EAGAIN) {
+        return result;
+    }
+
+    if (result < 0 && io_classify(result) == IO_ERROR) {
+        note_error(info, info->out_fd, -result);
+    }
+
+#ifdef ASSERT_DEBUG
+    if (result >= 0) {
+        fprintf(stderr, "%d: Wrote %s on fd %d.\n", info->id,
+                iov.iov_len > 0 ? "EOT" : "0 bytes", info->out_fd);
+    }
+#endif
+
+    info->keep_going = 0;
+
+    return 0;
+}
+
+
+int redirection_error(const struct redirection_info *info, int *fd) {
+    if (info->error != 0) {
+        *fd = info->error_fd;
+        return info->error;
+    }
+
+    *fd = info->out_fd;
+
+    return syncer_error(&info->syncer);
+}
+
+
+static int map_setup(struct redirection_info *info) {
+    struct stat in_stat;
+    void *map;
+
+    ASSERT_ZERO(fstat(info->in_fd, &in_stat));
+
+    /* An empty file has nothing to map, and one we aren't at the start of
+     * has been partly read by someone else already. A file too big for our
+     * address space is simply read instead. */
+    if (!S_ISREG(in_stat.st_mode) || in_stat.st_size == 0 ||
+            lseek(info->in_fd, 0, SEEK_CUR) != 0 ||
+            (uintmax_t) in_stat.st_size > SIZE_MAX) {
+        return 0;
+    }
+
+    map = mmap(NULL, in_stat.st_size, PROT_READ, MAP_PRIVATE, info->in_fd,
+               0);
+
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    /* It is only ever read front to back, once. */
+    madvise(map, in_stat.st_size, MADV_SEQUENTIAL);
+
+    info->buffer.data = map;
+    info->buffer.capacity = in_stat.st_size;
+    info->buffer.pool = NULL;
+    info->buffer.head = 0;
+    info->buffer.length = in_stat.st_size;
+    info->found_eof = 1;
+
+    return 1;
+}
+
+
+static int splice_setup(struct redirection_info *info, size_t buffer_size) {
+#ifdef HAVE_SPLICE
+    struct stat out_stat;
+    int out_flags;
+    int pipe_size;
+
+    ASSERT_ZERO(fstat(info->out_fd, &out_stat));
+    ASSERT_NONNEG(out_flags = fcntl(info->out_fd, F_GETFL));
+
+    /* splice() can write to pipes and files, but not to files opened for
+     * appending, as with >> in the shell. */
+    if (!S_ISFIFO(out_stat.st_mode) &&
+            !(S_ISREG(out_stat.st_mode) && !(out_flags & O_APPEND))) {
+        return 0;
+    }
+
+    ASSERT_ZERO(pipe2(info->splice_pipe, O_NONBLOCK | O_CLOEXEC));
+
+#ifdef F_SETPIPE_SZ
+    /* The pipe is our buffer, so try to make it as big as asked. The kernel
+     * rounds up, or may refuse beyond /proc/sys/fs/pipe-max-size, in which
+     * case the default will have to do. */
+    if (buffer_size <= (size_t) ~0U >> 1) {
+        fcntl(info->splice_pipe[0], F_SETPIPE_SZ, (int) buffer_size);
+    }
+#endif
+
+#ifdef F_GETPIPE_SZ
+    ASSERT_NONNEG(pipe_size = fcntl(info->splice_pipe[0], F_GETPIPE_SZ));
+#else
+    pipe_size = 4096;
+#endif
+
+    info->splice_capacity = pipe_size;
+    info->splice_length = 0;
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+static void splice_fall_back(struct redirection_info *info) {
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "%d: splice refused, falling back to the copy "
+            "transport.\n", info->id);
+#endif
+
+    /* The pipe may hold a little more than we asked for, since the kernel
+     * rounds its size up. */
+    ring_buffer_init(&info->buffer, info->splice_capacity, NULL);
+
+    while (info->buffer.length < info->splice_length) {
+        struct iovec iov[2];
+        int iov_count = ring_buffer_space_iov(&info->buffer, iov);
+        ssize_t n_read;
+
+        ASSERT_NONNEG(n_read = readv(info->splice_pipe[0], iov, iov_count));
+        ASSERT_WITH_MESSAGE(n_read > 0, "Lost data in the splice pipe");
+        ring_buffer_produce(&info->buffer, n_read);
+    }
+
+    ASSERT_ZERO(close(info->splice_pipe[0]));
+    ASSERT_ZERO(close(info->splice_pipe[1]));
+    info->splice_pipe[0] = info->splice_pipe[1] = -1;
+    info->splice_length = 0;
+    info->splice_full = 0;
+
+    info->transport = REDIRECTION_COPY;
+}
+
+
+static int splice_pipe_full(const struct redirection_info *info) {
+    /* A pipe polls as writable while it has a free page, which is what a
+     * splice into it needs, however much it moves. */
+    struct pollfd poll_fd;
+
+    poll_fd.fd = info->splice_pipe[1];
+    poll_fd.events = POLLOUT;
+    poll_fd.revents = 0;
+
+    return poll(&poll_fd, 1, 0) == 0;
+}
+
+
+static int flush_overdue(const struct redirection_info *info, uint64_t now) {
+    /* Holding on to data when no more can come in, or none will, would only
+     * stall us. */
+    if (buffered_space(info) == 0 || spill_length(&info->spill) > 0 ||
+            info->found_eof || !info->keep_going) {
+        return 1;
+    }
+
+    return now - info->hold_since_ns >= info->flush.latency_us * 1000ULL;
+}
+
+
+static void find_line_end(struct redirection_info *info,
+                          const struct iovec *iov, int iov_count, size_t n) {
+    /* How far into the new data each iovec starts, and how much of it was
+     * filled */
+    size_t offset[2];
+    size_t length[2];
+    int i;
+
+    offset[0] = 0;
+    length[0] = n < iov[0].iov_len ? n : iov[0].iov_len;
+    offset[1] = length[0];
+    length[1] = iov_count > 1 ? n - length[0] : 0;
+
+    for (i = 1; i >= 0; i--) {
+        const char *newline = length[i] > 0 ?
+            memrchr(iov[i].iov_base, '\n', length[i]) : NULL;
+
+        if (newline) {
+            info->line_end = info->buffer.length + offset[i] +
+                (newline - (const char *) iov[i].iov_base) + 1;
+            return;
+        }
+    }
+}
+
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    ASSERT_ZERO(clock_gettime(CLOCK_MONOTONIC, &now));
+
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+static void snapshot_render(struct redirection_info *info, uint64_t now,
+                            int final) {
+    struct screen *screen = info->screen;
+    char prefix[32];
+    size_t length;
+    int prefix_length;
+    unsigned row;
+
+    /* Periodic snapshots give the time since we started, then each row that
+     * changed, numbered from one. The last one is just like the others. */
+    if (info->snapshot_interval_ms > 0) {
+        if (!screen_any_dirty(screen)) {
+            info->snapshot_done = final;
+            return;
+        }
+
+        if (!snapshot_fits(info)) {
+            return;
+        }
+
+        prefix_length = snprintf(prefix, sizeof(prefix), "@%llu\n",
+                                 (unsigned long long)
+                                     ((now - info->snapshot_start_ns) /
+                                      1000000));
+        buffer_put(info, prefix, prefix_length);
+
+        for (row = 0; row < screen->rows && snapshot_fits(info); row++) {
+            if (!screen_row_dirty(screen, row)) {
+                continue;
+            }
+
+            prefix_length = snprintf(prefix, sizeof(prefix), "%u\t",
+                                     row + 1);
+            length = screen_render_row(screen, row, info->snapshot_row);
+
+            buffer_put(info, prefix, prefix_length);
+            buffer_put(info, info->snapshot_row, length);
+            buffer_put(info, "\n", 1);
+        }
+
+        info->snapshot_last_ns = now;
+        info->snapshot_done = final && !screen_any_dirty(screen);
+        return;
+    }
+
+    /* Otherwise, there's just the final screen, as plain lines, down to the
+     * last one with anything on it. */
+    while (info->snapshot_final_row < screen_used_rows(screen) &&
+            snapshot_fits(info)) {
+        length = screen_render_row(screen, info->snapshot_final_row++,
+                                   info->snapshot_row);
+
+        buffer_put(info, info->snapshot_row, length);
+        buffer_put(info, "\n", 1);
+    }
+
+    info->snapshot_done = info->snapshot_final_row >= screen_used_rows(screen);
+}
+
+
+static void screen_sync_size(struct redirection_info *info) {
+    unsigned size = atomic_exchange_explicit(&info->snapshot_resize, 0,
+                                             memory_order_relaxed);
+
+    if (size == 0) {
+        return;
+    }
+
+    screen_resize(info->screen, size >> 16, size & 0xffff);
+
+    free(info->snapshot_row);
+    ASSERT_NONZERO(info->snapshot_row =
+                   malloc(SCREEN_ROW_BYTES(info->screen->cols)));
+}
+
+
+static int snapshot_fits(const struct redirection_info *info) {
+    return buffered_space(info) >= SCREEN_ROW_BYTES(info->screen->cols) + 32;
+}
+
+
+static void buffer_put(struct redirection_info *info, const char *data,
+                       size_t n) {
+    struct iovec iov[2];
+    size_t first;
+
+    ring_buffer_space_iov(&info->buffer, iov);
+
+    first = n < iov[0].iov_len ? n : iov[0].iov_len;
+    memcpy(iov[0].iov_base, data, first);
+
+    if (n > first) {
+        memcpy(iov[1].iov_base, data + first, n - first);
+    }
+
+    if (info->stats) {
+        stats_read(info->stats, n);
+    }
+
+    if (info->flush.mode != FLUSH_IMMEDIATE && buffered_length(info) == 0) {
+        info->hold_since_ns = now_ns();
+    }
+
+    ring_buffer_produce(&info->buffer, n);
+
+    /* Everything rendered ends with a newline. */
+    if (info->flush.mode == FLUSH_LINE && n > 0 && data[n - 1] == '\n') {
+        info->line_end = info->buffer.length;
+    }
+}
+
+
+static void frame_put(struct redirection_info *info, size_t n) {
+    char piece[REDIRECTION_FRAME_PIECE_SIZE];
+    size_t offset, length;
+
+    length = framer_data_header(info->framer, info->id, n, now_ns(), piece);
+    buffer_put(info, piece, length);
+
+    for (offset = 0; offset < n; offset += length) {
+        length = n - offset < REDIRECTION_FRAME_PIECE ?
+            n - offset : REDIRECTION_FRAME_PIECE;
+        buffer_put(info, piece,
+                   framer_encode(info->framer, info->scratch + offset, length,
+                                 piece));
+    }
+
+    buffer_put(info, piece, framer_data_trailer(info->framer, piece));
+}
+
+
+static size_t buffered_length(const struct redirection_info *info) {
+    return info->transport == REDIRECTION_SPLICE ?
+        info->splice_length :
+        info->buffer.length + spill_length(&info->spill);
+}
+
+
+static size_t buffered_space(const struct redirection_info *info) {
+    if (info->transport == REDIRECTION_SPLICE) {
+        return info->splice_full ? 0 :
+            info->splice_capacity - info->splice_length;
+    }
+
+    return ring_buffer_space(&info->buffer);
+}
+
+
+static int read_fits_buffer(const struct redirection_info *info) {
+    if (info->backpressure == BACKPRESSURE_SPILL &&
+            spill_length(&info->spill) > 0) {
+        return 0;
+    }
+
+    if (info->framer) {
+        return framer_payload_room(info->framer, buffered_space(info)) > 0;
+    }
+
+    return buffered_space(info) > 0;
+}
+
+
+static int read_region(const struct redirection_info *info,
+                       struct iovec iov[2]) {
+    switch (info->read_target) {
+        case REDIRECTION_READ_SCRATCH:
+        case REDIRECTION_READ_FRAME:
+            iov[0].iov_base = info->scratch;
+            iov[0].iov_len = info->scratch_size;
+            return 1;
+
+        case REDIRECTION_READ_SPILL:
+            iov[0].iov_base = info->spill.data + info->spill.tail;
+            iov[0].iov_len = info->spill.capacity - info->spill.tail;
+            return 1;
+
+        case REDIRECTION_READ_BUFFER:
+            break;
+    }
+
+    return ring_buffer_space_iov(&info->buffer, iov);
+}
+
+
+static size_t backpressure_drop(struct redirection_info *info, size_t n) {
+    struct iovec iov[2];
+    const char *data = info->scratch;
+    size_t space = buffered_space(info);
+    size_t kept, first;
+
+    /* The oldest data can only go from the front of the buffer, and not
+     * while a write may still be copying it, in which case the new data has
+     * to give way instead. The scratch buffer is no bigger than the buffer,
+     * so there is always enough to drop. */
+    if (info->backpressure == BACKPRESSURE_DROP_OLDEST && space < n &&
+            !info->write_in_flight) {
+        size_t evicted = n - space;
+
+        ring_buffer_consume(&info->buffer, evicted);
+        info->line_end = info->line_end > evicted ?
+            info->line_end - evicted : 0;
+        note_dropped(info, evicted, 1);
+        space += evicted;
+    }
+
+    kept = n < space ? n : space;
+
+    /* Whatever can't fit is the newest data for drop-newest, and the oldest
+     * of what just arrived for drop-oldest. */
+    if (info->backpressure == BACKPRESSURE_DROP_OLDEST) {
+        data += n - kept;
+    }
+
+    note_dropped(info, n - kept, 0);
+
+    ring_buffer_space_iov(&info->buffer, iov);
+
+    first = kept < iov[0].iov_len ? kept : iov[0].iov_len;
+    memcpy(iov[0].iov_base, data, first);
+
+    if (kept > first) {
+        memcpy(iov[1].iov_base, data + first, kept - first);
+    }
+
+    return kept;
+}
+
+
+static void note_error(struct redirection_info *info, int fd, int error) {
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "%d: Error on fd %d: %s.\n", info->id, fd,
+            strerror(error));
+#endif
+
+    if (info->error == 0) {
+        info->error = error;
+        info->error_fd = fd;
+    }
+}
+
+
+static void output_gone(struct redirection_info *info) {
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "%d: Hangup on fd %d.\n", info->id, info->out_fd);
+#endif
+
+    info->out_hangup = 1;
+    info->keep_going = 0;
+
+    if (info->buffer.data) {
+        ring_buffer_clear(&info->buffer);
+    }
+
+    spill_consume(&info->spill, spill_length(&info->spill));
+    info->splice_length = 0;
+    info->splice_full = 0;
+    info->line_end = 0;
+}
+
+
+static void note_dropped(struct redirection_info *info, size_t n,
+                         int was_read) {
+    if (n == 0) {
+        return;
+    }
+
+    info->dropped += n;
+
+    if (info->stats) {
+        stats_dropped(info->stats, n, was_read);
+    }
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "%d: Dropped %zu bytes.\n", info->id, n);
+#endif
+}
+
+
+static ssize_t fill_buffer(struct redirection_info *info) {
+    struct iovec iov[2];
+    int iov_count;
+
+#ifdef HAVE_SPLICE
+    if (info->transport == REDIRECTION_SPLICE) {
+        info->read_asked = buffered_space(info);
+        return io_splice(info->in_fd, info->splice_pipe[1],
+                         info->read_asked);
+    }
+#endif
+
+    iov_count = redirection_input_iov(info, iov);
+
+    return io_readv(info->in_fd, iov, iov_count);
+}
+
+
+static ssize_t drain_buffer(struct redirection_info *info) {
+    struct iovec iov[2];
+    int iov_count;
+
+#ifdef HAVE_SPLICE
+    if (info->transport == REDIRECTION_SPLICE) {
+        return io_splice(info->splice_pipe[0], info->out_fd,
+                         info->splice_length);
+    }
+#endif
+
+    if (info->sink) {
+        return redirection_sink_write(info);
+    }
+
+    iov_count = redirection_output_iov(info, iov);
+
+    return io_writev(info->out_fd, iov, iov_count, info->out_blocking);
+}
+
+
+#if !defined(_XOPEN_STREAMS) || _XOPEN_STREAMS == -1
+/* Check if a file descriptor is actually a stream. If the OS doesn't support
+ * the STREAMS extension, this cannot be so. In that case, we define this
+ * function to always be false. */
+static int isastream(int fd) {
+    return 0;
+}
+#endif
@@ -0,0 +1,362 @@
+/* redirect.h
+ *
+ * The copy state for one direction of traffic through the PTY, e.g. from our
+ * standard input to the master PTY, or from the master PTY to our standard
+ * output. The state is driven by poll-style readiness events, so the same code
+ * serves both the per-direction threads and the single-threaded event loop.
+ */
+
+#ifndef REDIRECT_H_INCLUDED
+#define REDIRECT_H_INCLUDED
+
+#include <poll.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "backpressure_policy.h"
+#include "file_sink.h"
+#include "flush_policy.h"
+#include "framing.h"
+#include "read_pace.h"
+#include "record.h"
+#include "ring_buffer.h"
+#include "screen.h"
+#include "spill.h"
+#include "stats.h"
+#include "sync_policy.h"
+#include "text_filter.h"
+
+/* Identifiers for the directions of traffic. These double as the id field of
+ * struct redirection_info, which is what shows up in debugging output.
+ * REDIRECTION_ERROR is only there when the command's standard error has a
+ * channel of its own. */
+#define REDIRECTION_INPUT  0
+#define REDIRECTION_OUTPUT 1
+#define REDIRECTION_ERROR  2
+#define REDIRECTION_MAX_DIRECTIONS 3
+
+/* The default and allowed sizes of the buffer for each direction */
+#define REDIRECTION_DEFAULT_BUFFER_SIZE (64 * 1024)
+#define REDIRECTION_MIN_BUFFER_SIZE     (4 * 1024)
+#define REDIRECTION_MAX_BUFFER_SIZE     (1024 * 1024 * 1024)
+
+/* The longest wait between periodic snapshots, in milliseconds */
+#define REDIRECTION_MAX_SNAPSHOT_INTERVAL_MS (60 * 60 * 1000)
+
+/* The tunable settings for one direction */
+struct redirection_config {
+    /* How much data may be read ahead of what has been written */
+    size_t buffer_size;
+
+    /* When to flush what we write to out_fd */
+    struct sync_policy sync;
+
+    /* When to write out what we have read. Holding data back for a line
+     * needs to see it, so FLUSH_LINE rules out zero_copy. */
+    struct flush_policy flush;
+
+    /* What to do when the buffer is full. Anything but BACKPRESSURE_BLOCK
+     * makes out_fd nonblocking while the direction lasts, and rules out
+     * zero_copy. */
+    struct backpressure_policy backpressure;
+
+    /* What to filter out of the data on its way through, as a mask of
+     * TEXT_FILTER_* flags, or zero to pass it on untouched. Filtering rules
+     * out zero_copy. */
+    unsigned filter;
+
+    /* Nonzero to feed what is read through a model of a screen this size,
+     * and write out the text on it rather than the data itself: the rows
+     * that changed every snapshot_interval_ms if that isn't zero, and the
+     * whole screen at the end if it is. This rules out zero_copy. */
+    int snapshot;
+    unsigned snapshot_interval_ms;
+    unsigned snapshot_rows;
+    unsigned snapshot_cols;
+
+    /* Nonzero to allow moving data in the kernel with splice(), or writing
+     * it straight out of a mapping of in_fd, when the file descriptors allow
+     * it. Anything that needs to see the data itself has to turn this
+     * off. */
+    int zero_copy;
+
+    /* Where to get the copy buffer from, or NULL to allocate it on its
+     * own */
+    struct buffer_pool *pool;
+
+    /* Where to log a copy of everything read, or NULL. Recording needs to
+     * see the data, so it rules out zero_copy. */
+    struct recorder *recorder;
+
+    /* Where to copy what would be written to out_fd, instead of writing
+     * it, or NULL. out_fd should be the sink's fd, which is still polled
+     * and synced. This rules out zero_copy. */
+    struct file_sink *sink;
+
+    /* How to frame what is written, or NULL to write it as it is read.
+     * Framing needs to see the data, so it rules out zero_copy, and it
+     * doesn't go with a screen, FLUSH_LINE or a backpressure policy other
+     * than BACKPRESSURE_BLOCK. */
+    struct framer *framer;
+
+    /* Where to count what this direction does, or NULL */
+    struct redirection_stats *stats;
+};
+
+/* The ways a direction can move data from in_fd to out_fd */
+enum redirection_transport {
+    /* read() into a ring buffer, then write() it out */
+    REDIRECTION_COPY,
+
+    /* splice() into a pipe, then splice() out of it, so the data never
+     * passes through user space */
+    REDIRECTION_SPLICE,
+
+    /* write() straight out of a mapping of in_fd, a regular file, which
+     * takes the place of the ring buffer's memory, so the file is never
+     * read at all */
+    REDIRECTION_MAP
+};
+
+/* Where a read went, under a backpressure policy */
+enum redirection_read_target {
+    /* Into the free space in the buffer, as usual */
+    REDIRECTION_READ_BUFFER,
+
+    /* Into the scratch buffer, because the buffer was full, to be dropped
+     * or to make room for */
+    REDIRECTION_READ_SCRATCH,
+
+    /* Onto the end of the spill file */
+    REDIRECTION_READ_SPILL,
+
+    /* Into the scratch buffer, to be framed into the buffer */
+    REDIRECTION_READ_FRAME
+};
+
+struct redirection_info {
+    int id;
+    int in_fd;
+    int out_fd;
+    int send_eot;
+    int end_all;
+
+    /* Nonzero to carry on to in_fd's own end of file when another direction
+     * ends everything, so nothing already on its way is lost. Off unless
+     * the caller sets it after redirection_init. */
+    int wait_eof;
+
+    /* Copy state, managed by the redirection_* functions below. */
+    int keep_going;
+    int found_eof;
+    int out_hangup;
+
+    /* The first error that ended the direction, as an errno value, and the
+     * fd it was on, or zero if there hasn't been one. A hangup on out_fd
+     * isn't an error; it is just how output normally ends. */
+    int error;
+    int error_fd;
+
+    /* Nonzero if writes to out_fd block, so that a short write is worth
+     * finishing straight away */
+    int out_blocking;
+
+    /* Nonzero if out_fd is a terminal, which has its own ways of going
+     * away */
+    int out_tty;
+
+    /* How much to read at a time, how much the last read asked for, and
+     * whether in_fd is nonblocking, so that we can read it until it runs dry
+     * while the input is sustained */
+    struct read_pace pace;
+    size_t read_asked;
+    int in_nonblocking;
+
+    enum redirection_transport transport;
+
+    /* Data read from in_fd but not yet written to out_fd. Reading carries on
+     * while there is space, so a slow writer doesn't stall the reader until
+     * the buffer fills. With REDIRECTION_SPLICE the data waits in the pipe
+     * instead, and we just keep count. With REDIRECTION_MAP the whole file
+     * is already in the buffer, and the end of file found, from the
+     * start. */
+    struct ring_buffer buffer;
+    int splice_pipe[2];
+    size_t splice_capacity;
+    size_t splice_length;
+
+    /* Set once a splice into the pipe found it full, and cleared when one
+     * out of it makes room. Every splice in takes a whole page of the pipe,
+     * however little it moves, so the pipe can fill long before
+     * splice_length reaches splice_capacity. */
+    int splice_full;
+
+    /* When to flush what we write to out_fd */
+    struct syncer syncer;
+
+    /* What to do when the buffer is full, and where the last read went.
+     * Reads that find the buffer full go to scratch, and with
+     * BACKPRESSURE_SPILL, to the spill file from then until it has
+     * drained. write_in_flight is set from redirection_output_iov until
+     * redirection_output_done, so that data the kernel may still be copying
+     * isn't dropped, and write_from_spill says which queue it came from.
+     * out_nonblock is set if we made out_fd nonblocking, and should put it
+     * back. dropped counts the bytes thrown away. */
+    enum backpressure_mode backpressure;
+    char *scratch;
+    size_t scratch_size;
+    struct spill spill;
+    enum redirection_read_target read_target;
+    int write_in_flight;
+    int write_from_spill;
+    int out_nonblock;
+    unsigned long long dropped;
+
+    /* When to write out what we have read, when the buffer last went from
+     * empty to not, and with FLUSH_LINE, how much of the buffer is complete
+     * lines */
+    struct flush_policy flush;
+    uint64_t hold_since_ns;
+    size_t line_end;
+
+    /* What to filter out of the data as it is read */
+    struct text_filter filter;
+
+    /* Where writes go instead of out_fd, or NULL */
+    struct file_sink *sink;
+
+    /* How to frame the data as it is read, or NULL. Framed data is read
+     * into scratch, and framed from there into the buffer. */
+    struct framer *framer;
+
+    /* The screen model for snapshots, or NULL, with a buffer for rendering
+     * a row of it. The times are when the direction started and when the
+     * last periodic snapshot was taken. At the end, final_row is how far
+     * the last snapshot has got, and snapshot_done is set once it is all in
+     * the buffer. */
+    struct screen *screen;
+    char *snapshot_row;
+    unsigned snapshot_interval_ms;
+    uint64_t snapshot_start_ns;
+    uint64_t snapshot_last_ns;
+    unsigned snapshot_final_row;
+    int snapshot_done;
+
+    /* A new size for the screen from redirection_resize, as rows in the
+     * high 16 bits and columns in the low 16, or zero if there isn't one */
+    atomic_uint snapshot_resize;
+
+    /* Where to log what we read, or NULL */
+    struct recorder *recorder;
+
+    /* Where to count what we do, or NULL */
+    struct redirection_stats *stats;
+};
+
+/* Set up the copy state for one direction. The buffer is allocated here and
+ * released by redirection_destroy. */
+void redirection_init(struct redirection_info *info, int id, int in_fd,
+                      int out_fd, int send_eot, int end_all,
+                      const struct redirection_config *config);
+
+/* Fill in the default settings. */
+void redirection_config_init(struct redirection_config *config);
+
+/* Release the resources held by a direction, doing any final sync. */
+void redirection_destroy(struct redirection_info *info);
+
+/* Fill in the pollfd fields, fd and events, for the input and output side of
+ * a direction. A side we are not interested in has its fd set to -1 so it
+ * isn't polled at all. */
+void redirection_poll_setup(const struct redirection_info *info,
+                            int *in_fd, short *in_events,
+                            int *out_fd, short *out_events);
+
+/* Act on the revents reported by poll for the input and output side of a
+ * direction. */
+void redirection_handle(struct redirection_info *info, short in_revents,
+                        short out_revents);
+
+/* Do any work that comes due with time rather than with I/O, such as
+ * writing out a screen snapshot. Call this before setting up each wait. */
+void redirection_prepare(struct redirection_info *info);
+
+/* Tell the direction its input's terminal has changed size, so the screen
+ * model for snapshots should too. This may be called from any thread. */
+void redirection_resize(struct redirection_info *info, unsigned rows,
+                        unsigned cols);
+
+/* The number of nanoseconds until data held back by the flush policy is due
+ * to be written, or a snapshot is due, or -1 if there's nothing to wait for.
+ * Whoever waits for the direction must wake up by then, and call
+ * redirection_prepare, though it may find another read has made the data
+ * due sooner. */
+int64_t redirection_timeout(const struct redirection_info *info);
+
+/* Like poll(), but the timeout is in nanoseconds, or -1 to wait forever, so
+ * that short flush latencies aren't rounded up to whole milliseconds. */
+int redirection_poll(struct pollfd *fds, nfds_t n_fds, int64_t timeout_ns);
+
+/* The functions below are for backends that do the reads and writes
+ * themselves and report the results, such as io_uring, rather than waiting
+ * for readiness. They only support REDIRECTION_COPY and REDIRECTION_MAP.
+ * Results are byte counts, or negated errno values on failure. */
+
+/* Nonzero if the direction wants to read from in_fd. */
+int redirection_wants_input(const struct redirection_info *info);
+
+/* Nonzero if the direction has data to write to out_fd, and the flush policy
+ * says it is time to write it. */
+int redirection_wants_output(const struct redirection_info *info);
+
+/* Nonzero if all the data is written and only the end of file remains to be
+ * passed on. */
+int redirection_wants_eof(const struct redirection_info *info);
+
+/* Describe where the next read should go, as up to two iovecs. Only one
+ * read may be in flight at a time. */
+int redirection_input_iov(struct redirection_info *info, struct iovec iov[2]);
+
+/* Describe what the next write should send, as up to two iovecs. Only one
+ * write may be in flight at a time. */
+int redirection_output_iov(struct redirection_info *info,
+                           struct iovec iov[2]);
+
+/* Account for a finished read into the region from redirection_input_iov. */
+void redirection_input_done(struct redirection_info *info, ssize_t result);
+
+/* Account for a finished write of data from redirection_output_iov. */
+void redirection_output_done(struct redirection_info *info, ssize_t result);
+
+/* With a sink, copy what redirection_output_iov offers into it, which never
+ * blocks, so there's nothing to queue. Returns the result to pass to
+ * redirection_output_done. */
+ssize_t redirection_sink_write(struct redirection_info *info);
+
+/* Pass on the end of file to out_fd, which finishes the direction. Returns
+ * 0 once that's done, or -EAGAIN if out_fd can't take it yet, in which case
+ * try again once it is writable. */
+int redirection_send_eof(struct redirection_info *info);
+
+/* The first error that a direction hit, reading, writing or syncing, as an
+ * errno value, or zero if there wasn't one. *FD is set to the fd it was
+ * on. This still works after redirection_destroy, which may be when a final
+ * sync fails. */
+int redirection_error(const struct redirection_info *info, int *fd);
+
+/* Nonzero while the direction still has work to do. */
+int redirection_active(const struct redirection_info *info);
+
+/* Ask a direction to wind down. Anything already read is still written out,
+ * but no more input is read. */
+void redirection_stop(struct redirection_info *info);
+
+/* Wind down every direction after one with end_all set has finished, except
+ * those with wait_eof set. */
+void redirection_end_all(struct redirection_info *infos, size_t n_infos);
+
+#endif /* REDIRECT_H_INCLUDED */
@@ -0,0 +1,118 @@
+/* remote.c
+ *
+ * Run a command in a terminator server. See remote.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "my_assert.h"
+#include "protocol.h"
+#include "remote.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+
+extern char **environ;
+
+
+int remote_run(const char *path, char **argv) {
+    struct sockaddr_un address;
+    struct protocol_message message;
+    int fds[PROTOCOL_MAX_FDS] = { STDOUT_FILENO, STDIN_FILENO };
+    int received_fds[PROTOCOL_MAX_FDS];
+    size_t n_received_fds = 0;
+    const char *record;
+    size_t offset = 0;
+    char cwd[PATH_MAX];
+    char **p;
+    int sock;
+
+    /* The exit status with which we will exit. If the server never tells us
+     * how the command went, something went wrong and we should exit with
+     * failure. */
+    int exitstatus = EXIT_FAILURE;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    ASSERT_WITH_MESSAGE(strlen(path) < sizeof(address.sun_path),
+                        "Socket path is too long");
+    strcpy(address.sun_path, path);
+
+    ASSERT_NONNEG(sock = socket(AF_UNIX, SOCK_STREAM, 0));
+    ASSERT_ZERO(connect(sock, (struct sockaddr *) &address, sizeof(address)));
+
+    protocol_message_init(&message);
+
+    for (p = argv; *p; p++) {
+        protocol_put(&message, "arg", *p);
+    }
+
+    for (p = environ; *p; p++) {
+        protocol_put(&message, "env", *p);
+    }
+
+    /* If we can't tell where we are, the server's directory will have to
+     * do. */
+    if (getcwd(cwd, sizeof(cwd))) {
+        protocol_put(&message, "cwd", cwd);
+    }
+
+    protocol_finish(&message);
+
+    ASSERT_ZERO(protocol_send(sock, &message, fds, PROTOCOL_MAX_FDS));
+    protocol_message_destroy(&message);
+
+    /* The reply only comes once the command has exited, so this is where we
+     * wait. */
+    while (!protocol_complete(&message)) {
+        ssize_t n = protocol_receive(sock, &message, received_fds,
+                                     &n_received_fds);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        ASSERT_NONNEG(n);
+        ASSERT_WITH_MESSAGE(n > 0, "The server closed the connection");
+    }
+
+    /* We don't expect descriptors back, but don't leak any that come. */
+    while (n_received_fds > 0) {
+        ASSERT_ZERO(close(received_fds[--n_received_fds]));
+    }
+
+    while ((record = protocol_next(&message, &offset)) != NULL) {
+        const char *value;
+
+        if ((value = protocol_value(record, "status")) != NULL) {
+            int status = atoi(value);
+
+            /* Check if the command exited safely, and if so, capture its exit
+             * status. */
+            if (WIFEXITED(status)) {
+                exitstatus = WEXITSTATUS(status);
+            }
+        }
+        else if ((value = protocol_value(record, "error")) != NULL) {
+            fprintf(stderr, "%s: %s\n", ASSERT_PROGRAM_NAME, value);
+        }
+    }
+
+    protocol_message_destroy(&message);
+    ASSERT_ZERO(close(sock));
+
+    return exitstatus;
+}
@@ -0,0 +1,16 @@
+/* remote.h
+ *
+ * Run a command in a terminator server rather than in this process. The
+ * command gets our working directory, environment, standard input and
+ * standard output, so it behaves just as if we had run it ourselves.
+ */
+
+#ifndef REMOTE_H_INCLUDED
+#define REMOTE_H_INCLUDED
+
+/* Ask the server listening on the Unix socket at PATH to run the command in
+ * ARGV, terminated by NULL, and wait for it to finish. Returns the exit
+ * status to exit with, as for a command we ran ourselves. */
+int remote_run(const char *path, char **argv);
+
+#endif /* REMOTE_H_INCLUDED */
@@ -0,0 +1,712 @@
+/* replay.c
+ *
+ * Play a --record capture back, for terminator-replay: one stream of the
+ * recorded data, at the pace it was recorded or as fast as it will go,
+ * through the same output path terminator copies a command's output with.
+ * Filtering, snapshots, framing, the flush, sync and backpressure policies,
+ * --output-file and --stats all apply as they would have, so any stage can
+ * be measured on real traffic without running the command again.
+ *
+ * A thread of its own reads the capture and writes the data into a pipe,
+ * waiting for each record's time to come unless asked not to, and the
+ * output direction copies from the other end of the pipe just as it would
+ * from the PTY.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "backpressure_policy.h"
+#include "buffer_pool.h"
+#include "file_sink.h"
+#include "flush_policy.h"
+#include "framing.h"
+#include "io_result.h"
+#include "my_assert.h"
+#include "parse.h"
+#include "record_format.h"
+#include "record_reader.h"
+#include "redirect.h"
+#include "screen.h"
+#include "stats.h"
+#include "sync_policy.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator-replay"
+
+/* The latest --start-at, in milliseconds: thirty days */
+#define REPLAY_MAX_START_MS (30UL * 24 * 60 * 60 * 1000)
+
+
+/* The settings given on the command line */
+struct replay_options {
+    /* The capture to play */
+    const char *capture_path;
+
+    /* Which stream of the capture to play: REDIRECTION_OUTPUT,
+     * REDIRECTION_ERROR or REDIRECTION_INPUT */
+    int stream;
+
+    /* Nonzero to play the data as fast as the output takes it, rather than
+     * when it was recorded */
+    int fast;
+
+    /* Where in the capture to start, in nanoseconds */
+    uint64_t start_at_ns;
+
+    /* Nonzero to report how long the replay took on standard error */
+    int verbose;
+
+    int huge_pages;
+    const char *stats_path;
+    enum framing_mode framing;
+    const char *output_path;
+    struct file_sink_rotation rotation;
+
+    /* The settings for the output direction */
+    struct redirection_config output;
+};
+
+/* What the thread playing the capture needs, and what it found */
+struct replay_feeder {
+    struct record_reader *reader;
+    int stream;
+    int fast;
+    uint64_t start_at_ns;
+
+    /* The write end of the pipe to the output direction */
+    int fd;
+
+    /* The direction to resize as the capture's terminal size changes, or
+     * NULL if it has no screen */
+    struct redirection_info *screen_info;
+
+    pthread_t thread;
+
+    /* Set by the thread: the data played, the bytes the capture says it
+     * lost from the stream, and whether the command's exit was recorded,
+     * with its wait status */
+    unsigned long long records;
+    unsigned long long bytes;
+    unsigned long long missing;
+    int exited;
+    int status;
+};
+
+/* Parse the command line options into OPTIONS. */
+static void parse_options(int argc, char **argv,
+                          struct replay_options *options);
+
+/* Print a usage message to FP. */
+static void print_usage(FILE *fp);
+
+/* Find the terminal size the capture starts with, and put it in ROWS and
+ * COLS, or leave them alone if it doesn't give one before the first data.
+ * This leaves READER back at the start. */
+static void initial_size(struct record_reader *reader, unsigned *rows,
+                         unsigned *cols);
+
+/* Body of the thread playing the capture, given a struct replay_feeder. */
+static void *feeder_thread_fn(void *arg);
+
+/* Wait until the monotonic time DUE. Returns 0 then, or -1 if the output
+ * direction has closed its end of the pipe first. */
+static int wait_until(const struct replay_feeder *feeder, uint64_t due);
+
+/* Write all N bytes at DATA into the pipe. Returns 0, or -1 if the output
+ * direction has closed its end. */
+static int write_all(int fd, const unsigned char *data, size_t n);
+
+/* The current monotonic time in nanoseconds. */
+static uint64_t now_ns(void);
+
+
+int main(int argc, char **argv) {
+    struct replay_options options;
+    struct record_reader reader;
+    struct replay_feeder feeder;
+    struct redirection_info info;
+    struct buffer_pool pool;
+    struct redirection_stats stats[REDIRECTION_MAX_DIRECTIONS];
+    struct stats_reporter reporter;
+    struct framer framer;
+    struct file_sink sink;
+    int output_fd = STDOUT_FILENO;
+    int exitstatus = EXIT_SUCCESS;
+    int pipe_fds[2];
+    struct pollfd poll_fds[2];
+    uint64_t start;
+    uint64_t elapsed;
+    int error_fd;
+    int error;
+    size_t i;
+
+    parse_options(argc, argv, &options);
+
+    record_reader_open(&reader, options.capture_path);
+
+    /* The screen has to start the size the command thought its terminal
+     * was, as terminator's did. */
+    if (options.output.snapshot) {
+        options.output.snapshot_rows = SCREEN_DEFAULT_ROWS;
+        options.output.snapshot_cols = SCREEN_DEFAULT_COLS;
+        initial_size(&reader, &options.output.snapshot_rows,
+                     &options.output.snapshot_cols);
+    }
+
+    if (options.start_at_ns > 0 &&
+            record_reader_seek(&reader, options.start_at_ns) < 0) {
+        fprintf(stderr, "%s: The capture has no index, so it is read from "
+                "the start up to --start-at\n", ASSERT_PROGRAM_NAME);
+    }
+
+    /* When whatever reads our output goes away, the output direction sees
+     * a hangup, and the feeder a closed pipe; neither should kill us. */
+    ASSERT(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
+
+    ASSERT_ZERO(pipe2(pipe_fds, O_CLOEXEC));
+
+    if (options.framing != FRAMING_RAW) {
+        framer_init(&framer, options.framing);
+        options.output.framer = &framer;
+    }
+
+    if (options.output_path) {
+        file_sink_open(&sink, options.output_path, &options.rotation);
+        options.output.sink = &sink;
+        output_fd = sink.fd;
+    }
+
+    buffer_pool_init(&pool, options.output.buffer_size, options.huge_pages);
+    options.output.pool = &pool;
+
+    if (options.stats_path) {
+        for (i = 0; i < REDIRECTION_MAX_DIRECTIONS; i++) {
+            stats_init(&stats[i]);
+        }
+
+        options.output.stats = &stats[options.stream];
+        stats_reporter_start(&reporter, options.stats_path, stats,
+                             options.stream + 1, &pool, NULL);
+    }
+
+    /* The direction is numbered after the stream, so frames say where the
+     * data came from. */
+    redirection_init(&info, options.stream, pipe_fds[0], output_fd, 0, 1,
+                     &options.output);
+
+    feeder.reader = &reader;
+    feeder.stream = options.stream;
+    feeder.fast = options.fast;
+    feeder.start_at_ns = options.start_at_ns;
+    feeder.fd = pipe_fds[1];
+    feeder.screen_info = options.output.snapshot ? &info : NULL;
+
+    start = now_ns();
+    ASSERT_ZERO(pthread_create(&feeder.thread, NULL, &feeder_thread_fn,
+                               &feeder));
+
+    for (;;) {
+        redirection_prepare(&info);
+
+        if (!redirection_active(&info)) {
+            break;
+        }
+
+        redirection_poll_setup(&info, &poll_fds[0].fd, &poll_fds[0].events,
+                               &poll_fds[1].fd, &poll_fds[1].events);
+
+        if (redirection_poll(poll_fds, 2, redirection_timeout(&info)) < 0) {
+            ASSERT(errno == EINTR);
+            continue;
+        }
+
+        redirection_handle(&info, poll_fds[0].revents, poll_fds[1].revents);
+    }
+
+    elapsed = now_ns() - start;
+
+    /* If our output went away first, this is what stops the feeder. */
+    ASSERT_ZERO(close(pipe_fds[0]));
+    ASSERT_ZERO(pthread_join(feeder.thread, NULL));
+
+    redirection_destroy(&info);
+
+    if (info.dropped > 0) {
+        fprintf(stderr, "%s: Dropped %llu bytes of output\n",
+                ASSERT_PROGRAM_NAME, info.dropped);
+    }
+
+    if ((error = redirection_error(&info, &error_fd)) != 0) {
+        fprintf(stderr, "%s: Error on fd %d: %s\n", ASSERT_PROGRAM_NAME,
+                error_fd, strerror(error));
+        exitstatus = EXIT_FAILURE;
+    }
+
+    /* The exit status comes last, as terminator would have written it,
+     * unless the capture doesn't have it or our output has already
+     * gone. */
+    if (options.framing != FRAMING_RAW && feeder.exited && !info.out_hangup) {
+        char frame[FRAMING_MAX_OVERHEAD];
+        struct iovec iov;
+        ssize_t result;
+
+        iov.iov_base = frame;
+        iov.iov_len = framer_exit_frame(&framer, options.stream,
+                                        feeder.status,
+                                        WIFEXITED(feeder.status) ?
+                                            WEXITSTATUS(feeder.status) :
+                                            EXIT_FAILURE,
+                                        frame);
+
+        result = options.output_path ? file_sink_writev(&sink, &iov, 1) :
+            io_writev(STDOUT_FILENO, &iov, 1, 1);
+
+        if (result < 0 && io_classify(result) != IO_HANGUP) {
+            fprintf(stderr, "%s: Error on fd %d: %s\n", ASSERT_PROGRAM_NAME,
+                    output_fd, strerror(-result));
+            exitstatus = EXIT_FAILURE;
+        }
+    }
+
+    if (options.output_path) {
+        int result = file_sink_close(&sink);
+
+        if (result < 0) {
+            fprintf(stderr, "%s: Error on fd %d: %s\n", ASSERT_PROGRAM_NAME,
+                    output_fd, strerror(-result));
+            exitstatus = EXIT_FAILURE;
+        }
+    }
+
+    if (options.stats_path) {
+        stats_reporter_finish(&reporter, NULL);
+    }
+
+    buffer_pool_destroy(&pool);
+
+    /* A capture that ends early still plays, since it may just be one that
+     * is still being written, but it shouldn't pass for a whole one. */
+    if (reader.damaged) {
+        fprintf(stderr, "%s: The capture ends early, or is damaged part "
+                "way through\n", ASSERT_PROGRAM_NAME);
+    }
+
+    if (feeder.missing > 0) {
+        fprintf(stderr, "%s: The capture is missing %llu bytes that the "
+                "recorder couldn't keep up with\n", ASSERT_PROGRAM_NAME,
+                feeder.missing);
+    }
+
+    if (options.verbose) {
+        fprintf(stderr, "%s: Played %llu bytes in %llu records in %.3f s, "
+                "%.1f MiB/s\n", ASSERT_PROGRAM_NAME, feeder.bytes,
+                feeder.records, elapsed / 1e9,
+                elapsed ? feeder.bytes / (elapsed / 1e9) / (1024 * 1024) :
+                          0.0);
+    }
+
+    record_reader_close(&reader);
+
+    return exitstatus;
+}
+
+
+static void parse_options(int argc, char **argv,
+                          struct replay_options *options) {
+    static const struct option long_options[] = {
+        { "buffer-size", required_argument, NULL, 'b' },
+        { "fast",        no_argument,       NULL, 'n' },
+        { "flush",       required_argument, NULL, 'f' },
+        { "framing",     required_argument, NULL, 'F' },
+        { "help",        no_argument,       NULL, 'h' },
+        { "huge-pages",  no_argument,       NULL, 'H' },
+        { "normalize-crlf", no_argument,    NULL, 'N' },
+        { "on-backpressure", required_argument, NULL, 'D' },
+        { "output-file", required_argument, NULL, 'W' },
+        { "rotate",      required_argument, NULL, 'L' },
+        { "snapshot",    no_argument,       NULL, 'P' },
+        { "snapshot-interval", required_argument, NULL, 'i' },
+        { "start-at",    required_argument, NULL, 'a' },
+        { "stats",       required_argument, NULL, 'T' },
+        { "stream",      required_argument, NULL, 'd' },
+        { "strip-ansi",  no_argument,       NULL, 'A' },
+        { "sync",        required_argument, NULL, 's' },
+        { "verbose",     no_argument,       NULL, 'v' },
+        { NULL,          0,                 NULL, 0   }
+    };
+
+    int opt;
+    unsigned long interval_ms;
+    unsigned long start_ms;
+
+    options->stream = REDIRECTION_OUTPUT;
+    options->fast = 0;
+    options->start_at_ns = 0;
+    options->verbose = 0;
+    options->huge_pages = 0;
+    options->stats_path = NULL;
+    options->framing = FRAMING_RAW;
+    options->output_path = NULL;
+    options->rotation.bytes = 0;
+    options->rotation.interval_ms = 0;
+
+    /* The same defaults as terminator's output, splice and all. */
+    redirection_config_init(&options->output);
+    options->output.zero_copy = 1;
+
+    while ((opt = getopt_long(argc, argv, "Aa:b:D:d:F:f:Hhi:L:NnPs:T:vW:",
+                              long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'A':
+                options->output.filter |= TEXT_FILTER_STRIP_ANSI;
+                break;
+
+            case 'a':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    parse_unsigned(optarg, 0, REPLAY_MAX_START_MS,
+                                   &start_ms),
+                    "Invalid start time"
+                );
+                options->start_at_ns = start_ms * 1000000ULL;
+                break;
+
+            case 'b':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    parse_size(optarg, REDIRECTION_MIN_BUFFER_SIZE,
+                               REDIRECTION_MAX_BUFFER_SIZE,
+                               &options->output.buffer_size),
+                    "Invalid buffer size"
+                );
+                break;
+
+            case 'D':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    backpressure_policy_parse(optarg,
+                                              &options->output.backpressure),
+                    "Invalid backpressure policy"
+                );
+                break;
+
+            case 'd':
+                if (strcmp(optarg, "output") == 0) {
+                    options->stream = REDIRECTION_OUTPUT;
+                }
+                else if (strcmp(optarg, "error") == 0) {
+                    options->stream = REDIRECTION_ERROR;
+                }
+                else {
+                    ASSERT_WITH_MESSAGE(strcmp(optarg, "input") == 0,
+                                        "Invalid stream");
+                    options->stream = REDIRECTION_INPUT;
+                }
+                break;
+
+            case 'F':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    framing_parse(optarg, &options->framing),
+                    "Invalid framing"
+                );
+                break;
+
+            case 'f':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    flush_policy_parse(optarg, &options->output.flush),
+                    "Invalid flush policy"
+                );
+                break;
+
+            case 'H':
+                options->huge_pages = 1;
+                break;
+
+            case 'i':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    parse_unsigned(optarg, 1,
+                                   REDIRECTION_MAX_SNAPSHOT_INTERVAL_MS,
+                                   &interval_ms),
+                    "Invalid snapshot interval"
+                );
+                options->output.snapshot = 1;
+                options->output.snapshot_interval_ms = interval_ms;
+                break;
+
+            case 'L':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    file_sink_rotation_parse(optarg, &options->rotation),
+                    "Invalid rotation"
+                );
+                break;
+
+            case 'N':
+                options->output.filter |= TEXT_FILTER_NORMALIZE_CRLF;
+                break;
+
+            case 'n':
+                options->fast = 1;
+                break;
+
+            case 'P':
+                options->output.snapshot = 1;
+                break;
+
+            case 's':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    sync_policy_parse(optarg, &options->output.sync),
+                    "Invalid sync policy"
+                );
+                break;
+
+            case 'T':
+                options->stats_path = optarg;
+                break;
+
+            case 'v':
+                options->verbose = 1;
+                break;
+
+            case 'W':
+                options->output_path = optarg;
+                break;
+
+            case 'h':
+                print_usage(stdout);
+                exit(EXIT_SUCCESS);
+
+            default:
+                print_usage(stderr);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    ASSERT_WITH_MESSAGE(optind == argc - 1,
+                        "Give exactly one capture to play");
+    options->capture_path = argv[optind];
+
+    ASSERT_WITH_MESSAGE(options->output_path ||
+                        (!options->rotation.bytes &&
+                         !options->rotation.interval_ms),
+                        "--rotate only works with --output-file");
+
+    /* A frame is only written whole, so it can't hold back part of a line
+     * or be dropped part way, and a snapshot has its own layout. */
+    ASSERT_WITH_MESSAGE(!(options->framing != FRAMING_RAW &&
+                          (options->output.snapshot ||
+                           options->output.flush.mode == FLUSH_LINE ||
+                           options->output.backpressure.mode !=
+                               BACKPRESSURE_BLOCK)),
+                        "--framing doesn't work with --snapshot, --flush=line "
+                        "or --on-backpressure");
+}
+
+
+static void print_usage(FILE *fp) {
+    fprintf(fp,
+        "Usage: %s [options] capture\n"
+        "\n"
+        "Play back a capture made with terminator --record, through the\n"
+        "same output path as terminator.\n"
+        "\n"
+        "Options:\n"
+        "  -A, --strip-ansi        Remove escape sequences, such as colours and\n"
+        "                          cursor movement, from the output\n"
+        "  -a, --start-at=MS       Start MS milliseconds into the capture\n"
+        "  -b, --buffer-size=SIZE  Buffer up to SIZE bytes, with an optional\n"
+        "                          K, M or G suffix (default 64K)\n"
+        "  -D, --on-backpressure=POLICY\n"
+        "                          What to do when the output buffer is\n"
+        "                          full: block (the default), drop-oldest,\n"
+        "                          drop-newest or spill:<dir>\n"
+        "  -d, --stream=STREAM     Play the output (the default), error or\n"
+        "                          input that was recorded\n"
+        "  -F, --framing=FORMAT    Write the output as frames, as terminator\n"
+        "                          does: raw (the default, no frames),\n"
+        "                          length-prefixed or jsonl\n"
+        "  -f, --flush=POLICY      When to write the output: immediate (the\n"
+        "                          default), line, bytes:<n> or latency:<us>\n"
+        "  -H, --huge-pages        Back the buffer with huge pages where\n"
+        "                          possible\n"
+        "  -i, --snapshot-interval=MS\n"
+        "                          Like --snapshot, but also write the rows\n"
+        "                          that changed every MS milliseconds\n"
+        "  -L, --rotate=POLICY     With --output-file, start a new file at\n"
+        "                          size:<n> bytes or every interval:<ms>\n"
+        "  -N, --normalize-crlf    Turn CR LF and lone CRs in the output into LF\n"
+        "  -n, --fast              Play the capture as fast as the output\n"
+        "                          takes it, rather than at its own pace\n"
+        "  -P, --snapshot          Run the output through a model of the\n"
+        "                          screen, and write only what is on it at\n"
+        "                          the end\n"
+        "  -s, --sync=POLICY       When to fsync the output: never (the\n"
+        "                          default), interval:<ms>, eof or every-write\n"
+        "  -T, --stats=FILE        Write counters and latencies as JSON to\n"
+        "                          FILE at exit, and on SIGUSR1\n"
+        "  -v, --verbose           Report how long the replay took, and how\n"
+        "                          fast it went, on standard error\n"
+        "  -W, --output-file=FILE  Write the output to FILE through a memory\n"
+        "                          mapping, rather than to standard output\n"
+        "  -h, --help              Show this message and exit\n",
+        ASSERT_PROGRAM_NAME
+    );
+}
+
+
+static void initial_size(struct record_reader *reader, unsigned *rows,
+                         unsigned *cols) {
+    struct record_entry entry;
+
+    while (record_reader_next(reader, &entry) &&
+           entry.type != RECORD_TYPE_DATA) {
+        if (entry.type == RECORD_TYPE_WINSIZE && entry.length >= 4 &&
+                record_get_u16(entry.payload) > 0 &&
+                record_get_u16(entry.payload + 2) > 0) {
+            *rows = record_get_u16(entry.payload);
+            *cols = record_get_u16(entry.payload + 2);
+            break;
+        }
+    }
+
+    record_reader_rewind(reader);
+}
+
+
+static void *feeder_thread_fn(void *arg) {
+    struct replay_feeder *feeder = arg;
+    struct record_entry entry;
+    uint64_t start = now_ns();
+
+    feeder->records = feeder->bytes = feeder->missing = 0;
+    feeder->exited = 0;
+
+    while (record_reader_next(feeder->reader, &entry)) {
+        /* The exit is the last record, whenever it happened. */
+        if (entry.type == RECORD_TYPE_EXIT && entry.length >= 4) {
+            feeder->exited = 1;
+            feeder->status = (int) record_get_u32(entry.payload);
+            continue;
+        }
+
+        /* Before the start, only the terminal size matters, so the screen
+         * is the right size when the data starts. */
+        if (entry.timestamp < feeder->start_at_ns) {
+            if (entry.type == RECORD_TYPE_WINSIZE && feeder->screen_info &&
+                    entry.length >= 4) {
+                redirection_resize(feeder->screen_info,
+                                   record_get_u16(entry.payload),
+                                   record_get_u16(entry.payload + 2));
+            }
+
+            continue;
+        }
+
+        if (entry.type == RECORD_TYPE_GAP && entry.stream == feeder->stream &&
+                entry.length >= 8) {
+            feeder->missing += record_get_u64(entry.payload);
+            continue;
+        }
+
+        if (!(entry.type == RECORD_TYPE_DATA &&
+              entry.stream == feeder->stream) &&
+                !(entry.type == RECORD_TYPE_WINSIZE && feeder->screen_info &&
+                  entry.length >= 4)) {
+            continue;
+        }
+
+        if (!feeder->fast &&
+                wait_until(feeder, start + (entry.timestamp -
+                                            feeder->start_at_ns)) < 0) {
+            break;
+        }
+
+        if (entry.type == RECORD_TYPE_WINSIZE) {
+            redirection_resize(feeder->screen_info,
+                               record_get_u16(entry.payload),
+                               record_get_u16(entry.payload + 2));
+            continue;
+        }
+
+        if (write_all(feeder->fd, entry.payload, entry.length) < 0) {
+            break;
+        }
+
+        feeder->records++;
+        feeder->bytes += entry.length;
+    }
+
+    /* This is the end of file for the output direction. */
+    ASSERT_ZERO(close(feeder->fd));
+
+    return NULL;
+}
+
+
+static int wait_until(const struct replay_feeder *feeder, uint64_t due) {
+    struct pollfd poll_fd;
+
+    /* A pipe's write end polls as an error once the read end is closed,
+     * even with no events asked for. */
+    poll_fd.fd = feeder->fd;
+    poll_fd.events = 0;
+
+    for (;;) {
+        uint64_t now = now_ns();
+        int n;
+
+        if (now >= due) {
+            return 0;
+        }
+
+        n = redirection_poll(&poll_fd, 1, due - now);
+
+        if (n > 0) {
+            return -1;
+        }
+
+        ASSERT(n == 0 || errno == EINTR);
+    }
+}
+
+
+static int write_all(int fd, const unsigned char *data, size_t n) {
+    while (n > 0) {
+        ssize_t result = write(fd, data, n);
+
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (result < 0) {
+            ASSERT(errno == EPIPE);
+            return -1;
+        }
+
+        data += result;
+        n -= result;
+    }
+
+    return 0;
+}
+
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    ASSERT_ZERO(clock_gettime(CLOCK_MONOTONIC, &now));
+
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
@@ -0,0 +1,119 @@
+/* ring_buffer.c
+ *
+ * A fixed-size circular byte buffer. See ring_buffer.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "my_assert.h"
+#include "ring_buffer.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+
+void ring_buffer_init(struct ring_buffer *ring, size_t capacity,
+                      struct buffer_pool *pool) {
+    if (pool && capacity <= pool->slab_size) {
+        ring->data = buffer_pool_take(pool);
+        ring->pool = pool;
+    }
+    else {
+        ASSERT_NONZERO(ring->data = malloc(capacity));
+        ring->pool = NULL;
+    }
+
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->length = 0;
+}
+
+
+void ring_buffer_destroy(struct ring_buffer *ring) {
+    if (ring->pool) {
+        buffer_pool_give(ring->pool, ring->data);
+    }
+    else {
+        free(ring->data);
+    }
+
+    ring->data = NULL;
+    ring->pool = NULL;
+    ring->capacity = 0;
+    ring->head = 0;
+    ring->length = 0;
+}
+
+
+void ring_buffer_clear(struct ring_buffer *ring) {
+    ring_buffer_consume(ring, ring->length);
+}
+
+
+size_t ring_buffer_space(const struct ring_buffer *ring) {
+    return ring->capacity - ring->length;
+}
+
+
+int ring_buffer_space_iov(const struct ring_buffer *ring, struct iovec iov[2]) {
+    size_t tail = (ring->head + ring->length) % ring->capacity;
+    size_t space = ring_buffer_space(ring);
+
+    if (space == 0) {
+        return 0;
+    }
+
+    /* The free space runs from the tail to the end of the array, then wraps
+     * around to just before the head. */
+    iov[0].iov_base = ring->data + tail;
+
+    if (tail + space <= ring->capacity) {
+        iov[0].iov_len = space;
+        return 1;
+    }
+
+    iov[0].iov_len = ring->capacity - tail;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = space - iov[0].iov_len;
+
+    return 2;
+}
+
+
+int ring_buffer_data_iov(const struct ring_buffer *ring, struct iovec iov[2]) {
+    if (ring->length == 0) {
+        return 0;
+    }
+
+    iov[0].iov_base = ring->data + ring->head;
+
+    if (ring->head + ring->length <= ring->capacity) {
+        iov[0].iov_len = ring->length;
+        return 1;
+    }
+
+    iov[0].iov_len = ring->capacity - ring->head;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = ring->length - iov[0].iov_len;
+
+    return 2;
+}
+
+
+void ring_buffer_produce(struct ring_buffer *ring, size_t n) {
+    ASSERT_WITH_MESSAGE(n <= ring_buffer_space(ring), "Ring buffer overrun");
+    ring->length += n;
+}
+
+
+void ring_buffer_consume(struct ring_buffer *ring, size_t n) {
+    ASSERT_WITH_MESSAGE(n <= ring->length, "Ring buffer underrun");
+
+    /* The tail never moves here, so that a read already in flight into the
+     * free space still lands where the buffer expects it. */
+    ring->head = (ring->head + n) % ring->capacity;
+    ring->length -= n;
+}
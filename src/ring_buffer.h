@@ -0,0 +1,61 @@
+/* ring_buffer.h
+ *
+ * A fixed-size circular byte buffer. Data is added at the tail and removed
+ * from the head, and the free space and the data are each exposed as at most
+ * two iovecs, so that a single readv or writev can cross the wrap point.
+ */
+
+#ifndef RING_BUFFER_H_INCLUDED
+#define RING_BUFFER_H_INCLUDED
+
+#include <stddef.h>
+
+#include <sys/uio.h>
+
+#include "buffer_pool.h"
+
+struct ring_buffer {
+    char *data;
+    size_t capacity;
+
+    /* Where data came from, or NULL if it was allocated on its own */
+    struct buffer_pool *pool;
+
+    /* Offset of the first byte of data */
+    size_t head;
+
+    /* Number of bytes of data */
+    size_t length;
+};
+
+/* Allocate a buffer able to hold CAPACITY bytes. The memory comes from POOL
+ * if one is given and its buffers are big enough. */
+void ring_buffer_init(struct ring_buffer *ring, size_t capacity,
+                      struct buffer_pool *pool);
+
+/* Release the buffer's memory, back to its pool if it came from one. */
+void ring_buffer_destroy(struct ring_buffer *ring);
+
+/* Discard all data in the buffer. Like ring_buffer_consume, this leaves the
+ * free space where it was. */
+void ring_buffer_clear(struct ring_buffer *ring);
+
+/* The number of bytes that can still be added. */
+size_t ring_buffer_space(const struct ring_buffer *ring);
+
+/* Describe the free space as up to two iovecs, in order. Returns the number
+ * of iovecs filled in, which is zero when the buffer is full. */
+int ring_buffer_space_iov(const struct ring_buffer *ring, struct iovec iov[2]);
+
+/* Describe the data as up to two iovecs, in order. Returns the number of
+ * iovecs filled in, which is zero when the buffer is empty. */
+int ring_buffer_data_iov(const struct ring_buffer *ring, struct iovec iov[2]);
+
+/* Mark N bytes of the free space as data, after they've been filled in. */
+void ring_buffer_produce(struct ring_buffer *ring, size_t n);
+
+/* Remove N bytes of data from the head, after they've been used. The free
+ * space grows, but its start stays put. */
+void ring_buffer_consume(struct ring_buffer *ring, size_t n);
+
+#endif /* RING_BUFFER_H_INCLUDED */
@@ -0,0 +1,846 @@
+/* screen.c
+ *
+ * A small in-memory model of a VT100-style terminal screen. See screen.h for
+ * details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "my_assert.h"
+#include "screen.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* The control characters we act on */
+#define SCREEN_BEL 0x07
+#define SCREEN_BS  0x08
+#define SCREEN_HT  0x09
+#define SCREEN_LF  0x0a
+#define SCREEN_VT  0x0b
+#define SCREEN_FF  0x0c
+#define SCREEN_CR  0x0d
+#define SCREEN_CAN 0x18
+#define SCREEN_SUB 0x1a
+#define SCREEN_ESC 0x1b
+
+/* What a blank cell holds, and what stands in for malformed UTF-8 */
+#define SCREEN_BLANK       0x20
+#define SCREEN_REPLACEMENT 0xfffd
+
+/* The largest value kept for a CSI parameter */
+#define SCREEN_MAX_PARAM 65535
+
+
+/* Feed one byte that isn't part of an escape sequence. */
+static void ground_byte(struct screen *screen, unsigned char c);
+
+/* Feed one byte of an escape sequence. Returns zero if the byte wasn't used
+ * up and should be fed again in the new state. */
+static int escape_byte(struct screen *screen, unsigned char c);
+
+/* Act on a C0 control character. */
+static void control(struct screen *screen, unsigned char c);
+
+/* Act on the final byte of ESC sequence, or of a CSI sequence. */
+static void escape_final(struct screen *screen, unsigned char c);
+static void csi_final(struct screen *screen, unsigned char c);
+
+/* Put a character at the cursor and move along. */
+static void put_char(struct screen *screen, uint32_t c);
+
+/* Move down a line, scrolling at the bottom of the region, and up a line,
+ * scrolling at the top. */
+static void line_feed(struct screen *screen);
+static void reverse_line_feed(struct screen *screen);
+
+/* Scroll rows TOP to BOTTOM, inclusive, up or down by N, blanking the rows
+ * that are uncovered. */
+static void scroll_up(struct screen *screen, unsigned top, unsigned bottom,
+                      unsigned n);
+static void scroll_down(struct screen *screen, unsigned top, unsigned bottom,
+                        unsigned n);
+
+/* Blank the cells from column FROM up to but not including TO on a row. */
+static void erase(struct screen *screen, unsigned row, unsigned from,
+                  unsigned to);
+
+/* Switch to or from the alternate screen. */
+static void set_alternate(struct screen *screen, int alternate);
+
+/* Move the cursor, keeping it on the screen. */
+static void move_to(struct screen *screen, long row, long col);
+
+/* Mark a row as changed. */
+static void mark_dirty(struct screen *screen, unsigned row);
+
+/* CSI parameter I, or DEFAULT if it is missing or zero. */
+static unsigned param(const struct screen *screen, unsigned i,
+                      unsigned default_value);
+
+/* A row's cells on the active screen. */
+static uint32_t *row_cells(const struct screen *screen, unsigned row);
+
+
+void screen_init(struct screen *screen, unsigned rows, unsigned cols) {
+    size_t n_cells, i;
+
+    screen->rows = rows == 0 ? SCREEN_DEFAULT_ROWS :
+        rows > SCREEN_MAX_ROWS ? SCREEN_MAX_ROWS : rows;
+    screen->cols = cols == 0 ? SCREEN_DEFAULT_COLS :
+        cols > SCREEN_MAX_COLS ? SCREEN_MAX_COLS : cols;
+
+    n_cells = (size_t) screen->rows * screen->cols;
+
+    ASSERT_NONZERO(screen->cells = malloc(2 * n_cells *
+                                          sizeof(*screen->cells)));
+    ASSERT_NONZERO(screen->dirty = calloc((screen->rows + 63) / 64,
+                                          sizeof(*screen->dirty)));
+
+    for (i = 0; i < 2 * n_cells; i++) {
+        screen->cells[i] = SCREEN_BLANK;
+    }
+
+    screen->active = screen->cells;
+    screen->alternate = 0;
+
+    screen->row = screen->col = 0;
+    screen->wrap_pending = 0;
+    screen->saved_row = screen->saved_col = 0;
+    screen->top = 0;
+    screen->bottom = screen->rows - 1;
+
+    screen->state = SCREEN_GROUND;
+    screen->n_params = 0;
+    screen->private_params = 0;
+    screen->code_point = 0;
+    screen->utf8_remaining = 0;
+}
+
+
+void screen_destroy(struct screen *screen) {
+    free(screen->cells);
+    free(screen->dirty);
+    screen->cells = screen->active = NULL;
+    screen->dirty = NULL;
+}
+
+
+void screen_resize(struct screen *screen, unsigned rows, unsigned cols) {
+    struct screen old = *screen;
+    size_t old_cells = (size_t) old.rows * old.cols;
+    size_t new_cells;
+    unsigned shift, copy_cols, half, row;
+
+    rows = rows == 0 ? SCREEN_DEFAULT_ROWS :
+        rows > SCREEN_MAX_ROWS ? SCREEN_MAX_ROWS : rows;
+    cols = cols == 0 ? SCREEN_DEFAULT_COLS :
+        cols > SCREEN_MAX_COLS ? SCREEN_MAX_COLS : cols;
+
+    if (rows == old.rows && cols == old.cols) {
+        return;
+    }
+
+    screen_init(screen, rows, cols);
+    new_cells = (size_t) rows * cols;
+
+    /* Losing rows takes them off the top if that's what it takes to keep
+     * the cursor on the screen, as terminals do. */
+    shift = old.row >= rows ? old.row - rows + 1 : 0;
+    copy_cols = cols < old.cols ? cols : old.cols;
+
+    for (half = 0; half < 2; half++) {
+        for (row = 0; row < rows && row + shift < old.rows; row++) {
+            memcpy(screen->cells + half * new_cells + (size_t) row * cols,
+                   old.cells + half * old_cells +
+                       (size_t) (row + shift) * old.cols,
+                   copy_cols * sizeof(*screen->cells));
+        }
+    }
+
+    screen->alternate = old.alternate;
+    screen->active = screen->cells + (old.alternate ? new_cells : 0);
+
+    screen->row = old.row - shift;
+    screen->col = old.col < cols ? old.col : cols - 1;
+    screen->saved_row = old.saved_row < rows ? old.saved_row : rows - 1;
+    screen->saved_col = old.saved_col < cols ? old.saved_col : cols - 1;
+
+    /* A sequence in progress carries on where it was. */
+    screen->state = old.state;
+    memcpy(screen->params, old.params, sizeof(screen->params));
+    screen->n_params = old.n_params;
+    screen->private_params = old.private_params;
+    screen->code_point = old.code_point;
+    screen->utf8_remaining = old.utf8_remaining;
+
+    for (row = 0; row < rows; row++) {
+        mark_dirty(screen, row);
+    }
+
+    screen_destroy(&old);
+}
+
+
+void screen_feed(struct screen *screen, const unsigned char *data, size_t n) {
+    size_t i = 0;
+
+    while (i < n) {
+        if (screen->state == SCREEN_GROUND) {
+            ground_byte(screen, data[i++]);
+        }
+        else if (escape_byte(screen, data[i])) {
+            i++;
+        }
+    }
+}
+
+
+int screen_row_dirty(const struct screen *screen, unsigned row) {
+    return (screen->dirty[row / 64] >> (row % 64)) & 1;
+}
+
+
+int screen_any_dirty(const struct screen *screen) {
+    unsigned i;
+
+    for (i = 0; i < (screen->rows + 63) / 64; i++) {
+        if (screen->dirty[i]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+size_t screen_render_row(struct screen *screen, unsigned row, char *buffer) {
+    const uint32_t *cells = row_cells(screen, row);
+    unsigned length = screen->cols;
+    unsigned i;
+    char *p = buffer;
+
+    while (length > 0 && cells[length - 1] == SCREEN_BLANK) {
+        length--;
+    }
+
+    for (i = 0; i < length; i++) {
+        uint32_t c = cells[i];
+
+        if (c < 0x80) {
+            *p++ = c;
+        }
+        else if (c < 0x800) {
+            *p++ = 0xc0 | (c >> 6);
+            *p++ = 0x80 | (c & 0x3f);
+        }
+        else if (c < 0x10000) {
+            *p++ = 0xe0 | (c >> 12);
+            *p++ = 0x80 | ((c >> 6) & 0x3f);
+            *p++ = 0x80 | (c & 0x3f);
+        }
+        else {
+            *p++ = 0xf0 | (c >> 18);
+            *p++ = 0x80 | ((c >> 12) & 0x3f);
+            *p++ = 0x80 | ((c >> 6) & 0x3f);
+            *p++ = 0x80 | (c & 0x3f);
+        }
+    }
+
+    screen->dirty[row / 64] &= ~((uint64_t) 1 << (row % 64));
+
+    return p - buffer;
+}
+
+
+unsigned screen_used_rows(const struct screen *screen) {
+    unsigned rows = screen->rows;
+
+    while (rows > 0) {
+        const uint32_t *cells = row_cells(screen, rows - 1);
+        unsigned i;
+
+        for (i = 0; i < screen->cols; i++) {
+            if (cells[i] != SCREEN_BLANK) {
+                return rows;
+            }
+        }
+
+        rows--;
+    }
+
+    return 0;
+}
+
+
+static void ground_byte(struct screen *screen, unsigned char c) {
+    if (screen->utf8_remaining > 0) {
+        if ((c & 0xc0) == 0x80) {
+            screen->code_point = (screen->code_point << 6) | (c & 0x3f);
+
+            if (--screen->utf8_remaining == 0) {
+                put_char(screen, screen->code_point);
+            }
+            return;
+        }
+
+        /* The sequence was cut short. Mark the spot, and look at this byte
+         * on its own. */
+        screen->utf8_remaining = 0;
+        put_char(screen, SCREEN_REPLACEMENT);
+    }
+
+    if (c == SCREEN_ESC) {
+        screen->state = SCREEN_ESCAPE;
+    }
+    else if (c < 0x20 || c == 0x7f) {
+        control(screen, c);
+    }
+    else if (c < 0x80) {
+        put_char(screen, c);
+    }
+    else if (c >= 0xc2 && c <= 0xdf) {
+        screen->code_point = c & 0x1f;
+        screen->utf8_remaining = 1;
+    }
+    else if (c >= 0xe0 && c <= 0xef) {
+        screen->code_point = c & 0x0f;
+        screen->utf8_remaining = 2;
+    }
+    else if (c >= 0xf0 && c <= 0xf4) {
+        screen->code_point = c & 0x07;
+        screen->utf8_remaining = 3;
+    }
+    else {
+        put_char(screen, SCREEN_REPLACEMENT);
+    }
+}
+
+
+static int escape_byte(struct screen *screen, unsigned char c) {
+    /* CAN and SUB cancel any sequence. */
+    if (c == SCREEN_CAN || c == SCREEN_SUB) {
+        screen->state = SCREEN_GROUND;
+        return 1;
+    }
+
+    switch (screen->state) {
+        case SCREEN_ESCAPE:
+        case SCREEN_ESCAPE_INTERMEDIATE:
+            if (c == SCREEN_ESC) {
+                screen->state = SCREEN_ESCAPE;
+            }
+            else if (c < 0x20) {
+                /* Terminals act on control characters in the middle of a
+                 * sequence. */
+                control(screen, c);
+            }
+            else if (c < 0x30) {
+                screen->state = SCREEN_ESCAPE_INTERMEDIATE;
+            }
+            else if (screen->state == SCREEN_ESCAPE && c == '[') {
+                screen->state = SCREEN_CSI;
+                screen->n_params = 0;
+                screen->private_params = 0;
+            }
+            else if (screen->state == SCREEN_ESCAPE &&
+                     (c == ']' || c == 'P' || c == 'X' || c == '^' ||
+                      c == '_')) {
+                screen->state = SCREEN_STRING;
+            }
+            else {
+                /* Character set selections and the like, after
+                 * intermediates, don't change what's on the screen. */
+                if (screen->state == SCREEN_ESCAPE) {
+                    escape_final(screen, c);
+                }
+
+                screen->state = SCREEN_GROUND;
+            }
+            break;
+
+        case SCREEN_CSI:
+            if (c == SCREEN_ESC) {
+                screen->state = SCREEN_ESCAPE;
+            }
+            else if (c < 0x20) {
+                control(screen, c);
+            }
+            else if (c >= '0' && c <= '9') {
+                unsigned *p;
+
+                if (screen->n_params == 0) {
+                    screen->params[0] = 0;
+                    screen->n_params = 1;
+                }
+
+                p = &screen->params[screen->n_params - 1];
+                *p = *p * 10 + (c - '0');
+
+                if (*p > SCREEN_MAX_PARAM) {
+                    *p = SCREEN_MAX_PARAM;
+                }
+            }
+            else if (c == ';' || c == ':') {
+                if (screen->n_params == 0) {
+                    screen->params[0] = 0;
+                    screen->n_params = 1;
+                }
+
+                /* Anything past the last parameter we keep is dropped. */
+                if (screen->n_params < SCREEN_MAX_PARAMS) {
+                    screen->params[screen->n_params++] = 0;
+                }
+            }
+            else if (c >= '<' && c <= '?') {
+                screen->private_params = 1;
+            }
+            else if (c >= 0x40) {
+                if (c <= 0x7e) {
+                    csi_final(screen, c);
+                }
+
+                screen->state = SCREEN_GROUND;
+            }
+            break;
+
+        case SCREEN_STRING:
+            if (c == SCREEN_BEL) {
+                screen->state = SCREEN_GROUND;
+            }
+            else if (c == SCREEN_ESC) {
+                screen->state = SCREEN_STRING_ESCAPE;
+            }
+            break;
+
+        case SCREEN_STRING_ESCAPE:
+            if (c == '\\') {
+                screen->state = SCREEN_GROUND;
+                break;
+            }
+
+            screen->state = SCREEN_ESCAPE;
+            return 0;
+
+        case SCREEN_GROUND:
+            break;
+    }
+
+    return 1;
+}
+
+
+static void control(struct screen *screen, unsigned char c) {
+    switch (c) {
+        case SCREEN_BS:
+            if (screen->col > 0) {
+                screen->col--;
+            }
+            screen->wrap_pending = 0;
+            break;
+
+        case SCREEN_HT:
+            screen->col = (screen->col / 8 + 1) * 8;
+
+            if (screen->col >= screen->cols) {
+                screen->col = screen->cols - 1;
+            }
+            break;
+
+        /* The PTY is raw, so a newline doesn't become CR LF on the way out
+         * as it would on a real terminal. Do what the terminal would end up
+         * doing. */
+        case SCREEN_LF:
+        case SCREEN_VT:
+        case SCREEN_FF:
+            line_feed(screen);
+            screen->col = 0;
+            break;
+
+        case SCREEN_CR:
+            screen->col = 0;
+            screen->wrap_pending = 0;
+            break;
+    }
+}
+
+
+static void escape_final(struct screen *screen, unsigned char c) {
+    switch (c) {
+        case '7':
+            screen->saved_row = screen->row;
+            screen->saved_col = screen->col;
+            break;
+
+        case '8':
+            move_to(screen, screen->saved_row, screen->saved_col);
+            break;
+
+        case 'D':
+            line_feed(screen);
+            break;
+
+        case 'E':
+            screen->col = 0;
+            line_feed(screen);
+            break;
+
+        case 'M':
+            reverse_line_feed(screen);
+            break;
+
+        case 'c':
+            set_alternate(screen, 0);
+            scroll_up(screen, 0, screen->rows - 1, screen->rows);
+            screen->top = 0;
+            screen->bottom = screen->rows - 1;
+            move_to(screen, 0, 0);
+            break;
+    }
+}
+
+
+static void csi_final(struct screen *screen, unsigned char c) {
+    unsigned n = param(screen, 0, 1);
+    unsigned row;
+
+    if (screen->private_params) {
+        /* The only private mode that changes the text is the alternate
+         * screen. */
+        if ((c == 'h' || c == 'l') && screen->n_params > 0 &&
+                (screen->params[0] == 1049 || screen->params[0] == 1047 ||
+                 screen->params[0] == 47)) {
+            if (c == 'h' && screen->params[0] == 1049) {
+                screen->saved_row = screen->row;
+                screen->saved_col = screen->col;
+            }
+
+            set_alternate(screen, c == 'h');
+
+            if (c == 'l' && screen->params[0] == 1049) {
+                move_to(screen, screen->saved_row, screen->saved_col);
+            }
+        }
+        return;
+    }
+
+    switch (c) {
+        case 'A':
+            move_to(screen, (long) screen->row - n, screen->col);
+            break;
+
+        case 'B':
+        case 'e':
+            move_to(screen, (long) screen->row + n, screen->col);
+            break;
+
+        case 'C':
+        case 'a':
+            move_to(screen, screen->row, (long) screen->col + n);
+            break;
+
+        case 'D':
+            move_to(screen, screen->row, (long) screen->col - n);
+            break;
+
+        case 'E':
+            move_to(screen, (long) screen->row + n, 0);
+            break;
+
+        case 'F':
+            move_to(screen, (long) screen->row - n, 0);
+            break;
+
+        case 'G':
+        case '`':
+            move_to(screen, screen->row, (long) n - 1);
+            break;
+
+        case 'H':
+        case 'f':
+            move_to(screen, (long) n - 1, (long) param(screen, 1, 1) - 1);
+            break;
+
+        case 'd':
+            move_to(screen, (long) n - 1, screen->col);
+            break;
+
+        case 'J':
+            switch (screen->n_params > 0 ? screen->params[0] : 0) {
+                case 0:
+                    erase(screen, screen->row, screen->col, screen->cols);
+
+                    for (row = screen->row + 1; row < screen->rows; row++) {
+                        erase(screen, row, 0, screen->cols);
+                    }
+                    break;
+
+                case 1:
+                    for (row = 0; row < screen->row; row++) {
+                        erase(screen, row, 0, screen->cols);
+                    }
+
+                    erase(screen, screen->row, 0, screen->col + 1);
+                    break;
+
+                default:
+                    for (row = 0; row < screen->rows; row++) {
+                        erase(screen, row, 0, screen->cols);
+                    }
+                    break;
+            }
+            break;
+
+        case 'K':
+            switch (screen->n_params > 0 ? screen->params[0] : 0) {
+                case 0:
+                    erase(screen, screen->row, screen->col, screen->cols);
+                    break;
+
+                case 1:
+                    erase(screen, screen->row, 0, screen->col + 1);
+                    break;
+
+                default:
+                    erase(screen, screen->row, 0, screen->cols);
+                    break;
+            }
+            break;
+
+        case 'L':
+            if (screen->row >= screen->top && screen->row <= screen->bottom) {
+                scroll_down(screen, screen->row, screen->bottom, n);
+            }
+            break;
+
+        case 'M':
+            if (screen->row >= screen->top && screen->row <= screen->bottom) {
+                scroll_up(screen, screen->row, screen->bottom, n);
+            }
+            break;
+
+        case '@':
+            if (n > screen->cols - screen->col) {
+                n = screen->cols - screen->col;
+            }
+
+            memmove(row_cells(screen, screen->row) + screen->col + n,
+                    row_cells(screen, screen->row) + screen->col,
+                    (screen->cols - screen->col - n) *
+                        sizeof(*screen->cells));
+            erase(screen, screen->row, screen->col, screen->col + n);
+            break;
+
+        case 'P':
+            if (n > screen->cols - screen->col) {
+                n = screen->cols - screen->col;
+            }
+
+            memmove(row_cells(screen, screen->row) + screen->col,
+                    row_cells(screen, screen->row) + screen->col + n,
+                    (screen->cols - screen->col - n) *
+                        sizeof(*screen->cells));
+            erase(screen, screen->row, screen->cols - n, screen->cols);
+            break;
+
+        case 'X':
+            erase(screen, screen->row, screen->col,
+                  n > screen->cols - screen->col ?
+                      screen->cols : screen->col + n);
+            break;
+
+        case 'S':
+            scroll_up(screen, screen->top, screen->bottom, n);
+            break;
+
+        case 'T':
+            scroll_down(screen, screen->top, screen->bottom, n);
+            break;
+
+        case 'r':
+            screen->top = n - 1;
+            screen->bottom = param(screen, 1, screen->rows) - 1;
+
+            if (screen->bottom >= screen->rows) {
+                screen->bottom = screen->rows - 1;
+            }
+
+            if (screen->top >= screen->bottom) {
+                screen->top = 0;
+                screen->bottom = screen->rows - 1;
+            }
+
+            move_to(screen, 0, 0);
+            break;
+
+        case 's':
+            screen->saved_row = screen->row;
+            screen->saved_col = screen->col;
+            break;
+
+        case 'u':
+            move_to(screen, screen->saved_row, screen->saved_col);
+            break;
+    }
+}
+
+
+static void put_char(struct screen *screen, uint32_t c) {
+    if (screen->wrap_pending) {
+        screen->col = 0;
+        screen->wrap_pending = 0;
+        line_feed(screen);
+    }
+
+    row_cells(screen, screen->row)[screen->col] = c;
+    mark_dirty(screen, screen->row);
+
+    if (screen->col + 1 < screen->cols) {
+        screen->col++;
+    }
+    else {
+        screen->wrap_pending = 1;
+    }
+}
+
+
+static void line_feed(struct screen *screen) {
+    screen->wrap_pending = 0;
+
+    if (screen->row == screen->bottom) {
+        scroll_up(screen, screen->top, screen->bottom, 1);
+    }
+    else if (screen->row + 1 < screen->rows) {
+        screen->row++;
+    }
+}
+
+
+static void reverse_line_feed(struct screen *screen) {
+    screen->wrap_pending = 0;
+
+    if (screen->row == screen->top) {
+        scroll_down(screen, screen->top, screen->bottom, 1);
+    }
+    else if (screen->row > 0) {
+        screen->row--;
+    }
+}
+
+
+static void scroll_up(struct screen *screen, unsigned top, unsigned bottom,
+                      unsigned n) {
+    unsigned height = bottom - top + 1;
+    unsigned row;
+
+    if (n > height) {
+        n = height;
+    }
+
+    memmove(row_cells(screen, top), row_cells(screen, top + n),
+            (size_t) (height - n) * screen->cols * sizeof(*screen->cells));
+
+    for (row = bottom + 1 - n; row <= bottom; row++) {
+        erase(screen, row, 0, screen->cols);
+    }
+
+    for (row = top; row <= bottom; row++) {
+        mark_dirty(screen, row);
+    }
+}
+
+
+static void scroll_down(struct screen *screen, unsigned top, unsigned bottom,
+                        unsigned n) {
+    unsigned height = bottom - top + 1;
+    unsigned row;
+
+    if (n > height) {
+        n = height;
+    }
+
+    memmove(row_cells(screen, top + n), row_cells(screen, top),
+            (size_t) (height - n) * screen->cols * sizeof(*screen->cells));
+
+    for (row = top; row < top + n; row++) {
+        erase(screen, row, 0, screen->cols);
+    }
+
+    for (row = top; row <= bottom; row++) {
+        mark_dirty(screen, row);
+    }
+}
+
+
+static void erase(struct screen *screen, unsigned row, unsigned from,
+                  unsigned to) {
+    uint32_t *cells = row_cells(screen, row);
+
+    if (to > screen->cols) {
+        to = screen->cols;
+    }
+
+    for (; from < to; from++) {
+        cells[from] = SCREEN_BLANK;
+    }
+
+    mark_dirty(screen, row);
+    screen->wrap_pending = 0;
+}
+
+
+static void set_alternate(struct screen *screen, int alternate) {
+    size_t n_cells = (size_t) screen->rows * screen->cols;
+    unsigned row;
+
+    if (alternate == screen->alternate) {
+        return;
+    }
+
+    screen->alternate = alternate;
+    screen->active = screen->cells + (alternate ? n_cells : 0);
+
+    /* The alternate screen starts out blank every time. */
+    if (alternate) {
+        for (row = 0; row < screen->rows; row++) {
+            erase(screen, row, 0, screen->cols);
+        }
+    }
+
+    for (row = 0; row < screen->rows; row++) {
+        mark_dirty(screen, row);
+    }
+}
+
+
+static void move_to(struct screen *screen, long row, long col) {
+    screen->row = row < 0 ? 0 :
+        row >= (long) screen->rows ? screen->rows - 1 : (unsigned) row;
+    screen->col = col < 0 ? 0 :
+        col >= (long) screen->cols ? screen->cols - 1 : (unsigned) col;
+    screen->wrap_pending = 0;
+}
+
+
+static void mark_dirty(struct screen *screen, unsigned row) {
+    screen->dirty[row / 64] |= (uint64_t) 1 << (row % 64);
+}
+
+
+static unsigned param(const struct screen *screen, unsigned i,
+                      unsigned default_value) {
+    if (i >= screen->n_params || screen->params[i] == 0) {
+        return default_value;
+    }
+
+    return screen->params[i];
+}
+
+
+static uint32_t *row_cells(const struct screen *screen, unsigned row) {
+    return screen->active + (size_t) row * screen->cols;
+}
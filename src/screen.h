@@ -0,0 +1,117 @@
+/* screen.h
+ *
+ * A small in-memory model of a VT100-style terminal screen, for --snapshot.
+ * The command's output is fed through it, and what comes out is the text on
+ * the screen rather than the bytes that drew it, so a progress bar that
+ * repaints itself a thousand times a second costs one line.
+ *
+ * The cells are one contiguous array of code points, row after row, with a
+ * second screen's worth right after it for the alternate screen that
+ * full-screen programs switch to. Which rows have changed since they were
+ * last rendered is kept in a bitmap. Attributes such as colours are parsed
+ * and thrown away, and every character is taken to be one column wide.
+ */
+
+#ifndef SCREEN_H_INCLUDED
+#define SCREEN_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The size used when the PTY doesn't have one, and the largest we model */
+#define SCREEN_DEFAULT_ROWS 24
+#define SCREEN_DEFAULT_COLS 80
+#define SCREEN_MAX_ROWS     1000
+#define SCREEN_MAX_COLS     1000
+
+/* The most CSI parameters we keep track of */
+#define SCREEN_MAX_PARAMS 16
+
+/* The longest a rendered row can be, in bytes of UTF-8 */
+#define SCREEN_ROW_BYTES(COLS) ((size_t) (COLS) * 4)
+
+/* Where the parser is between reads */
+enum screen_state {
+    SCREEN_GROUND,
+
+    /* After ESC, and after ESC and intermediate bytes */
+    SCREEN_ESCAPE,
+    SCREEN_ESCAPE_INTERMEDIATE,
+
+    /* In a control sequence, after ESC [ */
+    SCREEN_CSI,
+
+    /* In a string such as OSC or DCS, waiting for BEL or ESC \, and after an
+     * ESC in one */
+    SCREEN_STRING,
+    SCREEN_STRING_ESCAPE
+};
+
+struct screen {
+    unsigned rows;
+    unsigned cols;
+
+    /* Both screens' cells, and the one being drawn on */
+    uint32_t *cells;
+    uint32_t *active;
+    int alternate;
+
+    /* One bit per row, set when the row changes */
+    uint64_t *dirty;
+
+    /* The cursor. After writing in the last column, the cursor stays there
+     * with wrap_pending set, and the next character goes on the next
+     * line. */
+    unsigned row;
+    unsigned col;
+    int wrap_pending;
+
+    /* Where ESC 7 or CSI s saved the cursor */
+    unsigned saved_row;
+    unsigned saved_col;
+
+    /* The scrolling region, inclusive */
+    unsigned top;
+    unsigned bottom;
+
+    /* The parser */
+    enum screen_state state;
+    unsigned params[SCREEN_MAX_PARAMS];
+    unsigned n_params;
+    int private_params;
+
+    /* A UTF-8 sequence in progress: the code point so far, and the number
+     * of continuation bytes still to come */
+    uint32_t code_point;
+    int utf8_remaining;
+};
+
+/* Set up a blank screen of the given size, clamped to the limits above, with
+ * zero meaning the default. */
+void screen_init(struct screen *screen, unsigned rows, unsigned cols);
+
+/* Release the screen's memory. */
+void screen_destroy(struct screen *screen);
+
+/* Change the size of the screen, keeping what fits, and mark every row
+ * changed. The scrolling region goes back to the whole screen. */
+void screen_resize(struct screen *screen, unsigned rows, unsigned cols);
+
+/* Act on N bytes of output from the command. */
+void screen_feed(struct screen *screen, const unsigned char *data, size_t n);
+
+/* Nonzero if the row has changed since it was last rendered. */
+int screen_row_dirty(const struct screen *screen, unsigned row);
+
+/* Nonzero if any row has changed since it was last rendered. */
+int screen_any_dirty(const struct screen *screen);
+
+/* Write the text of a row to BUFFER as UTF-8, without trailing blanks, and
+ * mark it clean. BUFFER must have room for SCREEN_ROW_BYTES(cols). Returns
+ * the number of bytes written. */
+size_t screen_render_row(struct screen *screen, unsigned row, char *buffer);
+
+/* The number of rows down to the last one with anything on it. */
+unsigned screen_used_rows(const struct screen *screen);
+
+#endif /* SCREEN_H_INCLUDED */
@@ -0,0 +1,937 @@
+/* server.c
+ *
+ * Run many commands, each on its own PTY, from one process. See server.h for
+ * details.
+ *
+ * The main thread accepts connections and hands each new session to the
+ * worker with the fewest. A worker polls all of its sessions at once, then
+ * moves the ones with something to do onto its ready queue and works through
+ * it from the front. A worker with nothing left to do takes sessions from
+ * the back of other workers' ready queues and adopts them, so a worker stuck
+ * with several busy sessions sheds them to the idle ones.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "buffer_pool.h"
+#include "child_watch.h"
+#include "mux.h"
+#include "my_assert.h"
+#include "protocol.h"
+#include "server.h"
+#include "spawn.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* The poll entries for a session: the connection, the input and output side
+ * of each direction, and the child watch */
+#define SESSION_POLL_CONN  0
+#define SESSION_POLL_INFOS 1
+#define SESSION_POLL_WATCH 5
+#define SESSION_POLL_FDS   6
+
+enum session_state {
+    /* Waiting for the whole spawn request to arrive */
+    SESSION_READING,
+
+    /* Copying the command's I/O */
+    SESSION_RUNNING,
+
+    /* The I/O is finished, and we're waiting for the command to exit so we
+     * can send its status. */
+    SESSION_EXITING
+};
+
+/* One connection, and the command it asked for. Everything a session needs
+ * lives here, including its last poll results, so it can be handled by
+ * whichever worker happens to hold it. */
+struct session {
+    int conn;
+    enum session_state state;
+
+    /* Set once the client hangs up, so we stop polling the connection */
+    int client_gone;
+
+    /* The request while it is being read, and the descriptors it carried:
+     * output, then optionally input */
+    struct protocol_message request;
+    int fds[PROTOCOL_MAX_FDS];
+    size_t n_fds;
+
+    int fdm;
+    struct redirection_info infos[2];
+    size_t n_infos;
+    struct child_watch watch;
+
+    /* The session on the --connect connection that the I/O goes to instead
+     * of the client's descriptors, or NULL */
+    struct mux_session *mux_session;
+
+    /* What to poll for, and what poll said, and how long poll may wait
+     * before output being held back is due, or -1 */
+    struct pollfd poll_fds[SESSION_POLL_FDS];
+    int64_t flush_timeout;
+
+    struct session *next;
+};
+
+/* A queue of sessions that can be taken from either end */
+struct session_deque {
+    struct session **items;
+    size_t head;
+    size_t length;
+    size_t capacity;
+};
+
+struct server_config;
+
+struct worker {
+    int id;
+    pthread_t thread;
+    struct server_config *config;
+
+    /* The sessions waiting on poll. Only the worker itself touches these. */
+    struct session *sessions;
+    struct pollfd *poll_fds;
+    size_t poll_capacity;
+
+    /* Guards incoming and ready, which other threads add to and take from */
+    pthread_mutex_t lock;
+
+    /* New sessions from the main thread, to be adopted on the next turn */
+    struct session *incoming;
+
+    /* Sessions with poll results to act on */
+    struct session_deque ready;
+
+    /* Where this worker's sessions get their buffers. Buffers are only
+     * touched once they're handed out, by the worker starting the session,
+     * so they end up in memory close to it. */
+    struct buffer_pool pool;
+
+    /* Writing a byte here interrupts the worker's poll. */
+    int wake_pipe[2];
+
+    /* Set while blocked in poll, so others know who to wake for stealing */
+    atomic_int idle;
+
+    /* How many sessions the worker holds, for placing new ones */
+    atomic_size_t n_sessions;
+};
+
+/* The settings and threads shared by every session */
+struct server_config {
+    const struct redirection_config *input;
+    const struct redirection_config *output;
+    int huge_pages;
+    enum spawn_method spawn_method;
+    struct pty_pool *pty_pool;
+    struct mux *mux;
+
+    struct worker *workers;
+    size_t n_workers;
+};
+
+/* Create the listening socket at PATH. */
+static int listen_at(const char *path);
+
+/* Accept one connection, waiting if there is none. Returns the new session,
+ * or NULL if the client gave up before we got to it. */
+static struct session *accept_session(int listener);
+
+/* Hand a new session to the worker with the fewest. */
+static void place_session(struct server_config *config,
+                          struct session *session);
+
+/* Set up a worker and start its thread. */
+static void worker_start(struct worker *worker, int id,
+                         struct server_config *config);
+
+/* The body of a worker thread. */
+static void *worker_thread_fn(void *arg);
+
+/* Poll the worker's sessions and queue the ones that are ready. */
+static void worker_poll(struct worker *worker);
+
+/* Act on ready sessions, the worker's own first and then anyone else's,
+ * until there are none. */
+static void worker_run_ready(struct worker *worker);
+
+/* Take a ready session from the back of another worker's queue. */
+static struct session *worker_steal(struct worker *worker);
+
+/* Interrupt a worker's poll. */
+static void worker_wake(struct worker *worker);
+
+static void deque_push_back(struct session_deque *deque,
+                            struct session *session);
+static struct session *deque_pop_front(struct session_deque *deque);
+static struct session *deque_pop_back(struct session_deque *deque);
+
+/* Fill in the poll entries for a session. */
+static void session_poll_setup(struct session *session);
+
+/* Act on the poll results for a session. Returns nonzero once the session is
+ * finished and can be freed. */
+static int session_handle(struct session *session, struct worker *worker);
+
+/* Start the command from a complete request, taking buffers from the
+ * worker's pool. Returns NULL on success, or a description of what is wrong
+ * with the request. */
+static const char *session_start(struct session *session,
+                                 struct worker *worker);
+
+/* Tear down the I/O once every direction is finished. This closes the master
+ * PTY, which hangs up the command if it is still running. */
+static void session_stop_io(struct session *session);
+
+/* Send a one-record reply, ignoring failure since the client may be gone. */
+static void session_reply(struct session *session, const char *key,
+                          const char *value);
+
+/* Close everything the session still holds and free it. */
+static void session_free(struct session *session);
+
+
+size_t server_default_workers(void) {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n_cpus > 0 ? (size_t) n_cpus : 1;
+}
+
+
+void server_run(const char *path, size_t n_workers, int huge_pages,
+                enum spawn_method spawn_method, struct pty_pool *pty_pool,
+                struct mux *mux, const struct redirection_config *input,
+                const struct redirection_config *output) {
+    struct server_config config;
+    int listener;
+    size_t i;
+
+    /* Without a descriptor per child, every watch shares one self-pipe, and
+     * whichever worker drains it would hide the wakeup from the rest. */
+    if (!child_watch_per_child()) {
+        n_workers = 1;
+    }
+
+    config.input = input;
+    config.output = output;
+    config.huge_pages = huge_pages;
+    config.spawn_method = spawn_method;
+    config.pty_pool = pty_pool;
+    config.mux = mux;
+    config.n_workers = n_workers;
+
+    /* A client whose output goes away mustn't take the whole server with it.
+     * Writes report EPIPE instead, which ends just that session. */
+    ASSERT(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
+
+    listener = listen_at(path);
+
+    ASSERT_NONZERO(config.workers = calloc(n_workers, sizeof(*config.workers)));
+
+    for (i = 0; i < n_workers; i++) {
+        worker_start(&config.workers[i], i, &config);
+    }
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Listening on %s with %zu workers.\n", path, n_workers);
+#endif
+
+    for (;;) {
+        struct session *session = accept_session(listener);
+
+        if (session) {
+            place_session(&config, session);
+        }
+    }
+}
+
+
+static int listen_at(const char *path) {
+    struct sockaddr_un address;
+    int listener;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    ASSERT_WITH_MESSAGE(strlen(path) < sizeof(address.sun_path),
+                        "Socket path is too long");
+    strcpy(address.sun_path, path);
+
+    /* Replace a socket left behind by an earlier server. */
+    if (unlink(path) < 0) {
+        ASSERT(errno == ENOENT);
+    }
+
+    ASSERT_NONNEG(listener = socket(AF_UNIX, SOCK_STREAM, 0));
+    ASSERT_NONNEG(fcntl(listener, F_SETFD, FD_CLOEXEC));
+
+    ASSERT_ZERO(bind(listener, (struct sockaddr *) &address,
+                     sizeof(address)));
+    ASSERT_ZERO(listen(listener, SOMAXCONN));
+
+    return listener;
+}
+
+
+static struct session *accept_session(int listener) {
+    struct session *session;
+    int conn;
+
+#ifdef HAVE_ACCEPT4
+    /* Workers fork while we accept, so the descriptor has to be
+     * close-on-exec from the start. */
+    conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+#else
+    if ((conn = accept(listener, NULL, NULL)) >= 0) {
+        ASSERT_NONNEG(fcntl(conn, F_SETFD, FD_CLOEXEC));
+    }
+#endif
+
+    if (conn < 0) {
+        /* ECONNABORTED and friends just mean that client gave up. */
+        ASSERT(errno == EINTR || errno == ECONNABORTED || errno == EPROTO);
+        return NULL;
+    }
+
+    ASSERT_NONZERO(session = calloc(1, sizeof(*session)));
+    session->conn = conn;
+    session->state = SESSION_READING;
+    session->fdm = -1;
+    protocol_message_init(&session->request);
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Accepted a connection on fd %d.\n", conn);
+#endif
+
+    return session;
+}
+
+
+static void place_session(struct server_config *config,
+                          struct session *session) {
+    struct worker *worker = &config->workers[0];
+    size_t i;
+
+    for (i = 1; i < config->n_workers; i++) {
+        if (atomic_load(&config->workers[i].n_sessions) <
+                atomic_load(&worker->n_sessions)) {
+            worker = &config->workers[i];
+        }
+    }
+
+    atomic_fetch_add(&worker->n_sessions, 1);
+
+    ASSERT_ZERO(pthread_mutex_lock(&worker->lock));
+    session->next = worker->incoming;
+    worker->incoming = session;
+    ASSERT_ZERO(pthread_mutex_unlock(&worker->lock));
+
+    worker_wake(worker);
+}
+
+
+static void worker_start(struct worker *worker, int id,
+                         struct server_config *config) {
+    worker->id = id;
+    worker->config = config;
+    worker->sessions = NULL;
+    worker->poll_fds = NULL;
+    worker->poll_capacity = 0;
+    worker->incoming = NULL;
+    worker->ready.items = NULL;
+    worker->ready.head = worker->ready.length = worker->ready.capacity = 0;
+    atomic_init(&worker->idle, 0);
+    atomic_init(&worker->n_sessions, 0);
+
+    ASSERT_ZERO(pthread_mutex_init(&worker->lock, NULL));
+
+    buffer_pool_init(&worker->pool, config->output->buffer_size,
+                     config->huge_pages);
+
+    ASSERT_ZERO(pipe(worker->wake_pipe));
+    ASSERT_NONNEG(fcntl(worker->wake_pipe[0], F_SETFL, O_NONBLOCK));
+    ASSERT_NONNEG(fcntl(worker->wake_pipe[1], F_SETFL, O_NONBLOCK));
+    ASSERT_NONNEG(fcntl(worker->wake_pipe[0], F_SETFD, FD_CLOEXEC));
+    ASSERT_NONNEG(fcntl(worker->wake_pipe[1], F_SETFD, FD_CLOEXEC));
+
+    ASSERT_ZERO(pthread_create(&worker->thread, NULL, &worker_thread_fn,
+                               worker));
+}
+
+
+static void *worker_thread_fn(void *arg) {
+    struct worker *worker = arg;
+
+    for (;;) {
+        struct session *incoming;
+
+        ASSERT_ZERO(pthread_mutex_lock(&worker->lock));
+        incoming = worker->incoming;
+        worker->incoming = NULL;
+        ASSERT_ZERO(pthread_mutex_unlock(&worker->lock));
+
+        while (incoming) {
+            struct session *session = incoming;
+
+            incoming = session->next;
+            session->next = worker->sessions;
+            worker->sessions = session;
+        }
+
+        worker_poll(worker);
+        worker_run_ready(worker);
+    }
+
+    return NULL;
+}
+
+
+static void worker_poll(struct worker *worker) {
+    struct session **link;
+    struct session *session;
+    size_t n_poll_fds = 1;
+    int64_t timeout = -1;
+    size_t i;
+    int result;
+
+    for (session = worker->sessions; session; session = session->next) {
+        n_poll_fds += SESSION_POLL_FDS;
+    }
+
+    if (n_poll_fds > worker->poll_capacity) {
+        worker->poll_capacity = 2 * n_poll_fds;
+        ASSERT_NONZERO(worker->poll_fds =
+                       realloc(worker->poll_fds,
+                               worker->poll_capacity *
+                               sizeof(*worker->poll_fds)));
+    }
+
+    worker->poll_fds[0].fd = worker->wake_pipe[0];
+    worker->poll_fds[0].events = POLLIN;
+
+    for (i = 1, session = worker->sessions; session;
+            session = session->next, i += SESSION_POLL_FDS) {
+        session_poll_setup(session);
+
+        if (session->flush_timeout >= 0 &&
+                (timeout < 0 || session->flush_timeout < timeout)) {
+            timeout = session->flush_timeout;
+        }
+
+        memcpy(&worker->poll_fds[i], session->poll_fds,
+               sizeof(session->poll_fds));
+    }
+
+    atomic_store(&worker->idle, 1);
+    result = redirection_poll(worker->poll_fds, n_poll_fds, timeout);
+    atomic_store(&worker->idle, 0);
+
+    if (result < 0) {
+        /* The SIGCHLD handler may interrupt us if there's no pidfd. */
+        ASSERT(errno == EINTR);
+        return;
+    }
+
+    if (worker->poll_fds[0].revents) {
+        char drain[64];
+
+        while (read(worker->wake_pipe[0], drain, sizeof(drain)) > 0) {
+            /* Keep draining. */
+        }
+    }
+
+    ASSERT_ZERO(pthread_mutex_lock(&worker->lock));
+
+    for (i = 1, link = &worker->sessions; *link; i += SESSION_POLL_FDS) {
+        size_t j;
+        int any_revents = 0;
+
+        session = *link;
+
+        for (j = 0; j < SESSION_POLL_FDS; j++) {
+            session->poll_fds[j].revents = worker->poll_fds[i + j].revents;
+            any_revents |= session->poll_fds[j].revents;
+        }
+
+        if (any_revents) {
+            *link = session->next;
+            deque_push_back(&worker->ready, session);
+        }
+        else {
+            link = &session->next;
+        }
+    }
+
+    /* If there's more here than one session's worth of work, someone who
+     * has nothing better to do can help. */
+    if (worker->ready.length > 1) {
+        for (i = 0; i < worker->config->n_workers; i++) {
+            struct worker *other = &worker->config->workers[i];
+
+            if (other != worker && atomic_load(&other->idle)) {
+                worker_wake(other);
+                break;
+            }
+        }
+    }
+
+    ASSERT_ZERO(pthread_mutex_unlock(&worker->lock));
+}
+
+
+static void worker_run_ready(struct worker *worker) {
+    for (;;) {
+        struct session *session;
+
+        ASSERT_ZERO(pthread_mutex_lock(&worker->lock));
+        session = deque_pop_front(&worker->ready);
+        ASSERT_ZERO(pthread_mutex_unlock(&worker->lock));
+
+        if (!session && !(session = worker_steal(worker))) {
+            return;
+        }
+
+        if (session_handle(session, worker)) {
+            atomic_fetch_sub(&worker->n_sessions, 1);
+            session_free(session);
+        }
+        else {
+            session->next = worker->sessions;
+            worker->sessions = session;
+        }
+    }
+}
+
+
+static struct session *worker_steal(struct worker *worker) {
+    size_t i;
+
+    for (i = 0; i < worker->config->n_workers; i++) {
+        struct worker *victim = &worker->config->workers[i];
+        struct session *session;
+
+        if (victim == worker) {
+            continue;
+        }
+
+        ASSERT_ZERO(pthread_mutex_lock(&victim->lock));
+        session = deque_pop_back(&victim->ready);
+        ASSERT_ZERO(pthread_mutex_unlock(&victim->lock));
+
+        if (session) {
+            atomic_fetch_sub(&victim->n_sessions, 1);
+            atomic_fetch_add(&worker->n_sessions, 1);
+
+#ifdef ASSERT_DEBUG
+            fprintf(stderr, "Worker %d took the connection on fd %d from "
+                    "worker %d.\n", worker->id, session->conn, victim->id);
+#endif
+
+            return session;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void worker_wake(struct worker *worker) {
+    char wake_char = 0;
+
+    /* If the pipe is full, a wakeup is already pending. */
+    if (write(worker->wake_pipe[1], &wake_char, 1) < 0) {
+        ASSERT(errno == EAGAIN);
+    }
+}
+
+
+static void deque_push_back(struct session_deque *deque,
+                            struct session *session) {
+    if (deque->length == deque->capacity) {
+        size_t capacity = deque->capacity ? 2 * deque->capacity : 16;
+        struct session **items;
+        size_t i;
+
+        ASSERT_NONZERO(items = malloc(capacity * sizeof(*items)));
+
+        for (i = 0; i < deque->length; i++) {
+            items[i] = deque->items[(deque->head + i) % deque->capacity];
+        }
+
+        free(deque->items);
+        deque->items = items;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+
+    deque->items[(deque->head + deque->length) % deque->capacity] = session;
+    deque->length++;
+}
+
+
+static struct session *deque_pop_front(struct session_deque *deque) {
+    struct session *session;
+
+    if (deque->length == 0) {
+        return NULL;
+    }
+
+    session = deque->items[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    deque->length--;
+
+    return session;
+}
+
+
+static struct session *deque_pop_back(struct session_deque *deque) {
+    if (deque->length == 0) {
+        return NULL;
+    }
+
+    deque->length--;
+
+    return deque->items[(deque->head + deque->length) % deque->capacity];
+}
+
+
+static void session_poll_setup(struct session *session) {
+    struct pollfd *poll_fds = session->poll_fds;
+    size_t i;
+
+    for (i = 0; i < SESSION_POLL_FDS; i++) {
+        poll_fds[i].fd = -1;
+        poll_fds[i].events = 0;
+        poll_fds[i].revents = 0;
+    }
+
+    session->flush_timeout = -1;
+
+    /* Once the request is in, we only care whether the client hangs up,
+     * which poll reports whatever the events. */
+    poll_fds[SESSION_POLL_CONN].fd = session->client_gone ? -1 : session->conn;
+    poll_fds[SESSION_POLL_CONN].events =
+        session->state == SESSION_READING ? POLLIN : 0;
+
+    if (session->state == SESSION_READING) {
+        return;
+    }
+
+    if (session->state == SESSION_RUNNING) {
+        for (i = 0; i < session->n_infos; i++) {
+            struct pollfd *in_pfd = &poll_fds[SESSION_POLL_INFOS + 2 * i];
+            struct pollfd *out_pfd = &poll_fds[SESSION_POLL_INFOS + 2 * i + 1];
+
+            if (redirection_active(&session->infos[i])) {
+                int64_t timeout;
+
+                redirection_prepare(&session->infos[i]);
+                timeout = redirection_timeout(&session->infos[i]);
+
+                redirection_poll_setup(&session->infos[i],
+                                       &in_pfd->fd, &in_pfd->events,
+                                       &out_pfd->fd, &out_pfd->events);
+
+                if (timeout >= 0 && (session->flush_timeout < 0 ||
+                                     timeout < session->flush_timeout)) {
+                    session->flush_timeout = timeout;
+                }
+            }
+        }
+    }
+
+    if (!session->watch.exited) {
+        poll_fds[SESSION_POLL_WATCH].fd = session->watch.fd;
+        poll_fds[SESSION_POLL_WATCH].events = POLLIN;
+    }
+}
+
+
+static int session_handle(struct session *session, struct worker *worker) {
+    struct pollfd *poll_fds = session->poll_fds;
+    size_t i;
+
+    if (session->state == SESSION_READING) {
+        const char *error;
+
+        if (!poll_fds[SESSION_POLL_CONN].revents) {
+            return 0;
+        }
+
+        if (protocol_receive(session->conn, &session->request, session->fds,
+                             &session->n_fds) <= 0) {
+            /* The client went away, or sent something we can't use, before
+             * finishing its request. */
+            return 1;
+        }
+
+        if (!protocol_complete(&session->request)) {
+            return 0;
+        }
+
+        if ((error = session_start(session, worker)) != NULL) {
+            session_reply(session, "error", error);
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (poll_fds[SESSION_POLL_WATCH].revents) {
+        child_watch_check(&session->watch);
+    }
+
+    if (session->state == SESSION_RUNNING) {
+        int any_active = 0;
+
+        /* If the client is gone, there's nobody to report to. Wind the
+         * command down, which hangs it up once the output is flushed. */
+        if (poll_fds[SESSION_POLL_CONN].revents & (POLLHUP | POLLERR)) {
+            session->client_gone = 1;
+
+            for (i = 0; i < session->n_infos; i++) {
+                redirection_stop(&session->infos[i]);
+            }
+        }
+
+        for (i = 0; i < session->n_infos; i++) {
+            struct pollfd *in_pfd = &poll_fds[SESSION_POLL_INFOS + 2 * i];
+            struct pollfd *out_pfd = &poll_fds[SESSION_POLL_INFOS + 2 * i + 1];
+
+            if (in_pfd->fd >= 0 || out_pfd->fd >= 0) {
+                redirection_handle(&session->infos[i], in_pfd->revents,
+                                   out_pfd->revents);
+            }
+
+            if (session->infos[i].end_all &&
+                    !redirection_active(&session->infos[i])) {
+                redirection_end_all(session->infos, session->n_infos);
+            }
+        }
+
+        for (i = 0; i < session->n_infos; i++) {
+            any_active |= redirection_active(&session->infos[i]);
+        }
+
+        if (!any_active) {
+            session_stop_io(session);
+        }
+    }
+
+    if (session->state == SESSION_EXITING && session->watch.exited) {
+        char status[32];
+
+        child_watch_finish(&session->watch);
+
+        if (session->mux_session) {
+            mux_exit(worker->config->mux, session->mux_session,
+                     session->watch.status);
+        }
+
+        snprintf(status, sizeof(status), "%d", session->watch.status);
+        session_reply(session, "status", status);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static const char *session_start(struct session *session,
+                                 struct worker *worker) {
+    struct redirection_config input = *worker->config->input;
+    struct redirection_config output = *worker->config->output;
+    struct spawn_request request;
+    struct spawn_slot slot;
+    const char *record;
+    size_t offset = 0;
+    size_t n_args = 0, n_envs = 0;
+    char **argv, **envp;
+    pid_t pid;
+
+    /* The protocol only carries one output descriptor, so standard error
+     * stays merged. */
+    int fde;
+
+    request.cwd = NULL;
+    request.default_sigpipe = 1;
+    request.stderr_mode = SPAWN_STDERR_MERGED;
+    request.winsize = NULL;
+    request.method = worker->config->spawn_method;
+    request.slot = NULL;
+    request.cgroup_fd = -1;
+
+    /* The records hold at most this many of each, so size the arrays from
+     * the number of records. */
+    while (protocol_next(&session->request, &offset)) {
+        n_args++;
+    }
+
+    ASSERT_NONZERO(argv = calloc(n_args + 1, sizeof(*argv)));
+    ASSERT_NONZERO(envp = calloc(n_args + 1, sizeof(*envp)));
+
+    n_args = 0;
+    offset = 0;
+
+    while ((record = protocol_next(&session->request, &offset)) != NULL) {
+        const char *value;
+
+        /* The values are NUL-terminated in place, and the request outlives
+         * the fork, so they can be used directly. */
+        if ((value = protocol_value(record, "arg")) != NULL) {
+            argv[n_args++] = (char *) value;
+        }
+        else if ((value = protocol_value(record, "env")) != NULL) {
+            envp[n_envs++] = (char *) value;
+        }
+        else if ((value = protocol_value(record, "cwd")) != NULL) {
+            request.cwd = value;
+        }
+    }
+
+    request.argv = argv;
+    request.envp = n_envs > 0 ? envp : NULL;
+
+    if (n_args == 0 || session->n_fds == 0) {
+        free(argv);
+        free(envp);
+        return n_args == 0 ? "No command given" : "No output descriptor given";
+    }
+
+    /* With --connect, the command's I/O goes over the connection, and the
+     * client only hears how it exited. */
+    if (worker->config->mux) {
+        int out_fd, in_fd;
+        size_t i;
+
+        session->mux_session = mux_open(worker->config->mux, argv, &out_fd,
+                                        &in_fd);
+
+        if (!session->mux_session) {
+            free(argv);
+            free(envp);
+            return "The --connect connection has been lost";
+        }
+
+        for (i = 0; i < session->n_fds; i++) {
+            ASSERT_ZERO(close(session->fds[i]));
+        }
+
+        session->fds[0] = out_fd;
+        session->fds[1] = in_fd;
+        session->n_fds = 2;
+    }
+
+    if (worker->config->pty_pool &&
+            pty_pool_take(worker->config->pty_pool, &slot) == 0) {
+        request.slot = &slot;
+    }
+
+    pid = spawn_pty(&request, &session->fdm, &fde);
+
+    free(argv);
+    free(envp);
+    protocol_message_destroy(&session->request);
+
+    child_watch_start(&session->watch, pid);
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Connection on fd %d started child %d.\n", session->conn,
+            (int) pid);
+#endif
+
+    session->n_infos = 0;
+    input.pool = output.pool = &worker->pool;
+
+    if (session->n_fds > 1) {
+        redirection_init(&session->infos[session->n_infos++],
+                         REDIRECTION_INPUT, session->fds[1], session->fdm,
+                         1, 0, &input);
+    }
+
+    redirection_init(&session->infos[session->n_infos++], REDIRECTION_OUTPUT,
+                     session->fdm, session->fds[0], 0, 1, &output);
+
+    session->state = SESSION_RUNNING;
+
+    return NULL;
+}
+
+
+static void session_stop_io(struct session *session) {
+    size_t i;
+
+    for (i = 0; i < session->n_infos; i++) {
+        redirection_destroy(&session->infos[i]);
+    }
+
+    session->n_infos = 0;
+
+    ASSERT_ZERO(close(session->fdm));
+    session->fdm = -1;
+
+    for (i = 0; i < session->n_fds; i++) {
+        ASSERT_ZERO(close(session->fds[i]));
+    }
+
+    session->n_fds = 0;
+
+    session->state = SESSION_EXITING;
+}
+
+
+static void session_reply(struct session *session, const char *key,
+                          const char *value) {
+    struct protocol_message reply;
+
+    protocol_message_init(&reply);
+    protocol_put(&reply, key, value);
+    protocol_finish(&reply);
+
+    if (protocol_send(session->conn, &reply, NULL, 0) < 0) {
+#ifdef ASSERT_DEBUG
+        fprintf(stderr, "Couldn't reply on fd %d.\n", session->conn);
+#endif
+    }
+
+    protocol_message_destroy(&reply);
+}
+
+
+static void session_free(struct session *session) {
+    size_t i;
+
+    /* Only a session whose request never got going still holds the
+     * descriptors it was sent. */
+    for (i = 0; i < session->n_fds; i++) {
+        ASSERT_ZERO(close(session->fds[i]));
+    }
+
+    protocol_message_destroy(&session->request);
+    ASSERT_ZERO(close(session->conn));
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Closed the connection on fd %d.\n", session->conn);
+#endif
+
+    free(session);
+}
@@ -0,0 +1,38 @@
+/* server.h
+ *
+ * Run many commands, each on its own PTY, from one process. The server
+ * listens on a Unix socket for spawn requests (see protocol.h), and a few
+ * worker threads, each with one poll() loop, copy the I/O of every running
+ * command and watch for every child's exit. Thousands of commands cost one
+ * process rather than thousands of processes and twice as many threads.
+ */
+
+#ifndef SERVER_H_INCLUDED
+#define SERVER_H_INCLUDED
+
+#include <stddef.h>
+
+#include "mux.h"
+#include "pty_pool.h"
+#include "redirect.h"
+#include "spawn.h"
+
+/* The largest number of worker threads allowed */
+#define SERVER_MAX_WORKERS 1024
+
+/* The number of workers to use by default: one per online CPU. */
+size_t server_default_workers(void);
+
+/* Listen on the Unix socket at PATH, replacing anything already there, and
+ * serve spawn requests with N_WORKERS threads until killed. Each command is
+ * started with SPAWN_METHOD, on a PTY from PTY_POOL where there is one and
+ * it isn't NULL, and its input and output are copied with the given
+ * settings, using buffers from a pool per worker, backed by huge pages if
+ * HUGE_PAGES is set. If MUX isn't NULL, every command's input and output go
+ * over its connection instead of the descriptors the client sent. */
+void server_run(const char *path, size_t n_workers, int huge_pages,
+                enum spawn_method spawn_method, struct pty_pool *pty_pool,
+                struct mux *mux, const struct redirection_config *input,
+                const struct redirection_config *output);
+
+#endif /* SERVER_H_INCLUDED */
@@ -0,0 +1,625 @@
+/* spawn.c
+ *
+ * Start a command on a fresh PTY. See spawn.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+/* In some environments, we'll be dealing with the STREAMS extension. If it's
+ * available, include it. */
+#if defined(_XOPEN_STREAMS) && _XOPEN_STREAMS != -1
+#include <stropts.h>
+#endif
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* posix_spawn can only give the child a controlling terminal where opening
+ * one as a session leader does that, as it does on Linux. */
+#if defined(__linux__) && defined(HAVE_POSIX_SPAWNP) && \
+    defined(HAVE_DECL_POSIX_SPAWN_SETSID) && HAVE_DECL_POSIX_SPAWN_SETSID
+#define SPAWN_POSIX 1
+#include <spawn.h>
+#endif
+
+#include "my_assert.h"
+#include "protocol.h"
+#include "spawn.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* Where posix_openpt just opens a device, as on Linux, it takes O_CLOEXEC
+ * like any other open. */
+#if defined(O_CLOEXEC) && defined(__linux__)
+#define SPAWN_CLOEXEC O_CLOEXEC
+#else
+#define SPAWN_CLOEXEC 0
+#endif
+
+
+extern char **environ;
+
+/* Open a new PTY, with the master non-blocking and both ends close-on-exec,
+ * and put the slave in raw mode, with the given window size unless it is
+ * NULL. The slave's path goes in SLAVE_PATH, which has room for PATH_MAX
+ * bytes. */
+static void open_pty(int *fdm, int *fds, const struct winsize *winsize,
+                     char *slave_path);
+
+/* Start the child with fork. */
+static pid_t spawn_fork(const struct spawn_request *request, int fdm,
+                        int fds, int fde, int error_fd);
+
+#ifdef SPAWN_POSIX
+/* Start the child with posix_spawn. The child opens the slaves by path, which
+ * makes the first its controlling terminal. Returns the child's process ID,
+ * or -1 if it couldn't be started this way. */
+static pid_t spawn_posix(const struct spawn_request *request,
+                         const char *slave_path, int error_fd,
+                         const char *error_path);
+
+/* Start a stub for a slot, and wait until it has the slave open. Leaves the
+ * slot without one if it can't. */
+static void stub_start(struct spawn_slot *slot);
+#endif
+
+/* Tell a slot's stub what to run. Returns the child's process ID, or -1 if
+ * the stub is gone, in which case it has been reaped. */
+static pid_t stub_request(const struct spawn_request *request,
+                          struct spawn_slot *slot);
+
+/* Get rid of a slot's stub, if it has one. */
+static void stub_discard(struct spawn_slot *slot);
+
+#ifdef __sun
+/* Put a terminal into raw mode. This is a library function on most systems,
+ * but not Solaris! :D */
+static void cfmakeraw(struct termios *termios_p);
+#endif
+
+
+int spawn_method_parse(const char *arg, enum spawn_method *method) {
+    if (strcmp(arg, "auto") == 0) {
+        *method = SPAWN_METHOD_AUTO;
+    }
+    else if (strcmp(arg, "fork") == 0) {
+        *method = SPAWN_METHOD_FORK;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int spawn_stderr_parse(const char *arg, enum spawn_stderr *mode) {
+    if (strcmp(arg, "merged") == 0) {
+        *mode = SPAWN_STDERR_MERGED;
+    }
+    else if (strcmp(arg, "pipe") == 0) {
+        *mode = SPAWN_STDERR_PIPE;
+    }
+    else if (strcmp(arg, "pty") == 0) {
+        *mode = SPAWN_STDERR_PTY;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void spawn_slot_open(struct spawn_slot *slot, int stub) {
+    open_pty(&slot->fdm, &slot->fds, NULL, slot->slave_path);
+
+    slot->stub_pid = -1;
+    slot->stub_fd = -1;
+
+#ifdef SPAWN_POSIX
+    if (stub) {
+        stub_start(slot);
+    }
+#else
+    (void) stub;
+#endif
+}
+
+
+void spawn_stub_run(const char *slave_path) {
+    struct protocol_message message;
+    int fds[PROTOCOL_MAX_FDS];
+    size_t n_fds = 0;
+    const char *record;
+    size_t offset = 0;
+    size_t n_records = 0, n_args = 0, n_envs = 0, i;
+    char **argv, **envp;
+    int channel, slave;
+    char ready = 0;
+
+    /* Standard input is about to be the slave, so move the socket out of
+     * the way. */
+    ASSERT_NONNEG(channel = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3));
+
+    ASSERT_NONNEG(setsid());
+    ASSERT_NONNEG(slave = open(slave_path, O_RDWR | O_NOCTTY));
+    ASSERT_NONNEG(ioctl(slave, TIOCSCTTY, 0));
+
+    ASSERT_NONNEG(dup2(slave, STDIN_FILENO));
+    ASSERT_NONNEG(dup2(slave, STDOUT_FILENO));
+    ASSERT_NONNEG(dup2(slave, STDERR_FILENO));
+    ASSERT_ZERO(close(slave));
+
+    /* Now the slave is held open, the server can let go of it. */
+    ASSERT(write(channel, &ready, 1) == 1);
+
+    protocol_message_init(&message);
+
+    while (!protocol_complete(&message)) {
+        ssize_t n = protocol_receive(channel, &message, fds, &n_fds);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        /* The slot was thrown away without being used. */
+        if (n <= 0) {
+            _exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < n_fds; i++) {
+        ASSERT_ZERO(close(fds[i]));
+    }
+
+    /* From here on, this is the command, as far as anyone can tell. */
+    while (protocol_next(&message, &offset)) {
+        n_records++;
+    }
+
+    ASSERT_NONZERO(argv = calloc(n_records + 1, sizeof(*argv)));
+    ASSERT_NONZERO(envp = calloc(n_records + 1, sizeof(*envp)));
+
+    offset = 0;
+
+    while ((record = protocol_next(&message, &offset)) != NULL) {
+        const char *value;
+
+        if ((value = protocol_value(record, "arg")) != NULL) {
+            argv[n_args++] = (char *) value;
+        }
+        else if ((value = protocol_value(record, "env")) != NULL) {
+            envp[n_envs++] = (char *) value;
+        }
+        else if ((value = protocol_value(record, "cwd")) != NULL) {
+            ASSERT_ZERO(chdir(value));
+        }
+        else if (protocol_value(record, "default-sigpipe") != NULL) {
+            ASSERT(signal(SIGPIPE, SIG_DFL) != SIG_ERR);
+        }
+    }
+
+    ASSERT_WITH_MESSAGE(n_args > 0, "No command given to the stub");
+
+    if (n_envs > 0) {
+        environ = envp;
+    }
+
+    ASSERT_ZERO(execvp(argv[0], argv));
+    _exit(EXIT_FAILURE);
+}
+
+
+pid_t spawn_pty(const struct spawn_request *request, int *fdm, int *fde) {
+    /* The slave PTY file descriptor, and its path */
+    int fds;
+    char slave_path[PATH_MAX];
+
+    /* The command's end of its standard error, if it has its own, and the
+     * path of its slave if that is a PTY */
+    int error_fd = -1;
+    char error_path[PATH_MAX];
+
+    /* The child process ID */
+    pid_t pid = -1;
+
+    if (request->slot) {
+        *fdm = request->slot->fdm;
+        fds = request->slot->fds;
+        strcpy(slave_path, request->slot->slave_path);
+
+        if (request->winsize) {
+            ASSERT_NONNEG(ioctl(fds, TIOCSWINSZ, request->winsize));
+        }
+    }
+    else {
+        open_pty(fdm, &fds, request->winsize, slave_path);
+    }
+
+    *fde = -1;
+    error_path[0] = '\0';
+
+    if (request->stderr_mode == SPAWN_STDERR_PIPE) {
+        int error_pipe[2];
+
+        /* Our end is non-blocking, like the master PTY, since it's read the
+         * same way. */
+        ASSERT_ZERO(pipe2(error_pipe, O_CLOEXEC));
+        ASSERT_NONNEG(fcntl(error_pipe[0], F_SETFL, O_NONBLOCK));
+
+        *fde = error_pipe[0];
+        error_fd = error_pipe[1];
+    }
+    else if (request->stderr_mode == SPAWN_STDERR_PTY) {
+        open_pty(fde, &error_fd, request->winsize, error_path);
+    }
+
+    /* The stub has everything set up already but what to run. */
+    if (request->slot && request->stderr_mode == SPAWN_STDERR_MERGED &&
+            request->cgroup_fd < 0) {
+        pid = stub_request(request, request->slot);
+    }
+    else if (request->slot) {
+        stub_discard(request->slot);
+    }
+
+#ifdef SPAWN_POSIX
+    if (pid < 0 && request->method == SPAWN_METHOD_AUTO &&
+            request->cgroup_fd < 0) {
+        pid = spawn_posix(request, slave_path, error_fd,
+                          error_path[0] ? error_path : NULL);
+    }
+#endif
+
+    /* If posix_spawn couldn't run the command, fork can at least say why
+     * the same way it always has. */
+    if (pid < 0) {
+        pid = spawn_fork(request, *fdm, fds, *fde, error_fd);
+    }
+
+    /* The child has its own copies of the slaves now. */
+    ASSERT_ZERO(close(fds));
+
+    if (error_fd >= 0) {
+        ASSERT_ZERO(close(error_fd));
+    }
+
+    return pid;
+}
+
+
+static pid_t spawn_fork(const struct spawn_request *request, int fdm,
+                        int fds, int fde, int error_fd) {
+    pid_t pid;
+
+    /* Fork a child process. */
+    ASSERT_NONNEG(pid = fork());
+
+    if (pid == 0) {
+        /* Before anything else, so that all the command does is counted
+         * and limited. */
+        if (request->cgroup_fd >= 0) {
+            ASSERT_WITH_MESSAGE(write(request->cgroup_fd, "0", 1) == 1,
+                                "Can't move the command into its cgroup");
+        }
+
+        ASSERT_NONNEG(setsid());
+
+        /* And duplicates all its I/O to that slave PTY, except for standard
+         * error if it has a place of its own. */
+        ASSERT_NONNEG(dup2(fds, STDIN_FILENO));
+        ASSERT_NONNEG(dup2(fds, STDOUT_FILENO));
+        ASSERT_NONNEG(dup2(error_fd >= 0 ? error_fd : fds, STDERR_FILENO));
+
+        ASSERT_ZERO(close(fdm));
+        ASSERT_ZERO(close(fds));
+
+        if (error_fd >= 0) {
+            ASSERT_ZERO(close(fde));
+            ASSERT_ZERO(close(error_fd));
+        }
+
+        ASSERT_NONNEG(ioctl(0, TIOCSCTTY, 0));
+
+        if (request->default_sigpipe) {
+            ASSERT(signal(SIGPIPE, SIG_DFL) != SIG_ERR);
+        }
+
+        if (request->cwd) {
+            ASSERT_ZERO(chdir(request->cwd));
+        }
+
+        if (request->envp) {
+            environ = request->envp;
+        }
+
+        /* Then it runs the specified command, passing all command line
+         * arguments. */
+        ASSERT_ZERO(execvp(request->argv[0], request->argv));
+    }
+
+    return pid;
+}
+
+
+#ifdef SPAWN_POSIX
+static pid_t spawn_posix(const struct spawn_request *request,
+                         const char *slave_path, int error_fd,
+                         const char *error_path) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t default_signals;
+    short flags = POSIX_SPAWN_SETSID;
+    pid_t pid;
+    int result;
+
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+    if (request->cwd) {
+        return -1;
+    }
+#endif
+
+    ASSERT_ZERO(posix_spawnattr_init(&attr));
+    ASSERT_ZERO(posix_spawn_file_actions_init(&actions));
+
+    if (request->default_sigpipe) {
+        ASSERT_ZERO(sigemptyset(&default_signals));
+        ASSERT_ZERO(sigaddset(&default_signals, SIGPIPE));
+        ASSERT_ZERO(posix_spawnattr_setsigdefault(&attr, &default_signals));
+        flags |= POSIX_SPAWN_SETSIGDEF;
+    }
+
+    ASSERT_ZERO(posix_spawnattr_setflags(&attr, flags));
+
+    /* The file actions run after setsid, so opening the slave without
+     * O_NOCTTY makes it the controlling terminal, as TIOCSCTTY would.
+     * Everything of ours is close-on-exec, so nothing else leaks in. */
+    ASSERT_ZERO(posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+                                                 slave_path, O_RDWR, 0));
+    ASSERT_ZERO(posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO,
+                                                 STDOUT_FILENO));
+
+    if (error_path) {
+        ASSERT_ZERO(posix_spawn_file_actions_addopen(&actions, STDERR_FILENO,
+                                                     error_path, O_RDWR, 0));
+    }
+    else {
+        ASSERT_ZERO(posix_spawn_file_actions_adddup2(
+            &actions, error_fd >= 0 ? error_fd : STDIN_FILENO,
+            STDERR_FILENO));
+    }
+
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+    if (request->cwd) {
+        ASSERT_ZERO(posix_spawn_file_actions_addchdir_np(&actions,
+                                                         request->cwd));
+    }
+#endif
+
+    result = posix_spawnp(&pid, request->argv[0], &actions, &attr,
+                          request->argv,
+                          request->envp ? request->envp : environ);
+
+    ASSERT_ZERO(posix_spawn_file_actions_destroy(&actions));
+    ASSERT_ZERO(posix_spawnattr_destroy(&attr));
+
+#ifdef ASSERT_DEBUG
+    if (result != 0) {
+        fprintf(stderr, "posix_spawn failed (%s), falling back to fork.\n",
+                strerror(result));
+    }
+#endif
+
+    return result == 0 ? pid : -1;
+}
+
+
+static void stub_start(struct spawn_slot *slot) {
+    posix_spawn_file_actions_t actions;
+    char exe[PATH_MAX];
+    char *argv[4];
+    int sockets[2];
+    char ready;
+    ssize_t n;
+    pid_t pid;
+    int result;
+
+    /* The stub is another copy of ourselves. */
+    if ((n = readlink("/proc/self/exe", exe, sizeof(exe) - 1)) < 0) {
+        return;
+    }
+
+    exe[n] = '\0';
+
+    argv[0] = exe;
+    argv[1] = SPAWN_STUB_ARG;
+    argv[2] = slot->slave_path;
+    argv[3] = NULL;
+
+    ASSERT_ZERO(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+                           sockets));
+
+    ASSERT_ZERO(posix_spawn_file_actions_init(&actions));
+    ASSERT_ZERO(posix_spawn_file_actions_adddup2(&actions, sockets[1],
+                                                 STDIN_FILENO));
+
+    result = posix_spawn(&pid, exe, &actions, NULL, argv, environ);
+
+    ASSERT_ZERO(posix_spawn_file_actions_destroy(&actions));
+    ASSERT_ZERO(close(sockets[1]));
+
+    if (result != 0) {
+        ASSERT_ZERO(close(sockets[0]));
+        return;
+    }
+
+    /* Until the stub has opened the slave, closing ours would hang up the
+     * master. */
+    do {
+        n = read(sockets[0], &ready, 1);
+    } while (n < 0 && errno == EINTR);
+
+    if (n != 1) {
+        ASSERT_ZERO(close(sockets[0]));
+        ASSERT_NONNEG(waitpid(pid, NULL, 0));
+        return;
+    }
+
+    slot->stub_pid = pid;
+    slot->stub_fd = sockets[0];
+}
+#endif
+
+
+static pid_t stub_request(const struct spawn_request *request,
+                          struct spawn_slot *slot) {
+    struct protocol_message message;
+    pid_t pid = slot->stub_pid;
+    int result;
+    size_t i;
+
+    if (pid < 0) {
+        return -1;
+    }
+
+    protocol_message_init(&message);
+
+    for (i = 0; request->argv[i]; i++) {
+        protocol_put(&message, "arg", request->argv[i]);
+    }
+
+    for (i = 0; request->envp && request->envp[i]; i++) {
+        protocol_put(&message, "env", request->envp[i]);
+    }
+
+    if (request->cwd) {
+        protocol_put(&message, "cwd", request->cwd);
+    }
+
+    if (request->default_sigpipe) {
+        protocol_put(&message, "default-sigpipe", "1");
+    }
+
+    protocol_finish(&message);
+
+    result = protocol_send(slot->stub_fd, &message, NULL, 0);
+    protocol_message_destroy(&message);
+
+    if (result < 0) {
+        stub_discard(slot);
+        return -1;
+    }
+
+    ASSERT_ZERO(close(slot->stub_fd));
+    slot->stub_pid = -1;
+    slot->stub_fd = -1;
+
+    return pid;
+}
+
+
+static void stub_discard(struct spawn_slot *slot) {
+    if (slot->stub_pid < 0) {
+        return;
+    }
+
+    /* On end of file the stub exits by itself, but there's no sense waiting
+     * for it to notice. */
+    ASSERT_ZERO(close(slot->stub_fd));
+    ASSERT(kill(slot->stub_pid, SIGKILL) == 0 || errno == ESRCH);
+    ASSERT_NONNEG(waitpid(slot->stub_pid, NULL, 0));
+
+    slot->stub_pid = -1;
+    slot->stub_fd = -1;
+}
+
+
+static void open_pty(int *fdm, int *fds, const struct winsize *winsize,
+                     char *slave_path) {
+#ifndef HAVE_PTSNAME_R
+    /* ptsname's own copy of the path */
+    const char *name;
+#endif
+
+    /* The terminal settings for the slave PTY */
+    struct termios fds_settings;
+
+    /* Open the PTY multiplexer to get a master PTY. Other commands started
+     * from the same process mustn't inherit either end of the PTY, or this
+     * one would never see a hangup when its command exits. With several
+     * threads spawning at once, that means close-on-exec from the start
+     * where the system allows it. */
+    ASSERT_NONNEG(*fdm = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK |
+                                      SPAWN_CLOEXEC));
+    ASSERT_NONNEG(fcntl(*fdm, F_SETFD, FD_CLOEXEC));
+
+    /* Allow a slave PTY to be opened. */
+    ASSERT_ZERO(grantpt(*fdm));
+    ASSERT_ZERO(unlockpt(*fdm));
+
+#ifdef HAVE_PTSNAME_R
+    /* ptsname's static buffer isn't safe to share between threads. */
+    ASSERT_ZERO(ptsname_r(*fdm, slave_path, PATH_MAX));
+#else
+    ASSERT_NONZERO(name = ptsname(*fdm));
+    ASSERT(strlen(name) < PATH_MAX);
+    strcpy(slave_path, name);
+#endif
+
+    /* The child process opens a slave PTY. dup2 clears close-on-exec on the
+     * copies the command gets. */
+    ASSERT_NONNEG(*fds = open(slave_path, O_RDWR | O_NOCTTY | SPAWN_CLOEXEC));
+
+    /* In some environments, we'll be dealing with the STREAMS extension. If
+     * it's available, see if we need to do any configuration. */
+#if defined(_XOPEN_STREAMS)  && _XOPEN_STREAMS != -1
+    /* System V implementations need STREAMS configuration for the slave
+     * PTY. */
+    if (isastream(*fds)) {
+        ASSERT_NONNEG(ioctl(*fds, I_PUSH, "ptem"));
+        ASSERT_NONNEG(ioctl(*fds, I_PUSH, "ldterm"));
+    }
+#endif
+
+    /* Enable raw mode on the slave PTY. This has to happen before we start
+     * copying input, or the line discipline may echo the first few bytes
+     * back at us while the child is still starting up. */
+    ASSERT_ZERO(tcgetattr(*fds, &fds_settings));
+    cfmakeraw(&fds_settings);
+    ASSERT_ZERO(tcsetattr(*fds, TCSANOW, &fds_settings));
+
+    /* Likewise the size, so the command never sees a terminal without
+     * one. */
+    if (winsize) {
+        ASSERT_NONNEG(ioctl(*fds, TIOCSWINSZ, winsize));
+    }
+}
+
+
+#ifdef __sun
+/* Put a terminal into raw mode. This is a library function on most systems,
+ * but not Solaris! :D */
+static void cfmakeraw(struct termios *termios_p) {
+    /* This implementation is taken from the Linux man page for termios(3). */
+    termios_p->c_iflag &= ~(IMAXBEL | IGNBRK | BRKINT | PARMRK | ISTRIP |
+                            INLCR | IGNCR | ICRNL | IXON);
+    termios_p->c_oflag &= ~OPOST;
+    termios_p->c_lflag &= ~(ECHO | ECHONL | /* ICANON |*/ ISIG | IEXTEN);
+    termios_p->c_cflag &= ~(CSIZE | PARENB);
+    termios_p->c_cflag |= CS8;
+}
+#endif
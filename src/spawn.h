@@ -0,0 +1,127 @@
+/* spawn.h
+ *
+ * Start a command on a fresh PTY: open the master, set the slave up in raw
+ * mode, and start a child that makes the slave its controlling terminal and
+ * standard I/O before running the command.
+ *
+ * Where the system allows, the child is started with posix_spawn, which
+ * shares our memory until the exec rather than copying our page tables as
+ * fork does. That makes no difference to a small process, but a server
+ * holding buffers for thousands of commands spends most of a fork copying
+ * them. Otherwise, or if posix_spawn fails, it falls back to fork.
+ *
+ * A PTY can also be opened ahead of time as a slot, for the server's pool
+ * (see pty_pool.h), optionally with a stub already running on it: a fresh
+ * copy of terminator that has made the slave its terminal and waits on a
+ * socket to be told what to run. Starting a command in a slot then skips
+ * setting up the PTY, and with a stub, starting the child as well.
+ */
+
+#ifndef SPAWN_H_INCLUDED
+#define SPAWN_H_INCLUDED
+
+#include <limits.h>
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+/* The argument that tells terminator it has been started as a stub. It is
+ * followed by the path of the slave PTY. */
+#define SPAWN_STUB_ARG "--spawn-stub"
+
+/* How the child is started */
+enum spawn_method {
+    /* posix_spawn where available, otherwise fork. This is the default. */
+    SPAWN_METHOD_AUTO,
+
+    /* Always fork */
+    SPAWN_METHOD_FORK
+};
+
+/* Where the command's standard error goes */
+enum spawn_stderr {
+    /* The same PTY as its standard output, mixed in with it. This is the
+     * default. */
+    SPAWN_STDERR_MERGED,
+
+    /* A pipe of its own, so the command sees that it isn't a terminal */
+    SPAWN_STDERR_PIPE,
+
+    /* A second PTY of its own, so the command still sees a terminal there */
+    SPAWN_STDERR_PTY
+};
+
+/* A PTY opened ahead of time */
+struct spawn_slot {
+    int fdm;
+    int fds;
+    char slave_path[PATH_MAX];
+
+    /* The stub waiting on the slave, and our end of its socket, or -1 */
+    pid_t stub_pid;
+    int stub_fd;
+};
+
+struct spawn_request {
+    /* The command and its arguments, terminated by NULL. The path is searched
+     * if the command name is not a path. */
+    char **argv;
+
+    /* The environment for the command, terminated by NULL, or NULL to pass on
+     * our own. */
+    char **envp;
+
+    /* The directory to run the command in, or NULL to stay where we are. */
+    const char *cwd;
+
+    /* Nonzero to give the command the default handling of SIGPIPE, for
+     * callers that ignore it themselves. Ignored signals would otherwise be
+     * inherited across exec. */
+    int default_sigpipe;
+
+    /* Where the command's standard error goes */
+    enum spawn_stderr stderr_mode;
+
+    /* The window size to give the PTY, and the one for standard error if it
+     * has its own, before the command starts, or NULL to leave it without
+     * one. */
+    const struct winsize *winsize;
+
+    /* How to start the child */
+    enum spawn_method method;
+
+    /* A slot to start the command in instead of a new PTY, or NULL. The
+     * request takes it over. A stub only runs commands with standard error
+     * merged, and any other request just uses its PTY. */
+    struct spawn_slot *slot;
+
+    /* The cgroup.procs file of a cgroup to run the command in, or -1 for
+     * ours. The child has to move itself there, so this always forks, and
+     * any stub in the slot is discarded. */
+    int cgroup_fd;
+};
+
+/* Parse how to start the child: auto or fork. Returns 0 on success or -1 if
+ * the name isn't recognized. */
+int spawn_method_parse(const char *arg, enum spawn_method *method);
+
+/* Parse where standard error goes: merged, pipe or pty. Returns 0 on success
+ * or -1 if the name isn't recognized. */
+int spawn_stderr_parse(const char *arg, enum spawn_stderr *mode);
+
+/* Open a PTY for a slot, raw but with no size, and start a stub on it if
+ * STUB is nonzero and that's possible here. */
+void spawn_slot_open(struct spawn_slot *slot, int stub);
+
+/* Run as the stub for the slave PTY at SLAVE_PATH, with the socket to the
+ * server on standard input, which is where terminator's main hands over when
+ * it sees SPAWN_STUB_ARG. Never returns. */
+void spawn_stub_run(const char *slave_path);
+
+/* Run the requested command on a new PTY. Returns the child's process ID, and
+ * stores the master PTY in *FDM, non-blocking and close-on-exec. Our end of
+ * the command's standard error, set up the same way, goes in *FDE, or -1 if
+ * it is merged with standard output. */
+pid_t spawn_pty(const struct spawn_request *request, int *fdm, int *fde);
+
+#endif /* SPAWN_H_INCLUDED */
@@ -0,0 +1,113 @@
+/* spill.c
+ *
+ * A queue of bytes kept in a file. See spill.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "my_assert.h"
+#include "spill.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+
+/* Try to make the file CAPACITY bytes long, with its blocks allocated so that
+ * writing through the mapping can't fail for want of disk space. Returns
+ * nonzero on success. */
+static int spill_grow(struct spill *spill, size_t capacity);
+
+
+void spill_open(struct spill *spill, const char *dir) {
+    static const char name[] = "/terminator-spill-XXXXXX";
+
+    char *path;
+
+    ASSERT_NONZERO(path = malloc(strlen(dir) + sizeof(name)));
+    strcpy(path, dir);
+    strcat(path, name);
+
+    ASSERT_NONNEG_WITH_MESSAGE(spill->fd = mkostemp(path, O_CLOEXEC),
+                               "Can't create a spill file");
+    ASSERT_ZERO(unlink(path));
+    free(path);
+
+    spill->capacity = 0;
+    spill->head = spill->tail = 0;
+
+    ASSERT_WITH_MESSAGE(spill_grow(spill, SPILL_CHUNK_SIZE),
+                        "Can't make room for a spill file");
+
+    /* Only the part within the file may be touched, but the mapping covers
+     * all it could ever grow to. */
+    spill->data = mmap(NULL, SPILL_MAX_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, spill->fd, 0);
+    ASSERT(spill->data != MAP_FAILED);
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Spilling to fd %d, in %s.\n", spill->fd, dir);
+#endif
+}
+
+
+void spill_close(struct spill *spill) {
+    ASSERT_ZERO(munmap(spill->data, SPILL_MAX_SIZE));
+    ASSERT_ZERO(close(spill->fd));
+    spill->data = NULL;
+    spill->fd = -1;
+}
+
+
+char *spill_reserve(struct spill *spill, size_t *n) {
+    /* With nothing waiting, nothing can be in flight either, so the queue
+     * can start again from the top, and give back the disk beyond its first
+     * chunk. */
+    if (spill->head == spill->tail && spill->tail > 0) {
+        spill->head = spill->tail = 0;
+
+        if (spill->capacity > SPILL_CHUNK_SIZE) {
+            ASSERT_ZERO(ftruncate(spill->fd, SPILL_CHUNK_SIZE));
+            spill->capacity = SPILL_CHUNK_SIZE;
+        }
+    }
+
+    *n = spill_room(spill);
+
+    return spill->data + spill->tail;
+}
+
+
+void spill_produce(struct spill *spill, size_t n) {
+    spill->tail += n;
+
+    /* Keep a good-sized read's worth of room ahead. If the file can't grow,
+     * whatever room is left will be used up first. */
+    if (spill->capacity - spill->tail < SPILL_CHUNK_SIZE / 4 &&
+            spill->capacity <= SPILL_MAX_SIZE - SPILL_CHUNK_SIZE) {
+        spill_grow(spill, spill->capacity + SPILL_CHUNK_SIZE);
+    }
+}
+
+
+static int spill_grow(struct spill *spill, size_t capacity) {
+    if (posix_fallocate(spill->fd, spill->capacity,
+                        capacity - spill->capacity) != 0) {
+#ifdef ASSERT_DEBUG
+        fprintf(stderr, "Can't grow the spill file to %zu bytes.\n",
+                capacity);
+#endif
+        return 0;
+    }
+
+    spill->capacity = capacity;
+
+    return 1;
+}
@@ -0,0 +1,80 @@
+/* spill.h
+ *
+ * A queue of bytes kept in a file, for output that has overflowed its buffer
+ * under --on-backpressure=spill. The file is unlinked as soon as it is made,
+ * so nothing is left behind however we exit, and it is mapped into memory
+ * once at its largest possible size, so that the data can be read into it
+ * and written out of it directly, and a read or write still in flight never
+ * sees it move. The file itself only grows as far as it has to, a chunk at a
+ * time, and shrinks back each time the queue empties. Its pages belong to the
+ * page cache, which can write them out and drop them, so a long stall costs
+ * disk rather than memory.
+ */
+
+#ifndef SPILL_H_INCLUDED
+#define SPILL_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The most a spill file can hold. Once it is full, reading stops, as if
+ * there were no spill file at all. */
+#if SIZE_MAX > 0xffffffffUL
+#define SPILL_MAX_SIZE ((size_t) 64 * 1024 * 1024 * 1024)
+#else
+#define SPILL_MAX_SIZE ((size_t) 256 * 1024 * 1024)
+#endif
+
+/* How much the file grows by at a time */
+#define SPILL_CHUNK_SIZE (1024 * 1024)
+
+struct spill {
+    int fd;
+    char *data;
+
+    /* How big the file is, and where the data in it starts and ends. Data
+     * is only ever added at the end, and the queue goes back to the start
+     * of the file once it is empty. */
+    size_t capacity;
+    size_t head;
+    size_t tail;
+};
+
+/* Make a spill file in DIR. Failing to do so is fatal. */
+void spill_open(struct spill *spill, const char *dir);
+
+/* Remove the spill file and release its mapping. */
+void spill_close(struct spill *spill);
+
+/* Get room to read more data into. Returns where the room starts, and sets
+ * *N to how much of it there is, which is what spill_room says. */
+char *spill_reserve(struct spill *spill, size_t *n);
+
+/* Add N bytes read into the room from spill_reserve to the queue, and grow
+ * the file if the room is running out. */
+void spill_produce(struct spill *spill, size_t n);
+
+/* The number of bytes waiting in the queue. */
+static inline size_t spill_length(const struct spill *spill) {
+    return spill->tail - spill->head;
+}
+
+/* How much more the queue can take without growing the file. Once this is
+ * zero, the file couldn't grow, and nothing more can be spilled until the
+ * queue has drained. */
+static inline size_t spill_room(const struct spill *spill) {
+    return spill->head == spill->tail ? spill->capacity :
+        spill->capacity - spill->tail;
+}
+
+/* Where the data waiting in the queue starts. */
+static inline const char *spill_data(const struct spill *spill) {
+    return spill->data + spill->head;
+}
+
+/* Remove N bytes from the start of the queue. */
+static inline void spill_consume(struct spill *spill, size_t n) {
+    spill->head += n;
+}
+
+#endif /* SPILL_H_INCLUDED */
@@ -0,0 +1,542 @@
+/* stats.c
+ *
+ * Counters and latency histograms for --stats. See stats.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "my_assert.h"
+#include "stats.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* What the self-pipe carries: a request for a report, or for the reporting
+ * thread to finish */
+#define STATS_REPORT_CHAR 'r'
+#define STATS_STOP_CHAR   'q'
+
+
+/* The self-pipe from the SIGUSR1 handler to the reporting thread */
+static int sigusr1_pipe[2] = { -1, -1 };
+
+/* Ask the reporting thread for a report. */
+static void sigusr1_handler(int signo);
+
+/* Body of the reporting thread. */
+static void *report_thread_fn(void *arg);
+
+/* Write a report to a temporary file, then move it into place, so that
+ * whoever reads the file never sees half a report. */
+static void write_report(const struct stats_reporter *reporter);
+
+/* Write the JSON for one direction's figures. */
+static void write_direction(FILE *fp, const char *name,
+                            const struct redirection_stats *stats);
+
+/* Write the JSON for a histogram. */
+static void write_histogram(FILE *fp, const struct stats_histogram *histogram);
+
+/* Write what the command used, and how much we copied for it, as the
+ * "child" member of the report. */
+static void write_child(FILE *fp, const struct stats_reporter *reporter);
+
+/* Add a value to a histogram. */
+static void histogram_record(struct stats_histogram *histogram,
+                             uint64_t value);
+
+/* The bucket a value falls in, and the smallest value in a bucket. */
+static size_t bucket_index(uint64_t value);
+static uint64_t bucket_lowest(size_t index);
+
+/* The value below which the fraction Q of a histogram's values fall, to the
+ * histogram's resolution but no more than MAX. COUNTS is a snapshot of its
+ * counts. */
+static unsigned long long histogram_quantile(const unsigned long long *counts,
+                                             unsigned long long total,
+                                             unsigned long long max, double q);
+
+/* The current monotonic time in nanoseconds. */
+static uint64_t now_ns(void);
+
+
+void stats_init(struct redirection_stats *stats) {
+    size_t i;
+
+    atomic_init(&stats->bytes_read, 0);
+    atomic_init(&stats->bytes_written, 0);
+    atomic_init(&stats->bytes_dropped, 0);
+    atomic_init(&stats->bytes_spilled, 0);
+    atomic_init(&stats->reads, 0);
+    atomic_init(&stats->writes, 0);
+    atomic_init(&stats->short_writes, 0);
+    atomic_init(&stats->would_block, 0);
+    atomic_init(&stats->wakeups, 0);
+    atomic_init(&stats->burst_reads, 0);
+
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        atomic_init(&stats->latency.counts[i], 0);
+    }
+
+    atomic_init(&stats->latency.sum, 0);
+    atomic_init(&stats->latency.max, 0);
+
+    stats->pending_head = 0;
+    stats->pending_length = 0;
+    stats->dropped_read = 0;
+}
+
+
+void stats_read(struct redirection_stats *stats, size_t n) {
+    uint64_t end;
+    struct stats_pending *pending;
+
+    stats_add(&stats->bytes_read, n);
+    end = atomic_load_explicit(&stats->bytes_read, memory_order_relaxed);
+
+    if (stats->pending_length == STATS_PENDING) {
+        /* Out of room, so the newest entry grows to cover this read too. */
+        pending = &stats->pending[(stats->pending_head +
+                                   stats->pending_length - 1) % STATS_PENDING];
+    }
+    else {
+        pending = &stats->pending[(stats->pending_head +
+                                   stats->pending_length) % STATS_PENDING];
+        pending->timestamp = now_ns();
+        stats->pending_length++;
+    }
+
+    pending->end = end;
+}
+
+
+void stats_wrote(struct redirection_stats *stats, size_t n, size_t wanted) {
+    uint64_t written, now;
+
+    stats_add(&stats->bytes_written, n);
+
+    if (n < wanted) {
+        stats_add(&stats->short_writes, 1);
+    }
+
+    written = atomic_load_explicit(&stats->bytes_written,
+                                   memory_order_relaxed) + stats->dropped_read;
+
+    if (stats->pending_length == 0 ||
+            stats->pending[stats->pending_head].end > written) {
+        return;
+    }
+
+    now = now_ns();
+
+    while (stats->pending_length > 0 &&
+            stats->pending[stats->pending_head].end <= written) {
+        histogram_record(&stats->latency,
+                         now - stats->pending[stats->pending_head].timestamp);
+        stats->pending_head = (stats->pending_head + 1) % STATS_PENDING;
+        stats->pending_length--;
+    }
+}
+
+
+void stats_dropped(struct redirection_stats *stats, size_t n, int was_read) {
+    uint64_t gone;
+
+    stats_add(&stats->bytes_dropped, n);
+
+    if (!was_read) {
+        return;
+    }
+
+    stats->dropped_read += n;
+    gone = atomic_load_explicit(&stats->bytes_written, memory_order_relaxed) +
+        stats->dropped_read;
+
+    while (stats->pending_length > 0 &&
+            stats->pending[stats->pending_head].end <= gone) {
+        stats->pending_head = (stats->pending_head + 1) % STATS_PENDING;
+        stats->pending_length--;
+    }
+}
+
+
+void stats_reporter_start(struct stats_reporter *reporter, const char *path,
+                          const struct redirection_stats *stats,
+                          size_t n_stats, struct buffer_pool *pool,
+                          struct pty_pool *pty_pool) {
+    struct sigaction action;
+
+    reporter->path = path;
+    reporter->stats = stats;
+    reporter->n_stats = n_stats;
+    reporter->pool = pool;
+    reporter->pty_pool = pty_pool;
+    reporter->child = NULL;
+    reporter->start_ns = now_ns();
+
+    /* Only the handler's end is nonblocking: if the pipe is full, a report
+     * is already on its way. */
+    ASSERT_ZERO(pipe(sigusr1_pipe));
+    ASSERT_NONNEG(fcntl(sigusr1_pipe[1], F_SETFL, O_NONBLOCK));
+    ASSERT_NONNEG(fcntl(sigusr1_pipe[0], F_SETFD, FD_CLOEXEC));
+    ASSERT_NONNEG(fcntl(sigusr1_pipe[1], F_SETFD, FD_CLOEXEC));
+
+    ASSERT_ZERO(pthread_create(&reporter->thread, NULL, &report_thread_fn,
+                               reporter));
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &sigusr1_handler;
+    action.sa_flags = SA_RESTART;
+    ASSERT_ZERO(sigemptyset(&action.sa_mask));
+    ASSERT_ZERO(sigaction(SIGUSR1, &action, NULL));
+}
+
+
+void stats_reporter_finish(struct stats_reporter *reporter,
+                           const struct child_watch *child) {
+    char stop_char = STATS_STOP_CHAR;
+
+    /* From here on a late SIGUSR1 is ignored rather than killing us, or
+     * writing to whatever ends up with the pipe's descriptor. */
+    ASSERT(signal(SIGUSR1, SIG_IGN) != SIG_ERR);
+
+    ASSERT_NONNEG(write(sigusr1_pipe[1], &stop_char, 1));
+    ASSERT_ZERO(pthread_join(reporter->thread, NULL));
+
+    ASSERT_ZERO(close(sigusr1_pipe[0]));
+    ASSERT_ZERO(close(sigusr1_pipe[1]));
+    sigusr1_pipe[0] = sigusr1_pipe[1] = -1;
+
+    /* Only now that the thread is gone can the child join the report. */
+    reporter->child = child;
+    write_report(reporter);
+}
+
+
+static void sigusr1_handler(int signo) {
+    int saved_errno = errno;
+    char report_char = STATS_REPORT_CHAR;
+
+    if (write(sigusr1_pipe[1], &report_char, 1) < 0) {
+        /* Nothing else we can safely do here. */
+    }
+
+    errno = saved_errno;
+}
+
+
+static void *report_thread_fn(void *arg) {
+    const struct stats_reporter *reporter = arg;
+    char c;
+
+    for (;;) {
+        ssize_t n = read(sigusr1_pipe[0], &c, 1);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        ASSERT_WITH_MESSAGE(n == 1, "Lost the stats self-pipe");
+
+        if (c == STATS_STOP_CHAR) {
+            break;
+        }
+
+        write_report(reporter);
+    }
+
+    return NULL;
+}
+
+
+static void write_report(const struct stats_reporter *reporter) {
+    static const char suffix[] = ".tmp";
+
+    /* In the order of the REDIRECTION_* identifiers */
+    static const char *const names[] = { "input", "output", "error" };
+
+    char *temp_path;
+    FILE *fp;
+    size_t i;
+
+    ASSERT_NONZERO(temp_path = malloc(strlen(reporter->path) + sizeof(suffix)));
+    strcpy(temp_path, reporter->path);
+    strcat(temp_path, suffix);
+
+    ASSERT_NONZERO_WITH_MESSAGE(fp = fopen(temp_path, "w"),
+                                "Can't write the stats file");
+
+    fprintf(fp, "{\n  \"elapsed_ns\": %llu",
+            (unsigned long long) (now_ns() - reporter->start_ns));
+
+    for (i = 0; i < reporter->n_stats &&
+            i < sizeof(names) / sizeof(names[0]); i++) {
+        fprintf(fp, ",\n");
+        write_direction(fp, names[i], &reporter->stats[i]);
+    }
+
+    if (reporter->pool) {
+        struct buffer_pool_stats pool_stats;
+
+        buffer_pool_get_stats(reporter->pool, &pool_stats);
+
+        fprintf(fp,
+                ",\n  \"buffer_pool\": {\n"
+                "    \"slab_size\": %zu,\n"
+                "    \"in_use\": %zu,\n"
+                "    \"high_water\": %zu,\n"
+                "    \"capacity\": %zu,\n"
+                "    \"huge_pages\": %s\n"
+                "  }",
+                pool_stats.slab_size, pool_stats.in_use,
+                pool_stats.high_water, pool_stats.capacity,
+                pool_stats.huge_pages ? "true" : "false");
+    }
+
+    if (reporter->pty_pool) {
+        struct pty_pool_stats pty_stats;
+
+        pty_pool_get_stats(reporter->pty_pool, &pty_stats);
+
+        fprintf(fp,
+                ",\n  \"pty_pool\": {\n"
+                "    \"size\": %zu,\n"
+                "    \"available\": %zu,\n"
+                "    \"stubs\": %s,\n"
+                "    \"hits\": %llu,\n"
+                "    \"misses\": %llu,\n"
+                "    \"opened\": %llu\n"
+                "  }",
+                pty_stats.size, pty_stats.available,
+                pty_stats.stubs ? "true" : "false", pty_stats.hits,
+                pty_stats.misses, pty_stats.opened);
+    }
+
+    if (reporter->child) {
+        write_child(fp, reporter);
+    }
+
+    fprintf(fp, "\n}\n");
+
+    ASSERT_WITH_MESSAGE(!ferror(fp) && fclose(fp) == 0,
+                        "Can't write the stats file");
+    ASSERT_ZERO(rename(temp_path, reporter->path));
+
+    free(temp_path);
+}
+
+
+static void write_direction(FILE *fp, const char *name,
+                            const struct redirection_stats *stats) {
+#define STATS_LOAD(FIELD) \
+    ((unsigned long long) atomic_load_explicit(&stats->FIELD, \
+                                               memory_order_relaxed))
+
+    fprintf(fp,
+            "  \"%s\": {\n"
+            "    \"bytes_read\": %llu,\n"
+            "    \"bytes_written\": %llu,\n"
+            "    \"bytes_dropped\": %llu,\n"
+            "    \"bytes_spilled\": %llu,\n"
+            "    \"reads\": %llu,\n"
+            "    \"writes\": %llu,\n"
+            "    \"short_writes\": %llu,\n"
+            "    \"would_block\": %llu,\n"
+            "    \"wakeups\": %llu,\n"
+            "    \"burst_reads\": %llu,\n"
+            "    \"latency\": ",
+            name, STATS_LOAD(bytes_read), STATS_LOAD(bytes_written),
+            STATS_LOAD(bytes_dropped), STATS_LOAD(bytes_spilled),
+            STATS_LOAD(reads), STATS_LOAD(writes), STATS_LOAD(short_writes),
+            STATS_LOAD(would_block), STATS_LOAD(wakeups),
+            STATS_LOAD(burst_reads));
+
+#undef STATS_LOAD
+
+    write_histogram(fp, &stats->latency);
+    fprintf(fp, "\n  }");
+}
+
+
+static void write_child(FILE *fp, const struct stats_reporter *reporter) {
+    const struct child_watch *child = reporter->child;
+    const struct rusage *usage = &child->usage;
+    unsigned long long copied = 0;
+    size_t i;
+
+    for (i = 0; i < reporter->n_stats; i++) {
+        copied += atomic_load_explicit(&reporter->stats[i].bytes_written,
+                                       memory_order_relaxed);
+    }
+
+    fprintf(fp, ",\n  \"child\": {\n");
+
+    if (WIFEXITED(child->status)) {
+        fprintf(fp, "    \"exit_code\": %d,\n", WEXITSTATUS(child->status));
+    }
+    else if (WIFSIGNALED(child->status)) {
+        fprintf(fp, "    \"signal\": %d,\n", WTERMSIG(child->status));
+    }
+
+    /* ru_maxrss is in kilobytes on Linux; everything else is a count */
+    fprintf(fp,
+            "    \"user_us\": %llu,\n"
+            "    \"system_us\": %llu,\n"
+            "    \"max_rss_kb\": %ld,\n"
+            "    \"minor_faults\": %ld,\n"
+            "    \"major_faults\": %ld,\n"
+            "    \"block_reads\": %ld,\n"
+            "    \"block_writes\": %ld,\n"
+            "    \"voluntary_switches\": %ld,\n"
+            "    \"involuntary_switches\": %ld,\n"
+            "    \"bytes_copied\": %llu\n"
+            "  }",
+            (unsigned long long) usage->ru_utime.tv_sec * 1000000ULL +
+                (unsigned long long) usage->ru_utime.tv_usec,
+            (unsigned long long) usage->ru_stime.tv_sec * 1000000ULL +
+                (unsigned long long) usage->ru_stime.tv_usec,
+            usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt,
+            usage->ru_inblock, usage->ru_oublock, usage->ru_nvcsw,
+            usage->ru_nivcsw, copied);
+}
+
+
+static void write_histogram(FILE *fp, const struct stats_histogram *histogram) {
+    unsigned long long counts[STATS_BUCKETS];
+    unsigned long long total = 0;
+    unsigned long long sum, max;
+    const char *separator = "";
+    size_t i;
+
+    /* The copying thread may be adding to it as we go, so work from one
+     * snapshot to keep the figures consistent with each other. */
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&histogram->counts[i],
+                                         memory_order_relaxed);
+        total += counts[i];
+    }
+
+    sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+    fprintf(fp,
+            "{\n"
+            "      \"count\": %llu,\n"
+            "      \"mean_ns\": %llu,\n"
+            "      \"p50_ns\": %llu,\n"
+            "      \"p90_ns\": %llu,\n"
+            "      \"p99_ns\": %llu,\n"
+            "      \"p999_ns\": %llu,\n"
+            "      \"max_ns\": %llu,\n"
+            "      \"buckets\": [",
+            total, total ? sum / total : 0,
+            histogram_quantile(counts, total, max, 0.5),
+            histogram_quantile(counts, total, max, 0.9),
+            histogram_quantile(counts, total, max, 0.99),
+            histogram_quantile(counts, total, max, 0.999),
+            max);
+
+    /* The nonzero buckets, as [lowest value, count], so that reports can be
+     * merged or plotted later. */
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        if (counts[i]) {
+            fprintf(fp, "%s[%llu, %llu]", separator,
+                    (unsigned long long) bucket_lowest(i), counts[i]);
+            separator = ", ";
+        }
+    }
+
+    fprintf(fp, "]\n    }");
+}
+
+
+static void histogram_record(struct stats_histogram *histogram,
+                             uint64_t value) {
+    stats_add(&histogram->counts[bucket_index(value)], 1);
+    stats_add(&histogram->sum, value);
+
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+
+static size_t bucket_index(uint64_t value) {
+    int magnitude;
+
+    if (value < STATS_SUB_BUCKETS) {
+        return value;
+    }
+
+    magnitude = 63 - __builtin_clzll(value);
+
+    if (magnitude > STATS_MAX_MAGNITUDE) {
+        return STATS_BUCKETS - 1;
+    }
+
+    /* The top STATS_SUB_BUCKET_BITS + 1 bits pick the bucket within the
+     * power of two. */
+    return (magnitude - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS +
+        (value >> (magnitude - STATS_SUB_BUCKET_BITS)) - STATS_SUB_BUCKETS;
+}
+
+
+static uint64_t bucket_lowest(size_t index) {
+    int magnitude;
+
+    if (index < STATS_SUB_BUCKETS) {
+        return index;
+    }
+
+    magnitude = index / STATS_SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+
+    return (uint64_t) (STATS_SUB_BUCKETS + index % STATS_SUB_BUCKETS) <<
+        (magnitude - STATS_SUB_BUCKET_BITS);
+}
+
+
+static unsigned long long histogram_quantile(const unsigned long long *counts,
+                                             unsigned long long total,
+                                             unsigned long long max,
+                                             double q) {
+    unsigned long long seen = 0;
+    uint64_t top;
+    size_t i;
+
+    if (total == 0) {
+        return 0;
+    }
+
+    /* Report the top of the bucket, to err on the side of slower. */
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        seen += counts[i];
+
+        if (seen >= q * total) {
+            break;
+        }
+    }
+
+    top = i + 1 < STATS_BUCKETS ? bucket_lowest(i + 1) - 1 : max;
+
+    return top < max ? top : max;
+}
+
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    ASSERT_ZERO(clock_gettime(CLOCK_MONOTONIC, &now));
+
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
@@ -0,0 +1,155 @@
+/* stats.h
+ *
+ * Counters and a latency histogram for each direction of traffic, for
+ * --stats. Each direction's figures are only ever updated by the thread that
+ * copies it, so updates are plain loads and stores rather than locked
+ * read-modify-writes; they are atomic only so that a report can be taken
+ * from another thread at any time.
+ *
+ * The histogram is HDR-style: every power of two is split into
+ * STATS_SUB_BUCKETS linear steps, so any value is known to within about 6%
+ * from nanoseconds up to hours, in a few kilobytes.
+ */
+
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer_pool.h"
+#include "child_watch.h"
+#include "pty_pool.h"
+
+/* The histogram's resolution and range. Latencies beyond
+ * 2^(STATS_MAX_MAGNITUDE + 1) nanoseconds, over two hours, all land in the
+ * last bucket. */
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_SUB_BUCKETS     (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_MAX_MAGNITUDE   42
+#define STATS_BUCKETS \
+    ((STATS_MAX_MAGNITUDE - STATS_SUB_BUCKET_BITS + 2) * STATS_SUB_BUCKETS)
+
+/* The number of separate reads we remember the time of while their data
+ * waits to be written. Beyond that, reads are lumped in with the one
+ * before, which can only make latencies look worse, never better. */
+#define STATS_PENDING 64
+
+struct stats_histogram {
+    atomic_ullong counts[STATS_BUCKETS];
+    atomic_ullong sum;
+    atomic_ullong max;
+};
+
+/* A read whose data hasn't all been written yet */
+struct stats_pending {
+    /* When the read finished */
+    uint64_t timestamp;
+
+    /* The total bytes read by the end of it */
+    uint64_t end;
+};
+
+/* The figures for one direction */
+struct redirection_stats {
+    atomic_ullong bytes_read;
+    atomic_ullong bytes_written;
+
+    /* Bytes thrown away by --on-backpressure, and those that went by way of
+     * the spill file */
+    atomic_ullong bytes_dropped;
+    atomic_ullong bytes_spilled;
+
+    /* Completed read and write calls, including failed ones */
+    atomic_ullong reads;
+    atomic_ullong writes;
+
+    /* Writes that took less than all the data on offer, and calls that
+     * would have blocked */
+    atomic_ullong short_writes;
+    atomic_ullong would_block;
+
+    /* Times poll woke up with something to do for this direction */
+    atomic_ullong wakeups;
+
+    /* Reads made straight after another, without waiting for more input to
+     * be ready, because the input was sustained */
+    atomic_ullong burst_reads;
+
+    /* From the read that brought a byte in to the write that sent it on */
+    struct stats_histogram latency;
+
+    /* The reads still being written, oldest first, starting at
+     * pending_head. Only the copying thread looks at these. */
+    struct stats_pending pending[STATS_PENDING];
+    size_t pending_head;
+    size_t pending_length;
+
+    /* Bytes counted by stats_read and then dropped, which will never be
+     * written, so that the reads they came in with can still finish */
+    uint64_t dropped_read;
+};
+
+/* Writes reports for both directions to a file, at the end and whenever we
+ * get SIGUSR1 */
+struct stats_reporter {
+    const char *path;
+
+    /* The figures to report, indexed by direction, the pool the buffers
+     * came from, or NULL, and the server's PTY pool, or NULL */
+    const struct redirection_stats *stats;
+    size_t n_stats;
+    struct buffer_pool *pool;
+    struct pty_pool *pty_pool;
+
+    /* The command, once it has been reaped, for the final report, or
+     * NULL */
+    const struct child_watch *child;
+
+    /* The monotonic time when reporting started */
+    uint64_t start_ns;
+
+    /* The thread that writes reports on SIGUSR1 */
+    pthread_t thread;
+};
+
+/* Add N to a counter. Only the thread that owns the counter may call
+ * this. */
+static inline void stats_add(atomic_ullong *counter, unsigned long long n) {
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter, memory_order_relaxed) +
+                              n,
+                          memory_order_relaxed);
+}
+
+/* Zero all the figures. */
+void stats_init(struct redirection_stats *stats);
+
+/* Count a read of N bytes, which is when its latency starts. */
+void stats_read(struct redirection_stats *stats, size_t n);
+
+/* Count a write of N bytes, out of WANTED bytes on offer, and record the
+ * latency of every read it finished. */
+void stats_wrote(struct redirection_stats *stats, size_t n, size_t wanted);
+
+/* Count N bytes dropped, which were counted by stats_read first if WAS_READ
+ * is set. Reads that finish with them record no latency, since their data
+ * never arrived. */
+void stats_dropped(struct redirection_stats *stats, size_t n, int was_read);
+
+/* Start reporting the N_STATS entries of STATS, indexed by direction, and
+ * the usage of POOL and PTY_POOL where they aren't NULL, to the file at PATH
+ * whenever we get SIGUSR1. Each report replaces the last one whole. */
+void stats_reporter_start(struct stats_reporter *reporter, const char *path,
+                          const struct redirection_stats *stats,
+                          size_t n_stats, struct buffer_pool *pool,
+                          struct pty_pool *pty_pool);
+
+/* Stop listening for SIGUSR1, and write the final report, with what CHILD
+ * used if it isn't NULL. CHILD must have been reaped. */
+void stats_reporter_finish(struct stats_reporter *reporter,
+                           const struct child_watch *child);
+
+#endif /* STATS_H_INCLUDED */
@@ -0,0 +1,214 @@
+/* sync_policy.c
+ *
+ * When to flush written data to disk. See sync_policy.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "io_result.h"
+#include "my_assert.h"
+#include "parse.h"
+#include "sync_policy.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+
+/* Body of the background thread used by SYNC_INTERVAL. */
+static void *interval_thread_fn(void *arg);
+
+/* Sync the file descriptor if anything has been written since last time. */
+static void sync_if_dirty(struct syncer *syncer);
+
+/* Sync the file descriptor, unless a sync has already failed, and remember
+ * if this one does. */
+static void sync_now(struct syncer *syncer);
+
+
+int sync_policy_parse(const char *arg, struct sync_policy *policy) {
+    static const char interval_prefix[] = "interval:";
+
+    policy->interval_ms = 0;
+
+    if (strcmp(arg, "never") == 0) {
+        policy->mode = SYNC_NEVER;
+    }
+    else if (strcmp(arg, "eof") == 0) {
+        policy->mode = SYNC_EOF;
+    }
+    else if (strcmp(arg, "every-write") == 0) {
+        policy->mode = SYNC_EVERY_WRITE;
+    }
+    else if (strncmp(arg, interval_prefix, sizeof(interval_prefix) - 1) == 0) {
+        const char *value = arg + sizeof(interval_prefix) - 1;
+        unsigned long interval;
+
+        if (parse_unsigned(value, 1, 24UL * 60 * 60 * 1000, &interval)) {
+            return -1;
+        }
+
+        policy->mode = SYNC_INTERVAL;
+        policy->interval_ms = interval;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void syncer_start(struct syncer *syncer, int fd,
+                  const struct sync_policy *policy) {
+    struct stat fd_stat;
+
+    syncer->fd = fd;
+    syncer->mode = policy->mode;
+    syncer->interval_ms = policy->interval_ms;
+    syncer->thread_running = 0;
+    syncer->stopping = 0;
+    atomic_init(&syncer->dirty, 0);
+    atomic_init(&syncer->error, 0);
+
+    /* fsync fails with EINVAL on pipes, sockets and terminals, and there's
+     * nothing for it to do there anyway. */
+    ASSERT_ZERO(fstat(fd, &fd_stat));
+
+    if (!S_ISREG(fd_stat.st_mode) && !S_ISBLK(fd_stat.st_mode)) {
+        syncer->mode = SYNC_NEVER;
+    }
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Sync mode %d on fd %d.\n", (int) syncer->mode, fd);
+#endif
+
+    if (syncer->mode == SYNC_INTERVAL) {
+        ASSERT_ZERO(pthread_mutex_init(&syncer->lock, NULL));
+        ASSERT_ZERO(pthread_cond_init(&syncer->cond, NULL));
+        ASSERT_ZERO(pthread_create(&syncer->thread, NULL, &interval_thread_fn,
+                                   syncer));
+        syncer->thread_running = 1;
+    }
+}
+
+
+void syncer_wrote(struct syncer *syncer) {
+    switch (syncer->mode) {
+        case SYNC_EVERY_WRITE:
+            sync_now(syncer);
+            break;
+
+        case SYNC_INTERVAL:
+        case SYNC_EOF:
+            /* Just a flag; the actual sync happens elsewhere, off the copy
+             * path. */
+            atomic_store_explicit(&syncer->dirty, 1, memory_order_relaxed);
+            break;
+
+        case SYNC_NEVER:
+            break;
+    }
+}
+
+
+void syncer_finish(struct syncer *syncer) {
+    if (syncer->thread_running) {
+        ASSERT_ZERO(pthread_mutex_lock(&syncer->lock));
+        syncer->stopping = 1;
+        ASSERT_ZERO(pthread_cond_signal(&syncer->cond));
+        ASSERT_ZERO(pthread_mutex_unlock(&syncer->lock));
+
+        ASSERT_ZERO(pthread_join(syncer->thread, NULL));
+        syncer->thread_running = 0;
+
+        ASSERT_ZERO(pthread_cond_destroy(&syncer->cond));
+        ASSERT_ZERO(pthread_mutex_destroy(&syncer->lock));
+    }
+
+    if (syncer->mode == SYNC_INTERVAL || syncer->mode == SYNC_EOF) {
+        sync_if_dirty(syncer);
+    }
+
+    syncer->mode = SYNC_NEVER;
+}
+
+
+int syncer_error(const struct syncer *syncer) {
+    return atomic_load_explicit(&syncer->error, memory_order_relaxed);
+}
+
+
+static void *interval_thread_fn(void *arg) {
+    struct syncer *syncer = arg;
+
+    ASSERT_ZERO(pthread_mutex_lock(&syncer->lock));
+
+    while (!syncer->stopping) {
+        struct timespec deadline;
+        int result;
+
+        ASSERT_ZERO(clock_gettime(CLOCK_REALTIME, &deadline));
+        deadline.tv_sec += syncer->interval_ms / 1000;
+        deadline.tv_nsec += (long) (syncer->interval_ms % 1000) * 1000000L;
+
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        result = pthread_cond_timedwait(&syncer->cond, &syncer->lock,
+                                        &deadline);
+        ASSERT_WITH_MESSAGE(result == 0 || result == ETIMEDOUT,
+                            "Failed to wait for the sync interval");
+
+        if (!syncer->stopping) {
+            /* Don't hold the lock over the sync, or stopping would have to
+             * wait for the disk. */
+            ASSERT_ZERO(pthread_mutex_unlock(&syncer->lock));
+            sync_if_dirty(syncer);
+            ASSERT_ZERO(pthread_mutex_lock(&syncer->lock));
+        }
+    }
+
+    ASSERT_ZERO(pthread_mutex_unlock(&syncer->lock));
+
+    return NULL;
+}
+
+
+static void sync_if_dirty(struct syncer *syncer) {
+    if (atomic_exchange_explicit(&syncer->dirty, 0, memory_order_relaxed)) {
+        sync_now(syncer);
+    }
+}
+
+
+static void sync_now(struct syncer *syncer) {
+    int result;
+
+    /* A disk that has failed once will only fail again, and the data is on
+     * its way to the output either way. */
+    if (syncer_error(syncer) != 0) {
+        return;
+    }
+
+    result = io_fsync(syncer->fd);
+
+    if (result < 0) {
+        atomic_store_explicit(&syncer->error, -result, memory_order_relaxed);
+    }
+
+#ifdef ASSERT_DEBUG
+    fprintf(stderr, "Synced fd %d%s.\n", syncer->fd,
+            result < 0 ? ", unsuccessfully" : "");
+#endif
+}
@@ -0,0 +1,74 @@
+/* sync_policy.h
+ *
+ * When to flush written data to disk. Flushing only means anything for regular
+ * files and block devices, so pipes and terminals are never synced whatever
+ * the policy says.
+ */
+
+#ifndef SYNC_POLICY_H_INCLUDED
+#define SYNC_POLICY_H_INCLUDED
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+enum sync_mode {
+    /* Leave it to the kernel. This is the default. */
+    SYNC_NEVER,
+
+    /* Sync from a background thread at most once per interval, and only if
+     * something was written since the last sync. */
+    SYNC_INTERVAL,
+
+    /* Sync once, when the direction reaches end of file. */
+    SYNC_EOF,
+
+    /* Sync after every write. This is the slowest, and was the only behavior
+     * in older versions. */
+    SYNC_EVERY_WRITE
+};
+
+struct sync_policy {
+    enum sync_mode mode;
+    unsigned interval_ms;
+};
+
+/* The state needed to apply a sync policy to one file descriptor */
+struct syncer {
+    int fd;
+    enum sync_mode mode;
+    unsigned interval_ms;
+
+    /* Set by the copy path after a write, cleared by whoever syncs. */
+    atomic_int dirty;
+
+    /* The first sync that failed, as an errno value, or zero. No more are
+     * tried after that. */
+    atomic_int error;
+
+    /* The background thread used by SYNC_INTERVAL */
+    int thread_running;
+    int stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Parse a policy of the form never, eof, every-write or interval:<ms>.
+ * Returns 0 on success or -1 if the string isn't a valid policy. */
+int sync_policy_parse(const char *arg, struct sync_policy *policy);
+
+/* Start applying POLICY to FD. If FD can't usefully be synced, the policy is
+ * quietly downgraded to SYNC_NEVER. */
+void syncer_start(struct syncer *syncer, int fd,
+                  const struct sync_policy *policy);
+
+/* Note that data was just written to the file descriptor. */
+void syncer_wrote(struct syncer *syncer);
+
+/* Stop applying the policy, doing a final sync if it calls for one. */
+void syncer_finish(struct syncer *syncer);
+
+/* The errno value from the first sync that failed, or zero. */
+int syncer_error(const struct syncer *syncer);
+
+#endif /* SYNC_POLICY_H_INCLUDED */
@@ -18,293 +18,1089 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <termios.h>
+#include <string.h>
 #include <unistd.h>
 
-/* In some environments, we'll be dealing with the STREAMS extension. If it's
- * available, include it. */
-#if defined(_XOPEN_STREAMS) && _XOPEN_STREAMS != -1
-#include <stropts.h>
-#endif
-
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "backpressure_policy.h"
+#include "buffer_pool.h"
+#include "cgroup.h"
+#include "child_watch.h"
+#include "event_loop.h"
+#include "file_sink.h"
+#include "flush_policy.h"
+#include "framing.h"
+#include "io_result.h"
+#include "mux.h"
 #include "my_assert.h"
+#include "parse.h"
+#include "pty_pool.h"
+#include "record.h"
+#include "record_format.h"
+#include "redirect.h"
+#include "remote.h"
+#include "screen.h"
+#include "server.h"
+#include "spawn.h"
+#include "stats.h"
+#include "sync_policy.h"
+#include "winsize_watch.h"
 
 /* The name the my_assert library will use for printing errors */
 #define ASSERT_PROGRAM_NAME "terminator"
 
-/* The number of bytes to read in one go */
-#define BUFFER_SIZE BUFSIZ
 
-#define POLL_TIMEOUT 100
+/* The settings given on the command line */
+struct terminator_options {
+    /* Nonzero to run all directions on one thread rather than one thread
+     * per direction */
+    int event_loop;
+
+    /* How the event loop waits for work */
+    enum event_loop_backend backend;
+
+    /* The socket to serve spawn requests on with --server, or to send our
+     * command to with --remote, or NULL */
+    const char *server_path;
+    const char *remote_path;
+
+    /* The number of worker threads for --server, and its PTY pool */
+    size_t workers;
+    struct pty_pool_config pty_pool;
+
+    /* Nonzero to back the copy buffers with huge pages */
+    int huge_pages;
+
+    /* The file to record the session to with --record, or NULL, and how to
+     * compress it */
+    const char *record_path;
+    int record_codec;
+
+    /* The file to write --stats reports to, or NULL */
+    const char *stats_path;
+
+    /* Where the command's standard error goes */
+    enum spawn_stderr stderr_mode;
+
+    /* The PTY's size from --cols and --rows, with zero for any not given,
+     * and nonzero to follow the size of our own terminal instead */
+    unsigned short cols;
+    unsigned short rows;
+    int mirror_size;
+
+    /* How to start the command */
+    enum spawn_method spawn_method;
+
+    /* Where to make a cgroup for the command with --cgroup, and the limits
+     * to set on it */
+    struct cgroup_config cgroup;
 
+    /* How to frame what we write for --framing */
+    enum framing_mode framing;
 
-struct redirection_info {
-    int id;
-    int in_fd;
-    int out_fd;
-    int send_eot;
-    int end_all;
+    /* The file to read the input from with --input-file, or NULL */
+    const char *input_path;
+
+    /* The file to write the output to with --output-file, or NULL, and
+     * when to rotate it */
+    const char *output_path;
+    struct file_sink_rotation rotation;
+
+    /* The collector to stream the command's I/O to with --connect, or
+     * NULL, and how to compress it */
+    const char *connect_address;
+    int connect_codec;
+
+    /* The settings for copying our standard input to the PTY, and the PTY
+     * to our standard output */
+    struct redirection_config input;
+    struct redirection_config output;
 };
 
-/* Copy all input from one file descriptor into another. */
-static void *redirection_thread_fn(void *arg);
+/* What each thread needs in the one-thread-per-direction mode */
+struct redirection_thread {
+    struct redirection_info *info;
 
+    /* The shutdown pipe. The read end becomes readable, and stays that way,
+     * once the direction with end_all set has finished, which tells every
+     * other direction to wind down. */
+    int stop_fds[2];
 
-#ifdef __sun
-/* Put a terminal into raw mode. This is a library function on most systems,
- * but not Solaris! :D */
-static void cfmakeraw(struct termios *termios_p);
-#endif
+    /* The child to reap as soon as it exits, or NULL */
+    struct child_watch *watch;
+};
 
-#if !defined(_XOPEN_STREAMS) || _XOPEN_STREAMS == -1
-static int isastream(int fd);
-#endif
+/* Parse the command line options into OPTIONS, and return the index of the
+ * first argument of the command to run, if there is one. */
+static int parse_options(int argc, char **argv,
+                         struct terminator_options *options);
+
+/* Print a usage message to FP. */
+static void print_usage(FILE *fp);
+
+/* Copy all input from one file descriptor into another, given a struct
+ * redirection_thread. */
+static void *redirection_thread_fn(void *arg);
 
 
 int main(int argc, char **argv) {
-    /* The master and slave PTY file descriptors, respectively */
-    int fdm, fds;
+    /* The master PTY file descriptor, and our end of the command's standard
+     * error if it has its own, or -1 */
+    int fdm;
+    int fde;
 
     /* The exit status with which we will exit. If we make it to the end
      * without changing the value, something went wrong and we should exit with
      * failure. */
     int exitstatus = EXIT_FAILURE;
 
-    /* The child process ID returned by fork */
+    /* The child process ID returned by spawn_pty */
     pid_t pid;
 
-    /* We need at least one argument, which will be the command to run. */
-    ASSERT_WITH_MESSAGE(argc > 1, "Insufficient command line arguments");
+    /* The status of the child process returned by waitpid */
+    int status;
+
+    struct terminator_options options;
+
+    struct spawn_request request;
 
-    /* Open the PTY multiplexer to get a master PTY. */
-    ASSERT_NONNEG(fdm = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK));
+    struct redirection_info infos[REDIRECTION_MAX_DIRECTIONS];
+    struct redirection_info *reader_info = &infos[REDIRECTION_INPUT];
+    struct redirection_info *writer_info = &infos[REDIRECTION_OUTPUT];
+    struct redirection_info *error_info = &infos[REDIRECTION_ERROR];
+    size_t n_infos;
+    size_t i;
 
-    /* Allow a slave PTY to be opened. */
-    ASSERT_ZERO(grantpt(fdm));
-    ASSERT_ZERO(unlockpt(fdm));
+    /* The settings for copying the command's separate standard error to
+     * ours */
+    struct redirection_config error;
 
-    /* The child process opens a slave PTY. */
-    ASSERT_NONNEG(fds = open(ptsname(fdm), O_RDWR | O_NOCTTY));
+    struct child_watch watch;
 
-    /* Fork a child process. */
-    ASSERT_NONNEG(pid = fork());
+    /* Where both directions get their buffers */
+    struct buffer_pool pool;
 
-    if (pid == 0) {
-        struct termios fds_settings;
+    /* The capture for --record */
+    struct recorder recorder;
 
-        /* In some environments, we'll be dealing with the STREAMS extension.
-         * If it's available, see if we need to do any configuration. */
-#if defined(_XOPEN_STREAMS)  && _XOPEN_STREAMS != -1
-        /* System V implementations need STREAMS configuration for the slave
-         * PTY. */
-        if (isastream(fds)) {
-            ASSERT_NONNEG(ioctl(fds, I_PUSH, "ptem"));
-            ASSERT_NONNEG(ioctl(fds, I_PUSH, "ldterm"));
+    /* The size the PTY starts with, if any, and what keeps it in step with
+     * our own terminal for --mirror-size */
+    struct winsize size;
+    struct winsize_watch winsize_watch;
+    int mirroring = 0;
+
+    /* The figures for --stats, indexed by direction */
+    struct redirection_stats stats[REDIRECTION_MAX_DIRECTIONS];
+    struct stats_reporter reporter;
+
+    /* The PTYs a server keeps ready */
+    struct pty_pool pty_pool;
+
+    /* What numbers the frames for --framing */
+    struct framer framer;
+
+    /* Where the output goes with --output-file, and our standard output
+     * otherwise */
+    struct file_sink sink;
+    int output_fd = STDOUT_FILENO;
+
+    /* Where the input comes from: --input-file, or our standard input */
+    int input_fd = STDIN_FILENO;
+
+    /* The command's own cgroup for --cgroup */
+    struct cgroup cgroup;
+
+    /* The connection for --connect, and the command's session on it */
+    struct mux mux;
+    struct mux_session *mux_session = NULL;
+
+    /* The index in argv of the command to run */
+    int command_index;
+
+    /* A stub from the server's PTY pool only waits to be told what to
+     * run. */
+    if (argc == 3 && strcmp(argv[1], SPAWN_STUB_ARG) == 0) {
+        spawn_stub_run(argv[2]);
+    }
+
+    command_index = parse_options(argc, argv, &options);
+
+    /* Connect before starting anything, so that a collector that isn't
+     * there is all we have to report. */
+    if (options.connect_address) {
+        mux_start(&mux, options.connect_address, options.connect_codec);
+    }
+
+    if (options.server_path) {
+        if (options.pty_pool.size > 0) {
+            pty_pool_start(&pty_pool, &options.pty_pool);
         }
-#endif
 
-        /* Enable raw mode on the slave PTY. */
-        ASSERT_ZERO(tcgetattr(fds, &fds_settings));
-        cfmakeraw(&fds_settings);
-        ASSERT_ZERO(tcsetattr(fds, TCSANOW, &fds_settings));
+        /* The server runs until it is killed, so its only reports are the
+         * ones asked for with SIGUSR1. */
+        if (options.stats_path) {
+            stats_reporter_start(&reporter, options.stats_path, NULL, 0, NULL,
+                                 options.pty_pool.size > 0 ? &pty_pool :
+                                                             NULL);
+        }
+
+        server_run(options.server_path, options.workers, options.huge_pages,
+                   options.spawn_method,
+                   options.pty_pool.size > 0 ? &pty_pool : NULL,
+                   options.connect_address ? &mux : NULL,
+                   &options.input, &options.output);
+        return EXIT_SUCCESS;
+    }
+
+    if (options.remote_path) {
+        return remote_run(options.remote_path, argv + command_index);
+    }
+
+    /* Run the specified command, passing all command line arguments. */
+    request.argv = argv + command_index;
+    request.envp = NULL;
+    request.cwd = NULL;
+
+    /* --connect ignores SIGPIPE, which the command shouldn't inherit. */
+    request.default_sigpipe = options.connect_address != NULL;
+    request.stderr_mode = options.stderr_mode;
+    request.winsize = NULL;
+    request.method = options.spawn_method;
+    request.slot = NULL;
+    request.cgroup_fd = -1;
+
+    if (options.cgroup.parent) {
+        cgroup_create(&cgroup, &options.cgroup);
+        request.cgroup_fd = cgroup.procs_fd;
+    }
+
+    /* A PTY starts out with no size at all. Give it ours, or the one asked
+     * for. The screen model for --snapshot has to be the same size as the
+     * command thinks its terminal is, so it always gets one. */
+    if (options.mirror_size &&
+            winsize_watch_get(STDIN_FILENO, &size) == 0) {
+        request.winsize = &size;
+        mirroring = 1;
+    }
+    else if (options.cols || options.rows || options.output.snapshot) {
+        size.ws_row = options.rows ? options.rows : SCREEN_DEFAULT_ROWS;
+        size.ws_col = options.cols ? options.cols : SCREEN_DEFAULT_COLS;
+        size.ws_xpixel = size.ws_ypixel = 0;
+        request.winsize = &size;
+    }
+
+    pid = spawn_pty(&request, &fdm, &fde);
+    n_infos = fde >= 0 ? 3 : 2;
 
-        ASSERT_NONNEG(setsid());
+    if (options.record_path) {
+        recorder_start(&recorder, options.record_path, options.record_codec);
 
-        /* And duplicates all its I/O to that slave PTY. */
-        ASSERT_NONNEG(dup2(fds, STDIN_FILENO));
-        ASSERT_NONNEG(dup2(fds, STDOUT_FILENO));
-        ASSERT_NONNEG(dup2(fds, STDERR_FILENO));
+        if (request.winsize) {
+            recorder_winsize(&recorder, request.winsize);
+        }
 
-        ASSERT_ZERO(close(fdm));
-        ASSERT_ZERO(close(fds));
+        options.input.recorder = options.output.recorder = &recorder;
+    }
 
-        ASSERT_NONNEG(ioctl(0, TIOCSCTTY, 0));
+    if (options.output.snapshot) {
+        options.output.snapshot_rows = size.ws_row;
+        options.output.snapshot_cols = size.ws_col;
+    }
 
-        /* Then it runs the specified command, passing all command line
-         * arguments. */
-        ASSERT_ZERO(execvp(argv[1], argv + 1));
+    if (options.framing != FRAMING_RAW) {
+        framer_init(&framer, options.framing);
+        options.output.framer = &framer;
     }
-    else{
-        /* The status of the child process returned by waitpid */
-        int status;
 
-        pthread_t reader_thread, writer_thread;
+    if (options.input_path) {
+        ASSERT_NONNEG_WITH_MESSAGE(input_fd = open(options.input_path,
+                                                   O_RDONLY | O_CLOEXEC),
+                                   "Can't open the input file");
+    }
 
-        struct redirection_info reader_info = { 0, STDIN_FILENO, fdm, 1, 0 };
-        struct redirection_info writer_info = { 1, fdm, STDOUT_FILENO, 0, 1 };
+    if (options.output_path) {
+        file_sink_open(&sink, options.output_path, &options.rotation);
+        options.output.sink = &sink;
+        output_fd = sink.fd;
+    }
 
-        void *reader_status, *writer_status;
+    if (options.connect_address) {
+        ASSERT_NONZERO_WITH_MESSAGE(
+            mux_session = mux_open(&mux, argv + command_index, &output_fd,
+                                   &input_fd),
+            "Lost the --connect connection"
+        );
+    }
 
-        pthread_create(&reader_thread, NULL, &redirection_thread_fn,
-                       &reader_info);
+    buffer_pool_init(&pool, options.output.buffer_size, options.huge_pages);
+    options.input.pool = options.output.pool = &pool;
 
-        pthread_create(&writer_thread, NULL, &redirection_thread_fn,
-                       &writer_info);
+    /* Standard error is copied like standard output, but --sync is only
+     * about standard output. */
+    error = options.output;
+    error.sync.mode = SYNC_NEVER;
+    error.sync.interval_ms = 0;
 
-        ASSERT_ZERO(close(fds));
+    /* A pipe has no screen, so standard error is passed on as it comes. */
+    error.snapshot = 0;
 
-        /* Wait for the child process to exit. */
-        ASSERT_NONNEG(waitpid(pid, &status, 0));
+    if (options.stats_path) {
+        for (i = 0; i < n_infos; i++) {
+            stats_init(&stats[i]);
+        }
 
-#ifdef ASSERT_DEBUG
-        fscanf(stderr, "Child exited.\n");
-#endif
+        options.input.stats = &stats[REDIRECTION_INPUT];
+        options.output.stats = &stats[REDIRECTION_OUTPUT];
+        error.stats = &stats[REDIRECTION_ERROR];
+        stats_reporter_start(&reporter, options.stats_path, stats, n_infos,
+                             &pool, NULL);
+    }
 
-        pthread_join(reader_thread, &reader_status);
-        pthread_join(writer_thread, &writer_status);
+    redirection_init(reader_info, REDIRECTION_INPUT, input_fd, fdm,
+                     1, 0, &options.input);
+    redirection_init(writer_info, REDIRECTION_OUTPUT, fdm, output_fd,
+                     0, 1, &options.output);
+
+    /* The command's standard error closes when it exits, like the PTY, but
+     * either may be noticed first. Whatever is left in the pipe or the
+     * second PTY still has to be passed on after the output is done. */
+    if (fde >= 0) {
+        redirection_init(error_info, REDIRECTION_ERROR, fde, STDERR_FILENO,
+                         0, 0, &error);
+        error_info->wait_eof = 1;
+    }
+
+    if (mirroring) {
+        int pty_fds[WINSIZE_WATCH_MAX_FDS];
+        size_t n_pty_fds = 0;
+
+        pty_fds[n_pty_fds++] = fdm;
 
-        /* Check if the child process exited safely, and if so, capture its
-         * exit status. */
-        if (WIFEXITED(status)) {
-            exitstatus = WEXITSTATUS(status);
+        if (options.stderr_mode == SPAWN_STDERR_PTY) {
+            pty_fds[n_pty_fds++] = fde;
         }
 
-        /* Close the master PTY. */
-        ASSERT_ZERO(close(fdm));
+        winsize_watch_start(&winsize_watch, STDIN_FILENO, pty_fds, n_pty_fds,
+                            options.record_path ? &recorder : NULL,
+                            options.output.snapshot ? writer_info : NULL);
     }
 
-    /* Exit with the exit code gotten from the child process. */
-    return exitstatus;
-}
+    child_watch_start(&watch, pid);
 
+    if (options.event_loop) {
+        event_loop_run(infos, n_infos, &watch, options.backend);
+    }
+    else {
+        pthread_t threads[REDIRECTION_MAX_DIRECTIONS];
 
-static void *redirection_thread_fn(void *arg) {
-    static volatile int all_done = 0;
+        struct redirection_thread thread_args[REDIRECTION_MAX_DIRECTIONS];
+
+        /* Nothing reads the pipe, so once a byte is written it wakes every
+         * poll on it from then on. */
+        int stop_fds[2];
 
-    int keep_going = 1;
-    int found_eof = 0;
+        ASSERT_ZERO(pipe(stop_fds));
+        ASSERT_NONNEG(fcntl(stop_fds[0], F_SETFD, FD_CLOEXEC));
+        ASSERT_NONNEG(fcntl(stop_fds[1], F_SETFD, FD_CLOEXEC));
 
-    struct redirection_info *info = arg;
+        for (i = 0; i < n_infos; i++) {
+            thread_args[i].info = &infos[i];
+            thread_args[i].stop_fds[0] = stop_fds[0];
+            thread_args[i].stop_fds[1] = stop_fds[1];
 
-    struct pollfd poll_fds[2];
+            /* The writer finishes when the child's side of the PTY closes,
+             * so it is the one to watch for the child's exit. */
+            thread_args[i].watch = i == REDIRECTION_OUTPUT ? &watch : NULL;
 
-    char *buffer;
-    size_t buffer_length = 0;
-    size_t buffer_offset = 0;
+            ASSERT_ZERO(pthread_create(&threads[i], NULL,
+                                       &redirection_thread_fn,
+                                       &thread_args[i]));
+        }
 
-    ASSERT_NONZERO(buffer = malloc(BUFFER_SIZE));
+        for (i = 0; i < n_infos; i++) {
+            ASSERT_ZERO(pthread_join(threads[i], NULL));
+        }
 
-    poll_fds[0].fd = info->in_fd;
-    poll_fds[0].events = POLLIN;
+        ASSERT_ZERO(close(stop_fds[0]));
+        ASSERT_ZERO(close(stop_fds[1]));
+    }
 
-    poll_fds[1].fd = info->out_fd;
-    poll_fds[1].events = POLLOUT;
+    /* The screen goes with the writer, so stop resizing it first. */
+    if (mirroring) {
+        winsize_watch_finish(&winsize_watch);
+    }
 
-    while ((keep_going &= !all_done) || buffer_length) {
-        ASSERT_NONNEG(poll(poll_fds, 2, POLL_TIMEOUT));
+    for (i = 0; i < n_infos; i++) {
+        redirection_destroy(&infos[i]);
+    }
 
-        if (poll_fds[0].revents & POLLHUP && !(poll_fds[0].revents & POLLIN)) {
-#ifdef ASSERT_DEBUG
-            fprintf(stderr, "%d: Hangup on fd %d.\n", info->id, poll_fds[0].fd);
-#endif
-            poll_fds[0].fd = -1;
-            found_eof = 1;
+    /* Losing output was asked for, but it shouldn't go unnoticed. */
+    for (i = REDIRECTION_OUTPUT; i < n_infos; i++) {
+        if (infos[i].dropped > 0) {
+            fprintf(stderr, "%s: Dropped %llu bytes of %s\n",
+                    ASSERT_PROGRAM_NAME, infos[i].dropped,
+                    i == REDIRECTION_OUTPUT ? "output" : "standard error");
         }
+    }
 
-        if (poll_fds[1].revents & POLLHUP) {
-#ifdef ASSERT_DEBUG
-            fprintf(stderr, "%d: Hangup on fd %d.\n", info->id, poll_fds[1].fd);
-#endif
-            poll_fds[1].fd = -1;
-            keep_going = 0;
-            buffer_offset = 0;
-            buffer_length = 0;
+    /* An error only ends its own direction, so the command still gets to
+     * finish, but some of what passed through may have been lost. */
+    for (i = 0; i < n_infos; i++) {
+        int error_fd;
+        int error = redirection_error(&infos[i], &error_fd);
+
+        if (error != 0) {
+            fprintf(stderr, "%s: Error on fd %d: %s\n", ASSERT_PROGRAM_NAME,
+                    error_fd, strerror(error));
         }
+    }
 
-        if (keep_going && !found_eof && poll_fds[0].revents & POLLIN &&
-                buffer_length == 0
-           ) {
-            size_t n_read;
+    /* Close the master PTY. Normally the child is gone by now, but if our
+     * output went away first, this hangs up its terminal rather than leaving
+     * it blocked on a full PTY forever. */
+    ASSERT_ZERO(close(fdm));
 
-            ASSERT_NONNEG(n_read = read(poll_fds[0].fd, buffer, BUFFER_SIZE));
+    if (fde >= 0) {
+        ASSERT_ZERO(close(fde));
+    }
 
-            buffer_offset = 0;
-            buffer_length = n_read;
+    /* Closing our end of the output pipe is what tells the mux that the
+     * output is over. */
+    if (options.connect_address) {
+        ASSERT_ZERO(close(output_fd));
+        ASSERT_ZERO(close(input_fd));
+    }
 
-#ifdef ASSERT_DEBUG
-            fprintf(stderr, "%d: Read %d bytes on fd %d.\n", info->id, n_read,
-                    poll_fds[0].fd);
-#endif
+    /* Wait for the child process to exit, if it hasn't already been
+     * reaped. */
+    child_watch_finish(&watch);
+    status = watch.status;
+
+    /* The final report has what the command used, now that it is known. */
+    if (options.stats_path) {
+        stats_reporter_finish(&reporter, &watch);
+    }
+
+    buffer_pool_destroy(&pool);
+
+    if (options.cgroup.parent) {
+        cgroup_destroy(&cgroup);
+    }
+
+    if (options.record_path) {
+        recorder_exit(&recorder, status);
+        recorder_finish(&recorder);
+    }
+
+    if (options.connect_address) {
+        int result;
+
+        mux_exit(&mux, mux_session, status);
+
+        if ((result = mux_finish(&mux)) < 0) {
+            fprintf(stderr, "%s: Lost the connection to %s: %s\n",
+                    ASSERT_PROGRAM_NAME, options.connect_address,
+                    strerror(-result));
+        }
+    }
+
+    /* Check if the child process exited safely, and if so, capture its exit
+     * status. */
+    if (WIFEXITED(status)) {
+        exitstatus = WEXITSTATUS(status);
+    }
+
+    /* The exit status comes after everything else the command wrote, unless
+     * our output has already gone. */
+    if (options.framing != FRAMING_RAW && !writer_info->out_hangup) {
+        char frame[FRAMING_MAX_OVERHEAD];
+        struct iovec iov;
+        ssize_t result;
+
+        iov.iov_base = frame;
+        iov.iov_len = framer_exit_frame(&framer, REDIRECTION_OUTPUT, status,
+                                        exitstatus, frame);
+
+        result = options.output_path ? file_sink_writev(&sink, &iov, 1) :
+            io_writev(STDOUT_FILENO, &iov, 1, 1);
 
-            if (n_read == 0) {
-                poll_fds[0].fd = -1;
-                found_eof = 1;
-            }
+        if (result < 0 && io_classify(result) != IO_HANGUP) {
+            fprintf(stderr, "%s: Error on fd %d: %s\n", ASSERT_PROGRAM_NAME,
+                    output_fd, strerror(-result));
         }
+    }
 
-        if (poll_fds[1].revents & POLLOUT) {
-            if (buffer_length > 0) {
-                size_t n_written;
+    if (options.input_path) {
+        ASSERT_ZERO(close(input_fd));
+    }
 
-                ASSERT_NONNEG(n_written = write(
-                    poll_fds[1].fd, buffer + buffer_offset, buffer_length
-                ));
-                ASSERT_ZERO(fsync(poll_fds[1].fd));
+    if (options.output_path) {
+        int result = file_sink_close(&sink);
 
-                buffer_offset += n_written;
-                buffer_length -= n_written;
+        if (result < 0) {
+            fprintf(stderr, "%s: Error on fd %d: %s\n", ASSERT_PROGRAM_NAME,
+                    output_fd, strerror(-result));
+        }
+    }
 
-#ifdef ASSERT_DEBUG
-                fprintf(stderr, "%d: Wrote %d bytes on fd %d. ",
-                    info->id, n_written, poll_fds[1].fd
+    /* Exit with the exit code gotten from the child process. */
+    return exitstatus;
+}
+
+
+static int parse_options(int argc, char **argv,
+                         struct terminator_options *options) {
+    static const struct option long_options[] = {
+        { "backend",     required_argument, NULL, 'B' },
+        { "buffer-size", required_argument, NULL, 'b' },
+        { "cgroup",      required_argument, NULL, 'C' },
+        { "cgroup-limit", required_argument, NULL, 'j' },
+        { "cols",        required_argument, NULL, 'c' },
+        { "connect",     required_argument, NULL, 'X' },
+        { "connect-compression", required_argument, NULL, 'Z' },
+        { "event-loop",  no_argument,       NULL, 'e' },
+        { "normalize-crlf", no_argument,    NULL, 'N' },
+        { "on-backpressure", required_argument, NULL, 'D' },
+        { "output-file", required_argument, NULL, 'W' },
+        { "pty-pool",    required_argument, NULL, 'o' },
+        { "pty-pool-rate", required_argument, NULL, 'O' },
+        { "pty-pool-stubs", no_argument,    NULL, 'k' },
+        { "strip-ansi",  no_argument,       NULL, 'A' },
+        { "stderr",      required_argument, NULL, 'E' },
+        { "flush",       required_argument, NULL, 'f' },
+        { "framing",     required_argument, NULL, 'F' },
+        { "help",        no_argument,       NULL, 'h' },
+        { "snapshot",    no_argument,       NULL, 'P' },
+        { "spawn",       required_argument, NULL, 'p' },
+        { "snapshot-interval", required_argument, NULL, 'i' },
+        { "huge-pages",  no_argument,       NULL, 'H' },
+        { "input-file",  required_argument, NULL, 'I' },
+        { "mirror-size", no_argument,       NULL, 'm' },
+        { "rows",        required_argument, NULL, 'l' },
+        { "record",      required_argument, NULL, 'r' },
+        { "record-compression", required_argument, NULL, 'z' },
+        { "remote",      required_argument, NULL, 'R' },
+        { "rotate",      required_argument, NULL, 'L' },
+        { "server",      required_argument, NULL, 'S' },
+        { "stats",       required_argument, NULL, 'T' },
+        { "sync",        required_argument, NULL, 's' },
+        { "workers",     required_argument, NULL, 'w' },
+        { NULL,          0,                 NULL, 0   }
+    };
+
+    int opt;
+    unsigned long workers;
+    unsigned long interval_ms;
+    unsigned long size;
+    unsigned long pool_size;
+
+    options->event_loop = 0;
+    options->backend = EVENT_LOOP_POLL;
+    options->server_path = NULL;
+    options->remote_path = NULL;
+    options->workers = 0;
+    pty_pool_config_init(&options->pty_pool);
+    options->huge_pages = 0;
+    options->record_path = NULL;
+    options->record_codec = RECORD_CODEC_NONE;
+    options->stats_path = NULL;
+    options->stderr_mode = SPAWN_STDERR_MERGED;
+    options->cols = options->rows = 0;
+    options->mirror_size = 0;
+    options->spawn_method = SPAWN_METHOD_AUTO;
+    cgroup_config_init(&options->cgroup);
+    options->framing = FRAMING_RAW;
+    options->input_path = NULL;
+    options->output_path = NULL;
+    options->rotation.bytes = 0;
+    options->rotation.interval_ms = 0;
+    options->connect_address = NULL;
+    options->connect_codec = RECORD_CODEC_NONE;
+
+    /* Syncing the master PTY would be meaningless, and holding back what is
+     * typed would only get in the way, so only the output direction ever
+     * gets a sync or flush policy. */
+    redirection_config_init(&options->input);
+    redirection_config_init(&options->output);
+
+    /* Output is passed through untouched, so it can skip user space when the
+     * file descriptors allow. */
+    options->output.zero_copy = 1;
+
+    /* The leading '+' stops option parsing at the first non-option, so that
+     * the command's own options are passed through untouched. */
+    while ((opt = getopt_long(argc, argv, "+AB:b:C:c:D:E:eF:f:HhI:i:j:kL:l:mNO:o:Pp:R:r:S:s:T:W:w:X:Z:z:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'A':
+                options->output.filter |= TEXT_FILTER_STRIP_ANSI;
+                break;
+
+            case 'B':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    event_loop_backend_parse(optarg, &options->backend),
+                    "Invalid event loop backend"
                 );
-                fprintf(stderr, "%d bytes remain in buffer.\n",
-                    buffer_length
+                break;
+
+            case 'b':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    parse_size(optarg, REDIRECTION_MIN_BUFFER_SIZE,
+                               REDIRECTION_MAX_BUFFER_SIZE,
+                               &options->output.buffer_size),
+                    "Invalid buffer size"
                 );
-#endif
-            }
-            else if (found_eof) {
-                char eot_char = 0x04;
+                options->input.buffer_size = options->output.buffer_size;
+                break;
 
-                if (info->send_eot && (isastream(poll_fds[1].fd) ||
-                                       isatty(poll_fds[1].fd))
-                   ) {
-                    ASSERT_NONNEG(write(poll_fds[1].fd, &eot_char, 1));
-                    ASSERT_ZERO(fsync(poll_fds[1].fd));
+            case 'C':
+                options->cgroup.parent = optarg;
+                break;
 
-#ifdef ASSERT_DEBUG
-                    fprintf(stderr, "%d: Wrote EOT on fd %d. ",
-                        info->id, poll_fds[1].fd
-                    );
-                    fprintf(stderr, "%d bytes remain in buffer.\n",
-                        buffer_length
-                    );
-#endif
-                }
-                else {
-                    ASSERT_NONNEG(write(poll_fds[1].fd, &eot_char, 0));
-                    ASSERT_ZERO(fsync(poll_fds[1].fd));
+            case 'c':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    parse_unsigned(optarg, 1, USHRT_MAX, &size),
+                    "Invalid number of columns"
+                );
+                options->cols = size;
+                break;
+
+            case 'D':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    backpressure_policy_parse(optarg,
+                                              &options->output.backpressure),
+                    "Invalid backpressure policy"
+                );
+                break;
 
-#ifdef ASSERT_DEBUG
-                    fprintf(stderr, "%d: Wrote 0 bytes on fd %d. ",
-                        info->id, poll_fds[1].fd
-                    );
-                    fprintf(stderr, "%d bytes remain in buffer.\n",
-                        buffer_length
-                    );
-#endif
-                }
+            case 'E':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    spawn_stderr_parse(optarg, &options->stderr_mode),
+                    "Invalid standard error mode"
+                );
+                break;
+
+            case 'e':
+                options->event_loop = 1;
+                break;
+
+            case 'F':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    framing_parse(optarg, &options->framing),
+                    "Invalid framing"
+                );
+                break;
+
+            case 'f':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    flush_policy_parse(optarg, &options->output.flush),
+                    "Invalid flush policy"
+                );
+                break;
+
+            case 'H':
+                options->huge_pages = 1;
+                break;
+
+            case 'I':
+                options->input_path = optarg;
+                /* A file can be written to the PTY straight out of a
+                 * mapping, with no need to read it. */
+                options->input.zero_copy = 1;
+                break;
+
+            case 'i':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    parse_unsigned(optarg, 1,
+                                   REDIRECTION_MAX_SNAPSHOT_INTERVAL_MS,
+                                   &interval_ms),
+                    "Invalid snapshot interval"
+                );
+                options->output.snapshot = 1;
+                options->output.snapshot_interval_ms = interval_ms;
+                break;
+
+            case 'j':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    cgroup_limit_parse(optarg, &options->cgroup),
+                    "Invalid cgroup limit"
+                );
+                break;
+
+            case 'k':
+                options->pty_pool.stubs = 1;
+                break;
+
+            case 'L':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    file_sink_rotation_parse(optarg, &options->rotation),
+                    "Invalid rotation"
+                );
+                break;
+
+            case 'l':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    parse_unsigned(optarg, 1, USHRT_MAX, &size),
+                    "Invalid number of rows"
+                );
+                options->rows = size;
+                break;
+
+            case 'm':
+                options->mirror_size = 1;
+                break;
+
+            case 'N':
+                options->output.filter |= TEXT_FILTER_NORMALIZE_CRLF;
+                break;
+
+            case 'O':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    parse_unsigned(optarg, 0, PTY_POOL_MAX_RATE,
+                                   &options->pty_pool.rate),
+                    "Invalid PTY pool refill rate"
+                );
+                break;
+
+            case 'o':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    parse_unsigned(optarg, 0, PTY_POOL_MAX_SIZE, &pool_size),
+                    "Invalid PTY pool size"
+                );
+                options->pty_pool.size = pool_size;
+                break;
+
+            case 'P':
+                options->output.snapshot = 1;
+                break;
+
+            case 'p':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    spawn_method_parse(optarg, &options->spawn_method),
+                    "Invalid spawn method"
+                );
+                break;
+
+            case 'R':
+                options->remote_path = optarg;
+                break;
+
+            case 'r':
+                options->record_path = optarg;
+                break;
+
+            case 'S':
+                options->server_path = optarg;
+                break;
+
+            case 's':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    sync_policy_parse(optarg, &options->output.sync),
+                    "Invalid sync policy"
+                );
+                break;
+
+            case 'T':
+                options->stats_path = optarg;
+                break;
 
-                keep_going = 0;
-            }
+            case 'W':
+                options->output_path = optarg;
+                break;
+
+            case 'w':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    parse_unsigned(optarg, 1, SERVER_MAX_WORKERS, &workers),
+                    "Invalid number of workers"
+                );
+                options->workers = workers;
+                break;
+
+            case 'X':
+                options->connect_address = optarg;
+                break;
+
+            case 'Z':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    recorder_codec_parse(optarg, &options->connect_codec),
+                    "Invalid or unsupported connect compression"
+                );
+                break;
+
+            case 'z':
+                ASSERT_ZERO_WITH_MESSAGE(
+                    recorder_codec_parse(optarg, &options->record_codec),
+                    "Invalid or unsupported record compression"
+                );
+                break;
+
+            case 'h':
+                print_usage(stdout);
+                exit(EXIT_SUCCESS);
+
+            default:
+                print_usage(stderr);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    /* A server takes its commands from the socket. Otherwise we need at
+     * least one argument, which will be the command to run. */
+    if (options->server_path) {
+        ASSERT_WITH_MESSAGE(optind == argc && !options->remote_path,
+                            "--server doesn't take a command");
+        ASSERT_WITH_MESSAGE(!options->record_path,
+                            "--record doesn't work with --server");
+        ASSERT_WITH_MESSAGE(options->stderr_mode == SPAWN_STDERR_MERGED,
+                            "--stderr doesn't work with --server");
+        ASSERT_WITH_MESSAGE(!options->output.snapshot,
+                            "--snapshot doesn't work with --server");
+        ASSERT_WITH_MESSAGE(options->output.backpressure.mode ==
+                                BACKPRESSURE_BLOCK,
+                            "--on-backpressure doesn't work with --server");
+        ASSERT_WITH_MESSAGE(options->framing == FRAMING_RAW,
+                            "--framing doesn't work with --server");
+        ASSERT_WITH_MESSAGE(!options->output_path,
+                            "--output-file doesn't work with --server");
+        ASSERT_WITH_MESSAGE(!options->cgroup.parent,
+                            "--cgroup doesn't work with --server");
+        ASSERT_WITH_MESSAGE(!options->input_path,
+                            "--input-file doesn't work with --server");
+        ASSERT_WITH_MESSAGE(!options->cols && !options->rows &&
+                            !options->mirror_size,
+                            "--cols, --rows and --mirror-size don't work "
+                            "with --server");
+
+        if (options->workers == 0) {
+            options->workers = server_default_workers();
+        }
+
+        return optind;
+    }
+
+    ASSERT_WITH_MESSAGE(optind < argc, "Insufficient command line arguments");
+    ASSERT_WITH_MESSAGE(options->pty_pool.size == 0 &&
+                        !options->pty_pool.stubs,
+                        "--pty-pool only works with --server");
+    ASSERT_WITH_MESSAGE(!(options->record_path && options->remote_path),
+                        "--record doesn't work with --remote");
+    ASSERT_WITH_MESSAGE(!(options->stats_path && options->remote_path),
+                        "--stats doesn't work with --remote");
+    ASSERT_WITH_MESSAGE(!(options->stderr_mode != SPAWN_STDERR_MERGED &&
+                          options->remote_path),
+                        "--stderr doesn't work with --remote");
+    ASSERT_WITH_MESSAGE(!(options->output.snapshot && options->remote_path),
+                        "--snapshot doesn't work with --remote");
+    ASSERT_WITH_MESSAGE(!(options->output.backpressure.mode !=
+                              BACKPRESSURE_BLOCK && options->remote_path),
+                        "--on-backpressure doesn't work with --remote");
+    ASSERT_WITH_MESSAGE(!((options->cols || options->rows ||
+                           options->mirror_size) && options->remote_path),
+                        "--cols, --rows and --mirror-size don't work with "
+                        "--remote");
+    ASSERT_WITH_MESSAGE(!(options->mirror_size &&
+                          (options->cols || options->rows)),
+                        "--mirror-size doesn't work with --cols or --rows");
+    ASSERT_WITH_MESSAGE(!(options->framing != FRAMING_RAW &&
+                          options->remote_path),
+                        "--framing doesn't work with --remote");
+    ASSERT_WITH_MESSAGE(!(options->output_path && options->remote_path),
+                        "--output-file doesn't work with --remote");
+    ASSERT_WITH_MESSAGE(options->output_path ||
+                        (!options->rotation.bytes &&
+                         !options->rotation.interval_ms),
+                        "--rotate only works with --output-file");
+    ASSERT_WITH_MESSAGE(!(options->cgroup.parent && options->remote_path),
+                        "--cgroup doesn't work with --remote");
+    ASSERT_WITH_MESSAGE(!(options->input_path && options->remote_path),
+                        "--input-file doesn't work with --remote");
+    ASSERT_WITH_MESSAGE(options->cgroup.parent ||
+                        options->cgroup.n_limits == 0,
+                        "--cgroup-limit only works with --cgroup");
+    ASSERT_WITH_MESSAGE(!(options->connect_address && options->remote_path),
+                        "--connect doesn't work with --remote");
+
+    /* The connection takes the place of our standard input and output, and
+     * says how the command exited itself. */
+    ASSERT_WITH_MESSAGE(!(options->connect_address &&
+                          (options->input_path || options->output_path ||
+                           options->framing != FRAMING_RAW)),
+                        "--connect doesn't work with --input-file, "
+                        "--output-file or --framing");
+
+    /* A frame is only written whole, so it can't hold back part of a line
+     * or be dropped part way, and a snapshot has its own layout. */
+    ASSERT_WITH_MESSAGE(!(options->framing != FRAMING_RAW &&
+                          (options->output.snapshot ||
+                           options->output.flush.mode == FLUSH_LINE ||
+                           options->output.backpressure.mode !=
+                               BACKPRESSURE_BLOCK)),
+                        "--framing doesn't work with --snapshot, --flush=line "
+                        "or --on-backpressure");
+
+    if (options->event_loop) {
+        options->backend = event_loop_backend_resolve(options->backend);
+
+        /* io_uring does its own reads and writes, so splice is out. */
+        if (options->backend == EVENT_LOOP_IO_URING) {
+            options->output.zero_copy = 0;
         }
     }
 
-    free(buffer);
+    return optind;
+}
+
+
+static void print_usage(FILE *fp) {
+    fprintf(fp,
+        "Usage: %s [options] command [arg...]\n"
+        "       %s [options] --server=SOCKET\n"
+        "\n"
+        "Options:\n"
+        "  -A, --strip-ansi        Remove escape sequences, such as colours and\n"
+        "                          cursor movement, from the output\n"
+        "  -B, --backend=NAME      With --event-loop, wait for I/O with poll\n"
+        "                          (the default), io_uring, or auto to use\n"
+        "                          io_uring where the kernel supports it\n"
+        "  -b, --buffer-size=SIZE  Buffer up to SIZE bytes in each direction,\n"
+        "                          with an optional K, M or G suffix\n"
+        "                          (default 64K)\n"
+        "  -C, --cgroup=DIR        Run the command in a cgroup of its own made\n"
+        "                          under the cgroup v2 directory DIR\n"
+        "  -c, --cols=N            Give the PTY N columns (default 80 if\n"
+        "                          only --rows is given)\n"
+        "  -X, --connect=HOST:PORT Stream the command's I/O to a collector\n"
+        "                          at HOST:PORT over TCP, rather than our\n"
+        "                          standard input and output; with --server,\n"
+        "                          every command's, on one connection\n"
+        "  -Z, --connect-compression=CODEC\n"
+        "                          Compress what --connect sends with none\n"
+        "                          (the default), zstd or lz4, where built in\n"
+        "  -D, --on-backpressure=POLICY\n"
+        "                          What to do when the output buffer is\n"
+        "                          full: block (the default), drop-oldest,\n"
+        "                          drop-newest or spill:<dir>\n"
+        "  -E, --stderr=MODE       Give the command's standard error its own\n"
+        "                          pipe or pty, copied to ours, rather than\n"
+        "                          merged (the default) into standard output\n"
+        "  -e, --event-loop        Run all I/O on a single thread\n"
+        "  -F, --framing=FORMAT    Write the output as frames with a length,\n"
+        "                          stream, time and sequence number, then an\n"
+        "                          exit status frame: raw (the default, no\n"
+        "                          frames), length-prefixed or jsonl\n"
+        "  -f, --flush=POLICY      When to write the command's output:\n"
+        "                          immediate (the default), line,\n"
+        "                          bytes:<n> or latency:<us>\n"
+        "  -H, --huge-pages        Back the buffers with huge pages where\n"
+        "                          possible\n"
+        "  -I, --input-file=FILE   Feed the command FILE, rather than our\n"
+        "                          standard input, by way of a mapping where\n"
+        "                          possible\n"
+        "  -i, --snapshot-interval=MS\n"
+        "                          Like --snapshot, but also write the rows\n"
+        "                          that changed every MS milliseconds\n"
+        "  -j, --cgroup-limit=FILE=VALUE\n"
+        "                          With --cgroup, write VALUE to the cgroup's\n"
+        "                          FILE, such as memory.max or cpu.max\n"
+        "  -L, --rotate=POLICY     With --output-file, start a new file at\n"
+        "                          size:<n> bytes or every interval:<ms>\n"
+        "  -l, --rows=N            Give the PTY N rows (default 24 if only\n"
+        "                          --cols is given)\n"
+        "  -m, --mirror-size       Keep the PTY the same size as the terminal\n"
+        "                          on our standard input, as it changes\n"
+        "  -N, --normalize-crlf    Turn CR LF and lone CRs in the output into LF\n"
+        "  -o, --pty-pool=N        With --server, keep N PTYs set up ready\n"
+        "                          for new commands\n"
+        "  -O, --pty-pool-rate=N   Open at most N PTYs a second to refill the\n"
+        "                          pool (default 100, 0 for no limit)\n"
+        "  -k, --pty-pool-stubs    Start a stub process on each pooled PTY,\n"
+        "                          waiting to run the next command\n"
+        "  -P, --snapshot          Run the output through a model of the\n"
+        "                          screen, and write only what is on it at\n"
+        "                          the end\n"
+        "  -p, --spawn=METHOD      Start the command with posix_spawn where\n"
+        "                          possible (auto, the default) or fork\n"
+        "  -r, --record=FILE       Also record everything that passes through\n"
+        "                          the PTY, with timings, to FILE\n"
+        "  -R, --remote=SOCKET     Run the command in the server listening\n"
+        "                          on SOCKET\n"
+        "  -S, --server=SOCKET     Listen on SOCKET and run the commands\n"
+        "                          sent by --remote, all in one process\n"
+        "  -s, --sync=POLICY       When to fsync standard output: never (the\n"
+        "                          default), interval:<ms>, eof or every-write\n"
+        "  -T, --stats=FILE        Write counters and latencies as JSON to\n"
+        "                          FILE at exit, and on SIGUSR1\n"
+        "  -W, --output-file=FILE  Write the output to FILE through a memory\n"
+        "                          mapping, rather than to standard output\n"
+        "  -w, --workers=N         With --server, run I/O on N threads (default\n"
+        "                          one per CPU)\n"
+        "  -z, --record-compression=CODEC\n"
+        "                          Compress the --record file with none (the\n"
+        "                          default), zstd or lz4, where built in\n"
+        "  -h, --help              Show this message and exit\n",
+        ASSERT_PROGRAM_NAME, ASSERT_PROGRAM_NAME
+    );
+}
+
+
+static void *redirection_thread_fn(void *arg) {
+    struct redirection_thread *thread = arg;
+    struct redirection_info *info = thread->info;
+
+    /* The two sides of the direction, the shutdown pipe, and the child */
+    struct pollfd poll_fds[4];
+
+    char stop_char = 0;
+
+    for (;;) {
+        redirection_prepare(info);
+
+        if (!redirection_active(info)) {
+            break;
+        }
+
+        redirection_poll_setup(info, &poll_fds[0].fd, &poll_fds[0].events,
+                               &poll_fds[1].fd, &poll_fds[1].events);
+
+        poll_fds[2].fd = info->wait_eof ? -1 : thread->stop_fds[0];
+        poll_fds[2].events = POLLIN;
+
+        poll_fds[3].fd = thread->watch && !thread->watch->exited ?
+            thread->watch->fd : -1;
+        poll_fds[3].events = POLLIN;
+
+        if (redirection_poll(poll_fds, 4,
+                             redirection_timeout(info)) < 0) {
+            /* Without pidfds, SIGCHLD may interrupt us; that's what the
+             * self-pipe is for. */
+            ASSERT(errno == EINTR);
+            continue;
+        }
+
+        if (poll_fds[2].revents) {
+            redirection_stop(info);
+        }
+
+        if (poll_fds[3].revents) {
+            child_watch_check(thread->watch);
+        }
+
+        redirection_handle(info, poll_fds[0].revents, poll_fds[1].revents);
+    }
 
     if (info->end_all) {
 #ifdef ASSERT_DEBUG
         fprintf(stderr, "%d: And we are all done!\n", info->id);
 #endif
-        all_done = 1;
+        ASSERT_NONNEG(write(thread->stop_fds[1], &stop_char, 1));
     }
 
 #ifdef ASSERT_DEBUG
@@ -313,29 +1109,3 @@ static void *redirection_thread_fn(void *arg) {
 
     return NULL;
 }
-
-
-#ifdef __sun
-/* Put a terminal into raw mode. This is a library function on most systems,
- * but not Solaris! :D */
-static void cfmakeraw(struct termios *termios_p) {
-    /* This implementation is taken from the Linux man page for termios(3). */
-    termios_p->c_iflag &= ~(IMAXBEL | IGNBRK | BRKINT | PARMRK | ISTRIP |
-                            INLCR | IGNCR | ICRNL | IXON);
-    termios_p->c_oflag &= ~OPOST;
-    termios_p->c_lflag &= ~(ECHO | ECHONL | /* ICANON |*/ ISIG | IEXTEN);
-    termios_p->c_cflag &= ~(CSIZE | PARENB);
-    termios_p->c_cflag |= CS8;
-}
-#endif
-
-
-#if !defined(_XOPEN_STREAMS) || _XOPEN_STREAMS == -1
-/* Check if a file descriptor is actually a stream. If the OS doesn't support
- * the STREAMS extension, this cannot be so. In that case, we define this
- * function to always be false. */
-static int isastream(int fd) {
-    return 0;
-}
-#endif
-
@@ -0,0 +1,375 @@
+/* text_filter.c
+ *
+ * Turn terminal output into plain text as it is copied. See text_filter.h
+ * for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <string.h>
+
+/* The vector scans need the compiler's intrinsics and builtins. AVX2 is
+ * compiled in alongside SSE2, but only used if the CPU turns out to have
+ * it. */
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define TEXT_FILTER_SSE2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__ARM_NEON) && defined(__aarch64__)
+#define TEXT_FILTER_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "text_filter.h"
+
+/* The bytes the state machine cares about */
+#define TEXT_FILTER_BEL 0x07
+#define TEXT_FILTER_CAN 0x18
+#define TEXT_FILTER_SUB 0x1a
+#define TEXT_FILTER_ESC 0x1b
+
+
+/* Where the next byte that is kept goes, as a position in the iovecs being
+ * filtered */
+struct filter_output {
+    const struct iovec *iov;
+    int index;
+    size_t offset;
+    size_t length;
+};
+
+/* Filter N bytes from DATA, which must be at or after OUTPUT's position. */
+static void filter_run(struct text_filter *filter,
+                       struct filter_output *output,
+                       const unsigned char *data, size_t n);
+
+/* Handle a byte while in an escape sequence. Returns zero if the byte
+ * wasn't used up and should be looked at again in the new state. */
+static int filter_escape(struct text_filter *filter,
+                         struct filter_output *output, unsigned char c);
+
+/* Pass on a control character, applying TEXT_FILTER_NORMALIZE_CRLF. */
+static void put_control(struct text_filter *filter,
+                        struct filter_output *output, unsigned char c);
+
+/* Keep N bytes from DATA, moving them up if anything before them was
+ * dropped. */
+static void output_put(struct filter_output *output,
+                       const unsigned char *data, size_t n);
+
+/* The ways to find the first of two bytes in a run */
+static size_t scan_scalar(const unsigned char *data, size_t n,
+                          unsigned char a, unsigned char b);
+
+#ifdef TEXT_FILTER_SSE2
+static size_t scan_sse2(const unsigned char *data, size_t n,
+                        unsigned char a, unsigned char b);
+static size_t scan_avx2(const unsigned char *data, size_t n,
+                        unsigned char a, unsigned char b)
+    __attribute__((target("avx2")));
+#endif
+
+#ifdef TEXT_FILTER_NEON
+static size_t scan_neon(const unsigned char *data, size_t n,
+                        unsigned char a, unsigned char b);
+#endif
+
+
+void text_filter_init(struct text_filter *filter, unsigned flags) {
+    filter->flags = flags;
+    filter->state = TEXT_FILTER_GROUND;
+    filter->after_cr = 0;
+
+#if defined(TEXT_FILTER_SSE2)
+    __builtin_cpu_init();
+    filter->scan = __builtin_cpu_supports("avx2") ? &scan_avx2 : &scan_sse2;
+#elif defined(TEXT_FILTER_NEON)
+    filter->scan = &scan_neon;
+#else
+    filter->scan = &scan_scalar;
+#endif
+}
+
+
+size_t text_filter_apply(struct text_filter *filter, const struct iovec *iov,
+                         int iov_count, size_t n) {
+    struct filter_output output;
+    int i;
+
+    output.iov = iov;
+    output.index = 0;
+    output.offset = 0;
+    output.length = 0;
+
+    for (i = 0; i < iov_count && n > 0; i++) {
+        size_t length = n < iov[i].iov_len ? n : iov[i].iov_len;
+
+        filter_run(filter, &output, iov[i].iov_base, length);
+        n -= length;
+    }
+
+    return output.length;
+}
+
+
+static void filter_run(struct text_filter *filter,
+                       struct filter_output *output,
+                       const unsigned char *data, size_t n) {
+    const unsigned char *end = data + n;
+
+    /* The bytes that interrupt plain text. If only one is wanted, both are
+     * the same. */
+    unsigned char a = filter->flags & TEXT_FILTER_STRIP_ANSI ?
+        TEXT_FILTER_ESC : '\r';
+    unsigned char b = filter->flags & TEXT_FILTER_NORMALIZE_CRLF ?
+        '\r' : TEXT_FILTER_ESC;
+
+    while (data < end) {
+        size_t run;
+
+        if (filter->state != TEXT_FILTER_GROUND) {
+            if (filter_escape(filter, output, *data)) {
+                data++;
+            }
+            continue;
+        }
+
+        if (filter->after_cr && *data == '\n') {
+            filter->after_cr = 0;
+            data++;
+            continue;
+        }
+
+        run = filter->scan(data, end - data, a, b);
+
+        if (run > 0) {
+            output_put(output, data, run);
+            filter->after_cr = 0;
+            data += run;
+            continue;
+        }
+
+        if (*data == TEXT_FILTER_ESC) {
+            filter->state = TEXT_FILTER_ESCAPE;
+        }
+        else {
+            put_control(filter, output, *data);
+        }
+
+        data++;
+    }
+}
+
+
+static int filter_escape(struct text_filter *filter,
+                         struct filter_output *output, unsigned char c) {
+    /* CAN and SUB cancel any sequence. */
+    if (c == TEXT_FILTER_CAN || c == TEXT_FILTER_SUB) {
+        filter->state = TEXT_FILTER_GROUND;
+        return 1;
+    }
+
+    switch (filter->state) {
+        case TEXT_FILTER_ESCAPE:
+        case TEXT_FILTER_ESCAPE_INTERMEDIATE:
+            if (c == TEXT_FILTER_ESC) {
+                filter->state = TEXT_FILTER_ESCAPE;
+            }
+            else if (c < 0x20) {
+                /* Terminals act on control characters in the middle of a
+                 * sequence, so they are text as far as we're concerned. */
+                put_control(filter, output, c);
+            }
+            else if (c < 0x30) {
+                filter->state = TEXT_FILTER_ESCAPE_INTERMEDIATE;
+            }
+            else if (filter->state == TEXT_FILTER_ESCAPE && c == '[') {
+                filter->state = TEXT_FILTER_CSI;
+            }
+            else if (filter->state == TEXT_FILTER_ESCAPE &&
+                     (c == ']' || c == 'P' || c == 'X' || c == '^' ||
+                      c == '_')) {
+                filter->state = TEXT_FILTER_STRING;
+            }
+            else {
+                /* A final byte, or something that can't be part of a
+                 * sequence at all */
+                filter->state = TEXT_FILTER_GROUND;
+            }
+            break;
+
+        case TEXT_FILTER_CSI:
+            if (c == TEXT_FILTER_ESC) {
+                filter->state = TEXT_FILTER_ESCAPE;
+            }
+            else if (c < 0x20) {
+                put_control(filter, output, c);
+            }
+            else if (c >= 0x40) {
+                /* Parameters and intermediates are 0x20 to 0x3f, and
+                 * anything else ends the sequence. */
+                filter->state = TEXT_FILTER_GROUND;
+            }
+            break;
+
+        case TEXT_FILTER_STRING:
+            if (c == TEXT_FILTER_BEL) {
+                filter->state = TEXT_FILTER_GROUND;
+            }
+            else if (c == TEXT_FILTER_ESC) {
+                filter->state = TEXT_FILTER_STRING_ESCAPE;
+            }
+            break;
+
+        case TEXT_FILTER_STRING_ESCAPE:
+            if (c == '\\') {
+                filter->state = TEXT_FILTER_GROUND;
+                break;
+            }
+
+            /* Not a string terminator after all, but the start of a new
+             * sequence. */
+            filter->state = TEXT_FILTER_ESCAPE;
+            return 0;
+
+        case TEXT_FILTER_GROUND:
+            break;
+    }
+
+    return 1;
+}
+
+
+static void put_control(struct text_filter *filter,
+                        struct filter_output *output, unsigned char c) {
+    unsigned char newline = '\n';
+
+    if (filter->flags & TEXT_FILTER_NORMALIZE_CRLF) {
+        if (c == '\r') {
+            output_put(output, &newline, 1);
+            filter->after_cr = 1;
+            return;
+        }
+
+        if (c == '\n' && filter->after_cr) {
+            filter->after_cr = 0;
+            return;
+        }
+    }
+
+    output_put(output, &c, 1);
+    filter->after_cr = 0;
+}
+
+
+static void output_put(struct filter_output *output,
+                       const unsigned char *data, size_t n) {
+    /* Output never gets ahead of the input, so there's always room. */
+    while (n > 0) {
+        const struct iovec *iov = &output->iov[output->index];
+        unsigned char *destination =
+            (unsigned char *) iov->iov_base + output->offset;
+        size_t room = iov->iov_len - output->offset;
+        size_t length = n < room ? n : room;
+
+        /* Until something is dropped, everything is already in place. */
+        if (destination != data) {
+            memmove(destination, data, length);
+        }
+
+        output->offset += length;
+        output->length += length;
+        data += length;
+        n -= length;
+
+        if (output->offset == iov->iov_len) {
+            output->index++;
+            output->offset = 0;
+        }
+    }
+}
+
+
+static size_t scan_scalar(const unsigned char *data, size_t n,
+                          unsigned char a, unsigned char b) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (data[i] == a || data[i] == b) {
+            return i;
+        }
+    }
+
+    return n;
+}
+
+
+#ifdef TEXT_FILTER_SSE2
+static size_t scan_sse2(const unsigned char *data, size_t n,
+                        unsigned char a, unsigned char b) {
+    const __m128i va = _mm_set1_epi8((char) a);
+    const __m128i vb = _mm_set1_epi8((char) b);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                                  _mm_cmpeq_epi8(v, vb)));
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + scan_scalar(data + i, n - i, a, b);
+}
+
+
+static size_t scan_avx2(const unsigned char *data, size_t n,
+                        unsigned char a, unsigned char b) {
+    const __m256i va = _mm256_set1_epi8((char) a);
+    const __m256i vb = _mm256_set1_epi8((char) b);
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                            _mm256_cmpeq_epi8(v, vb)));
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + scan_sse2(data + i, n - i, a, b);
+}
+#endif
+
+
+#ifdef TEXT_FILTER_NEON
+static size_t scan_neon(const unsigned char *data, size_t n,
+                        unsigned char a, unsigned char b) {
+    const uint8x16_t va = vdupq_n_u8(a);
+    const uint8x16_t vb = vdupq_n_u8(b);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(data + i);
+        uint8x16_t match = vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb));
+
+        /* Narrow each byte of the match to four bits, which packs the whole
+         * thing into 64 bits. */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+
+        if (mask) {
+            return i + __builtin_ctzll(mask) / 4;
+        }
+    }
+
+    return i + scan_scalar(data + i, n - i, a, b);
+}
+#endif
@@ -0,0 +1,72 @@
+/* text_filter.h
+ *
+ * Turn terminal output into plain text as it is copied, for --strip-ansi and
+ * --normalize-crlf. The filter is a streaming state machine, so an escape
+ * sequence split between two reads is still recognized, and it only ever
+ * removes or replaces bytes, so it can work in place on data just read into
+ * the ring buffer.
+ *
+ * Most output has no escapes or carriage returns in it at all, so the bytes
+ * the filter cares about are searched for 16 or 32 at a time with SSE2 or
+ * AVX2 on x86, or NEON on ARM, and runs without them are left exactly where
+ * they are.
+ */
+
+#ifndef TEXT_FILTER_H_INCLUDED
+#define TEXT_FILTER_H_INCLUDED
+
+#include <stddef.h>
+
+#include <sys/uio.h>
+
+/* What to filter out, as a bitmask */
+
+/* Remove escape sequences, such as colours and cursor movement: CSI
+ * sequences, OSC, DCS and the other string sequences, and two and three byte
+ * escapes. Control characters other than ESC are kept. */
+#define TEXT_FILTER_STRIP_ANSI     0x1
+
+/* Turn CR LF and lone CRs, as a progress meter uses, into LF. */
+#define TEXT_FILTER_NORMALIZE_CRLF 0x2
+
+/* Where the state machine is between reads */
+enum text_filter_state {
+    TEXT_FILTER_GROUND,
+
+    /* After ESC, and after ESC and intermediate bytes */
+    TEXT_FILTER_ESCAPE,
+    TEXT_FILTER_ESCAPE_INTERMEDIATE,
+
+    /* In a control sequence, after ESC [ */
+    TEXT_FILTER_CSI,
+
+    /* In a string such as OSC or DCS, waiting for BEL or ESC \, and after an
+     * ESC in one */
+    TEXT_FILTER_STRING,
+    TEXT_FILTER_STRING_ESCAPE
+};
+
+struct text_filter {
+    unsigned flags;
+    enum text_filter_state state;
+
+    /* Nonzero if the last byte passed on was a CR turned into LF, so an LF
+     * straight after it should be dropped */
+    int after_cr;
+
+    /* Find the first of two bytes in a run, using the best instructions the
+     * CPU has. Returns N if neither is there. */
+    size_t (*scan)(const unsigned char *data, size_t n, unsigned char a,
+                   unsigned char b);
+};
+
+/* Set up a filter that does what FLAGS asks for. */
+void text_filter_init(struct text_filter *filter, unsigned flags);
+
+/* Filter the N bytes at the start of IOV in place. The bytes that are kept
+ * are moved up to close the gaps, filling IOV in order. Returns how many
+ * there are. */
+size_t text_filter_apply(struct text_filter *filter, const struct iovec *iov,
+                         int iov_count, size_t n);
+
+#endif /* TEXT_FILTER_H_INCLUDED */
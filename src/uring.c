@@ -0,0 +1,187 @@
+/* uring.c
+ *
+ * A minimal wrapper around the raw io_uring system calls. See uring.h for
+ * details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "my_assert.h"
+#include "uring.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+
+/* Fill in ring->supported from the kernel's probe. */
+static void probe_opcodes(struct uring *ring);
+
+
+int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    char *sq_ring, *cq_ring;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+
+    if (ring->fd < 0) {
+        return -errno;
+    }
+
+    /* We rely on reads and writes at the current file position, which came
+     * along in the same release as IORING_REGISTER_PROBE. */
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        ASSERT_ZERO(close(ring->fd));
+        return -ENOSYS;
+    }
+
+    ring->sq_ring_size = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels map both rings at once. */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ASSERT(ring->sq_ring != MAP_FAILED);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        ASSERT(ring->cq_ring != MAP_FAILED);
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ASSERT(ring->sqes != MAP_FAILED);
+
+    sq_ring = ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    cq_ring = ring->cq_ring;
+    ring->cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+    probe_opcodes(ring);
+
+    return 0;
+}
+
+
+void uring_destroy(struct uring *ring) {
+    ASSERT_ZERO(munmap(ring->sqes, ring->sqes_size));
+
+    if (ring->cq_ring != ring->sq_ring) {
+        ASSERT_ZERO(munmap(ring->cq_ring, ring->cq_ring_size));
+    }
+
+    ASSERT_ZERO(munmap(ring->sq_ring, ring->sq_ring_size));
+    ASSERT_ZERO(close(ring->fd));
+
+    ring->fd = -1;
+}
+
+
+int uring_opcode_supported(const struct uring *ring, int opcode) {
+    return opcode >= 0 && opcode < 256 && ring->supported[opcode];
+}
+
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (ring->sqe_tail - head > *ring->sq_mask) {
+        return NULL;
+    }
+
+    sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sq_array[ring->sqe_tail & *ring->sq_mask] =
+        ring->sqe_tail & *ring->sq_mask;
+    ring->sqe_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr) {
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    int result;
+
+    /* Publish the new entries before telling the kernel about them. */
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    result = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                     wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    return result < 0 ? -errno : result;
+}
+
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+static void probe_opcodes(struct uring *ring) {
+    struct io_uring_probe *probe;
+    size_t probe_size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int i;
+
+    ASSERT_NONZERO(probe = calloc(1, probe_size));
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe,
+                256) == 0) {
+        for (i = 0; i < probe->ops_len && i < 256; i++) {
+            ring->supported[i] =
+                (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+        }
+    }
+
+    free(probe);
+}
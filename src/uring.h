@@ -0,0 +1,75 @@
+/* uring.h
+ *
+ * A minimal wrapper around the raw io_uring system calls: set up the rings,
+ * queue submissions, and reap completions. This avoids depending on liburing
+ * for the handful of operations the event loop needs.
+ */
+
+#ifndef URING_H_INCLUDED
+#define URING_H_INCLUDED
+
+#include <stddef.h>
+
+#include <linux/io_uring.h>
+
+/* Older kernel headers don't have IORING_OP_WAITID, which appeared in Linux
+ * 6.7. Its value is fixed by the kernel ABI, and whether the running kernel
+ * supports it is checked with uring_opcode_supported anyway. */
+#if !HAVE_DECL_IORING_OP_WAITID
+#define IORING_OP_WAITID 50
+#endif
+
+struct uring {
+    int fd;
+
+    /* The submission queue, shared with the kernel */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    /* Our copy of the submission tail, published on submit */
+    unsigned sqe_tail;
+
+    /* The completion queue, shared with the kernel */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* The mappings, for cleaning up */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /* Which opcodes the kernel supports, from IORING_REGISTER_PROBE */
+    unsigned char supported[256];
+};
+
+/* Set up a ring with room for ENTRIES submissions. Returns 0 on success, or
+ * a negated errno value if the kernel won't give us one. */
+int uring_init(struct uring *ring, unsigned entries);
+
+/* Tear down the ring. */
+void uring_destroy(struct uring *ring);
+
+/* Nonzero if the running kernel supports OPCODE. */
+int uring_opcode_supported(const struct uring *ring, int opcode);
+
+/* Get a cleared submission entry to fill in, or NULL if the queue is full. */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* Submit everything queued, and wait until at least WAIT_NR completions are
+ * available. Returns the number submitted, or a negated errno value. */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+
+/* The oldest unreaped completion, or NULL if there is none. */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+/* Mark the completion from uring_peek_cqe as reaped. */
+void uring_cqe_seen(struct uring *ring);
+
+#endif /* URING_H_INCLUDED */
@@ -0,0 +1,160 @@
+/* winsize_watch.c
+ *
+ * Keep the PTY the same size as the terminal we are running on. See
+ * winsize_watch.h for details.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "my_assert.h"
+#include "winsize_watch.h"
+
+/* The name the my_assert library will use for printing errors */
+#define ASSERT_PROGRAM_NAME "terminator"
+
+/* What the self-pipe carries: a change of size, or a request for the thread
+ * to finish */
+#define WINSIZE_CHANGE_CHAR 'w'
+#define WINSIZE_STOP_CHAR   'q'
+
+
+/* The self-pipe from the SIGWINCH handler to the watching thread */
+static int sigwinch_pipe[2] = { -1, -1 };
+
+/* Tell the watching thread the size has changed. */
+static void sigwinch_handler(int signo);
+
+/* Body of the watching thread. */
+static void *watch_thread_fn(void *arg);
+
+
+int winsize_watch_get(int fd, struct winsize *size) {
+    if (ioctl(fd, TIOCGWINSZ, size) < 0 || size->ws_row == 0 ||
+            size->ws_col == 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void winsize_watch_start(struct winsize_watch *watch, int source_fd,
+                         const int *fds, size_t n_fds,
+                         struct recorder *recorder,
+                         struct redirection_info *info) {
+    struct sigaction action;
+    size_t i;
+
+    watch->source_fd = source_fd;
+    watch->n_fds = n_fds < WINSIZE_WATCH_MAX_FDS ? n_fds :
+        WINSIZE_WATCH_MAX_FDS;
+    watch->recorder = recorder;
+    watch->info = info;
+
+    for (i = 0; i < watch->n_fds; i++) {
+        watch->fds[i] = fds[i];
+    }
+
+    /* Only the handler's end is nonblocking: if the pipe is full, the
+     * thread has a look coming anyway. */
+    ASSERT_ZERO(pipe(sigwinch_pipe));
+    ASSERT_NONNEG(fcntl(sigwinch_pipe[1], F_SETFL, O_NONBLOCK));
+    ASSERT_NONNEG(fcntl(sigwinch_pipe[0], F_SETFD, FD_CLOEXEC));
+    ASSERT_NONNEG(fcntl(sigwinch_pipe[1], F_SETFD, FD_CLOEXEC));
+
+    ASSERT_ZERO(pthread_create(&watch->thread, NULL, &watch_thread_fn,
+                               watch));
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &sigwinch_handler;
+    action.sa_flags = SA_RESTART;
+    ASSERT_ZERO(sigemptyset(&action.sa_mask));
+    ASSERT_ZERO(sigaction(SIGWINCH, &action, NULL));
+}
+
+
+void winsize_watch_finish(struct winsize_watch *watch) {
+    char stop_char = WINSIZE_STOP_CHAR;
+
+    /* SIGWINCH is ignored by default, which is what we want from here
+     * on. */
+    ASSERT(signal(SIGWINCH, SIG_DFL) != SIG_ERR);
+
+    ASSERT_NONNEG(write(sigwinch_pipe[1], &stop_char, 1));
+    ASSERT_ZERO(pthread_join(watch->thread, NULL));
+
+    ASSERT_ZERO(close(sigwinch_pipe[0]));
+    ASSERT_ZERO(close(sigwinch_pipe[1]));
+    sigwinch_pipe[0] = sigwinch_pipe[1] = -1;
+}
+
+
+static void sigwinch_handler(int signo) {
+    int saved_errno = errno;
+    char change_char = WINSIZE_CHANGE_CHAR;
+
+    if (write(sigwinch_pipe[1], &change_char, 1) < 0) {
+        /* Nothing else we can safely do here. */
+    }
+
+    errno = saved_errno;
+}
+
+
+static void *watch_thread_fn(void *arg) {
+    const struct winsize_watch *watch = arg;
+    struct winsize size;
+    char c;
+    size_t i;
+
+    for (;;) {
+        ssize_t n = read(sigwinch_pipe[0], &c, 1);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        ASSERT_WITH_MESSAGE(n == 1, "Lost the window size self-pipe");
+
+        if (c == WINSIZE_STOP_CHAR) {
+            break;
+        }
+
+        if (winsize_watch_get(watch->source_fd, &size) < 0) {
+            continue;
+        }
+
+#ifdef ASSERT_DEBUG
+        fprintf(stderr, "Window size is now %u by %u.\n", size.ws_col,
+                size.ws_row);
+#endif
+
+        /* The screen model has to know before the command does, so that it
+         * takes the command's redraw at the new size. */
+        if (watch->info) {
+            redirection_resize(watch->info, size.ws_row, size.ws_col);
+        }
+
+        if (watch->recorder) {
+            recorder_winsize(watch->recorder, &size);
+        }
+
+        /* After the command has exited, the PTY may already be hung up,
+         * which is nothing to worry about. */
+        for (i = 0; i < watch->n_fds; i++) {
+            if (ioctl(watch->fds[i], TIOCSWINSZ, &size) < 0) {
+                ASSERT(errno == EIO);
+            }
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,54 @@
+/* winsize_watch.h
+ *
+ * Keep the PTY the same size as the terminal we are running on, for
+ * --mirror-size. A SIGWINCH handler wakes a thread through a self-pipe, and
+ * the thread copies the new size to the PTY, whose kernel then sends the
+ * command a SIGWINCH of its own. The recording and the screen model for
+ * --snapshot are told about the new size too.
+ */
+
+#ifndef WINSIZE_WATCH_H_INCLUDED
+#define WINSIZE_WATCH_H_INCLUDED
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <sys/ioctl.h>
+
+#include "record.h"
+#include "redirect.h"
+
+/* The most PTYs one watch keeps in step: the command's, and a second one for
+ * its standard error */
+#define WINSIZE_WATCH_MAX_FDS 2
+
+struct winsize_watch {
+    /* The terminal whose size we follow */
+    int source_fd;
+
+    /* The master PTYs to resize */
+    int fds[WINSIZE_WATCH_MAX_FDS];
+    size_t n_fds;
+
+    /* Where else to report a new size, or NULL */
+    struct recorder *recorder;
+    struct redirection_info *info;
+
+    pthread_t thread;
+};
+
+/* Get the size of the terminal on FD. Returns 0 on success, or -1 if FD
+ * isn't a terminal or has no size. */
+int winsize_watch_get(int fd, struct winsize *size);
+
+/* Start following the size of the terminal on SOURCE_FD, copying it to the N
+ * PTYs in FDS as it changes. Only one watch may run at a time. */
+void winsize_watch_start(struct winsize_watch *watch, int source_fd,
+                         const int *fds, size_t n_fds,
+                         struct recorder *recorder,
+                         struct redirection_info *info);
+
+/* Stop following the size. */
+void winsize_watch_finish(struct winsize_watch *watch);
+
+#endif /* WINSIZE_WATCH_H_INCLUDED */
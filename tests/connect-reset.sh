@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# connect-reset.sh
+#
+# A --connect collector that stops reading and then resets the connection
+# must only cost the sessions on it. The server has to keep running, the
+# commands on the connection have to finish, and a command sent after the
+# loss has to be refused with a message saying why. Needs python3 for the
+# collector, and is skipped without it.
+
+set -e
+
+TERMINATOR=${TERMINATOR:-./terminator}
+CLIENTS=24
+
+command -v python3 >/dev/null 2>&1 || exit 77
+
+dir=$(mktemp -d)
+server=
+trap 'test -z "$server" || kill "$server" 2>/dev/null; rm -rf "$dir"' EXIT
+
+head -c 2000000 /dev/zero >"$dir/data"
+
+# Accept one connection, never read from it, so that with a small receive
+# buffer there is still something waiting to be sent, then close it with a
+# reset rather than a FIN.
+python3 - "$dir/port" <<'COLLECTOR' &
+import os, socket, struct, sys, time
+
+listener = socket.socket()
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+listener.bind(('127.0.0.1', 0))
+listener.listen(1)
+
+with open(sys.argv[1] + '.tmp', 'w') as f:
+    f.write(str(listener.getsockname()[1]))
+
+os.rename(sys.argv[1] + '.tmp', sys.argv[1])
+
+connection, _ = listener.accept()
+time.sleep(2)
+connection.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER,
+                      struct.pack('ii', 1, 0))
+connection.close()
+COLLECTOR
+collector=$!
+
+while [ ! -f "$dir/port" ]; do
+    sleep 0.1
+done
+
+"$TERMINATOR" --server="$dir/sock" --connect="127.0.0.1:$(cat "$dir/port")" &
+server=$!
+
+while [ ! -S "$dir/sock" ]; do
+    sleep 0.1
+done
+
+clients=
+for i in $(seq "$CLIENTS"); do
+    "$TERMINATOR" --remote="$dir/sock" cat "$dir/data" >/dev/null 2>&1 &
+    clients="$clients $!"
+done
+
+wait "$collector"
+
+# Their output went with the connection, so they exit however they may,
+# but they have to exit.
+for client in $clients; do
+    wait "$client" || true
+done
+
+if ! kill -0 "$server" 2>/dev/null; then
+    echo "connect-reset: the server died with the connection" >&2
+    exit 1
+fi
+
+if "$TERMINATOR" --remote="$dir/sock" true 2>"$dir/error"; then
+    echo "connect-reset: a command ran after the connection was lost" >&2
+    exit 1
+fi
+
+if ! grep -q "connection has been lost" "$dir/error"; then
+    echo "connect-reset: unexpected error: $(cat "$dir/error")" >&2
+    exit 1
+fi
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# splice-stall.sh
+#
+# A command's output spliced into a pipe whose reader stops for a while has
+# to be waited on, not polled for. Every splice from the PTY takes a page of
+# the intermediate pipe, so it fills well before its byte count says, and a
+# direction that kept asking for input would spin on splices that can only
+# fail. Counts the reads that would block in --stats, with the threads and
+# with --event-loop, and checks all the output still arrives.
+
+set -e
+
+TERMINATOR=${TERMINATOR:-./terminator}
+BYTES=20000000
+
+# Far fewer than the millions a spin gets through in the stall
+MAX_WOULD_BLOCK=100000
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for mode in threads event-loop; do
+    if [ "$mode" = event-loop ]; then
+        set -- --event-loop
+    else
+        set --
+    fi
+
+    rm -f "$dir/stats"
+
+    "$TERMINATOR" "$@" --stats="$dir/stats" sh -c \
+        "head -c $BYTES /dev/zero | tr '\\0' y" |
+        (sleep 2; wc -c >"$dir/count")
+
+    count=$(tr -d ' ' <"$dir/count")
+
+    if [ "$count" != "$BYTES" ]; then
+        echo "splice-stall: $mode: $count bytes of $BYTES arrived" >&2
+        exit 1
+    fi
+
+    would_block=$(sed -n '/"output"/,/}/s/.*"would_block": \([0-9]*\).*/\1/p' \
+                  "$dir/stats")
+
+    if [ -z "$would_block" ] || [ "$would_block" -gt "$MAX_WOULD_BLOCK" ]; then
+        echo "splice-stall: $mode: $would_block reads would block while" \
+             "the output was stalled" >&2
+        exit 1
+    fi
+done